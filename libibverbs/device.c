@@ -189,15 +189,20 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 	struct ibv_context *context;
 	struct verbs_context *context_ex;
 
-	if (asprintf(&devpath, "/dev/infiniband/%s", device->dev_name) < 0)
-		return NULL;
+	if (verbs_device->ops->open_cmd_fd) {
+		cmd_fd = verbs_device->ops->open_cmd_fd(verbs_device);
+	} else {
+		if (asprintf(&devpath, "/dev/infiniband/%s",
+			     device->dev_name) < 0)
+			return NULL;
 
-	/*
-	 * We'll only be doing writes, but we need O_RDWR in case the
-	 * provider needs to mmap() the file.
-	 */
-	cmd_fd = open(devpath, O_RDWR | O_CLOEXEC);
-	free(devpath);
+		/*
+		 * We'll only be doing writes, but we need O_RDWR in case the
+		 * provider needs to mmap() the file.
+		 */
+		cmd_fd = open(devpath, O_RDWR | O_CLOEXEC);
+		free(devpath);
+	}
 
 	if (cmd_fd < 0)
 		return NULL;
@@ -173,6 +173,15 @@ struct verbs_device_ops {
 
 	struct verbs_device *(*alloc_device)(struct verbs_sysfs_dev *sysfs_dev);
 	void (*uninit_device)(struct verbs_device *device);
+
+	/*
+	 * Optional, for devices that are not backed by a uverbs character
+	 * device.  open_cmd_fd replaces opening /dev/infiniband/<dev_name>,
+	 * and create_comp_channel returns the fd of a new completion channel
+	 * in place of the CREATE_COMP_CHANNEL command.
+	 */
+	int (*open_cmd_fd)(struct verbs_device *device);
+	int (*create_comp_channel)(struct ibv_context *context);
 };
 
 /* Must change the PRIVATE IBVERBS_PRIVATE_ symbol if this is changed */
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2017 Intel Corporation.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/driver.h>
+
+/*
+ * Measures the rate at which ibv_dontfork_range()/ibv_dofork_range(), the
+ * fork protection done by every memory registration after ibv_fork_init(),
+ * can be executed by concurrent threads.  No RDMA device is required.
+ */
+
+static int num_threads = 1;
+static int iterations = 100000;
+static int buffers = 64;
+static size_t buf_size = 65536;
+static int shared;
+static char *mem;
+static size_t page_size;
+
+static void *run(void *arg)
+{
+	long id = (long) arg;
+	int half = buffers / 2;
+	char *base;
+	int i;
+
+	/* Keep half of the buffers protected while cycling through them */
+	base = shared ? mem : mem + id * buffers * buf_size;
+	for (i = 0; i < iterations + half; i++) {
+		if (i < iterations &&
+		    ibv_dontfork_range(base + (i % buffers) * buf_size,
+				       buf_size)) {
+			perror("ibv_dontfork_range");
+			break;
+		}
+
+		if (i >= half &&
+		    ibv_dofork_range(base + ((i - half) % buffers) * buf_size,
+				     buf_size)) {
+			perror("ibv_dofork_range");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            measure fork protection scalability\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -t, --threads=<num>     number of threads (default 1)\n");
+	printf("  -n, --iters=<num>       registrations per thread (default 100000)\n");
+	printf("  -b, --buffers=<num>     buffers per thread (default 64)\n");
+	printf("  -s, --size=<size>       size of each buffer (default 65536)\n");
+	printf("  -S, --shared            threads use the same buffers\n");
+	printf("  -h, --help              print a help text and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct timeval start, end;
+	pthread_t *threads;
+	char *suffix;
+	size_t len;
+	double usec;
+	long i;
+	int ret;
+
+	while (1) {
+		int c;
+
+		static struct option long_options[] = {
+			{ .name = "threads", .has_arg = 1, .val = 't' },
+			{ .name = "iters",   .has_arg = 1, .val = 'n' },
+			{ .name = "buffers", .has_arg = 1, .val = 'b' },
+			{ .name = "size",    .has_arg = 1, .val = 's' },
+			{ .name = "shared",  .has_arg = 0, .val = 'S' },
+			{ .name = "help",    .has_arg = 0, .val = 'h' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "t:n:b:s:Sh", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'b':
+			buffers = atoi(optarg);
+			break;
+		case 's':
+			buf_size = strtoul(optarg, &suffix, 0);
+			if (*suffix == 'k' || *suffix == 'K')
+				buf_size <<= 10;
+			else if (*suffix == 'm' || *suffix == 'M')
+				buf_size <<= 20;
+			else if (*suffix == 'g' || *suffix == 'G')
+				buf_size <<= 30;
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_threads < 1 || iterations < 1 || buffers < 2 || !buf_size) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = ibv_fork_init();
+	if (ret) {
+		fprintf(stderr, "ibv_fork_init failed: %s\n", strerror(ret));
+		return 1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	buf_size = (buf_size + page_size - 1) & ~(page_size - 1);
+	len = buffers * buf_size * (shared ? 1 : num_threads);
+	if (posix_memalign((void **) &mem, page_size, len)) {
+		fprintf(stderr, "failed to allocate %zu bytes\n", len);
+		return 1;
+	}
+
+	threads = calloc(num_threads, sizeof *threads);
+	if (!threads) {
+		fprintf(stderr, "failed to allocate threads\n");
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, run, (void *) i)) {
+			fprintf(stderr, "failed to create thread\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	gettimeofday(&end, NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000.0 +
+	       (end.tv_usec - start.tv_usec);
+	printf("%d threads, %d registrations each: %.0f usec, %.0f registrations/sec\n",
+	       num_threads, iterations, usec,
+	       (double) num_threads * iterations * 1000000.0 / usec);
+
+	free(threads);
+	free(mem);
+	return 0;
+}
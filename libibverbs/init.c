@@ -47,6 +47,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <fnmatch.h>
+#include <ctype.h>
 
 #include <util/util.h>
 #include "ibverbs.h"
@@ -66,7 +67,33 @@ struct ibv_driver {
 static LIST_HEAD(driver_name_list);
 static LIST_HEAD(driver_list);
 
-static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
+/* Reuse the sysfs information of an already known device if it is the same
+ * device, with the same name and creation time, which saves reading its
+ * remaining sysfs files again.
+ */
+static bool reuse_sysfs_dev(struct list_head *device_list,
+			    struct verbs_sysfs_dev *sysfs_dev)
+{
+	struct verbs_device *vdev;
+
+	list_for_each(device_list, vdev, entry) {
+		if (strcmp(vdev->sysfs->sysfs_name, sysfs_dev->sysfs_name))
+			continue;
+
+		if (strcmp(vdev->sysfs->ibdev_name, sysfs_dev->ibdev_name) ||
+		    !ts_cmp(&vdev->sysfs->time_created,
+			    &sysfs_dev->time_created, ==))
+			return false;
+
+		*sysfs_dev = *vdev->sysfs;
+		return true;
+	}
+
+	return false;
+}
+
+static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list,
+			   struct list_head *device_list)
 {
 	char class_path[IBV_SYSFS_PATH_MAX];
 	DIR *class_dir;
@@ -135,6 +162,12 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 
 		sysfs_dev->time_created = buf.st_mtim;
 
+		if (reuse_sysfs_dev(device_list, sysfs_dev)) {
+			list_add(tmp_sysfs_dev_list, &sysfs_dev->entry);
+			sysfs_dev = NULL;
+			continue;
+		}
+
 		if (ibv_read_sysfs_file(sysfs_dev->sysfs_path, "abi_version",
 					value, sizeof value) > 0)
 			sysfs_dev->abi_ver = strtol(value, NULL, 10);
@@ -156,6 +189,33 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 	return ret;
 }
 
+/* RDMAV_LOOPBACK adds a device that has no kernel or sysfs counterpart, to be
+ * claimed by the in-process loopback provider.
+ */
+static bool loopback_enabled(void)
+{
+	return getenv("RDMAV_LOOPBACK") != NULL;
+}
+
+static int find_loopback_devs(struct list_head *tmp_sysfs_dev_list)
+{
+	struct verbs_sysfs_dev *sysfs_dev;
+
+	if (!loopback_enabled())
+		return 0;
+
+	sysfs_dev = calloc(1, sizeof(*sysfs_dev));
+	if (!sysfs_dev)
+		return ENOMEM;
+
+	strcpy(sysfs_dev->sysfs_name, "loopback0");
+	strcpy(sysfs_dev->ibdev_name, "loopback0");
+	sysfs_dev->abi_ver = IB_USER_VERBS_MAX_ABI_VERSION;
+
+	list_add(tmp_sysfs_dev_list, &sysfs_dev->entry);
+	return 0;
+}
+
 void verbs_register_driver(const struct verbs_device_ops *ops)
 {
 	struct ibv_driver *driver;
@@ -222,17 +282,45 @@ out_dlopen:
 	return;
 }
 
-static void load_drivers(void)
+/* True if the ibdev name of the device starts with the provider name, as in
+ * mlx5_0 for mlx5 or rxe0 for rxe.
+ */
+static bool driver_name_hint(const char *name, struct verbs_sysfs_dev *sysfs_dev)
+{
+	const char *base = strrchr(name, '/');
+	size_t len;
+
+	/* Absolute paths name the library file, eg /usr/lib/libmlx5 */
+	if (base) {
+		name = base + 1;
+		if (!strncmp(name, "lib", 3))
+			name += 3;
+	}
+	len = strlen(name);
+
+	return !strncmp(sysfs_dev->ibdev_name, name, len) &&
+	       (sysfs_dev->ibdev_name[len] == '_' ||
+		isdigit((unsigned char)sysfs_dev->ibdev_name[len]));
+}
+
+/* Load the configured providers named after a device in sysfs_list, or all
+ * of them if sysfs_list is NULL.  Returns true once every provider has been
+ * loaded.
+ */
+static bool load_drivers(struct list_head *sysfs_list)
 {
 	struct ibv_driver_name *name, *next_name;
+	struct verbs_sysfs_dev *sysfs_dev;
+	static bool env_loaded;
 	const char *env;
 	char *list, *env_name;
+	bool hint;
 
 	/*
 	 * Only use drivers passed in through the calling user's
 	 * environment if we're not running setuid.
 	 */
-	if (getuid() == geteuid()) {
+	if (!env_loaded && getuid() == geteuid()) {
 		if ((env = getenv("RDMAV_DRIVERS"))) {
 			list = strdupa(env);
 			while ((env_name = strsep(&list, ":;")))
@@ -243,12 +331,28 @@ static void load_drivers(void)
 				load_driver(env_name);
 		}
 	}
+	env_loaded = true;
 
 	list_for_each_safe(&driver_name_list, name, next_name, entry) {
+		hint = !sysfs_list;
+		if (sysfs_list) {
+			list_for_each(sysfs_list, sysfs_dev, entry) {
+				if (driver_name_hint(name->name, sysfs_dev)) {
+					hint = true;
+					break;
+				}
+			}
+		}
+		if (!hint)
+			continue;
+
 		load_driver(name->name);
+		list_del(&name->entry);
 		free(name->name);
 		free(name);
 	}
+
+	return list_empty(&driver_name_list);
 }
 
 static void read_config_file(const char *path)
@@ -464,7 +568,9 @@ static struct verbs_device *try_driver(const struct verbs_device_ops *ops,
 	assert(dev->_ops._dummy1 == NULL);
 	assert(dev->_ops._dummy2 == NULL);
 
-	if (ibv_read_sysfs_file(sysfs_dev->ibdev_path, "node_type", value, sizeof value) < 0) {
+	if (!sysfs_dev->ibdev_path[0]) {
+		dev->node_type = IBV_NODE_CA;
+	} else if (ibv_read_sysfs_file(sysfs_dev->ibdev_path, "node_type", value, sizeof value) < 0) {
 		fprintf(stderr, PFX "Warning: no node_type attr under %s.\n",
 			sysfs_dev->ibdev_path);
 			dev->node_type = IBV_NODE_UNKNOWN;
@@ -600,7 +706,11 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	int statically_linked = 0;
 	int ret;
 
-	ret = find_sysfs_devs(&sysfs_list);
+	ret = find_sysfs_devs(&sysfs_list, device_list);
+	if (ret && !(ret == ENOSYS && loopback_enabled()))
+		return -ret;
+
+	ret = find_loopback_devs(&sysfs_list);
 	if (ret)
 		return -ret;
 
@@ -653,9 +763,18 @@ int ibverbs_get_device_list(struct list_head *device_list)
 		dlclose(hand);
 	}
 
-	load_drivers();
-	drivers_loaded = 1;
+	/*
+	 * Only load the providers that the remaining devices are named after,
+	 * and the rest of them if that leaves some devices unmatched.  The
+	 * match table of each provider still decides if it is used.
+	 */
+	drivers_loaded = load_drivers(&sysfs_list);
+	try_all_drivers(&sysfs_list, device_list, &num_devices);
 
+	if (list_empty(&sysfs_list) || drivers_loaded)
+		goto out;
+
+	drivers_loaded = load_drivers(NULL);
 	try_all_drivers(&sysfs_list, device_list, &num_devices);
 
 out:
@@ -692,8 +811,11 @@ int ibverbs_init(void)
 		return -ENOSYS;
 
 	ret = check_abi_version(sysfs_path);
-	if (ret)
-		return -ret;
+	if (ret) {
+		if (!loopback_enabled())
+			return -ret;
+		abi_ver = IB_USER_VERBS_MAX_ABI_VERSION;
+	}
 
 	check_memlock_limit();
 
@@ -57,8 +57,26 @@ struct ibv_mem_node {
 	int			refcnt;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * The address space is divided into 64MB chunks, and each chunk is tracked
+ * by one of several independently locked trees, so that threads registering
+ * memory in different areas do not serialize on a single lock.  The chunk
+ * size matches the heaps of glibc's per-thread malloc arenas, and keeps
+ * the number of trees touched by a large registration small.  Huge pages
+ * may be larger than a chunk, so with RDMAV_HUGEPAGES_SAFE a single tree
+ * tracks everything.
+ */
+#define IBV_MEM_CHUNK_SHIFT	26
+#define IBV_MEM_CHUNK_SIZE	(1UL << IBV_MEM_CHUNK_SHIFT)
+#define IBV_MEM_TREES		16
+
+struct ibv_mem_tree {
+	struct ibv_mem_node    *root;
+	pthread_mutex_t		mutex;
+} __attribute__((aligned(64)));
+
+static struct ibv_mem_tree mm_trees[IBV_MEM_TREES];
+static int mm_ready;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
@@ -123,14 +141,15 @@ out:
 
 int ibv_fork_init(void)
 {
+	struct ibv_mem_node *root;
 	void *tmp, *tmp_aligned;
-	int ret;
+	int i, ret;
 	unsigned long size;
 
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_ready)
 		return 0;
 
 	if (too_late)
@@ -159,18 +178,27 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
-		return ENOMEM;
+	for (i = 0; i < IBV_MEM_TREES; i++) {
+		root = malloc(sizeof *root);
+		if (!root) {
+			while (i--)
+				free(mm_trees[i].root);
+			return ENOMEM;
+		}
 
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+		root->parent = NULL;
+		root->left   = NULL;
+		root->right  = NULL;
+		root->color  = IBV_BLACK;
+		root->start  = 0;
+		root->end    = UINTPTR_MAX;
+		root->refcnt = 0;
 
+		mm_trees[i].root = root;
+		pthread_mutex_init(&mm_trees[i].mutex, NULL);
+	}
+
+	mm_ready = 1;
 	return 0;
 }
 
@@ -206,7 +234,8 @@ static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
 	return node;
 }
 
-static void __mm_rotate_right(struct ibv_mem_node *node)
+static void __mm_rotate_right(struct ibv_mem_tree *tree,
+			      struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -222,7 +251,7 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		tree->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -230,7 +259,8 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 	node->parent = tmp;
 }
 
-static void __mm_rotate_left(struct ibv_mem_node *node)
+static void __mm_rotate_left(struct ibv_mem_tree *tree,
+			    struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -246,7 +276,7 @@ static void __mm_rotate_left(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		tree->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -282,7 +312,8 @@ static int verify(struct ibv_mem_node *node)
 }
 #endif
 
-static void __mm_add_rebalance(struct ibv_mem_node *node)
+static void __mm_add_rebalance(struct ibv_mem_tree *tree,
+			       struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *parent, *gp, *uncle;
 
@@ -301,7 +332,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->right) {
-					__mm_rotate_left(parent);
+					__mm_rotate_left(tree, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -309,7 +340,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_right(gp);
+				__mm_rotate_right(tree, gp);
 			}
 		} else {
 			uncle = gp->left;
@@ -322,7 +353,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->left) {
-					__mm_rotate_right(parent);
+					__mm_rotate_right(tree, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -330,19 +361,19 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_left(gp);
+				__mm_rotate_left(tree, gp);
 			}
 		}
 	}
 
-	mm_root->color = IBV_BLACK;
+	tree->root->color = IBV_BLACK;
 }
 
-static void __mm_add(struct ibv_mem_node *new)
+static void __mm_add(struct ibv_mem_tree *tree, struct ibv_mem_node *new)
 {
 	struct ibv_mem_node *node, *parent = NULL;
 
-	node = mm_root;
+	node = tree->root;
 	while (node) {
 		parent = node;
 		if (node->start < new->start)
@@ -361,10 +392,11 @@ static void __mm_add(struct ibv_mem_node *new)
 	new->right  = NULL;
 
 	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	__mm_add_rebalance(tree, new);
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+static void __mm_remove(struct ibv_mem_tree *tree,
+			struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *child, *parent, *sib, *tmp;
 	int nodecol;
@@ -399,7 +431,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				node->parent->right = tmp;
 		} else
-			mm_root = tmp;
+			tree->root = tmp;
 	} else {
 		nodecol = node->color;
 
@@ -414,7 +446,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				parent->right = child;
 		} else
-			mm_root = child;
+			tree->root = child;
 	}
 
 	free(node);
@@ -422,14 +454,14 @@ static void __mm_remove(struct ibv_mem_node *node)
 	if (nodecol == IBV_RED)
 		return;
 
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
+	while ((!child || child->color == IBV_BLACK) && child != tree->root) {
 		if (parent->left == child) {
 			sib = parent->right;
 
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
+				__mm_rotate_left(tree, parent);
 				sib = parent->right;
 			}
 
@@ -443,7 +475,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->left)
 						sib->left->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
+					__mm_rotate_right(tree, sib);
 					sib = parent->right;
 				}
 
@@ -451,8 +483,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->right)
 					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
+				__mm_rotate_left(tree, parent);
+				child = tree->root;
 				break;
 			}
 		} else {
@@ -461,7 +493,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
+				__mm_rotate_right(tree, parent);
 				sib = parent->left;
 			}
 
@@ -475,7 +507,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->right)
 						sib->right->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
+					__mm_rotate_left(tree, sib);
 					sib = parent->left;
 				}
 
@@ -483,8 +515,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->left)
 					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
+				__mm_rotate_right(tree, parent);
+				child = tree->root;
 				break;
 			}
 		}
@@ -494,9 +526,10 @@ static void __mm_remove(struct ibv_mem_node *node)
 		child->color = IBV_BLACK;
 }
 
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
+static struct ibv_mem_node *__mm_find_start(struct ibv_mem_tree *tree,
+					    uintptr_t start)
 {
-	struct ibv_mem_node *node = mm_root;
+	struct ibv_mem_node *node = tree->root;
 
 	while (node) {
 		if (node->start <= start && node->end >= start)
@@ -511,17 +544,19 @@ static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
 	return node;
 }
 
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
+static struct ibv_mem_node *merge_ranges(struct ibv_mem_tree *tree,
+					 struct ibv_mem_node *node,
 					 struct ibv_mem_node *prev)
 {
 	prev->end = node->end;
 	prev->refcnt = node->refcnt;
-	__mm_remove(node);
+	__mm_remove(tree, node);
 
 	return prev;
 }
 
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
+static struct ibv_mem_node *split_range(struct ibv_mem_tree *tree,
+					struct ibv_mem_node *node,
 					uintptr_t cut_line)
 {
 	struct ibv_mem_node *new_node = NULL;
@@ -533,68 +568,231 @@ static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
 	new_node->end    = node->end;
 	new_node->refcnt = node->refcnt;
 	node->end  = cut_line - 1;
-	__mm_add(new_node);
+	__mm_add(tree, new_node);
 
 	return new_node;
 }
 
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
-					   int inc)
+static inline struct ibv_mem_tree *chunk_tree(uintptr_t addr)
 {
-	struct ibv_mem_node *node, *tmp = NULL;
+	if (huge_page_enabled)
+		return &mm_trees[0];
 
-	node = __mm_find_start(start, end);
-	if (node->start < start)
-		node = split_range(node, start);
-	else {
-		tmp = __mm_prev(node);
-		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
+	return &mm_trees[(addr >> IBV_MEM_CHUNK_SHIFT) % IBV_MEM_TREES];
+}
+
+static inline uintptr_t chunk_end(uintptr_t addr, uintptr_t end)
+{
+	uintptr_t last = addr | (IBV_MEM_CHUNK_SIZE - 1);
+
+	if (huge_page_enabled)
+		return end;
+
+	return last < end ? last : end;
+}
+
+/*
+ * Lock every tree that tracks a chunk of [start, end].  Trees are always
+ * locked in index order, so that threads updating overlapping sets of
+ * trees cannot deadlock.
+ */
+static unsigned int lock_trees(uintptr_t start, uintptr_t end)
+{
+	unsigned int mask = 0;
+	uintptr_t chunk;
+	int i;
+
+	if (huge_page_enabled) {
+		mask = 1;
+	} else if ((end >> IBV_MEM_CHUNK_SHIFT) - (start >> IBV_MEM_CHUNK_SHIFT) >=
+		   IBV_MEM_TREES - 1) {
+		mask = (1U << IBV_MEM_TREES) - 1;
+	} else {
+		for (chunk = start >> IBV_MEM_CHUNK_SHIFT;
+		     chunk <= end >> IBV_MEM_CHUNK_SHIFT; chunk++)
+			mask |= 1U << (chunk % IBV_MEM_TREES);
 	}
-	return node;
+
+	for (i = 0; i < IBV_MEM_TREES; i++)
+		if (mask & (1U << i))
+			pthread_mutex_lock(&mm_trees[i].mutex);
+
+	return mask;
+}
+
+static void unlock_trees(unsigned int mask)
+{
+	int i;
+
+	for (i = IBV_MEM_TREES - 1; i >= 0; i--)
+		if (mask & (1U << i))
+			pthread_mutex_unlock(&mm_trees[i].mutex);
 }
 
 /*
- * This function is called if madvise() fails to undo merging/splitting
- * operations performed on the node.
+ * Split nodes so that [start, end] starts and ends on node boundaries.
+ * Returns the node starting at start, or NULL on failure.
  */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
-				      uintptr_t start, int inc)
+static struct ibv_mem_node *split_chunk(struct ibv_mem_tree *tree,
+					uintptr_t start, uintptr_t end)
 {
-	struct ibv_mem_node *tmp = NULL;
-
-	/*
-	 * This condition can be true only if we merged this
-	 * node with the previous one, so we need to split them.
-	*/
-	if (start > node->start) {
-		tmp = split_range(node, start);
-		if (tmp) {
-			node->refcnt += inc;
-			node = tmp;
-		} else
+	struct ibv_mem_node *node, *first;
+
+	first = __mm_find_start(tree, start);
+	if (first->start < start) {
+		first = split_range(tree, first, start);
+		if (!first)
 			return NULL;
 	}
 
-	tmp  =  __mm_prev(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
+	for (node = first; node && node->start <= end; node = __mm_next(node)) {
+		if (node->end > end && !split_range(tree, node, end + 1))
+			return NULL;
+	}
 
-	tmp  =  __mm_next(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
+	return first;
+}
 
-	return node;
+/*
+ * Nodes are not merged across a chunk boundary once split there, so that
+ * ranges spanning chunks do not split and merge them again on every call.
+ * This keeps at most two extra nodes per chunk boundary that a range has
+ * crossed.
+ */
+static inline int can_merge(struct ibv_mem_node *prev,
+			    struct ibv_mem_node *node)
+{
+	return prev->refcnt == node->refcnt &&
+	       (huge_page_enabled || node->start & (IBV_MEM_CHUNK_SIZE - 1));
+}
+
+/*
+ * Add inc to the reference count of every node from node up to end, and
+ * merge each with its predecessor, and the node after end with the last
+ * one, where possible.
+ */
+static void update_chunk(struct ibv_mem_tree *tree, struct ibv_mem_node *node,
+			 uintptr_t end, int inc)
+{
+	struct ibv_mem_node *prev, *next;
+
+	prev = __mm_prev(node);
+	for (; node && node->start <= end; node = next) {
+		node->refcnt += inc;
+		next = __mm_next(node);
+		if (prev && can_merge(prev, node))
+			merge_ranges(tree, node, prev);
+		else
+			prev = node;
+	}
+
+	if (node && prev && can_merge(prev, node))
+		merge_ranges(tree, node, prev);
 }
 
+/*
+ * Issue madvise() for every node in [start, end] whose reference count
+ * crosses zero.  Nodes are visited in address order across the chunks of
+ * the range, and each run of adjacent nodes is covered by a single call,
+ * even if it spans several trees.  On failure, *fail is set to the start
+ * of the range that could not be advised.
+ */
+static int advise_range(uintptr_t start, uintptr_t end, int inc, int advice,
+			uintptr_t *fail)
+{
+	uintptr_t addr, last, batch_start = 0, batch_end = 0;
+	struct ibv_mem_node *node;
+	int batched = 0, cross;
+
+	for (addr = start; ; addr = last + 1) {
+		last = chunk_end(addr, end);
+		for (node = __mm_find_start(chunk_tree(addr), addr);
+		     node && node->start <= last; node = __mm_next(node)) {
+			cross = (inc == -1 && node->refcnt == 1) ||
+				(inc ==  1 && node->refcnt == 0);
+			if (cross && batched) {
+				batch_end = node->end;
+				continue;
+			}
+
+			if (batched && madvise((void *) batch_start,
+					       batch_end - batch_start + 1,
+					       advice)) {
+				*fail = batch_start;
+				return -1;
+			}
+
+			batched = cross;
+			batch_start = node->start;
+			batch_end = node->end;
+		}
+		if (last == end)
+			break;
+	}
+
+	if (batched && madvise((void *) batch_start,
+			       batch_end - batch_start + 1, advice)) {
+		*fail = batch_start;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Advise [start, end], rolling back the calls already made on failure */
+static int advise_or_undo(uintptr_t start, uintptr_t end, int inc, int advice)
+{
+	uintptr_t fail;
+
+	if (!advise_range(start, end, inc, advice, &fail))
+		return 0;
+
+	if (fail > start)
+		advise_range(start, fail - 1, inc,
+			     advice == MADV_DONTFORK ? MADV_DOFORK : MADV_DONTFORK,
+			     &fail);
+	return -1;
+}
+
+/*
+ * Fast path for a range within a single chunk, which covers most
+ * registrations.  Only that chunk's tree is locked, and the node found
+ * while splitting is reused to update the reference counts.
+ */
+static int madvise_chunk(uintptr_t start, uintptr_t end, int inc, int advice)
+{
+	struct ibv_mem_tree *tree = chunk_tree(start);
+	struct ibv_mem_node *first;
+	int ret = -1;
+
+	pthread_mutex_lock(&tree->mutex);
+
+	first = split_chunk(tree, start, end);
+	if (first)
+		ret = advise_or_undo(start, end, inc, advice);
+	else
+		first = __mm_find_start(tree, start);
+
+	update_chunk(tree, first, end, ret ? 0 : inc);
+
+	pthread_mutex_unlock(&tree->mutex);
+	return ret;
+}
+
+/*
+ * All trees covering the range are locked for the whole update, so that
+ * the range is advised with one madvise() call per run of nodes rather
+ * than one per chunk.  Nodes are first split at the range and chunk
+ * boundaries, madvise() is issued, and the reference counts are only
+ * updated once every call has succeeded.
+ */
 static int ibv_madvise_range(void *base, size_t size, int advice)
 {
-	uintptr_t start, end;
-	struct ibv_mem_node *node, *tmp;
-	int inc;
-	int rolling_back = 0;
-	int ret = 0;
+	uintptr_t start, end, addr, last;
 	unsigned long range_page_size;
+	struct ibv_mem_tree *tree;
+	unsigned int locked;
+	int inc, ret = 0;
 
 	if (!size)
 		return 0;
@@ -607,85 +805,42 @@ static int ibv_madvise_range(void *base, size_t size, int advice)
 	start = (uintptr_t) base & ~(range_page_size - 1);
 	end   = ((uintptr_t) (base + size + range_page_size - 1) &
 		 ~(range_page_size - 1)) - 1;
-
-	pthread_mutex_lock(&mm_mutex);
-again:
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
-	node = get_start_node(start, end, inc);
-	if (!node) {
-		ret = -1;
-		goto out;
-	}
+	if (chunk_end(start, end) == end)
+		return madvise_chunk(start, end, inc, advice);
 
-	while (node && node->start <= end) {
-		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
-				ret = -1;
-				goto out;
-			}
-		}
+	locked = lock_trees(start, end);
 
-		if ((inc == -1 && node->refcnt == 1) ||
-		    (inc ==  1 && node->refcnt == 0)) {
-			/*
-			 * If this is the first time through the loop,
-			 * and we merged this node with the previous
-			 * one, then we only want to do the madvise()
-			 * on start ... node->end (rather than
-			 * starting at node->start).
-			 *
-			 * Otherwise we end up doing madvise() on
-			 * bigger region than we're being asked to,
-			 * and that may lead to a spurious failure.
-			 */
-			if (start > node->start)
-				ret = madvise((void *) start, node->end - start + 1,
-					      advice);
-			else
-				ret = madvise((void *) node->start,
-					      node->end - node->start + 1,
-					      advice);
-			if (ret) {
-				node = undo_node(node, start, inc);
-
-				if (rolling_back || !node)
-					goto out;
-
-				/* madvise failed, roll back previous changes */
-				rolling_back = 1;
-				advice = advice == MADV_DONTFORK ?
-					MADV_DOFORK : MADV_DONTFORK;
-				tmp = __mm_prev(node);
-				if (!tmp || start > tmp->end)
-					goto out;
-				end = tmp->end;
-				goto again;
-			}
+	for (addr = start; ; addr = last + 1) {
+		last = chunk_end(addr, end);
+		if (!split_chunk(chunk_tree(addr), addr, last)) {
+			ret = -1;
+			break;
 		}
-
-		node->refcnt += inc;
-		node = __mm_next(node);
-	}
-
-	if (node) {
-		tmp = __mm_prev(node);
-		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+		if (last == end)
+			break;
 	}
 
-out:
-	if (rolling_back)
-		ret = -1;
+	if (!ret)
+		ret = advise_or_undo(start, end, inc, advice);
 
-	pthread_mutex_unlock(&mm_mutex);
+	for (addr = start; ; addr = last + 1) {
+		last = chunk_end(addr, end);
+		tree = chunk_tree(addr);
+		update_chunk(tree, __mm_find_start(tree, addr), last,
+			     ret ? 0 : inc);
+		if (last == end)
+			break;
+	}
 
+	unlock_trees(locked);
 	return ret;
 }
 
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_ready)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -695,7 +850,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_ready)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
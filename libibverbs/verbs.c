@@ -213,10 +213,416 @@ LATEST_SYMVER_FUNC(ibv_alloc_pd, 1_1, "IBVERBS_1.1",
 	return pd;
 }
 
+/*
+ * Optional cache of memory registrations, enabled on a PD by calling
+ * ibv_set_mr_cache with the number of unused registrations to keep.  A
+ * registration that matches the PD, address, length, and access flags of
+ * an existing one shares its MR, which is reference counted.  When the last
+ * user releases it, the MR is kept on the PD's LRU list rather than
+ * deregistered, until it is evicted, invalidated, or the cache is disabled.
+ * Registrations removed while in use become stale, and are deregistered
+ * by their last user.  MRs that grant remote access are never cached,
+ * since their rkey would stay valid after ibv_dereg_mr.
+ */
+#define MR_CACHE_HASH_SIZE 1024
+#define MR_CACHE_NO_ACCESS (IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | \
+			    IBV_ACCESS_REMOTE_ATOMIC | IBV_ACCESS_MW_BIND)
+
+struct mr_cache_pd {
+	struct list_node	entry;
+	struct ibv_pd		*pd;
+	struct list_head	lru;
+	int			max_unused;
+	int			unused;
+};
+
+struct mr_cache_entry {
+	struct list_node	entry;		/* mr_cache, until stale */
+	struct list_node	mr_entry;	/* mr_cache_mrs */
+	struct list_node	lru_entry;	/* the PD's LRU list, while unused */
+	struct mr_cache_pd	*cpd;		/* NULL once stale */
+	struct ibv_mr		*mr;
+	int			access;
+	int			refcnt;
+};
+
+/*
+ * Entries are hashed by PD, address, and length for lookup on
+ * registration, and by MR for release.  mr_cache_users counts the
+ * cache-enabled PDs and stale entries.  While it is zero, no MR is cached,
+ * and registration does not take mr_cache_lock.
+ */
+static pthread_mutex_t mr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head mr_cache[MR_CACHE_HASH_SIZE];
+static struct list_head mr_cache_mrs[MR_CACHE_HASH_SIZE];
+static int mr_cache_ready;
+static LIST_HEAD(mr_cache_pds);
+static atomic_int mr_cache_users;
+
+static unsigned int mr_cache_mix(uint64_t key)
+{
+	key ^= key >> 29;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 32;
+	return key % MR_CACHE_HASH_SIZE;
+}
+
+static unsigned int mr_cache_hash(struct ibv_pd *pd, void *addr, size_t length)
+{
+	return mr_cache_mix((uintptr_t) pd ^ (uintptr_t) addr ^ length);
+}
+
+static struct list_head *mr_cache_mr_head(struct ibv_mr *mr)
+{
+	return &mr_cache_mrs[mr_cache_mix((uintptr_t) mr)];
+}
+
+/* Caller must hold mr_cache_lock */
+static void mr_cache_init(void)
+{
+	int i;
+
+	if (mr_cache_ready)
+		return;
+
+	for (i = 0; i < MR_CACHE_HASH_SIZE; i++) {
+		list_head_init(&mr_cache[i]);
+		list_head_init(&mr_cache_mrs[i]);
+	}
+	mr_cache_ready = 1;
+}
+
+/* Caller must hold mr_cache_lock */
+static struct mr_cache_pd *mr_cache_find_pd(struct ibv_pd *pd)
+{
+	struct mr_cache_pd *cpd;
+
+	list_for_each(&mr_cache_pds, cpd, entry) {
+		if (cpd->pd == pd)
+			return cpd;
+	}
+	return NULL;
+}
+
+/* Caller must hold mr_cache_lock */
+static struct mr_cache_entry *mr_cache_find(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *entry;
+
+	list_for_each(mr_cache_mr_head(mr), entry, mr_entry) {
+		if (entry->mr == mr)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Unlink an entry that is not on an LRU list.  Caller must hold mr_cache_lock. */
+static void mr_cache_free(struct mr_cache_entry *entry)
+{
+	list_del(&entry->mr_entry);
+	if (entry->cpd)
+		list_del(&entry->entry);
+	else
+		atomic_fetch_sub(&mr_cache_users, 1);
+	free(entry);
+}
+
+static int mr_dereg(struct ibv_mr *mr)
+{
+	void *addr	= mr->addr;
+	size_t length	= mr->length;
+	int ret;
+
+	ret = mr->context->ops.dereg_mr(mr);
+	if (!ret)
+		ibv_dofork_range(addr, length);
+
+	return ret;
+}
+
+/*
+ * Remove entries that match.  Entries still in use become stale, so that
+ * they are no longer returned by ibv_reg_mr.  Caller must hold
+ * mr_cache_lock.
+ */
+static void mr_cache_purge(int (*match)(struct mr_cache_entry *entry,
+					void *arg), void *arg)
+{
+	struct mr_cache_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < MR_CACHE_HASH_SIZE; i++) {
+		list_for_each_safe(&mr_cache[i], entry, next, entry) {
+			if (!match(entry, arg))
+				continue;
+
+			list_del(&entry->entry);
+			if (entry->refcnt) {
+				entry->cpd = NULL;
+				atomic_fetch_add(&mr_cache_users, 1);
+				continue;
+			}
+
+			list_del(&entry->lru_entry);
+			list_del(&entry->mr_entry);
+			entry->cpd->unused--;
+			mr_dereg(entry->mr);
+			free(entry);
+		}
+	}
+}
+
+static int mr_cache_match_pd(struct mr_cache_entry *entry, void *arg)
+{
+	return entry->cpd == arg;
+}
+
+struct mr_cache_range {
+	uintptr_t	start;
+	uintptr_t	end;
+};
+
+static int mr_cache_match_range(struct mr_cache_entry *entry, void *arg)
+{
+	struct mr_cache_range *range = arg;
+	uintptr_t addr = (uintptr_t) entry->mr->addr;
+
+	return addr < range->end && addr + entry->mr->length > range->start;
+}
+
+/*
+ * Remove the least recently used MR of a PD, and return it to be
+ * deregistered.  Caller must hold mr_cache_lock.
+ */
+static struct ibv_mr *mr_cache_evict(struct mr_cache_pd *cpd)
+{
+	struct mr_cache_entry *entry;
+	struct ibv_mr *mr;
+
+	entry = list_top(&cpd->lru, struct mr_cache_entry, lru_entry);
+	list_del(&entry->lru_entry);
+	cpd->unused--;
+	mr = entry->mr;
+	mr_cache_free(entry);
+	return mr;
+}
+
+/* Deregister unused MRs of a PD beyond its limit.  Caller must hold mr_cache_lock. */
+static void mr_cache_trim(struct mr_cache_pd *cpd)
+{
+	while (cpd->unused > cpd->max_unused)
+		mr_dereg(mr_cache_evict(cpd));
+}
+
+/* Caller must hold mr_cache_lock */
+static void mr_cache_disable(struct mr_cache_pd *cpd)
+{
+	mr_cache_purge(mr_cache_match_pd, cpd);
+	list_del(&cpd->entry);
+	free(cpd);
+	atomic_fetch_sub(&mr_cache_users, 1);
+}
+
+int ibv_set_mr_cache(struct ibv_pd *pd, int max_unused)
+{
+	struct mr_cache_pd *cpd;
+	int ret = 0;
+
+	if (max_unused < 0)
+		return EINVAL;
+
+	pthread_mutex_lock(&mr_cache_lock);
+	cpd = mr_cache_find_pd(pd);
+	if (!max_unused) {
+		if (cpd)
+			mr_cache_disable(cpd);
+		goto out;
+	}
+
+	if (!cpd) {
+		cpd = calloc(1, sizeof(*cpd));
+		if (!cpd) {
+			ret = ENOMEM;
+			goto out;
+		}
+		mr_cache_init();
+		cpd->pd = pd;
+		list_head_init(&cpd->lru);
+		list_add_tail(&mr_cache_pds, &cpd->entry);
+		atomic_fetch_add(&mr_cache_users, 1);
+	}
+
+	cpd->max_unused = max_unused;
+	mr_cache_trim(cpd);
+out:
+	pthread_mutex_unlock(&mr_cache_lock);
+	return ret;
+}
+
+void ibv_mr_cache_invalidate(void *addr, size_t length)
+{
+	struct mr_cache_range range;
+
+	if (!atomic_load(&mr_cache_users))
+		return;
+
+	range.start = (uintptr_t) addr;
+	range.end = (uintptr_t) addr + length;
+	pthread_mutex_lock(&mr_cache_lock);
+	if (!list_empty(&mr_cache_pds))
+		mr_cache_purge(mr_cache_match_range, &range);
+	pthread_mutex_unlock(&mr_cache_lock);
+}
+
+/*
+ * Returns a cached MR, or NULL.  *cache is set if a new registration
+ * should be added to the cache.
+ */
+static struct ibv_mr *mr_cache_get(struct ibv_pd *pd, void *addr,
+				   size_t length, int access, int *cache)
+{
+	struct mr_cache_entry *entry;
+	struct ibv_mr *mr = NULL;
+
+	*cache = 0;
+	if ((access & MR_CACHE_NO_ACCESS) || !atomic_load(&mr_cache_users))
+		return NULL;
+
+	pthread_mutex_lock(&mr_cache_lock);
+	if (!mr_cache_find_pd(pd))
+		goto out;
+
+	*cache = 1;
+	list_for_each(&mr_cache[mr_cache_hash(pd, addr, length)], entry, entry) {
+		if (entry->mr->pd == pd && entry->mr->addr == addr &&
+		    entry->mr->length == length && entry->access == access) {
+			if (!entry->refcnt++) {
+				list_del(&entry->lru_entry);
+				entry->cpd->unused--;
+			}
+			mr = entry->mr;
+			break;
+		}
+	}
+out:
+	pthread_mutex_unlock(&mr_cache_lock);
+	return mr;
+}
+
+static void mr_cache_add(struct ibv_mr *mr, int access)
+{
+	struct mr_cache_entry *entry;
+	struct mr_cache_pd *cpd;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return;
+
+	entry->mr = mr;
+	entry->access = access;
+	entry->refcnt = 1;
+	pthread_mutex_lock(&mr_cache_lock);
+	cpd = mr_cache_find_pd(mr->pd);
+	if (!cpd) {
+		pthread_mutex_unlock(&mr_cache_lock);
+		free(entry);
+		return;
+	}
+
+	entry->cpd = cpd;
+	list_add(&mr_cache[mr_cache_hash(mr->pd, mr->addr, mr->length)],
+		 &entry->entry);
+	list_add(mr_cache_mr_head(mr), &entry->mr_entry);
+	pthread_mutex_unlock(&mr_cache_lock);
+}
+
+/*
+ * Returns 1 if the MR is still cached or in use by others, 0 if the caller
+ * should deregister it.
+ */
+static int mr_cache_put(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *entry;
+	struct mr_cache_pd *cpd;
+	struct ibv_mr *evicted;
+	int cached = 1;
+
+	if (!atomic_load(&mr_cache_users))
+		return 0;
+
+	pthread_mutex_lock(&mr_cache_lock);
+	entry = mr_cache_find(mr);
+	if (!entry) {
+		cached = 0;
+		goto out;
+	}
+
+	if (--entry->refcnt)
+		goto out;
+
+	if (!entry->cpd) {
+		mr_cache_free(entry);
+		cached = 0;
+		goto out;
+	}
+
+	cpd = entry->cpd;
+	list_add_tail(&cpd->lru, &entry->lru_entry);
+	if (++cpd->unused <= cpd->max_unused)
+		goto out;
+
+	evicted = mr_cache_evict(cpd);
+	if (evicted == mr)
+		cached = 0;
+	else
+		mr_dereg(evicted);
+out:
+	pthread_mutex_unlock(&mr_cache_lock);
+	return cached;
+}
+
+/*
+ * Drop an MR from the cache before it is modified.  Fails if the MR is
+ * shared by other users.
+ */
+static int mr_cache_remove(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *entry;
+	int ret = 0;
+
+	if (!atomic_load(&mr_cache_users))
+		return 0;
+
+	pthread_mutex_lock(&mr_cache_lock);
+	entry = mr_cache_find(mr);
+	if (!entry)
+		goto out;
+
+	if (entry->refcnt > 1) {
+		ret = EBUSY;
+		goto out;
+	}
+
+	mr_cache_free(entry);
+out:
+	pthread_mutex_unlock(&mr_cache_lock);
+	return ret;
+}
+
 LATEST_SYMVER_FUNC(ibv_dealloc_pd, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_pd *pd)
 {
+	struct mr_cache_pd *cpd;
+
+	if (atomic_load(&mr_cache_users)) {
+		pthread_mutex_lock(&mr_cache_lock);
+		cpd = mr_cache_find_pd(pd);
+		if (cpd)
+			mr_cache_disable(cpd);
+		pthread_mutex_unlock(&mr_cache_lock);
+	}
+
 	return pd->context->ops.dealloc_pd(pd);
 }
 
@@ -226,6 +632,11 @@ LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
 		   size_t length, int access)
 {
 	struct ibv_mr *mr;
+	int cache;
+
+	mr = mr_cache_get(pd, addr, length, access, &cache);
+	if (mr)
+		return mr;
 
 	if (ibv_dontfork_range(addr, length))
 		return NULL;
@@ -236,6 +647,8 @@ LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
 		mr->pd      = pd;
 		mr->addr    = addr;
 		mr->length  = length;
+		if (cache)
+			mr_cache_add(mr, access);
 	} else
 		ibv_dofork_range(addr, length);
 
@@ -274,6 +687,12 @@ LATEST_SYMVER_FUNC(ibv_rereg_mr, 1_1, "IBVERBS_1.1",
 		return IBV_REREG_MR_ERR_INPUT;
 	}
 
+	err = mr_cache_remove(mr);
+	if (err) {
+		errno = err;
+		return IBV_REREG_MR_ERR_INPUT;
+	}
+
 	if (flags & IBV_REREG_MR_CHANGE_TRANSLATION) {
 		err = ibv_dontfork_range(addr, length);
 		if (err)
@@ -309,15 +728,10 @@ LATEST_SYMVER_FUNC(ibv_dereg_mr, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_mr *mr)
 {
-	int ret;
-	void *addr	= mr->addr;
-	size_t length	= mr->length;
-
-	ret = mr->context->ops.dereg_mr(mr);
-	if (!ret)
-		ibv_dofork_range(addr, length);
+	if (mr_cache_put(mr))
+		return 0;
 
-	return ret;
+	return mr_dereg(mr);
 }
 
 static struct ibv_comp_channel *ibv_create_comp_channel_v2(struct ibv_context *context)
@@ -343,6 +757,8 @@ struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 	struct ibv_comp_channel            *channel;
 	struct ibv_create_comp_channel      cmd;
 	struct ibv_create_comp_channel_resp resp;
+	const struct verbs_device_ops      *ops =
+		verbs_get_device(context->device)->ops;
 
 	if (abi_ver <= 2)
 		return ibv_create_comp_channel_v2(context);
@@ -351,6 +767,18 @@ struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 	if (!channel)
 		return NULL;
 
+	if (ops->create_comp_channel) {
+		channel->fd = ops->create_comp_channel(context);
+		if (channel->fd < 0) {
+			free(channel);
+			return NULL;
+		}
+
+		channel->context = context;
+		channel->refcnt  = 0;
+		return channel;
+	}
+
 	IBV_INIT_CMD_RESP(&cmd, sizeof cmd, CREATE_COMP_CHANNEL, &resp, sizeof resp);
 	if (write(context->cmd_fd, &cmd, sizeof cmd) != sizeof cmd) {
 		free(channel);
@@ -1871,6 +1871,28 @@ int ibv_rereg_mr(struct ibv_mr *mr, int flags,
  */
 int ibv_dereg_mr(struct ibv_mr *mr);
 
+/**
+ * ibv_set_mr_cache - Enable or disable the registration cache of a PD
+ * @pd: Protection domain
+ * @max_unused: Number of unreferenced MRs to keep registered, 0 to disable
+ *
+ * While enabled, ibv_reg_mr on @pd returns a shared MR for registrations
+ * with the same address, length, and access flags, unless remote access is
+ * requested.  Returns 0 on success, or the value of errno on failure.
+ */
+int ibv_set_mr_cache(struct ibv_pd *pd, int max_unused);
+
+/**
+ * ibv_mr_cache_invalidate - Drop cached registrations covering a range
+ * @addr: Start of the range
+ * @length: Length of the range
+ *
+ * Must be called before memory registered on a PD with the cache enabled
+ * is unmapped or freed, so that a later registration of a reused address
+ * does not return a stale MR.
+ */
+void ibv_mr_cache_invalidate(void *addr, size_t length);
+
 /**
  * ibv_alloc_mw - Allocate a memory window
  */
@@ -38,6 +38,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "cma.h"
 #include <rdma/rdma_cma.h>
@@ -45,6 +48,45 @@
 
 static struct rdma_addrinfo nohints;
 
+/*
+ * If RDMACM_ADDRINFO_TTL is set, successful lookups are cached for that
+ * many seconds, so that repeated resolution of the same peer does not go
+ * through getaddrinfo and ibacm again.  The cache is disabled by default,
+ * since it hides changes in name resolution from the application.
+ */
+#define UCMA_RAI_TTL		0
+#define UCMA_RAI_HASH_SIZE	256
+#define UCMA_RAI_CACHE_MAX	4096
+#define UCMA_RAI_THREADS	4
+
+struct ucma_rai_entry {
+	struct ucma_rai_entry	*next;
+	time_t			expires;
+	struct rdma_addrinfo	*rai;
+	size_t			key_len;
+	uint8_t			key[];
+};
+
+struct ucma_rai_req {
+	struct ucma_rai_req	*next;
+	char			*node;
+	char			*service;
+	struct rdma_addrinfo	*hints;
+	rdma_getaddrinfo_cb	callback;
+	void			*context;
+};
+
+static pthread_mutex_t rai_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ucma_rai_entry *rai_cache[UCMA_RAI_HASH_SIZE];
+static int rai_cache_cnt;
+static int rai_ttl = -1;
+
+static pthread_cond_t rai_cond = PTHREAD_COND_INITIALIZER;
+static struct ucma_rai_req *rai_req_head, **rai_req_tail = &rai_req_head;
+static int rai_threads;
+static int rai_idle;
+static pthread_once_t rai_atfork_once = PTHREAD_ONCE_INIT;
+
 static void ucma_convert_to_ai(struct addrinfo *ai,
 			       const struct rdma_addrinfo *rai)
 {
@@ -234,27 +276,17 @@ static int ucma_getaddrinfo(const char *node, const char *service,
 	return ret;
 }
 
-int rdma_getaddrinfo(const char *node, const char *service,
-		     const struct rdma_addrinfo *hints,
-		     struct rdma_addrinfo **res)
+static int ucma_resolve_addrinfo(const char *node, const char *service,
+				 const struct rdma_addrinfo *hints,
+				 struct rdma_addrinfo **res)
 {
 	struct rdma_addrinfo *rai;
-	int ret;
-
-	if (!service && !node && !hints)
-		return ERR(EINVAL);
-
-	ret = ucma_init();
-	if (ret)
-		return ret;
+	int ret = 0;
 
 	rai = calloc(1, sizeof(*rai));
 	if (!rai)
 		return ERR(ENOMEM);
 
-	if (!hints)
-		hints = &nohints;
-
 	if (node || service) {
 		ret = ucma_getaddrinfo(node, service, hints, rai);
 	} else {
@@ -288,6 +320,443 @@ err:
 	return ret;
 }
 
+static int ucma_dup_buf(void **dst, const void *src, size_t len)
+{
+	if (!src || !len)
+		return 0;
+
+	*dst = malloc(len);
+	if (!*dst)
+		return ERR(ENOMEM);
+
+	memcpy(*dst, src, len);
+	return 0;
+}
+
+static struct rdma_addrinfo *ucma_dup_one(const struct rdma_addrinfo *src)
+{
+	struct rdma_addrinfo *rai;
+
+	rai = calloc(1, sizeof(*rai));
+	if (!rai)
+		return NULL;
+
+	rai->ai_flags = src->ai_flags;
+	rai->ai_family = src->ai_family;
+	rai->ai_qp_type = src->ai_qp_type;
+	rai->ai_port_space = src->ai_port_space;
+	if (ucma_dup_buf((void **) &rai->ai_src_addr, src->ai_src_addr,
+			 src->ai_src_len) ||
+	    ucma_dup_buf((void **) &rai->ai_dst_addr, src->ai_dst_addr,
+			 src->ai_dst_len) ||
+	    ucma_dup_buf(&rai->ai_route, src->ai_route, src->ai_route_len) ||
+	    ucma_dup_buf(&rai->ai_connect, src->ai_connect, src->ai_connect_len))
+		goto err;
+
+	rai->ai_src_len = rai->ai_src_addr ? src->ai_src_len : 0;
+	rai->ai_dst_len = rai->ai_dst_addr ? src->ai_dst_len : 0;
+	rai->ai_route_len = rai->ai_route ? src->ai_route_len : 0;
+	rai->ai_connect_len = rai->ai_connect ? src->ai_connect_len : 0;
+
+	if (src->ai_src_canonname &&
+	    !(rai->ai_src_canonname = strdup(src->ai_src_canonname)))
+		goto err;
+	if (src->ai_dst_canonname &&
+	    !(rai->ai_dst_canonname = strdup(src->ai_dst_canonname)))
+		goto err;
+
+	return rai;
+err:
+	rdma_freeaddrinfo(rai);
+	return NULL;
+}
+
+static struct rdma_addrinfo *ucma_dup_addrinfo(const struct rdma_addrinfo *src)
+{
+	struct rdma_addrinfo *head = NULL, **next = &head;
+
+	for (; src; src = src->ai_next) {
+		*next = ucma_dup_one(src);
+		if (!*next) {
+			rdma_freeaddrinfo(head);
+			return NULL;
+		}
+		next = &(*next)->ai_next;
+	}
+	return head;
+}
+
+static size_t ucma_rai_key_add(uint8_t *key, size_t off,
+			       const void *data, size_t len)
+{
+	if (key && len)
+		memcpy(key + off, data, len);
+	return off + len;
+}
+
+/* The cache key is the request: node, service, and the hints used */
+static uint8_t *ucma_rai_key(const char *node, const char *service,
+			     const struct rdma_addrinfo *hints, size_t *len)
+{
+	uint8_t *key = NULL;
+	size_t off;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		off = ucma_rai_key_add(key, 0, node ? node : "",
+				       node ? strlen(node) + 1 : 1);
+		off = ucma_rai_key_add(key, off, service ? service : "",
+				       service ? strlen(service) + 1 : 1);
+		off = ucma_rai_key_add(key, off, &hints->ai_flags,
+				       sizeof(int) * 4);
+		off = ucma_rai_key_add(key, off, &hints->ai_src_len,
+				       sizeof(hints->ai_src_len));
+		off = ucma_rai_key_add(key, off, hints->ai_src_addr,
+				       hints->ai_src_len);
+		off = ucma_rai_key_add(key, off, &hints->ai_dst_len,
+				       sizeof(hints->ai_dst_len));
+		off = ucma_rai_key_add(key, off, hints->ai_dst_addr,
+				       hints->ai_dst_len);
+		off = ucma_rai_key_add(key, off, &hints->ai_route_len,
+				       sizeof(hints->ai_route_len));
+		off = ucma_rai_key_add(key, off, hints->ai_route,
+				       hints->ai_route_len);
+
+		if (!key) {
+			key = malloc(off);
+			if (!key)
+				return NULL;
+		}
+	}
+
+	*len = off;
+	return key;
+}
+
+static uint32_t ucma_rai_hash(const uint8_t *key, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ *key++) * 16777619;
+	return hash % UCMA_RAI_HASH_SIZE;
+}
+
+static time_t ucma_rai_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* Caller must hold rai_lock */
+static int ucma_rai_cache_ttl(void)
+{
+	char *value;
+
+	if (rai_ttl < 0) {
+		value = getenv("RDMACM_ADDRINFO_TTL");
+		rai_ttl = value ? atoi(value) : UCMA_RAI_TTL;
+		if (rai_ttl < 0)
+			rai_ttl = 0;
+	}
+	return rai_ttl;
+}
+
+static void ucma_rai_free_entry(struct ucma_rai_entry *entry)
+{
+	rdma_freeaddrinfo(entry->rai);
+	free(entry);
+}
+
+/* Caller must hold rai_lock */
+static void ucma_rai_cache_purge(time_t now)
+{
+	struct ucma_rai_entry **entry, *del;
+	int i;
+
+	for (i = 0; i < UCMA_RAI_HASH_SIZE; i++) {
+		for (entry = &rai_cache[i]; *entry; ) {
+			if ((*entry)->expires > now) {
+				entry = &(*entry)->next;
+				continue;
+			}
+			del = *entry;
+			*entry = del->next;
+			ucma_rai_free_entry(del);
+			rai_cache_cnt--;
+		}
+	}
+}
+
+static struct rdma_addrinfo *
+ucma_rai_cache_get(const uint8_t *key, size_t len, uint32_t hash)
+{
+	struct ucma_rai_entry **entry, *del;
+	struct rdma_addrinfo *rai = NULL;
+	time_t now = ucma_rai_time();
+
+	pthread_mutex_lock(&rai_lock);
+	for (entry = &rai_cache[hash]; *entry; entry = &(*entry)->next) {
+		if ((*entry)->key_len != len || memcmp((*entry)->key, key, len))
+			continue;
+
+		if ((*entry)->expires > now) {
+			rai = ucma_dup_addrinfo((*entry)->rai);
+		} else {
+			del = *entry;
+			*entry = del->next;
+			ucma_rai_free_entry(del);
+			rai_cache_cnt--;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&rai_lock);
+	return rai;
+}
+
+static void ucma_rai_cache_put(const uint8_t *key, size_t len, uint32_t hash,
+			       const struct rdma_addrinfo *rai)
+{
+	struct ucma_rai_entry *entry, **cur;
+	time_t now = ucma_rai_time();
+
+	entry = malloc(sizeof(*entry) + len);
+	if (!entry)
+		return;
+
+	entry->rai = ucma_dup_addrinfo(rai);
+	if (!entry->rai) {
+		free(entry);
+		return;
+	}
+	entry->key_len = len;
+	memcpy(entry->key, key, len);
+
+	pthread_mutex_lock(&rai_lock);
+	entry->expires = now + ucma_rai_cache_ttl();
+	for (cur = &rai_cache[hash]; *cur; cur = &(*cur)->next) {
+		if ((*cur)->key_len == len && !memcmp((*cur)->key, key, len)) {
+			entry->next = (*cur)->next;
+			ucma_rai_free_entry(*cur);
+			*cur = entry;
+			goto unlock;
+		}
+	}
+
+	if (rai_cache_cnt >= UCMA_RAI_CACHE_MAX)
+		ucma_rai_cache_purge(now);
+	if (rai_cache_cnt >= UCMA_RAI_CACHE_MAX) {
+		ucma_rai_free_entry(entry);
+		goto unlock;
+	}
+
+	entry->next = rai_cache[hash];
+	rai_cache[hash] = entry;
+	rai_cache_cnt++;
+unlock:
+	pthread_mutex_unlock(&rai_lock);
+}
+
+static int ucma_rai_cache_enabled(const char *node, const char *service)
+{
+	int ttl;
+
+	if (!node && !service)
+		return 0;
+
+	pthread_mutex_lock(&rai_lock);
+	ttl = ucma_rai_cache_ttl();
+	pthread_mutex_unlock(&rai_lock);
+	return ttl > 0;
+}
+
+int rdma_getaddrinfo(const char *node, const char *service,
+		     const struct rdma_addrinfo *hints,
+		     struct rdma_addrinfo **res)
+{
+	uint8_t *key = NULL;
+	uint32_t hash = 0;
+	size_t len;
+	int ret;
+
+	if (!service && !node && !hints)
+		return ERR(EINVAL);
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!hints)
+		hints = &nohints;
+
+	if (ucma_rai_cache_enabled(node, service)) {
+		key = ucma_rai_key(node, service, hints, &len);
+		if (key) {
+			hash = ucma_rai_hash(key, len);
+			*res = ucma_rai_cache_get(key, len, hash);
+			if (*res) {
+				free(key);
+				return 0;
+			}
+		}
+	}
+
+	ret = ucma_resolve_addrinfo(node, service, hints, res);
+	if (!ret && key)
+		ucma_rai_cache_put(key, len, hash, *res);
+
+	free(key);
+	return ret;
+}
+
+static void ucma_free_rai_req(struct ucma_rai_req *req)
+{
+	free(req->node);
+	free(req->service);
+	rdma_freeaddrinfo(req->hints);
+	free(req);
+}
+
+static void *ucma_rai_thread(void *arg)
+{
+	struct rdma_addrinfo *res;
+	struct ucma_rai_req *req;
+	int ret;
+
+	pthread_mutex_lock(&rai_lock);
+	while (1) {
+		while (!rai_req_head) {
+			rai_idle++;
+			pthread_cond_wait(&rai_cond, &rai_lock);
+			rai_idle--;
+		}
+
+		req = rai_req_head;
+		rai_req_head = req->next;
+		if (!rai_req_head)
+			rai_req_tail = &rai_req_head;
+		pthread_mutex_unlock(&rai_lock);
+
+		res = NULL;
+		ret = rdma_getaddrinfo(req->node, req->service, req->hints, &res);
+		if (ret == -1)
+			ret = errno;
+		req->callback(req->context, ret, ret ? NULL : res);
+		ucma_free_rai_req(req);
+
+		pthread_mutex_lock(&rai_lock);
+	}
+	return NULL;
+}
+
+static void ucma_rai_atfork_prepare(void)
+{
+	pthread_mutex_lock(&rai_lock);
+}
+
+static void ucma_rai_atfork_parent(void)
+{
+	pthread_mutex_unlock(&rai_lock);
+}
+
+/*
+ * The resolver threads do not exist in the child, and the requests queued
+ * for them belong to the parent, so the child starts with an empty pool.
+ */
+static void ucma_rai_atfork_child(void)
+{
+	struct ucma_rai_req *req;
+
+	while ((req = rai_req_head)) {
+		rai_req_head = req->next;
+		ucma_free_rai_req(req);
+	}
+	rai_req_tail = &rai_req_head;
+	rai_threads = 0;
+	rai_idle = 0;
+	pthread_cond_init(&rai_cond, NULL);
+	pthread_mutex_init(&rai_lock, NULL);
+}
+
+static void ucma_rai_atfork_init(void)
+{
+	pthread_atfork(ucma_rai_atfork_prepare, ucma_rai_atfork_parent,
+		       ucma_rai_atfork_child);
+}
+
+/*
+ * Requests are resolved by a small pool of threads, which are started as
+ * needed and then kept for the life of the process, or until it forks.
+ */
+int rdma_getaddrinfo_async(const char *node, const char *service,
+			   const struct rdma_addrinfo *hints,
+			   rdma_getaddrinfo_cb callback, void *context)
+{
+	struct rdma_addrinfo *res;
+	struct ucma_rai_req *req;
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint8_t *key;
+	size_t len;
+	int ret;
+
+	if ((!service && !node && !hints) || !callback)
+		return ERR(EINVAL);
+
+	if (ucma_rai_cache_enabled(node, service)) {
+		key = ucma_rai_key(node, service, hints ? hints : &nohints, &len);
+		if (key) {
+			res = ucma_rai_cache_get(key, len, ucma_rai_hash(key, len));
+			free(key);
+			if (res) {
+				callback(context, 0, res);
+				return 0;
+			}
+		}
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return ERR(ENOMEM);
+
+	if ((node && !(req->node = strdup(node))) ||
+	    (service && !(req->service = strdup(service))) ||
+	    (hints && !(req->hints = ucma_dup_one(hints)))) {
+		ret = ERR(ENOMEM);
+		goto err;
+	}
+	req->callback = callback;
+	req->context = context;
+
+	pthread_once(&rai_atfork_once, ucma_rai_atfork_init);
+	pthread_mutex_lock(&rai_lock);
+	if (!rai_idle && rai_threads < UCMA_RAI_THREADS) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread, &attr, ucma_rai_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (!ret)
+			rai_threads++;
+		else if (!rai_threads) {
+			pthread_mutex_unlock(&rai_lock);
+			ret = ERR(ret);
+			goto err;
+		}
+	}
+
+	*rai_req_tail = req;
+	rai_req_tail = &req->next;
+	pthread_cond_signal(&rai_cond);
+	pthread_mutex_unlock(&rai_lock);
+	return 0;
+
+err:
+	ucma_free_rai_req(req);
+	return ret;
+}
+
 void rdma_freeaddrinfo(struct rdma_addrinfo *res)
 {
 	struct rdma_addrinfo *rai;
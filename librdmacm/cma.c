@@ -122,16 +122,24 @@ struct cma_event {
 	uint8_t			private_data[RDMA_MAX_PRIVATE_DATA];
 	struct cma_id_private	*id_priv;
 	struct cma_multicast	*mc;
+	struct cma_event	*next;
 };
 
+/* Acked events are kept for reuse, up to CMA_EVENT_CACHE_MAX */
+#define CMA_EVENT_CACHE_MAX 256
+
 static struct cma_device *cma_dev_array;
 static int cma_dev_cnt;
 static int cma_init_cnt;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 static int abi_ver = RDMA_USER_CM_MAX_ABI_VERSION;
 int af_ib_support;
+static int ucma_loopback;
 static struct index_map ucma_idm;
 static fastlock_t idm_lock;
+static fastlock_t evt_lock;
+static struct cma_event *evt_cache;
+static int evt_cache_cnt;
 
 static int check_abi_version(void)
 {
@@ -159,6 +167,25 @@ static int check_abi_version(void)
 	return 0;
 }
 
+/*
+ * With RDMAV_LOOPBACK set, commands go to the userspace rdma_cm in
+ * loopback.c, which serves the loopback verbs device.
+ */
+static ssize_t ucma_write(int fd, void *cmd, size_t size)
+{
+	if (ucma_loopback)
+		return ucma_lo_write(fd, cmd, size);
+	return write(fd, cmd, size);
+}
+
+/* loopback0 has no sysfs node_guid to match the CM's responses against */
+static __be64 ucma_get_device_guid(struct ibv_device *dev)
+{
+	if (ucma_loopback && !strcmp(ibv_get_device_name(dev), "loopback0"))
+		return UCMA_LO_NODE_GUID;
+	return ibv_get_device_guid(dev);
+}
+
 /*
  * This function is called holding the mutex lock
  * cma_dev_cnt must be set before calling this function to
@@ -201,9 +228,13 @@ int ucma_init(void)
 	}
 
 	fastlock_init(&idm_lock);
-	ret = check_abi_version();
-	if (ret)
-		goto err1;
+	fastlock_init(&evt_lock);
+	ucma_loopback = getenv("RDMAV_LOOPBACK") != NULL;
+	if (!ucma_loopback) {
+		ret = check_abi_version();
+		if (ret)
+			goto err1;
+	}
 
 	dev_list = ibv_get_device_list(&dev_cnt);
 	if (!dev_list) {
@@ -223,7 +254,7 @@ int ucma_init(void)
 	}
 
 	for (i = 0; dev_list[i]; i++)
-		cma_dev_array[i].guid = ibv_get_device_guid(dev_list[i]);
+		cma_dev_array[i].guid = ucma_get_device_guid(dev_list[i]);
 
 	cma_dev_cnt = dev_cnt;
 	ucma_set_af_ib_support();
@@ -234,6 +265,7 @@ int ucma_init(void)
 err2:
 	ibv_free_device_list(dev_list);
 err1:
+	fastlock_destroy(&evt_lock);
 	fastlock_destroy(&idm_lock);
 	pthread_mutex_unlock(&mut);
 	return ret;
@@ -251,7 +283,7 @@ static struct ibv_context *ucma_open_device(__be64 guid)
 	}
 
 	for (i = 0; dev_list[i]; i++) {
-		if (ibv_get_device_guid(dev_list[i]) == guid) {
+		if (ucma_get_device_guid(dev_list[i]) == guid) {
 			verbs = ibv_open_device(dev_list[i]);
 			break;
 		}
@@ -366,7 +398,10 @@ struct rdma_event_channel *rdma_create_event_channel(void)
 	if (!channel)
 		return NULL;
 
-	channel->fd = open("/dev/infiniband/rdma_cm", O_RDWR | O_CLOEXEC);
+	if (ucma_loopback)
+		channel->fd = ucma_lo_open();
+	else
+		channel->fd = open("/dev/infiniband/rdma_cm", O_RDWR | O_CLOEXEC);
 	if (channel->fd < 0) {
 		goto err;
 	}
@@ -378,7 +413,10 @@ err:
 
 void rdma_destroy_event_channel(struct rdma_event_channel *channel)
 {
-	close(channel->fd);
+	if (ucma_loopback)
+		ucma_lo_close(channel->fd);
+	else
+		close(channel->fd);
 	free(channel);
 }
 
@@ -534,7 +572,7 @@ static int rdma_create_id2(struct rdma_event_channel *channel,
 	cmd.ps = ps;
 	cmd.qp_type = qp_type;
 
-	ret = write(id_priv->id.channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id_priv->id.channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		goto err;
 
@@ -569,7 +607,7 @@ static int ucma_destroy_kern_id(int fd, uint32_t handle)
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, DESTROY_ID, &resp, sizeof resp);
 	cmd.id = handle;
 
-	ret = write(fd, &cmd, sizeof cmd);
+	ret = ucma_write(fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -629,7 +667,7 @@ static int ucma_query_addr(struct rdma_cm_id *id)
 	cmd.id = id_priv->handle;
 	cmd.option = UCMA_QUERY_ADDR;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -662,7 +700,7 @@ static int ucma_query_gid(struct rdma_cm_id *id)
 	cmd.id = id_priv->handle;
 	cmd.option = UCMA_QUERY_GID;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -723,7 +761,7 @@ static int ucma_query_path(struct rdma_cm_id *id)
 	cmd.id = id_priv->handle;
 	cmd.option = UCMA_QUERY_PATH;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -754,7 +792,7 @@ static int ucma_query_route(struct rdma_cm_id *id)
 	id_priv = container_of(id, struct cma_id_private, id);
 	cmd.id = id_priv->handle;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -805,7 +843,7 @@ static int rdma_bind_addr2(struct rdma_cm_id *id, struct sockaddr *addr,
 	cmd.addr_size = addrlen;
 	memcpy(&cmd.addr, addr, addrlen);
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -833,7 +871,7 @@ int rdma_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr)
 	cmd.id = id_priv->handle;
 	memcpy(&cmd.addr, addr, addrlen);
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -886,7 +924,7 @@ static int rdma_resolve_addr2(struct rdma_cm_id *id, struct sockaddr *src_addr,
 	cmd.dst_size = dst_len;
 	cmd.timeout_ms = timeout_ms;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -921,7 +959,7 @@ int rdma_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr,
 	memcpy(&cmd.dst_addr, dst_addr, dst_len);
 	cmd.timeout_ms = timeout_ms;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -973,7 +1011,7 @@ int rdma_resolve_route(struct rdma_cm_id *id, int timeout_ms)
 	cmd.id = id_priv->handle;
 	cmd.timeout_ms = timeout_ms;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -999,7 +1037,7 @@ static int rdma_init_qp_attr(struct rdma_cm_id *id, struct ibv_qp_attr *qp_attr,
 	cmd.id = id_priv->handle;
 	cmd.qp_state = qp_attr->qp_state;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1500,7 +1538,7 @@ int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param)
 					     conn_param, 0, 0);
 	}
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1523,7 +1561,7 @@ int rdma_listen(struct rdma_cm_id *id, int backlog)
 	cmd.id = id_priv->handle;
 	cmd.backlog = backlog;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1626,7 +1664,7 @@ int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param)
 					     conn_param, conn_param->qp_num,
 					     conn_param->srq);
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		ucma_modify_qp_err(id);
 		return (ret >= 0) ? ERR(ENODATA) : -1;
@@ -1654,7 +1692,7 @@ int rdma_reject(struct rdma_cm_id *id, const void *private_data,
 		cmd.private_data_len = private_data_len;
 	}
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1672,7 +1710,7 @@ int rdma_notify(struct rdma_cm_id *id, enum ibv_event_type event)
 	id_priv = container_of(id, struct cma_id_private, id);
 	cmd.id = id_priv->handle;
 	cmd.event = event;
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1705,7 +1743,7 @@ int rdma_disconnect(struct rdma_cm_id *id)
 	id_priv = container_of(id, struct cma_id_private, id);
 	cmd.id = id_priv->handle;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -1748,7 +1786,7 @@ static int rdma_join_multicast2(struct rdma_cm_id *id, struct sockaddr *addr,
 		cmd.uid = (uintptr_t) mc;
 		cmd.reserved = 0;
 
-		ret = write(id->channel->fd, &cmd, sizeof cmd);
+		ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 		if (ret != sizeof cmd) {
 			ret = (ret >= 0) ? ERR(ENODATA) : -1;
 			goto err2;
@@ -1761,7 +1799,7 @@ static int rdma_join_multicast2(struct rdma_cm_id *id, struct sockaddr *addr,
 		memcpy(&cmd.addr, addr, addrlen);
 		cmd.uid = (uintptr_t) mc;
 
-		ret = write(id->channel->fd, &cmd, sizeof cmd);
+		ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 		if (ret != sizeof cmd) {
 			ret = (ret >= 0) ? ERR(ENODATA) : -1;
 			goto err2;
@@ -1827,7 +1865,7 @@ int rdma_leave_multicast(struct rdma_cm_id *id, struct sockaddr *addr)
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, LEAVE_MCAST, &resp, sizeof resp);
 	cmd.id = mc->handle;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		ret = (ret >= 0) ? ERR(ENODATA) : -1;
 		goto free;
@@ -1846,14 +1884,19 @@ free:
 	return ret;
 }
 
-static void ucma_complete_event(struct cma_id_private *id_priv)
+static void ucma_complete_events(struct cma_id_private *id_priv, int cnt)
 {
 	pthread_mutex_lock(&id_priv->mut);
-	id_priv->events_completed++;
+	id_priv->events_completed += cnt;
 	pthread_cond_signal(&id_priv->cond);
 	pthread_mutex_unlock(&id_priv->mut);
 }
 
+static void ucma_complete_event(struct cma_id_private *id_priv)
+{
+	ucma_complete_events(id_priv, 1);
+}
+
 static void ucma_complete_mc_event(struct cma_multicast *mc)
 {
 	pthread_mutex_lock(&mc->id_priv->mut);
@@ -1864,20 +1907,86 @@ static void ucma_complete_mc_event(struct cma_multicast *mc)
 	pthread_mutex_unlock(&mc->id_priv->mut);
 }
 
-int rdma_ack_cm_event(struct rdma_cm_event *event)
+static struct cma_event *ucma_alloc_event(void)
 {
 	struct cma_event *evt;
 
-	if (!event)
+	fastlock_acquire(&evt_lock);
+	evt = evt_cache;
+	if (evt) {
+		evt_cache = evt->next;
+		evt_cache_cnt--;
+	}
+	fastlock_release(&evt_lock);
+
+	return evt ? evt : malloc(sizeof(*evt));
+}
+
+static void ucma_free_events(struct cma_event *head, struct cma_event *tail,
+			     int cnt)
+{
+	fastlock_acquire(&evt_lock);
+	if (evt_cache_cnt < CMA_EVENT_CACHE_MAX) {
+		tail->next = evt_cache;
+		evt_cache = head;
+		evt_cache_cnt += cnt;
+		head = NULL;
+	}
+	fastlock_release(&evt_lock);
+
+	while (head) {
+		tail = head->next;
+		free(head);
+		head = tail;
+	}
+}
+
+int rdma_ack_cm_event(struct rdma_cm_event *event)
+{
+	return rdma_ack_cm_events(&event, 1);
+}
+
+/*
+ * Completions for consecutive events on the same rdma_cm_id are reported
+ * together, and all events are returned to the cache under a single lock.
+ */
+int rdma_ack_cm_events(struct rdma_cm_event **events, int num_events)
+{
+	struct cma_event *evt, *head = NULL, *tail = NULL;
+	struct cma_id_private *id_priv = NULL;
+	int i, cnt = 0;
+
+	if (!events || num_events <= 0)
 		return ERR(EINVAL);
 
-	evt = container_of(event, struct cma_event, event);
+	for (i = 0; i < num_events; i++) {
+		if (!events[i])
+			return ERR(EINVAL);
+	}
 
-	if (evt->mc)
-		ucma_complete_mc_event(evt->mc);
-	else
-		ucma_complete_event(evt->id_priv);
-	free(evt);
+	for (i = 0; i < num_events; i++) {
+		evt = container_of(events[i], struct cma_event, event);
+
+		if (evt->mc) {
+			ucma_complete_mc_event(evt->mc);
+		} else if (evt->id_priv == id_priv) {
+			cnt++;
+		} else {
+			if (cnt)
+				ucma_complete_events(id_priv, cnt);
+			id_priv = evt->id_priv;
+			cnt = 1;
+		}
+
+		evt->next = head;
+		head = evt;
+		if (!tail)
+			tail = evt;
+	}
+
+	if (cnt)
+		ucma_complete_events(id_priv, cnt);
+	ucma_free_events(head, tail, num_events);
 	return 0;
 }
 
@@ -1989,7 +2098,7 @@ static int ucma_process_conn_resp(struct cma_id_private *id_priv)
 	CMA_INIT_CMD(&cmd, sizeof cmd, ACCEPT);
 	cmd.id = id_priv->handle;
 
-	ret = write(id_priv->id.channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id_priv->id.channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		ret = (ret >= 0) ? ERR(ENODATA) : -1;
 		goto err;
@@ -2051,33 +2160,37 @@ static void ucma_copy_ud_event(struct cma_event *event,
 	dst->qkey = src->qkey;
 }
 
-int rdma_get_cm_event(struct rdma_event_channel *channel,
-		      struct rdma_cm_event **event)
+/*
+ * The kernel returns a single event per GET_EVENT command.  If nonblock is
+ * set, the channel is checked for a pending event before each command, so
+ * that the call does not block regardless of the fd's O_NONBLOCK setting.
+ * The check only holds while this is the sole reader of the channel:
+ * another thread may take the pending event before the command is issued,
+ * which then blocks unless the fd is O_NONBLOCK.
+ */
+static int ucma_get_event(struct rdma_event_channel *channel,
+			  struct cma_event *evt, int nonblock)
 {
 	struct ucma_abi_event_resp resp;
 	struct ucma_abi_get_event cmd;
-	struct cma_event *evt;
+	struct pollfd fds;
 	int ret;
 
-	ret = ucma_init();
-	if (ret)
-		return ret;
-
-	if (!event)
-		return ERR(EINVAL);
-
-	evt = malloc(sizeof(*evt));
-	if (!evt)
-		return ERR(ENOMEM);
-
 retry:
+	if (nonblock) {
+		fds.fd = channel->fd;
+		fds.events = POLLIN;
+		fds.revents = 0;
+		ret = poll(&fds, 1, 0);
+		if (ret <= 0)
+			return ret ? ret : ERR(EAGAIN);
+	}
+
 	memset(evt, 0, sizeof(*evt));
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, GET_EVENT, &resp, sizeof resp);
-	ret = write(channel->fd, &cmd, sizeof cmd);
-	if (ret != sizeof cmd) {
-		free(evt);
+	ret = ucma_write(channel->fd, &cmd, sizeof cmd);
+	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
-	}
 	
 	VALGRIND_MAKE_MEM_DEFINED(&resp, sizeof resp);
 
@@ -2185,10 +2298,61 @@ retry:
 		break;
 	}
 
-	*event = &evt->event;
 	return 0;
 }
 
+int rdma_get_cm_event(struct rdma_event_channel *channel,
+		      struct rdma_cm_event **event)
+{
+	int ret;
+
+	ret = rdma_get_cm_events(channel, event, 1);
+	return (ret == 1) ? 0 : ret;
+}
+
+/*
+ * Blocks (subject to the fd's O_NONBLOCK setting) only for the first event.
+ * Additional events are returned only if they are already pending, provided
+ * no other thread reads the channel concurrently.  An O_NONBLOCK fd needs
+ * no check for pending events: the command fails with EAGAIN once there are
+ * none, which ends the batch.
+ */
+int rdma_get_cm_events(struct rdma_event_channel *channel,
+		       struct rdma_cm_event **events, int num_events)
+{
+	struct cma_event *evt;
+	int i, ret, fd_nonblock = 0;
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!events || num_events <= 0)
+		return ERR(EINVAL);
+
+	if (num_events > 1)
+		fd_nonblock = fcntl(channel->fd, F_GETFL) & O_NONBLOCK;
+
+	for (i = 0; i < num_events; i++) {
+		evt = ucma_alloc_event();
+		if (!evt) {
+			ret = ERR(ENOMEM);
+			break;
+		}
+
+		ret = ucma_get_event(channel, evt, i > 0 && !fd_nonblock);
+		if (ret) {
+			ucma_free_events(evt, evt, 1);
+			break;
+		}
+
+		events[i] = &evt->event;
+	}
+
+	return i ? i : ret;
+}
+
+
 const char *rdma_event_str(enum rdma_cm_event_type event)
 {
 	switch (event) {
@@ -2244,7 +2408,7 @@ int rdma_set_option(struct rdma_cm_id *id, int level, int optname,
 	cmd.optname = optname;
 	cmd.optlen = optlen;
 
-	ret = write(id->channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(id->channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
 
@@ -2272,7 +2436,7 @@ int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel)
 	cmd.id = id_priv->handle;
 	cmd.fd = id->channel->fd;
 
-	ret = write(channel->fd, &cmd, sizeof cmd);
+	ret = ucma_write(channel->fd, &cmd, sizeof cmd);
 	if (ret != sizeof cmd) {
 		if (sync)
 			rdma_destroy_event_channel(channel);
@@ -2416,6 +2580,193 @@ void rdma_destroy_ep(struct rdma_cm_id *id)
 	rdma_destroy_id(id);
 }
 
+struct ucma_ep_req {
+	struct rdma_cm_id	*id;
+	struct rdma_addrinfo	*res;
+};
+
+static void ucma_ep_done(struct ucma_ep_req *req, int index, int status,
+			 rdma_connect_eps_cb callback, void *context)
+{
+	if (status) {
+		rdma_destroy_ep(req->id);
+		req->id = NULL;
+	}
+
+	if (callback)
+		callback(context, index, req->id, status);
+}
+
+static int ucma_ep_route(struct ucma_ep_req *req)
+{
+	struct rdma_addrinfo *res = req->res;
+
+	if (res->ai_route_len)
+		return rdma_set_option(req->id, RDMA_OPTION_IB,
+				       RDMA_OPTION_IB_PATH, res->ai_route,
+				       res->ai_route_len);
+
+	return rdma_resolve_route(req->id, 2000);
+}
+
+static int ucma_ep_connect(struct ucma_ep_req *req, struct ibv_pd *pd,
+			   struct ibv_qp_init_attr *qp_init_attr,
+			   struct rdma_conn_param *conn_param)
+{
+	struct rdma_addrinfo *res = req->res;
+	struct cma_id_private *id_priv;
+	struct ibv_qp_init_attr attr;
+	int ret;
+
+	if (qp_init_attr) {
+		attr = *qp_init_attr;
+		attr.qp_type = res->ai_qp_type;
+		ret = rdma_create_qp(req->id, pd, &attr);
+		if (ret)
+			return ret;
+	}
+
+	if (res->ai_connect_len) {
+		id_priv = container_of(req->id, struct cma_id_private, id);
+		id_priv->connect = malloc(res->ai_connect_len);
+		if (!id_priv->connect)
+			return ERR(ENOMEM);
+		memcpy(id_priv->connect, res->ai_connect, res->ai_connect_len);
+		id_priv->connect_len = res->ai_connect_len;
+	}
+
+	return rdma_connect(req->id, conn_param);
+}
+
+/*
+ * Each id is created on a shared channel in asynchronous mode, so that the
+ * kernel resolves and connects all of them at once.  We advance each id by
+ * one step per CM event, then move connected ids to synchronous mode, as if
+ * they had come from rdma_create_ep.  Events are retrieved one at a time:
+ * migrating or destroying an id waits for all of its reported events to be
+ * acked, and migration carries the events still queued for the id, such as
+ * a quick disconnect, over to its new channel.
+ */
+int rdma_connect_eps(struct rdma_cm_id **ids, struct rdma_addrinfo **res,
+		     int num, struct ibv_pd *pd,
+		     struct ibv_qp_init_attr *qp_init_attr,
+		     struct rdma_conn_param *conn_param,
+		     rdma_connect_eps_cb callback, void *context)
+{
+	struct rdma_event_channel *channel;
+	struct rdma_cm_event *event;
+	struct ucma_ep_req *reqs, *req;
+	int i, index, ret, pending = 0, connected = 0;
+
+	if (!ids || !res || num <= 0)
+		return ERR(EINVAL);
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	reqs = calloc(num, sizeof(*reqs));
+	if (!reqs)
+		return ERR(ENOMEM);
+
+	channel = rdma_create_event_channel();
+	if (!channel) {
+		free(reqs);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		req = &reqs[i];
+		req->res = res[i];
+		if (res[i]->ai_flags & RAI_PASSIVE) {
+			errno = EINVAL;
+			if (callback)
+				callback(context, i, NULL, -1);
+			continue;
+		}
+
+		ret = rdma_create_id2(channel, &req->id, (void *) (uintptr_t) i,
+				      res[i]->ai_port_space, res[i]->ai_qp_type);
+		if (ret) {
+			if (callback)
+				callback(context, i, NULL, ret);
+			continue;
+		}
+
+		if (af_ib_support)
+			ret = rdma_resolve_addr2(req->id, res[i]->ai_src_addr,
+						 res[i]->ai_src_len,
+						 res[i]->ai_dst_addr,
+						 res[i]->ai_dst_len, 2000);
+		else
+			ret = rdma_resolve_addr(req->id, res[i]->ai_src_addr,
+						res[i]->ai_dst_addr, 2000);
+		if (ret)
+			ucma_ep_done(req, i, ret, callback, context);
+		else
+			pending++;
+	}
+
+	while (pending) {
+		ret = rdma_get_cm_event(channel, &event);
+		if (ret) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		index = (int) (uintptr_t) event->id->context;
+		req = &reqs[index];
+
+		switch (event->event) {
+		case RDMA_CM_EVENT_ADDR_RESOLVED:
+			ret = ucma_ep_route(req);
+			break;
+		case RDMA_CM_EVENT_ROUTE_RESOLVED:
+			ret = ucma_ep_connect(req, pd, qp_init_attr, conn_param);
+			break;
+		case RDMA_CM_EVENT_ESTABLISHED:
+			ret = 1;
+			break;
+		case RDMA_CM_EVENT_REJECTED:
+			ret = ERR(ECONNREFUSED);
+			break;
+		case RDMA_CM_EVENT_ADDR_ERROR:
+		case RDMA_CM_EVENT_ROUTE_ERROR:
+		case RDMA_CM_EVENT_CONNECT_ERROR:
+		case RDMA_CM_EVENT_UNREACHABLE:
+			ret = ERR(event->status < 0 ? -event->status : ETIMEDOUT);
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		rdma_ack_cm_event(event);
+
+		if (ret > 0) {
+			req->id->context = NULL;
+			ret = rdma_migrate_id(req->id, NULL);
+			connected += !ret;
+		} else if (!ret) {
+			continue;
+		}
+
+		ucma_ep_done(req, index, ret, callback, context);
+		pending--;
+	}
+
+	/* Only reached with ids pending if the channel failed */
+	for (i = 0; i < num; i++) {
+		if (reqs[i].id && reqs[i].id->channel == channel)
+			ucma_ep_done(&reqs[i], i, -1, callback, context);
+		ids[i] = reqs[i].id;
+	}
+
+	rdma_destroy_event_channel(channel);
+	free(reqs);
+	return connected;
+}
+
 int ucma_max_qpsize(struct rdma_cm_id *id)
 {
 	struct cma_id_private *id_priv;
@@ -39,8 +39,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <endian.h>
-#include <semaphore.h>
 #include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <rdma/rdma_cma.h>
 #include <infiniband/ib.h>
@@ -52,30 +54,57 @@
 #define PFX "librdmacm: "
 
 /*
- * Fast synchronization for low contention locking.
+ * Fast synchronization for low contention locking.  The lock word is 0 when
+ * unlocked, 1 when locked, and 2 when locked with possible waiters.  An
+ * uncontended acquire and release are a single atomic operation each.  A
+ * contended acquire spins briefly before sleeping on a futex, and release
+ * only enters the kernel if there may be a sleeper.
  */
+#define FASTLOCK_SPIN 100
+
 typedef struct {
-	sem_t sem;
-	_Atomic(int) cnt;
+	_Atomic(int) state;
 } fastlock_t;
+static inline void fastlock_futex(fastlock_t *lock, int op, int val)
+{
+	syscall(SYS_futex, &lock->state, op | FUTEX_PRIVATE_FLAG, val,
+		NULL, NULL, 0);
+}
 static inline void fastlock_init(fastlock_t *lock)
 {
-	sem_init(&lock->sem, 0, 0);
-	atomic_store(&lock->cnt, 0);
+	atomic_store(&lock->state, 0);
 }
 static inline void fastlock_destroy(fastlock_t *lock)
 {
-	sem_destroy(&lock->sem);
 }
 static inline void fastlock_acquire(fastlock_t *lock)
 {
-	if (atomic_fetch_add(&lock->cnt, 1) > 0)
-		sem_wait(&lock->sem);
+	int i, state = 0;
+
+	if (atomic_compare_exchange_strong(&lock->state, &state, 1))
+		return;
+
+	for (i = 0; i < FASTLOCK_SPIN; i++) {
+		state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+		if (!state && atomic_compare_exchange_weak(&lock->state, &state, 1))
+			return;
+	}
+
+	while (atomic_exchange(&lock->state, 2))
+		fastlock_futex(lock, FUTEX_WAIT, 2);
+}
+static inline int fastlock_tryacquire(fastlock_t *lock)
+{
+	int state = 0;
+
+	return atomic_compare_exchange_strong(&lock->state, &state, 1);
 }
 static inline void fastlock_release(fastlock_t *lock)
 {
-	if (atomic_fetch_sub(&lock->cnt, 1) > 1)
-		sem_post(&lock->sem);
+	if (atomic_fetch_sub(&lock->state, 1) != 1) {
+		atomic_store(&lock->state, 0);
+		fastlock_futex(lock, FUTEX_WAKE, 1);
+	}
 }
 
 __be16 ucma_get_port(struct sockaddr *addr);
@@ -95,6 +124,13 @@ static inline int ERR(int err)
 int ucma_init(void);
 extern int af_ib_support;
 
+/* Userspace rdma_cm for the loopback verbs device, see loopback.c */
+#define UCMA_LO_NODE_GUID htobe64(0x6c6f6f706261636bULL)	/* "loopback" */
+
+int ucma_lo_open(void);
+void ucma_lo_close(int fd);
+ssize_t ucma_lo_write(int fd, const void *buf, size_t size);
+
 #define RAI_ROUTEONLY		0x01000000
 
 void ucma_ib_init(void);
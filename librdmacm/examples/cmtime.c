@@ -52,6 +52,8 @@ static char *dst_addr;
 static char *src_addr;
 static int timeout = 2000;
 static int retries = 2;
+static int loopback;
+static int json;
 
 enum step {
 	STEP_CREATE_ID,
@@ -102,15 +104,21 @@ static struct work_list disc_work;
 static struct node *nodes;
 static struct timeval times[STEP_CNT][2];
 static int connections = 100;
+static int *depths;
+static int depth_cnt;
+static int depth;
+static int runs;
 static volatile int started[STEP_CNT];
 static volatile int completed[STEP_CNT];
 static struct ibv_qp_init_attr init_qp_attr;
 static struct rdma_conn_param conn_param;
+static struct rdma_cm_id *listen_id;
 
 #define start_perf(n, s)	gettimeofday(&((n)->times[s][0]), NULL)
 #define end_perf(n, s)		gettimeofday(&((n)->times[s][1]), NULL)
 #define start_time(s)		gettimeofday(&times[s][0], NULL)
 #define end_time(s)		gettimeofday(&times[s][1], NULL)
+#define step_msg(msg)		do { if (!json) printf("%s\n", msg); } while (0)
 
 static inline void __list_delete(struct list_head *list)
 {
@@ -159,35 +167,99 @@ static float diff_us(struct timeval *end, struct timeval *start)
 	return (end->tv_sec - start->tv_sec) * 1000000. + (end->tv_usec - start->tv_usec);
 }
 
-static void show_perf(void)
+static int cmp_float(const void *a, const void *b)
 {
-	int c, i;
-	float us, max[STEP_CNT], min[STEP_CNT];
+	float x = *(const float *) a, y = *(const float *) b;
 
-	for (i = 0; i < STEP_CNT; i++) {
-		max[i] = 0;
-		min[i] = 999999999.;
-		for (c = 0; c < connections; c++) {
-			if (!zero_time(&nodes[c].times[i][0]) &&
-			    !zero_time(&nodes[c].times[i][1])) {
-				us = diff_us(&nodes[c].times[i][1], &nodes[c].times[i][0]);
-				if (us > max[i])
-					max[i] = us;
-				if (us < min[i])
-					min[i] = us;
-			}
-		}
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of a sorted array */
+static float percentile(float *us, int cnt, float pct)
+{
+	int i;
+
+	if (!cnt)
+		return 0;
+
+	i = (int) (pct * cnt + .999999) - 1;
+	return us[i < 0 ? 0 : i];
+}
+
+static int show_perf(void)
+{
+	int c, i, cnt, errors = 0;
+	float us, *step_us, p50, p99, p999;
+
+	if (connections <= 0)
+		return 0;
+
+	step_us = calloc(sizeof *step_us, connections);
+	if (!step_us) {
+		perror("failure allocating step times");
+		return 1;
+	}
+
+	for (c = 0; c < connections; c++)
+		errors += nodes[c].error;
+
+	if (json) {
+		printf("%s{\"connections\": %d, \"depth\": %d, \"errors\": %d, "
+		       "\"steps\": [", runs++ ? ",\n " : "[", connections,
+		       depth, errors);
+	} else {
+		if (depth)
+			printf("connections %d, depth %d, errors %d\n",
+			       connections, depth, errors);
+		printf("step              total ms     max ms     min us  us / conn"
+		       "     p50 us     p99 us    p999 us\n");
 	}
 
-	printf("step              total ms     max ms     min us  us / conn\n");
 	for (i = 0; i < STEP_CNT; i++) {
 		if (i == STEP_BIND && !src_addr)
 			continue;
 
+		for (c = cnt = 0; c < connections; c++) {
+			if (!zero_time(&nodes[c].times[i][0]) &&
+			    !zero_time(&nodes[c].times[i][1]))
+				step_us[cnt++] = diff_us(&nodes[c].times[i][1],
+							 &nodes[c].times[i][0]);
+		}
+		qsort(step_us, cnt, sizeof *step_us, cmp_float);
+		p50 = percentile(step_us, cnt, .5);
+		p99 = percentile(step_us, cnt, .99);
+		p999 = percentile(step_us, cnt, .999);
+
 		us = diff_us(&times[i][1], &times[i][0]);
-		printf("%-13s: %11.2f%11.2f%11.2f%11.2f\n", step_str[i], us / 1000.,
-			max[i] / 1000., min[i], us / connections);
+		if (json) {
+			printf("%s{\"step\": \"%s\", \"total_ms\": %.2f, "
+			       "\"max_ms\": %.2f, \"min_us\": %.2f, "
+			       "\"us_per_conn\": %.2f, \"p50_us\": %.2f, "
+			       "\"p99_us\": %.2f, \"p999_us\": %.2f}",
+			       i ? ", " : "", step_str[i], us / 1000.,
+			       cnt ? step_us[cnt - 1] / 1000. : 0,
+			       cnt ? step_us[0] : 0, us / connections,
+			       p50, p99, p999);
+		} else {
+			printf("%-13s: %11.2f%11.2f%11.2f%11.2f%11.2f%11.2f%11.2f\n",
+			       step_str[i], us / 1000.,
+			       cnt ? step_us[cnt - 1] / 1000. : 0,
+			       cnt ? step_us[0] : 0, us / connections,
+			       p50, p99, p999);
+		}
 	}
+
+	if (json)
+		printf("]}");
+	free(step_us);
+	return errors;
+}
+
+/* Limit the number of outstanding operations for a step to depth */
+static void wait_depth(enum step s)
+{
+	while (depth && started[s] - completed[s] >= depth)
+		sched_yield();
 }
 
 static void addr_handler(struct node *n)
@@ -232,7 +304,7 @@ static void __req_handler(struct rdma_cm_id *id)
 	return;
 
 err:
-	printf("failing connection request\n");
+	fprintf(stderr, "failing connection request\n");
 	rdma_reject(id, NULL, 0);
 	rdma_destroy_id(id);
 	return;
@@ -303,7 +375,8 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 					       rai->ai_dst_addr, timeout))
 				break;
 		}
-		printf("RDMA_CM_EVENT_ADDR_ERROR, error: %d\n", event->status);
+		fprintf(stderr, "RDMA_CM_EVENT_ADDR_ERROR, error: %d\n",
+			event->status);
 		addr_handler(n);
 		n->error = 1;
 		break;
@@ -312,15 +385,16 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 			if (!rdma_resolve_route(n->id, timeout))
 				break;
 		}
-		printf("RDMA_CM_EVENT_ROUTE_ERROR, error: %d\n", event->status);
+		fprintf(stderr, "RDMA_CM_EVENT_ROUTE_ERROR, error: %d\n",
+			event->status);
 		route_handler(n);
 		n->error = 1;
 		break;
 	case RDMA_CM_EVENT_CONNECT_ERROR:
 	case RDMA_CM_EVENT_UNREACHABLE:
 	case RDMA_CM_EVENT_REJECTED:
-		printf("event: %s, error: %d\n",
-		       rdma_event_str(event->event), event->status);
+		fprintf(stderr, "event: %s, error: %d\n",
+			rdma_event_str(event->event), event->status);
 		conn_handler(n);
 		n->error = 1;
 		break;
@@ -356,7 +430,7 @@ static int alloc_nodes(void)
 	if (!nodes)
 		return -ENOMEM;
 
-	printf("creating id\n");
+	step_msg("creating id");
 	start_time(STEP_CREATE_ID);
 	for (i = 0; i < connections; i++) {
 		start_perf(&nodes[i], STEP_CREATE_ID);
@@ -382,7 +456,7 @@ static void cleanup_nodes(void)
 {
 	int i;
 
-	printf("destroying id\n");
+	step_msg("destroying id");
 	start_time(STEP_DESTROY);
 	for (i = 0; i < connections; i++) {
 		start_perf(&nodes[i], STEP_DESTROY);
@@ -410,10 +484,10 @@ static void *process_events(void *arg)
 	return NULL;
 }
 
-static int run_server(void)
+static int start_server(void)
 {
 	pthread_t req_thread, disc_thread;
-	struct rdma_cm_id *listen_id;
+	struct rdma_addrinfo listen_hints, *listen_rai;
 	int ret;
 
 	INIT_LIST(&req_work.list);
@@ -460,34 +534,54 @@ static int run_server(void)
 		return ret;
 	}
 
-	ret = get_rdma_addr(src_addr, dst_addr, port, &hints, &rai);
+	/* In loopback mode, listen on the address that the client targets */
+	listen_hints = hints;
+	listen_hints.ai_flags |= RAI_PASSIVE;
+	ret = get_rdma_addr(loopback ? dst_addr : src_addr, NULL, port,
+			    &listen_hints, &listen_rai);
 	if (ret) {
 		printf("getrdmaaddr error: %s\n", gai_strerror(ret));
-		goto out;
+		goto err;
 	}
 
-	ret = rdma_bind_addr(listen_id, rai->ai_src_addr);
+	ret = rdma_bind_addr(listen_id, listen_rai->ai_src_addr);
+	rdma_freeaddrinfo(listen_rai);
 	if (ret) {
 		perror("bind address failed");
-		goto out;
+		goto err;
 	}
 
 	ret = rdma_listen(listen_id, 0);
 	if (ret) {
 		perror("failure trying to listen");
-		goto out;
+		goto err;
 	}
+	return 0;
 
-	process_events(NULL);
- out:
+err:
 	rdma_destroy_id(listen_id);
+	listen_id = NULL;
 	return ret;
 }
 
-static int run_client(void)
+static int run_server(void)
+{
+	int ret;
+
+	ret = start_server();
+	if (ret)
+		return ret;
+
+	process_events(NULL);
+	rdma_destroy_id(listen_id);
+	listen_id = NULL;
+	return 0;
+}
+
+static int start_client(void)
 {
 	pthread_t event_thread;
-	int i, ret;
+	int ret;
 
 	ret = get_rdma_addr(src_addr, dst_addr, port, &hints, &rai);
 	if (ret) {
@@ -502,13 +596,21 @@ static int run_client(void)
 	conn_param.private_data_len = rai->ai_connect_len;
 
 	ret = pthread_create(&event_thread, NULL, process_events, NULL);
-	if (ret) {
+	if (ret)
 		perror("failure creating event thread");
-		return ret;
-	}
+	return ret;
+}
+
+static int run_client(void)
+{
+	int i, ret = 0;
+
+	memset(times, 0, sizeof times);
+	for (i = 0; i < STEP_CNT; i++)
+		started[i] = completed[i] = 0;
 
 	if (src_addr) {
-		printf("binding source address\n");
+		step_msg("binding source address");
 		start_time(STEP_BIND);
 		for (i = 0; i < connections; i++) {
 			start_perf(&nodes[i], STEP_BIND);
@@ -523,11 +625,12 @@ static int run_client(void)
 		end_time(STEP_BIND);
 	}
 
-	printf("resolving address\n");
+	step_msg("resolving address");
 	start_time(STEP_RESOLVE_ADDR);
 	for (i = 0; i < connections; i++) {
 		if (nodes[i].error)
 			continue;
+		wait_depth(STEP_RESOLVE_ADDR);
 		nodes[i].retries = retries;
 		start_perf(&nodes[i], STEP_RESOLVE_ADDR);
 		ret = rdma_resolve_addr(nodes[i].id, rai->ai_src_addr,
@@ -542,11 +645,12 @@ static int run_client(void)
 	while (started[STEP_RESOLVE_ADDR] != completed[STEP_RESOLVE_ADDR]) sched_yield();
 	end_time(STEP_RESOLVE_ADDR);
 
-	printf("resolving route\n");
+	step_msg("resolving route");
 	start_time(STEP_RESOLVE_ROUTE);
 	for (i = 0; i < connections; i++) {
 		if (nodes[i].error)
 			continue;
+		wait_depth(STEP_RESOLVE_ROUTE);
 		nodes[i].retries = retries;
 		start_perf(&nodes[i], STEP_RESOLVE_ROUTE);
 		ret = rdma_resolve_route(nodes[i].id, timeout);
@@ -560,7 +664,7 @@ static int run_client(void)
 	while (started[STEP_RESOLVE_ROUTE] != completed[STEP_RESOLVE_ROUTE]) sched_yield();
 	end_time(STEP_RESOLVE_ROUTE);
 
-	printf("creating qp\n");
+	step_msg("creating qp");
 	start_time(STEP_CREATE_QP);
 	for (i = 0; i < connections; i++) {
 		if (nodes[i].error)
@@ -576,11 +680,12 @@ static int run_client(void)
 	}
 	end_time(STEP_CREATE_QP);
 
-	printf("connecting\n");
+	step_msg("connecting");
 	start_time(STEP_CONNECT);
 	for (i = 0; i < connections; i++) {
 		if (nodes[i].error)
 			continue;
+		wait_depth(STEP_CONNECT);
 		start_perf(&nodes[i], STEP_CONNECT);
 		ret = rdma_connect(nodes[i].id, &conn_param);
 		if (ret) {
@@ -593,11 +698,12 @@ static int run_client(void)
 	while (started[STEP_CONNECT] != completed[STEP_CONNECT]) sched_yield();
 	end_time(STEP_CONNECT);
 
-	printf("disconnecting\n");
+	step_msg("disconnecting");
 	start_time(STEP_DISCONNECT);
 	for (i = 0; i < connections; i++) {
 		if (nodes[i].error)
 			continue;
+		wait_depth(STEP_DISCONNECT);
 		start_perf(&nodes[i], STEP_DISCONNECT);
 		rdma_disconnect(nodes[i].id);
 		started[STEP_DISCONNECT]++;
@@ -608,13 +714,29 @@ static int run_client(void)
 	return ret;
 }
 
+static int parse_depths(char *arg)
+{
+	char *str;
+
+	for (depth_cnt = 1, str = arg; *str; str++)
+		depth_cnt += (*str == ',');
+
+	depths = calloc(depth_cnt, sizeof *depths);
+	if (!depths)
+		return -ENOMEM;
+
+	for (depth_cnt = 0, str = strtok(arg, ","); str; str = strtok(NULL, ","))
+		depths[depth_cnt++] = atoi(str);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	int op, ret;
+	int op, ret, i, errors = 0;
 
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
-	while ((op = getopt(argc, argv, "s:b:c:p:r:t:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:c:p:r:t:q:lj")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -634,6 +756,16 @@ int main(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'q':
+			if (parse_depths(optarg))
+				exit(1);
+			break;
+		case 'l':
+			loopback = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
 		default:
 			printf("usage: %s\n", argv[0]);
 			printf("\t[-s server_address]\n");
@@ -642,10 +774,18 @@ int main(int argc, char **argv)
 			printf("\t[-p port_number]\n");
 			printf("\t[-r retries]\n");
 			printf("\t[-t timeout_ms]\n");
+			printf("\t[-q depth[,depth...]]\n");
+			printf("\t[-l (run client and server in one process)]\n");
+			printf("\t[-j (json output)]\n");
 			exit(1);
 		}
 	}
 
+	if (loopback && !dst_addr) {
+		printf("loopback mode requires a local server_address\n");
+		exit(1);
+	}
+
 	init_qp_attr.cap.max_send_wr = 1;
 	init_qp_attr.cap.max_recv_wr = 1;
 	init_qp_attr.cap.max_send_sge = 1;
@@ -658,20 +798,42 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	if (dst_addr) {
-		alloc_nodes();
-		ret = run_client();
-	} else {
+	if (!dst_addr) {
 		hints.ai_flags |= RAI_PASSIVE;
 		ret = run_server();
+		goto out;
+	}
+
+	if (loopback) {
+		ret = start_server();
+		if (ret)
+			goto out;
 	}
 
-	cleanup_nodes();
+	ret = start_client();
+	if (ret)
+		goto out;
+
+	for (i = 0; i < (depth_cnt ? depth_cnt : 1); i++) {
+		depth = depth_cnt ? depths[i] : 0;
+		ret = alloc_nodes();
+		if (ret)
+			break;
+
+		ret = run_client();
+		cleanup_nodes();
+		errors += show_perf();
+		free(nodes);
+	}
+	if (json && runs)
+		printf("]\n");
+
+out:
+	if (listen_id)
+		rdma_destroy_id(listen_id);
 	rdma_destroy_event_channel(channel);
 	if (rai)
 		rdma_freeaddrinfo(rai);
-
-	show_perf();
-	free(nodes);
-	return ret;
+	free(depths);
+	return ret ? ret : (errors != 0);
 }
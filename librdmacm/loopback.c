@@ -0,0 +1,1233 @@
+/*
+ * Copyright (c) 2026 The rdma-core contributors.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include "cma.h"
+#include "indexer.h"
+#include <infiniband/driver.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_cma_abi.h>
+
+/*
+ * Userspace rdma_cm for the loopback verbs device (RDMAV_LOOPBACK).
+ *
+ * cma.c hands every ucma command to ucma_lo_write() instead of writing it
+ * to /dev/infiniband/rdma_cm.  All addresses resolve to loopback0, and the
+ * CM messages are exchanged between ids of the same user over abstract
+ * unix seqpacket sockets.  An id bound to a port owns the socket named
+ * after it, which also reserves the port; listening ids accept
+ * connections on it, and each connection carries the REQ/REP/RTU, REJ
+ * and DREQ messages of one CM connection.  A peer that exits without
+ * disconnecting closes the connection, which is reported as if its id
+ * was destroyed.
+ *
+ * An event channel is an epoll set holding the sockets of its ids, plus an
+ * eventfd counting locally generated events (address and route
+ * resolution, failed connects and our own disconnects).
+ */
+
+#define LO_CM_LID		1
+#define LO_CM_PORT_NUM		1
+#define LO_CM_PORT_MIN		32768
+#define LO_CM_PORT_MAX		60999
+
+/* IB CM reject reasons */
+#define LO_CM_REJ_INVALID_SID	8
+#define LO_CM_REJ_CONSUMER	28
+
+enum {
+	LO_CM_REQ,
+	LO_CM_REP,
+	LO_CM_RTU,
+	LO_CM_REJ,
+	LO_CM_DREQ,
+	LO_CM_SIDR_REP
+};
+
+enum lo_cm_state {
+	LO_CM_IDLE,
+	LO_CM_BOUND,
+	LO_CM_LISTEN,
+	LO_CM_ADDR_RESOLVED,
+	LO_CM_ROUTE_RESOLVED,
+	LO_CM_REQ_WAIT,		/* accepted connection, REQ not yet read */
+	LO_CM_REQ_SENT,
+	LO_CM_REQ_RCVD,
+	LO_CM_REP_SENT,
+	LO_CM_REP_RCVD,
+	LO_CM_CONNECTED,
+	LO_CM_DISCONNECTED
+};
+
+struct lo_cm_msg {
+	uint32_t		op;
+	int32_t			status;
+	uint32_t		qkey;
+	uint32_t		reserved;
+	struct sockaddr_in6	src_addr;
+	struct sockaddr_in6	dst_addr;
+	struct ucma_abi_conn_param conn;
+};
+
+struct lo_cm_chan {
+	int			epfd;
+	int			evfd;
+	dlist_entry		ids;
+	dlist_entry		events;
+};
+
+struct lo_cm_id {
+	dlist_entry		entry;
+	struct lo_cm_chan	*chan;
+	struct lo_cm_id		*listen;
+	dlist_entry		pending;	/* REQ_WAIT ids, or listen entry */
+	uint64_t		uid;
+	int			sock;		/* also the id's handle */
+	int			polled;
+	uint16_t		ps;
+	uint8_t			qp_type;
+	enum lo_cm_state	state;
+	uint32_t		events_reported;
+	struct sockaddr_in6	src_addr;
+	struct sockaddr_in6	dst_addr;
+	uint32_t		remote_qpn;
+	uint8_t			responder_resources;
+	uint8_t			initiator_depth;
+	uint8_t			retry_count;
+	uint8_t			rnr_retry_count;
+};
+
+struct lo_cm_event {
+	dlist_entry		entry;
+	struct lo_cm_id		*id;
+	uint32_t		event;
+	int32_t			status;
+};
+
+static pthread_mutex_t lo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct index_map lo_chan_idm;
+static struct index_map lo_id_idm;
+
+static struct lo_cm_id *lo_lookup_id(uint32_t handle)
+{
+	return idm_lookup(&lo_id_idm, handle);
+}
+
+static int lo_addrlen(const struct sockaddr *addr)
+{
+	switch (addr->sa_family) {
+	case AF_INET:
+		return sizeof(struct sockaddr_in);
+	case AF_INET6:
+		return sizeof(struct sockaddr_in6);
+	default:
+		return 0;
+	}
+}
+
+static bool lo_any_addr(const struct sockaddr_in6 *addr)
+{
+	switch (addr->sin6_family) {
+	case AF_INET:
+		return ((struct sockaddr_in *) addr)->sin_addr.s_addr ==
+		       htobe32(INADDR_ANY);
+	case AF_INET6:
+		return IN6_IS_ADDR_UNSPECIFIED(&addr->sin6_addr);
+	default:
+		return true;
+	}
+}
+
+/* Copies the IP address of src, keeping the port of dst */
+static void lo_copy_ip(struct sockaddr_in6 *dst, const struct sockaddr_in6 *src)
+{
+	__be16 port = ucma_get_port((struct sockaddr *) dst);
+
+	memcpy(dst, src, sizeof *dst);
+	dst->sin6_port = port;
+}
+
+static void lo_set_loopback(struct sockaddr_in6 *addr)
+{
+	if (addr->sin6_family == AF_INET)
+		((struct sockaddr_in *) addr)->sin_addr.s_addr =
+			htobe32(INADDR_LOOPBACK);
+	else
+		addr->sin6_addr = in6addr_loopback;
+}
+
+static socklen_t lo_port_name(struct sockaddr_un *name, uint16_t ps,
+			      uint16_t port)
+{
+	int len;
+
+	memset(name, 0, sizeof *name);
+	name->sun_family = AF_UNIX;
+	len = snprintf(name->sun_path + 1, sizeof name->sun_path - 1,
+		       "rdma_loopback-%u-cm-%u-%u", getuid(), ps, port);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static int lo_send(struct lo_cm_id *id, struct lo_cm_msg *msg)
+{
+	if (send(id->sock, msg, sizeof *msg, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+	    sizeof *msg)
+		return errno == EPIPE ? ECONNRESET : errno;
+	return 0;
+}
+
+static int lo_send_op(struct lo_cm_id *id, uint32_t op, int32_t status,
+		      const uint8_t *data, uint8_t data_len)
+{
+	struct lo_cm_msg msg;
+
+	memset(&msg, 0, sizeof msg);
+	msg.op = op;
+	msg.status = status;
+	memcpy(msg.conn.private_data, data, data_len);
+	msg.conn.private_data_len = data_len;
+	return lo_send(id, &msg);
+}
+
+static int lo_queue_event(struct lo_cm_id *id, uint32_t event, int32_t status)
+{
+	struct lo_cm_event *evt;
+
+	evt = calloc(1, sizeof *evt);
+	if (!evt)
+		return ENOMEM;
+
+	evt->id = id;
+	evt->event = event;
+	evt->status = status;
+	dlist_insert_tail(&evt->entry, &id->chan->events);
+	eventfd_write(id->chan->evfd, 1);
+	return 0;
+}
+
+/* Moves the queued events of id to chan, or drops them if chan is NULL */
+static void lo_move_events(struct lo_cm_id *id, struct lo_cm_chan *chan)
+{
+	struct lo_cm_event *evt;
+	dlist_entry *entry, *next;
+	eventfd_t cnt;
+
+	for (entry = id->chan->events.next; entry != &id->chan->events;
+	     entry = next) {
+		next = entry->next;
+		evt = container_of(entry, struct lo_cm_event, entry);
+		if (evt->id != id)
+			continue;
+
+		dlist_remove(entry);
+		eventfd_read(id->chan->evfd, &cnt);
+		if (chan) {
+			dlist_insert_tail(entry, &chan->events);
+			eventfd_write(chan->evfd, 1);
+		} else {
+			free(evt);
+		}
+	}
+}
+
+static int lo_poll_id(struct lo_cm_id *id)
+{
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.fd = id->sock;
+	if (epoll_ctl(id->chan->epfd, EPOLL_CTL_ADD, id->sock, &event))
+		return errno;
+
+	id->polled = 1;
+	return 0;
+}
+
+static void lo_unpoll_id(struct lo_cm_id *id)
+{
+	if (id->polled) {
+		epoll_ctl(id->chan->epfd, EPOLL_CTL_DEL, id->sock, NULL);
+		id->polled = 0;
+	}
+}
+
+static struct lo_cm_id *lo_alloc_id(struct lo_cm_chan *chan, int sock)
+{
+	struct lo_cm_id *id;
+
+	id = calloc(1, sizeof *id);
+	if (!id)
+		return NULL;
+
+	if (idm_set(&lo_id_idm, sock, id) < 0) {
+		free(id);
+		return NULL;
+	}
+
+	id->sock = sock;
+	id->chan = chan;
+	dlist_init(&id->pending);
+	dlist_insert_tail(&id->entry, &chan->ids);
+	return id;
+}
+
+static void lo_destroy_id(struct lo_cm_id *id)
+{
+	struct lo_cm_id *child;
+
+	switch (id->state) {
+	case LO_CM_LISTEN:
+		while (!dlist_empty(&id->pending)) {
+			child = container_of(id->pending.next,
+					     struct lo_cm_id, pending);
+			lo_destroy_id(child);
+		}
+		break;
+	case LO_CM_REQ_WAIT:
+		dlist_remove(&id->pending);
+		break;
+	case LO_CM_REQ_RCVD:
+	case LO_CM_REP_SENT:
+	case LO_CM_REP_RCVD:
+		if (id->qp_type != IBV_QPT_UD)
+			lo_send_op(id, LO_CM_REJ, LO_CM_REJ_CONSUMER, NULL, 0);
+		break;
+	case LO_CM_CONNECTED:
+		if (id->qp_type != IBV_QPT_UD)
+			lo_send_op(id, LO_CM_DREQ, 0, NULL, 0);
+		break;
+	default:
+		break;
+	}
+
+	lo_move_events(id, NULL);
+	idm_clear(&lo_id_idm, id->sock);
+	dlist_remove(&id->entry);
+	close(id->sock);
+	free(id);
+}
+
+/*
+ * Binds the id's socket to the name of its port, which fails with
+ * EADDRINUSE if another id already owns it.  Port 0 picks a free port.
+ */
+static int lo_bind_port(struct lo_cm_id *id)
+{
+	struct sockaddr_un name;
+	uint16_t port, start;
+	socklen_t len;
+
+	port = be16toh(ucma_get_port((struct sockaddr *) &id->src_addr));
+	if (port) {
+		len = lo_port_name(&name, id->ps, port);
+		if (bind(id->sock, (struct sockaddr *) &name, len))
+			return errno;
+		goto out;
+	}
+
+	start = LO_CM_PORT_MIN + random() % (LO_CM_PORT_MAX - LO_CM_PORT_MIN + 1);
+	port = start;
+	do {
+		len = lo_port_name(&name, id->ps, port);
+		if (!bind(id->sock, (struct sockaddr *) &name, len))
+			goto out;
+		if (errno != EADDRINUSE)
+			return errno;
+
+		if (++port > LO_CM_PORT_MAX)
+			port = LO_CM_PORT_MIN;
+	} while (port != start);
+	return EADDRINUSE;
+
+out:
+	/* sin_port and sin6_port share their offset */
+	id->src_addr.sin6_port = htobe16(port);
+	id->state = LO_CM_BOUND;
+	return 0;
+}
+
+static int lo_bind(struct lo_cm_id *id, const struct sockaddr *addr)
+{
+	int len;
+
+	if (id->state != LO_CM_IDLE)
+		return EINVAL;
+
+	len = lo_addrlen(addr);
+	if (!len)
+		return EAFNOSUPPORT;
+
+	memset(&id->src_addr, 0, sizeof id->src_addr);
+	memcpy(&id->src_addr, addr, len);
+	return lo_bind_port(id);
+}
+
+static int lo_resolve_addr(struct lo_cm_id *id, const struct sockaddr *src,
+			   const struct sockaddr *dst)
+{
+	int ret, len;
+
+	len = lo_addrlen(dst);
+	if (!len)
+		return EAFNOSUPPORT;
+
+	if (id->state == LO_CM_IDLE) {
+		if (src && lo_addrlen(src)) {
+			ret = lo_bind(id, src);
+		} else {
+			memset(&id->src_addr, 0, sizeof id->src_addr);
+			id->src_addr.sin6_family = dst->sa_family;
+			ret = lo_bind_port(id);
+		}
+		if (ret)
+			return ret;
+	}
+
+	if (id->state != LO_CM_BOUND && id->state != LO_CM_ADDR_RESOLVED &&
+	    id->state != LO_CM_ROUTE_RESOLVED)
+		return EINVAL;
+
+	/* Every address is local: source and destination are the same */
+	memset(&id->dst_addr, 0, sizeof id->dst_addr);
+	memcpy(&id->dst_addr, dst, len);
+	if (lo_any_addr(&id->dst_addr))
+		lo_set_loopback(&id->dst_addr);
+	if (lo_any_addr(&id->src_addr) ||
+	    id->src_addr.sin6_family != id->dst_addr.sin6_family)
+		lo_copy_ip(&id->src_addr, &id->dst_addr);
+
+	id->state = LO_CM_ADDR_RESOLVED;
+	return lo_queue_event(id, RDMA_CM_EVENT_ADDR_RESOLVED, 0);
+}
+
+static int lo_resolve_route(struct lo_cm_id *id)
+{
+	if (id->state != LO_CM_ADDR_RESOLVED &&
+	    id->state != LO_CM_ROUTE_RESOLVED)
+		return EINVAL;
+
+	id->state = LO_CM_ROUTE_RESOLVED;
+	return lo_queue_event(id, RDMA_CM_EVENT_ROUTE_RESOLVED, 0);
+}
+
+static int lo_listen(struct lo_cm_id *id, int backlog)
+{
+	int ret;
+
+	if (id->state == LO_CM_IDLE) {
+		memset(&id->src_addr, 0, sizeof id->src_addr);
+		id->src_addr.sin6_family = AF_INET;
+		ret = lo_bind_port(id);
+		if (ret)
+			return ret;
+	}
+
+	if (id->state != LO_CM_BOUND && id->state != LO_CM_LISTEN)
+		return EINVAL;
+
+	if (listen(id->sock, backlog > 0 ? backlog : SOMAXCONN))
+		return errno;
+
+	if (id->state == LO_CM_BOUND) {
+		ret = lo_poll_id(id);
+		if (ret)
+			return ret;
+		id->state = LO_CM_LISTEN;
+	}
+	return 0;
+}
+
+static void lo_save_conn_param(struct lo_cm_id *id,
+			       const struct ucma_abi_conn_param *param)
+{
+	id->responder_resources = param->responder_resources;
+	id->initiator_depth = param->initiator_depth;
+	id->retry_count = param->retry_count;
+	id->rnr_retry_count = param->rnr_retry_count;
+}
+
+static int lo_connect(struct lo_cm_id *id,
+		      const struct ucma_abi_conn_param *param)
+{
+	struct sockaddr_un name;
+	struct lo_cm_msg msg;
+	socklen_t len;
+	int ret;
+
+	if (id->state != LO_CM_ROUTE_RESOLVED)
+		return EINVAL;
+
+	lo_save_conn_param(id, param);
+	len = lo_port_name(&name, id->ps,
+			   be16toh(ucma_get_port((struct sockaddr *) &id->dst_addr)));
+	if (connect(id->sock, (struct sockaddr *) &name, len)) {
+		/*
+		 * Nobody listens on the port, or its backlog is full: report
+		 * what a REQ would have earned from an IB CM.
+		 */
+		id->state = LO_CM_DISCONNECTED;
+		if (errno == ECONNREFUSED && id->qp_type != IBV_QPT_UD)
+			return lo_queue_event(id, RDMA_CM_EVENT_REJECTED,
+					      LO_CM_REJ_INVALID_SID);
+		return lo_queue_event(id, RDMA_CM_EVENT_UNREACHABLE,
+				      errno == ECONNREFUSED ? -ECONNREFUSED :
+							      -ETIMEDOUT);
+	}
+
+	memset(&msg, 0, sizeof msg);
+	msg.op = LO_CM_REQ;
+	msg.src_addr = id->src_addr;
+	msg.dst_addr = id->dst_addr;
+	msg.conn = *param;
+	ret = lo_send(id, &msg);
+	if (ret)
+		return ret;
+
+	id->state = LO_CM_REQ_SENT;
+	return lo_poll_id(id);
+}
+
+static int lo_accept(struct lo_cm_id *id, const struct ucma_abi_accept *cmd)
+{
+	struct lo_cm_msg msg;
+	int ret;
+
+	memset(&msg, 0, sizeof msg);
+	msg.conn = cmd->conn_param;
+	switch (id->state) {
+	case LO_CM_REQ_RCVD:
+		/* rdma_accept() on the passive side: send the REP */
+		lo_save_conn_param(id, &cmd->conn_param);
+		if (id->qp_type == IBV_QPT_UD) {
+			msg.op = LO_CM_SIDR_REP;
+			msg.qkey = RDMA_UDP_QKEY;
+		} else {
+			msg.op = LO_CM_REP;
+		}
+		ret = lo_send(id, &msg);
+		if (ret)
+			return ret;
+
+		id->uid = cmd->uid;
+		id->state = id->qp_type == IBV_QPT_UD ?
+			    LO_CM_CONNECTED : LO_CM_REP_SENT;
+		return 0;
+	case LO_CM_REP_RCVD:
+		/* The active side's QP is ready: send the RTU */
+		msg.op = LO_CM_RTU;
+		ret = lo_send(id, &msg);
+		if (ret)
+			return ret;
+
+		id->state = LO_CM_CONNECTED;
+		return 0;
+	default:
+		return EINVAL;
+	}
+}
+
+static int lo_reject(struct lo_cm_id *id, const struct ucma_abi_reject *cmd)
+{
+	int ret;
+
+	if (id->state != LO_CM_REQ_RCVD)
+		return EINVAL;
+
+	if (id->qp_type == IBV_QPT_UD)
+		ret = lo_send_op(id, LO_CM_SIDR_REP, -ECONNRESET,
+				 cmd->private_data, cmd->private_data_len);
+	else
+		ret = lo_send_op(id, LO_CM_REJ, LO_CM_REJ_CONSUMER,
+				 cmd->private_data, cmd->private_data_len);
+
+	id->state = LO_CM_DISCONNECTED;
+	return ret;
+}
+
+static int lo_disconnect(struct lo_cm_id *id)
+{
+	switch (id->state) {
+	case LO_CM_REP_SENT:
+	case LO_CM_CONNECTED:
+		if (id->qp_type == IBV_QPT_UD)
+			return EINVAL;
+
+		id->state = LO_CM_DISCONNECTED;
+		lo_send_op(id, LO_CM_DREQ, 0, NULL, 0);
+		return lo_queue_event(id, RDMA_CM_EVENT_DISCONNECTED, 0);
+	case LO_CM_DISCONNECTED:
+		return 0;
+	default:
+		return EINVAL;
+	}
+}
+
+static int lo_init_qp_attr(struct lo_cm_id *id,
+			   const struct ucma_abi_init_qp_attr *cmd)
+{
+	struct ibv_kern_qp_attr resp;
+
+	memset(&resp, 0, sizeof resp);
+	resp.qp_state = cmd->qp_state;
+	switch (cmd->qp_state) {
+	case IBV_QPS_INIT:
+		resp.qp_attr_mask = IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+				    IBV_QP_PORT;
+		resp.port_num = LO_CM_PORT_NUM;
+		if (id->qp_type == IBV_QPT_UD) {
+			resp.qp_attr_mask |= IBV_QP_QKEY;
+			resp.qkey = RDMA_UDP_QKEY;
+		} else {
+			resp.qp_attr_mask |= IBV_QP_ACCESS_FLAGS;
+			resp.qp_access_flags = IBV_ACCESS_REMOTE_WRITE;
+			if (id->responder_resources)
+				resp.qp_access_flags |= IBV_ACCESS_REMOTE_READ |
+							IBV_ACCESS_REMOTE_ATOMIC;
+		}
+		break;
+	case IBV_QPS_RTR:
+		resp.qp_attr_mask = IBV_QP_STATE;
+		if (id->qp_type == IBV_QPT_UD)
+			break;
+
+		if (id->state < LO_CM_REQ_RCVD || id->state > LO_CM_CONNECTED)
+			return EINVAL;
+
+		resp.qp_attr_mask |= IBV_QP_AV | IBV_QP_PATH_MTU |
+				     IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+				     IBV_QP_MAX_DEST_RD_ATOMIC |
+				     IBV_QP_MIN_RNR_TIMER;
+		resp.ah_attr.dlid = LO_CM_LID;
+		resp.ah_attr.port_num = LO_CM_PORT_NUM;
+		resp.path_mtu = IBV_MTU_4096;
+		resp.dest_qp_num = id->remote_qpn;
+		resp.max_dest_rd_atomic = id->responder_resources;
+		resp.min_rnr_timer = 12;
+		break;
+	case IBV_QPS_RTS:
+		resp.qp_attr_mask = IBV_QP_STATE | IBV_QP_SQ_PSN;
+		if (id->qp_type == IBV_QPT_UD)
+			break;
+
+		resp.qp_attr_mask |= IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+				     IBV_QP_RNR_RETRY | IBV_QP_MAX_QP_RD_ATOMIC;
+		resp.timeout = 14;
+		resp.retry_cnt = id->retry_count;
+		resp.rnr_retry = id->rnr_retry_count;
+		resp.max_rd_atomic = id->initiator_depth;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	memcpy((void *) (uintptr_t) cmd->response, &resp, sizeof resp);
+	return 0;
+}
+
+static int lo_query_route(struct lo_cm_id *id, const struct ucma_abi_query *cmd)
+{
+	struct ucma_abi_query_route_resp resp;
+	struct ib_user_path_rec *path;
+
+	memset(&resp, 0, sizeof resp);
+	resp.src_addr = id->src_addr;
+	resp.dst_addr = id->dst_addr;
+	resp.port_num = LO_CM_PORT_NUM;
+
+	/* Like the kernel, ids bound to a wildcard address have no device */
+	if (!lo_any_addr(&id->src_addr))
+		resp.node_guid = UCMA_LO_NODE_GUID;
+
+	/* The device has no GIDs, so paths only carry the LID */
+	if (id->state >= LO_CM_ROUTE_RESOLVED) {
+		resp.num_paths = 1;
+		path = &resp.ib_route[0];
+		path->dlid = htobe16(LO_CM_LID);
+		path->slid = htobe16(LO_CM_LID);
+		path->pkey = htobe16(0xffff);
+		path->mtu = IBV_MTU_4096;
+		path->reversible = 1;
+		path->numb_path = 1;
+	}
+
+	memcpy((void *) (uintptr_t) cmd->response, &resp, sizeof resp);
+	return 0;
+}
+
+static int lo_set_option(struct lo_cm_id *id,
+			 const struct ucma_abi_set_option *cmd)
+{
+	switch (cmd->level) {
+	case RDMA_OPTION_ID:
+		switch (cmd->optname) {
+		case RDMA_OPTION_ID_TOS:
+		case RDMA_OPTION_ID_REUSEADDR:
+		case RDMA_OPTION_ID_AFONLY:
+			return 0;
+		}
+		break;
+	case RDMA_OPTION_IB:
+		/* A path from ibacm stands in for RESOLVE_ROUTE */
+		if (cmd->optname == RDMA_OPTION_IB_PATH)
+			return lo_resolve_route(id);
+		break;
+	}
+	return ENOSYS;
+}
+
+static int lo_migrate_id(struct lo_cm_chan *chan, struct lo_cm_id *id,
+			 const struct ucma_abi_migrate_id *cmd)
+{
+	struct ucma_abi_migrate_resp resp;
+	struct lo_cm_id *child;
+	dlist_entry *entry;
+	int polled, ret;
+
+	if (id->chan != chan) {
+		polled = id->polled;
+		lo_unpoll_id(id);
+		lo_move_events(id, chan);
+		dlist_remove(&id->entry);
+		dlist_insert_tail(&id->entry, &chan->ids);
+		id->chan = chan;
+		if (polled) {
+			ret = lo_poll_id(id);
+			if (ret)
+				return ret;
+		}
+
+		/* Connections not yet reported follow their listener */
+		if (id->state == LO_CM_LISTEN) {
+			for (entry = id->pending.next; entry != &id->pending;
+			     entry = entry->next) {
+				child = container_of(entry, struct lo_cm_id,
+						     pending);
+				lo_unpoll_id(child);
+				dlist_remove(&child->entry);
+				dlist_insert_tail(&child->entry, &chan->ids);
+				child->chan = chan;
+				lo_poll_id(child);
+			}
+		}
+	}
+
+	resp.events_reported = id->events_reported;
+	memcpy((void *) (uintptr_t) cmd->response, &resp, sizeof resp);
+	return 0;
+}
+
+static int lo_create_id(struct lo_cm_chan *chan,
+			const struct ucma_abi_create_id *cmd)
+{
+	struct ucma_abi_create_id_resp resp;
+	struct lo_cm_id *id;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return errno;
+
+	id = lo_alloc_id(chan, sock);
+	if (!id) {
+		close(sock);
+		return ENOMEM;
+	}
+
+	id->uid = cmd->uid;
+	id->ps = cmd->ps;
+	id->qp_type = cmd->qp_type;
+
+	resp.id = id->sock;
+	memcpy((void *) (uintptr_t) cmd->response, &resp, sizeof resp);
+	return 0;
+}
+
+static int lo_destroy_kern_id(struct lo_cm_id *id,
+			      const struct ucma_abi_destroy_id *cmd)
+{
+	struct ucma_abi_destroy_id_resp resp;
+
+	resp.events_reported = id->events_reported;
+	lo_destroy_id(id);
+	memcpy((void *) (uintptr_t) cmd->response, &resp, sizeof resp);
+	return 0;
+}
+
+/*
+ * Accepts a connection on a listening id.  The new id stays hidden from
+ * the user until its REQ arrives and is reported as a connect request.
+ */
+static void lo_accept_conn(struct lo_cm_id *listen)
+{
+	struct lo_cm_id *id;
+	int sock;
+
+	sock = accept4(listen->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	id = lo_alloc_id(listen->chan, sock);
+	if (!id) {
+		close(sock);
+		return;
+	}
+
+	id->ps = listen->ps;
+	id->qp_type = listen->qp_type;
+	id->state = LO_CM_REQ_WAIT;
+	id->listen = listen;
+	dlist_insert_tail(&id->pending, &listen->pending);
+	if (lo_poll_id(id))
+		lo_destroy_id(id);
+}
+
+static void lo_copy_conn_event(struct ucma_abi_event_resp *resp,
+			       const struct ucma_abi_conn_param *param)
+{
+	resp->param.conn = *param;
+
+	/* Reported from the receiver's point of view */
+	resp->param.conn.responder_resources = param->initiator_depth;
+	resp->param.conn.initiator_depth = param->responder_resources;
+}
+
+static void lo_copy_ud_event(struct ucma_abi_event_resp *resp,
+			     const struct lo_cm_msg *msg)
+{
+	resp->param.ud.qp_num = msg->conn.qp_num;
+	resp->param.ud.qkey = msg->qkey;
+	resp->param.ud.ah_attr.dlid = LO_CM_LID;
+	resp->param.ud.ah_attr.port_num = LO_CM_PORT_NUM;
+	memcpy(resp->param.ud.private_data, msg->conn.private_data,
+	       msg->conn.private_data_len);
+	resp->param.ud.private_data_len = msg->conn.private_data_len;
+}
+
+/*
+ * Turns a CM message into the event it causes, if any.  Messages that do
+ * not fit the id's state are stale and dropped.
+ */
+static bool lo_process_msg(struct lo_cm_id *id, const struct lo_cm_msg *msg,
+			   struct ucma_abi_event_resp *resp)
+{
+	struct lo_cm_id *listen;
+
+	switch (msg->op) {
+	case LO_CM_REQ:
+		if (id->state != LO_CM_REQ_WAIT)
+			return false;
+
+		listen = id->listen;
+		dlist_remove(&id->pending);
+		id->listen = NULL;
+		id->src_addr = msg->dst_addr;
+		id->dst_addr = msg->src_addr;
+		id->remote_qpn = msg->conn.qp_num;
+		id->responder_resources = msg->conn.initiator_depth;
+		id->initiator_depth = msg->conn.responder_resources;
+		id->retry_count = msg->conn.retry_count;
+		id->rnr_retry_count = msg->conn.rnr_retry_count;
+		id->state = LO_CM_REQ_RCVD;
+
+		resp->uid = listen->uid;
+		resp->event = RDMA_CM_EVENT_CONNECT_REQUEST;
+		if (id->qp_type == IBV_QPT_UD)
+			lo_copy_ud_event(resp, msg);
+		else
+			lo_copy_conn_event(resp, &msg->conn);
+		listen->events_reported++;
+		return true;
+	case LO_CM_REP:
+		if (id->state != LO_CM_REQ_SENT)
+			return false;
+
+		id->remote_qpn = msg->conn.qp_num;
+		id->state = LO_CM_REP_RCVD;
+		resp->event = RDMA_CM_EVENT_CONNECT_RESPONSE;
+		lo_copy_conn_event(resp, &msg->conn);
+		break;
+	case LO_CM_SIDR_REP:
+		if (id->state != LO_CM_REQ_SENT)
+			return false;
+
+		if (msg->status) {
+			id->state = LO_CM_DISCONNECTED;
+			resp->event = RDMA_CM_EVENT_UNREACHABLE;
+			resp->status = msg->status;
+		} else {
+			id->remote_qpn = msg->conn.qp_num;
+			id->state = LO_CM_CONNECTED;
+			resp->event = RDMA_CM_EVENT_ESTABLISHED;
+		}
+		lo_copy_ud_event(resp, msg);
+		break;
+	case LO_CM_RTU:
+		if (id->state != LO_CM_REP_SENT)
+			return false;
+
+		id->state = LO_CM_CONNECTED;
+		resp->event = RDMA_CM_EVENT_ESTABLISHED;
+		break;
+	case LO_CM_REJ:
+		if (id->state != LO_CM_REQ_SENT && id->state != LO_CM_REP_SENT)
+			return false;
+
+		id->state = LO_CM_DISCONNECTED;
+		resp->event = RDMA_CM_EVENT_REJECTED;
+		resp->status = msg->status;
+		lo_copy_conn_event(resp, &msg->conn);
+		break;
+	case LO_CM_DREQ:
+		if (id->state != LO_CM_CONNECTED && id->state != LO_CM_REP_SENT)
+			return false;
+
+		id->state = LO_CM_DISCONNECTED;
+		resp->event = RDMA_CM_EVENT_DISCONNECTED;
+		break;
+	default:
+		return false;
+	}
+
+	resp->uid = id->uid;
+	id->events_reported++;
+	return true;
+}
+
+/* The peer closed the connection without a REJ or DREQ: it went away */
+static bool lo_process_close(struct lo_cm_id *id,
+			     struct ucma_abi_event_resp *resp)
+{
+	lo_unpoll_id(id);
+	switch (id->state) {
+	case LO_CM_REQ_WAIT:
+		lo_destroy_id(id);
+		return false;
+	case LO_CM_REQ_SENT:
+	case LO_CM_REP_SENT:
+		resp->event = RDMA_CM_EVENT_UNREACHABLE;
+		resp->status = -ECONNRESET;
+		break;
+	case LO_CM_CONNECTED:
+		if (id->qp_type == IBV_QPT_UD)
+			return false;
+		resp->event = RDMA_CM_EVENT_DISCONNECTED;
+		break;
+	default:
+		return false;
+	}
+
+	id->state = LO_CM_DISCONNECTED;
+	resp->uid = id->uid;
+	id->events_reported++;
+	return true;
+}
+
+/* Called holding lo_lock.  Returns true if resp holds an event. */
+static bool lo_next_event(struct lo_cm_chan *chan, int fd,
+			  struct ucma_abi_event_resp *resp)
+{
+	struct lo_cm_event *evt;
+	struct lo_cm_msg msg;
+	struct lo_cm_id *id;
+	eventfd_t cnt;
+	ssize_t ret;
+
+	memset(resp, 0, sizeof *resp);
+	if (fd == chan->evfd) {
+		if (dlist_empty(&chan->events))
+			return false;
+
+		evt = container_of(chan->events.next, struct lo_cm_event, entry);
+		dlist_remove(&evt->entry);
+		eventfd_read(chan->evfd, &cnt);
+
+		resp->uid = evt->id->uid;
+		resp->id = evt->id->sock;
+		resp->event = evt->event;
+		resp->status = evt->status;
+		evt->id->events_reported++;
+		free(evt);
+		return true;
+	}
+
+	id = lo_lookup_id(fd);
+	if (!id || id->chan != chan || !id->polled)
+		return false;
+
+	if (id->state == LO_CM_LISTEN) {
+		lo_accept_conn(id);
+		return false;
+	}
+
+	resp->id = id->sock;
+	ret = recv(id->sock, &msg, sizeof msg, MSG_DONTWAIT);
+	if (ret == sizeof msg)
+		return lo_process_msg(id, &msg, resp);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return false;
+	return lo_process_close(id, resp);
+}
+
+static int lo_get_event(struct lo_cm_chan *chan,
+			const struct ucma_abi_get_event *cmd)
+{
+	struct ucma_abi_event_resp resp;
+	struct epoll_event event;
+	int epfd, timeout, ret;
+	bool found;
+
+	epfd = chan->epfd;
+	timeout = (fcntl(epfd, F_GETFL) & O_NONBLOCK) ? 0 : -1;
+	do {
+		pthread_mutex_unlock(&lo_lock);
+		ret = epoll_wait(epfd, &event, 1, timeout);
+		pthread_mutex_lock(&lo_lock);
+		if (ret <= 0)
+			return ret ? errno : EAGAIN;
+
+		/* The channel may have been closed while we waited */
+		if (idm_lookup(&lo_chan_idm, epfd) != chan)
+			return EBADF;
+
+		found = lo_next_event(chan, event.data.fd, &resp);
+	} while (!found);
+
+	memcpy((void *) (uintptr_t) cmd->response, &resp, sizeof resp);
+	return 0;
+}
+
+static int lo_write(struct lo_cm_chan *chan, const void *buf)
+{
+	const struct ucma_abi_cmd_hdr *hdr = buf;
+	struct lo_cm_id *id;
+
+	switch (hdr->cmd) {
+	case UCMA_CMD_CREATE_ID:
+		return lo_create_id(chan, buf);
+	case UCMA_CMD_GET_EVENT:
+		return lo_get_event(chan, buf);
+	case UCMA_CMD_DESTROY_ID:
+	/* These share the layout of DESTROY_ID up to the id */
+	case UCMA_CMD_QUERY_ROUTE:
+	case UCMA_CMD_INIT_QP_ATTR:
+	case UCMA_CMD_MIGRATE_ID:
+		id = lo_lookup_id(((struct ucma_abi_destroy_id *) buf)->id);
+		break;
+	case UCMA_CMD_BIND_IP:
+		id = lo_lookup_id(((struct ucma_abi_bind_ip *) buf)->id);
+		break;
+	case UCMA_CMD_BIND:
+		id = lo_lookup_id(((struct ucma_abi_bind *) buf)->id);
+		break;
+	case UCMA_CMD_RESOLVE_IP:
+		id = lo_lookup_id(((struct ucma_abi_resolve_ip *) buf)->id);
+		break;
+	case UCMA_CMD_RESOLVE_ADDR:
+		id = lo_lookup_id(((struct ucma_abi_resolve_addr *) buf)->id);
+		break;
+	case UCMA_CMD_RESOLVE_ROUTE:
+		id = lo_lookup_id(((struct ucma_abi_resolve_route *) buf)->id);
+		break;
+	case UCMA_CMD_CONNECT:
+		id = lo_lookup_id(((struct ucma_abi_connect *) buf)->id);
+		break;
+	case UCMA_CMD_LISTEN:
+		id = lo_lookup_id(((struct ucma_abi_listen *) buf)->id);
+		break;
+	case UCMA_CMD_ACCEPT:
+		id = lo_lookup_id(((struct ucma_abi_accept *) buf)->id);
+		break;
+	case UCMA_CMD_REJECT:
+		id = lo_lookup_id(((struct ucma_abi_reject *) buf)->id);
+		break;
+	case UCMA_CMD_DISCONNECT:
+		id = lo_lookup_id(((struct ucma_abi_disconnect *) buf)->id);
+		break;
+	case UCMA_CMD_NOTIFY:
+		id = lo_lookup_id(((struct ucma_abi_notify *) buf)->id);
+		break;
+	case UCMA_CMD_SET_OPTION:
+		id = lo_lookup_id(((struct ucma_abi_set_option *) buf)->id);
+		break;
+	default:
+		/* Multicast, GET_OPTION and the AF_IB QUERY */
+		return ENOSYS;
+	}
+
+	if (!id || id->state == LO_CM_REQ_WAIT)
+		return EINVAL;
+
+	switch (hdr->cmd) {
+	case UCMA_CMD_DESTROY_ID:
+		return lo_destroy_kern_id(id, buf);
+	case UCMA_CMD_BIND_IP:
+		return lo_bind(id, (struct sockaddr *)
+			       &((struct ucma_abi_bind_ip *) buf)->addr);
+	case UCMA_CMD_BIND:
+		return lo_bind(id, (struct sockaddr *)
+			       &((struct ucma_abi_bind *) buf)->addr);
+	case UCMA_CMD_RESOLVE_IP: {
+		const struct ucma_abi_resolve_ip *cmd = buf;
+
+		return lo_resolve_addr(id, (struct sockaddr *) &cmd->src_addr,
+				       (struct sockaddr *) &cmd->dst_addr);
+	}
+	case UCMA_CMD_RESOLVE_ADDR: {
+		const struct ucma_abi_resolve_addr *cmd = buf;
+
+		return lo_resolve_addr(id, cmd->src_size ?
+				       (struct sockaddr *) &cmd->src_addr : NULL,
+				       (struct sockaddr *) &cmd->dst_addr);
+	}
+	case UCMA_CMD_RESOLVE_ROUTE:
+		return lo_resolve_route(id);
+	case UCMA_CMD_QUERY_ROUTE:
+		return lo_query_route(id, buf);
+	case UCMA_CMD_CONNECT:
+		return lo_connect(id, &((struct ucma_abi_connect *) buf)->conn_param);
+	case UCMA_CMD_LISTEN:
+		return lo_listen(id, ((struct ucma_abi_listen *) buf)->backlog);
+	case UCMA_CMD_ACCEPT:
+		return lo_accept(id, buf);
+	case UCMA_CMD_REJECT:
+		return lo_reject(id, buf);
+	case UCMA_CMD_DISCONNECT:
+		return lo_disconnect(id);
+	case UCMA_CMD_INIT_QP_ATTR:
+		return lo_init_qp_attr(id, buf);
+	case UCMA_CMD_NOTIFY:
+		return 0;
+	case UCMA_CMD_SET_OPTION:
+		return lo_set_option(id, buf);
+	case UCMA_CMD_MIGRATE_ID:
+		return lo_migrate_id(chan, id, buf);
+	default:
+		return ENOSYS;
+	}
+}
+
+ssize_t ucma_lo_write(int fd, const void *buf, size_t size)
+{
+	struct lo_cm_chan *chan;
+	int ret;
+
+	pthread_mutex_lock(&lo_lock);
+	chan = idm_lookup(&lo_chan_idm, fd);
+	ret = chan ? lo_write(chan, buf) : EBADF;
+	pthread_mutex_unlock(&lo_lock);
+
+	if (ret)
+		return ERR(ret);
+	return size;
+}
+
+int ucma_lo_open(void)
+{
+	struct lo_cm_chan *chan;
+	struct epoll_event event;
+
+	chan = calloc(1, sizeof *chan);
+	if (!chan)
+		return ERR(ENOMEM);
+
+	dlist_init(&chan->ids);
+	dlist_init(&chan->events);
+
+	/* Not epoll_create1(), which the rsocket preload takes over */
+	chan->epfd = syscall(SYS_epoll_create1, EPOLL_CLOEXEC);
+	if (chan->epfd < 0)
+		goto err1;
+
+	chan->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (chan->evfd < 0)
+		goto err2;
+
+	event.events = EPOLLIN;
+	event.data.fd = chan->evfd;
+	if (epoll_ctl(chan->epfd, EPOLL_CTL_ADD, chan->evfd, &event))
+		goto err3;
+
+	pthread_mutex_lock(&lo_lock);
+	if (idm_set(&lo_chan_idm, chan->epfd, chan) < 0) {
+		pthread_mutex_unlock(&lo_lock);
+		errno = ENOMEM;
+		goto err3;
+	}
+	pthread_mutex_unlock(&lo_lock);
+	return chan->epfd;
+
+err3:
+	close(chan->evfd);
+err2:
+	close(chan->epfd);
+err1:
+	free(chan);
+	return -1;
+}
+
+/* Like closing the rdma_cm file, this destroys the ids left on the channel */
+void ucma_lo_close(int fd)
+{
+	struct lo_cm_chan *chan;
+
+	pthread_mutex_lock(&lo_lock);
+	chan = idm_lookup(&lo_chan_idm, fd);
+	if (chan) {
+		idm_clear(&lo_chan_idm, fd);
+		while (!dlist_empty(&chan->ids))
+			lo_destroy_id(container_of(chan->ids.next,
+						   struct lo_cm_id, entry));
+		close(chan->evfd);
+		close(chan->epfd);
+		free(chan);
+	}
+	pthread_mutex_unlock(&lo_lock);
+}
@@ -50,6 +50,8 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
+#include <limits.h>
 
 #include <sys/uio.h>
 
@@ -69,15 +71,29 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
+	int (*epoll_pwait2)(int epfd, struct epoll_event *events, int maxevents,
+			    const struct timespec *timeout,
+			    const sigset_t *sigmask);
 	int (*shutdown)(int socket, int how);
 	int (*close)(int socket);
 	int (*getpeername)(int socket, struct sockaddr *addr, socklen_t *addrlen);
@@ -393,14 +409,22 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+	real.epoll_pwait2 = dlsym(RTLD_NEXT, "epoll_pwait2");
 	real.shutdown = dlsym(RTLD_NEXT, "shutdown");
 	real.close = dlsym(RTLD_NEXT, "close");
 	real.getpeername = dlsym(RTLD_NEXT, "getpeername");
@@ -420,14 +444,19 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
+	rs.epoll_create = dlsym(RTLD_DEFAULT, "repoll_create");
+	rs.epoll_ctl = dlsym(RTLD_DEFAULT, "repoll_ctl");
+	rs.epoll_wait = dlsym(RTLD_DEFAULT, "repoll_wait");
 	rs.shutdown = dlsym(RTLD_DEFAULT, "rshutdown");
 	rs.close = dlsym(RTLD_DEFAULT, "rclose");
 	rs.getpeername = dlsym(RTLD_DEFAULT, "rgetpeername");
@@ -529,9 +558,14 @@ static void set_rsocket_options(int rsocket)
 		rsetsockopt(rsocket, SOL_RDMA, RDMA_INLINE, &sq_inline, sizeof sq_inline);
 }
 
+/*
+ * Set while librdmacm is called to create an rsocket or a repoll set, so
+ * that the sockets and epoll sets it creates internally are not converted.
+ */
+static __thread int recursive;
+
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -809,6 +843,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -848,6 +891,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -992,6 +1043,140 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 	return ret;
 }
 
+/*
+ * All epoll sets are created as repoll sets, since we cannot tell in
+ * advance whether the application will add rsockets to them.  Normal fd's
+ * are passed through to the underlying kernel epoll set.  Every call that
+ * takes an epoll fd must therefore be intercepted, including the pwait
+ * variants.  An rsocket can only belong to one repoll set, so adding a
+ * socket that was converted to an rsocket to a second epoll set fails
+ * with EBUSY, where the kernel would allow it.
+ */
+static int epoll_open(int size, int flags)
+{
+	int index, ret;
+
+	if (recursive)
+		goto real;
+
+	index = fd_open();
+	if (index < 0)
+		return index;
+
+	recursive = 1;
+	ret = repoll_create(size);
+	recursive = 0;
+	if (ret < 0) {
+		fd_close(index, &ret);
+		goto real;
+	}
+
+	if (flags > 0 && (flags & EPOLL_CLOEXEC)) {
+		real.fcntl(index, F_SETFD, FD_CLOEXEC);
+		real.fcntl(ret, F_SETFD, FD_CLOEXEC);
+	}
+
+	fd_store(index, ret, fd_rsocket, fd_ready);
+	return index;
+
+real:
+	return flags < 0 ? real.epoll_create(size) : real.epoll_create1(flags);
+}
+
+int epoll_create(int size)
+{
+	init_preload();
+	return epoll_open(size, -1);
+}
+
+int epoll_create1(int flags)
+{
+	init_preload();
+	if (flags & ~EPOLL_CLOEXEC)
+		return ERR(EINVAL);
+	return epoll_open(1, flags);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_rsocket) ?
+		repoll_ctl(efd, op, fd_getd(fd), event) :
+		real.epoll_ctl(efd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_rsocket) ?
+		repoll_wait(efd, events, maxevents, timeout) :
+		real.epoll_wait(efd, events, maxevents, timeout);
+}
+
+/*
+ * The signal mask is swapped around a wait on a repoll set.  Unlike the
+ * kernel, we cannot make the change atomic with the wait.
+ */
+static int repoll_pwait(int efd, struct epoll_event *events, int maxevents,
+			int timeout, const sigset_t *sigmask)
+{
+	sigset_t oldmask;
+	int ret, err;
+
+	if (sigmask)
+		pthread_sigmask(SIG_SETMASK, sigmask, &oldmask);
+
+	ret = repoll_wait(efd, events, maxevents, timeout);
+
+	if (sigmask) {
+		err = errno;
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		errno = err;
+	}
+	return ret;
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_rsocket) ?
+		repoll_pwait(efd, events, maxevents, timeout, sigmask) :
+		real.epoll_pwait(efd, events, maxevents, timeout, sigmask);
+}
+
+#ifdef HAVE_EPOLL_PWAIT2
+static int rs_convert_timespec(const struct timespec *timeout)
+{
+	if (!timeout)
+		return -1;
+	if (timeout->tv_sec >= INT_MAX / 1000)
+		return INT_MAX;
+	return timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+}
+
+int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents,
+		 const struct timespec *timeout, const sigset_t *sigmask)
+{
+	int efd;
+
+	init_preload();
+	if (fd_get(epfd, &efd) == fd_rsocket)
+		return repoll_pwait(efd, events, maxevents,
+				    rs_convert_timespec(timeout), sigmask);
+
+	return real.epoll_pwait2 ?
+		real.epoll_pwait2(efd, events, maxevents, timeout, sigmask) :
+		ERR(ENOSYS);
+}
+#endif
+
 int shutdown(int socket, int how)
 {
 	int fd;
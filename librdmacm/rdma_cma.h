@@ -276,6 +276,44 @@ int rdma_create_id(struct rdma_event_channel *channel,
 int rdma_create_ep(struct rdma_cm_id **id, struct rdma_addrinfo *res,
 		   struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr);
 
+typedef void (*rdma_connect_eps_cb)(void *context, int index,
+				    struct rdma_cm_id *id, int status);
+
+/**
+ * rdma_connect_eps - Connect to multiple destinations in parallel.
+ * @ids: An array of num entries where the connected identifiers are
+ *   returned.  Entries that failed to connect are set to NULL.
+ * @res: An array of num results from rdma_getaddrinfo, one per destination.
+ * @num: Number of destinations.
+ * @pd: Optional protection domain.  This parameter is ignored if qp_init_attr
+ *   is NULL.
+ * @qp_init_attr: Optional attributes for the QP created on each rdma_cm_id.
+ * @conn_param: Optional connection parameters used for every connection.
+ * @callback: Optional function invoked as each destination completes.
+ * @context: User specified context passed to the callback.
+ * Description:
+ *   Performs the equivalent of rdma_create_ep followed by rdma_connect for
+ *   every destination, with address resolution, route resolution, and
+ *   connection establishment for all destinations in progress at once.
+ *   The call returns after every destination has either connected or
+ *   failed.
+ * Notes:
+ *   The callback is invoked with a status of 0 and the connected rdma_cm_id,
+ *   or with a status of -1 and a NULL id, in which case errno indicates the
+ *   failure reason.  Index identifies the destination in res.  Connected
+ *   identifiers use synchronous operations, as if created by rdma_create_ep,
+ *   and should be released using rdma_destroy_ep after disconnecting.
+ * Return Value:
+ *   The number of destinations that were connected, or -1 on error.
+ * See also:
+ *   rdma_create_ep, rdma_connect, rdma_getaddrinfo, rdma_destroy_ep
+ */
+int rdma_connect_eps(struct rdma_cm_id **ids, struct rdma_addrinfo **res,
+		     int num, struct ibv_pd *pd,
+		     struct ibv_qp_init_attr *qp_init_attr,
+		     struct rdma_conn_param *conn_param,
+		     rdma_connect_eps_cb callback, void *context);
+
 /**
  * rdma_destroy_ep - Deallocates a communication identifier and qp.
  * @id: The communication identifier to destroy.
@@ -573,6 +611,27 @@ int rdma_leave_multicast(struct rdma_cm_id *id, struct sockaddr *addr);
 int rdma_get_cm_event(struct rdma_event_channel *channel,
 		      struct rdma_cm_event **event);
 
+/**
+ * rdma_get_cm_events - Retrieves multiple pending communication events.
+ * @channel: Event channel to check for events.
+ * @events: Array where the retrieved events will be returned.
+ * @num_events: Maximum number of events to retrieve.
+ * Description:
+ *   Retrieves up to num_events communication events.  The call waits for
+ *   the first event in the same way as rdma_get_cm_event, but only returns
+ *   additional events that are already pending.
+ * Notes:
+ *   Returns the number of events retrieved, or -1 on error if no events
+ *   were retrieved.  Each returned event must be acknowledged by calling
+ *   rdma_ack_cm_event or rdma_ack_cm_events.  If other threads retrieve
+ *   events from the same channel, the channel's fd must be non-blocking
+ *   for the call to be guaranteed not to wait for additional events.
+ * See also:
+ *   rdma_get_cm_event, rdma_ack_cm_events
+ */
+int rdma_get_cm_events(struct rdma_event_channel *channel,
+		       struct rdma_cm_event **events, int num_events);
+
 /**
  * rdma_ack_cm_event - Free a communication event.
  * @event: Event to be released.
@@ -585,6 +644,18 @@ int rdma_get_cm_event(struct rdma_event_channel *channel,
  */
 int rdma_ack_cm_event(struct rdma_cm_event *event);
 
+/**
+ * rdma_ack_cm_events - Free multiple communication events.
+ * @events: Array of events to be released.
+ * @num_events: Number of events in the array.
+ * Description:
+ *   Releases a set of events, as if rdma_ack_cm_event were called on
+ *   each of them.
+ * See also:
+ *   rdma_get_cm_events, rdma_ack_cm_event
+ */
+int rdma_ack_cm_events(struct rdma_cm_event **events, int num_events);
+
 __be16 rdma_get_src_port(struct rdma_cm_id *id);
 __be16 rdma_get_dst_port(struct rdma_cm_id *id);
 
@@ -674,6 +745,34 @@ int rdma_getaddrinfo(const char *node, const char *service,
 
 void rdma_freeaddrinfo(struct rdma_addrinfo *res);
 
+typedef void (*rdma_getaddrinfo_cb)(void *context, int status,
+				    struct rdma_addrinfo *res);
+
+/**
+ * rdma_getaddrinfo_async - Asynchronous address and route resolution.
+ * @node: Optional, name, dotted-decimal IPv4, or IPv6 hex address to resolve.
+ * @service: Service name or port number of address.
+ * @hints: Reference to an rdma_addrinfo structure containing hints about the
+ *   type of service the caller supports.
+ * @callback: Function invoked when resolution completes.
+ * @context: User specified context passed to the callback.
+ * Description:
+ *   Queues a resolution request that is serviced by a library thread.  When
+ *   it completes, the callback is invoked with a status of 0 and a list of
+ *   rdma_addrinfo structures that the user must release with
+ *   rdma_freeaddrinfo.  On failure, status is the errno value describing
+ *   the error, or the getaddrinfo error code if name resolution failed,
+ *   and res is NULL.
+ * Notes:
+ *   If the result is already cached, the callback may be invoked before
+ *   this call returns, from the calling thread.
+ * See also:
+ *   rdma_getaddrinfo, rdma_freeaddrinfo
+ */
+int rdma_getaddrinfo_async(const char *node, const char *service,
+			   const struct rdma_addrinfo *hints,
+			   rdma_getaddrinfo_cb callback, void *context);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,10 +43,11 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <inttypes.h>
 #include <string.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
-#include <search.h>
+#include <sys/eventfd.h>
 #include <byteswap.h>
 #include <util/compiler.h>
 #include <util/util.h>
@@ -58,25 +59,164 @@
 #include "indexer.h"
 
 #define RS_OLAP_START_SIZE 2048
-#define RS_MAX_TRANSFER 65536
 #define RS_SNDLOWAT 2048
 #define RS_QP_MIN_SIZE 16
 #define RS_QP_MAX_SIZE 0xFFFE
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_POLL_BATCH 32
+#define RS_POOL_MR_CNT 8
+#define RS_POLL_PROBE 16
+#define RS_RBUF_MIN_SIZE (RS_SNDLOWAT << 2)
+#define RS_RBUF_IDLE_SEC 2
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
 struct rsocket;
 
+/*
+ * A CQ and completion channel shared by connected rsockets on the same
+ * device, and optionally created by the same thread.  Completions are
+ * demultiplexed by the slot carried in the wr_id into a per-rsocket
+ * backlog, which the rsocket processes under its own cq_lock.  Only one
+ * thread (the leader) blocks on the channel at a time; other blocked
+ * threads wait on the condition variable for the leader to report events.
+ */
+struct rs_cq {
+	dlist_entry	  entry;
+	struct ibv_context *verbs;
+	pthread_t	  owner;
+	int		  per_thread;
+	int		  refcnt;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq	  *cq;
+	int		  cqe_used;
+	pthread_mutex_t	  lock;
+	pthread_cond_t	  cond;
+	struct indexer	  slots;
+	int		  armed;
+	int		  leader;
+	int		  unack_cqe;
+	dlist_entry	  notify_list;
+	dlist_entry	  wc_notify_list;	/* rsockets with new completions */
+};
+
+struct rs_wc {
+	uint64_t	  wr_id;
+	__be32		  imm_data;
+	uint16_t	  status;
+	uint16_t	  wc_flags;
+};
+
+static dlist_entry rs_cq_list = { &rs_cq_list, &rs_cq_list };
+
+/*
+ * A shared receive queue used by connected rsockets on the same protection
+ * domain.  Data and control messages are carried in immediate data, so the
+ * receives carry no buffers and only consume a work request.  A receive is
+ * reposted to the SRQ as soon as its completion is polled.
+ */
+struct rs_srq {
+	dlist_entry	  entry;
+	struct ibv_pd	  *pd;
+	struct ibv_srq	  *srq;
+	int		  refcnt;
+};
+
+/* Protected by mut */
+static dlist_entry rs_srq_list = { &rs_srq_list, &rs_srq_list };
+
+/*
+ * Application buffers registered with rregister, shared by all rsockets.
+ * Each buffer is registered with a PD the first time that an rsocket on
+ * that PD sends from it.
+ */
+struct rs_pool_buf {
+	dlist_entry	  entry;
+	void		  *buf;
+	size_t		  len;
+	int		  mr_cnt;
+	struct ibv_mr	  *mr[RS_POOL_MR_CNT];
+};
+
+static pthread_mutex_t pool_mut = PTHREAD_MUTEX_INITIALIZER;
+static dlist_entry rs_pool_list = { &rs_pool_list, &rs_pool_list };
+
+/* Receive data returned by rrecv_zc that the user has not yet released */
+struct rs_zc_seg {
+	uint64_t	  start;
+	uint32_t	  len;
+};
+
+/*
+ * repoll support.  A repoll set owns a kernel epoll fd, which also serves
+ * as the repoll descriptor.  Normal fd's are added to it directly.  For an
+ * rsocket, we add the fd that rpoll would wait on (the CQ channel once
+ * connected, the CM channel before that, or the epoll fd of a datagram
+ * rsocket).  Rsockets that need to be checked are kept on a ready list,
+ * so that repoll_wait only touches sockets that the kernel reported,
+ * that were reported ready last time (level triggered), or whose state was
+ * changed outside of repoll_wait.
+ */
+static struct index_map epidm;
+static pthread_mutex_t epoll_mut = PTHREAD_MUTEX_INITIALIZER;
+static __thread int rs_epoll_busy;
+
+struct rs_epoll {
+	int		  epfd;
+	int		  evfd;
+	pthread_mutex_t	  lock;
+	struct index_map  items;
+	dlist_entry	  item_list;
+	dlist_entry	  ready_list;
+	dlist_entry	  free_list;
+	dlist_entry	  cq_list;
+	int		  waiters;
+	uint32_t	  poll_time;
+};
+
+struct rs_epoll_cq;
+
+struct rs_epoll_item {
+	struct rs_epoll	  *ep;
+	struct rsocket	  *rs;	/* NULL for normal fd's */
+	dlist_entry	  list;
+	dlist_entry	  ready;
+	struct epoll_event event;
+	int		  fd;	/* -1 once removed from the set */
+	int		  wait_fd;
+	int		  queued;
+	int		  signaled;
+	int		  disabled;
+	struct rs_epoll_cq *cq;	/* shared CQ registration */
+};
+
+/*
+ * rsockets on a shared CQ do not have a wait fd of their own.  The CQ's
+ * channel is added to the epoll set once, along with an eventfd that is
+ * signaled when another thread hands completions to one of the rsockets.
+ */
+struct rs_epoll_cq {
+	struct rs_epoll_item item;	/* rs is NULL, fd is -1 */
+	struct rs_cq	  *scq;
+	dlist_entry	  entry;	/* on scq->notify_list */
+	int		  evfd;
+	int		  signaled;
+	int		  refcnt;
+};
+
+static void rs_epoll_signal(struct rsocket *rs);
+
 enum {
 	RS_SVC_NOOP,
 	RS_SVC_ADD_DGRAM,
 	RS_SVC_REM_DGRAM,
 	RS_SVC_ADD_KEEPALIVE,
 	RS_SVC_REM_KEEPALIVE,
-	RS_SVC_MOD_KEEPALIVE
+	RS_SVC_MOD_KEEPALIVE,
+	RS_SVC_ADD_RBUF,
+	RS_SVC_REM_TCP
 };
 
 struct rs_svc_msg {
@@ -94,14 +234,17 @@ struct rs_svc {
 	void *(*run)(void *svc);
 	struct rsocket **rss;
 	void *contexts;
+	int epfd;
 };
 
-static struct pollfd *udp_svc_fds;
+/*
+ * Datagram rsockets are spread by index across one UDP service thread
+ * per online CPU, up to RS_UDP_SVC_MAX.
+ */
+#define RS_UDP_SVC_MAX 16
 static void *udp_svc_run(void *arg);
-static struct rs_svc udp_svc = {
-	.context_size = sizeof(*udp_svc_fds),
-	.run = udp_svc_run
-};
+static struct rs_svc udp_svc[RS_UDP_SVC_MAX];
+static int udp_svc_cnt = 1;
 static uint32_t *tcp_svc_timeouts;
 static void *tcp_svc_run(void *arg);
 static struct rs_svc tcp_svc = {
@@ -115,7 +258,11 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_max_xfer = 0;
+static uint32_t def_srqsize = 4096;
 static uint32_t polling_time = 10;
+static char *stats_file;
+static struct rsocket_stats rs_closed_stats;
 
 /*
  * Immediate data format is determined by the upper bits
@@ -130,6 +277,8 @@ static uint32_t polling_time = 10;
  * bits [28-0]: receive credits granted
  * IOMAP_SGL
  * bits [28-16]: reserved, bits [15-0]: index
+ * IOMAP_LANDED
+ * bits [28-0]: slot in the remote landed ring
  */
 
 enum {
@@ -138,7 +287,7 @@ enum {
 	RS_OP_WRITE, /* opcode is not transmitted over the network */
 	RS_OP_RSVD_DRA_MORE,
 	RS_OP_SGL,
-	RS_OP_RSVD,
+	RS_OP_IOMAP_LANDED, /* only sent to peers with RS_CONN_FLAG_IONOTIFY */
 	RS_OP_IOMAP_SGL,
 	RS_OP_CTRL
 };
@@ -154,6 +303,10 @@ enum {
 #define rs_wr_is_recv(wr_id) (wr_id & RS_WR_ID_FLAG_RECV)
 #define rs_wr_is_msg_send(wr_id) (wr_id & RS_WR_ID_FLAG_MSG_SEND)
 #define rs_wr_data(wr_id) ((uint32_t) wr_id)
+/* Connected rsockets on a shared CQ carry their CQ slot in bits 32-47 */
+#define RS_WR_ID_SLOT_SHIFT 32
+#define rs_wr_id_slot(rs) (((uint64_t) (rs)->cq_slot) << RS_WR_ID_SLOT_SHIFT)
+#define rs_wr_slot(wr_id) ((int) ((wr_id >> RS_WR_ID_SLOT_SHIFT) & IDX_MAX_INDEX))
 
 enum {
 	RS_CTRL_DISCONNECT,
@@ -197,10 +350,21 @@ struct rs_iomap_mr {
 	int index;	/* -1 if mapping is local and not in iomap_list */
 };
 
+/*
+ * Range written by riowrite with RIO_NOTIFY.  Peers that accept
+ * notifications place a ring of rq_size entries after their target
+ * iomap list, and the writer fills in a slot before signaling it.
+ */
+struct rs_iorange {
+	uint64_t offset;
+	uint64_t length;
+};
+
 #define RS_MAX_CTRL_MSG    (sizeof(struct rs_sge))
 #define rs_host_is_net()   (__BYTE_ORDER == __BIG_ENDIAN)
 #define RS_CONN_FLAG_NET   (1 << 0)
 #define RS_CONN_FLAG_IOMAP (1 << 1)
+#define RS_CONN_FLAG_IONOTIFY (1 << 2)
 
 struct rs_conn_data {
 	uint8_t		  version;
@@ -250,6 +414,8 @@ enum rs_state {
  */
 #define RS_OPT_MSG_SEND   (1 << 1)
 #define RS_OPT_SVC_ACTIVE (1 << 2)
+#define RS_OPT_SINGLE_THREAD (1 << 3)
+#define RS_OPT_KEEPALIVE  (1 << 4)
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -280,6 +446,23 @@ struct ds_dest {
 	uint32_t	   qpn;
 };
 
+/*
+ * Open addressing hash of a datagram rsocket's destinations.  Lookups are
+ * lock free; updates are made under map_lock.  Removed entries leave a
+ * DS_DEST_DELETED marker, and a table replaced by a larger one is kept
+ * until the rsocket is closed, so a reader never sees freed slots.
+ */
+#define DS_DEST_MAP_MIN	64
+#define DS_DEST_DELETED	((struct ds_dest *) 1)
+
+struct ds_dest_map {
+	struct ds_dest_map *prev;
+	uint32_t	   mask;
+	uint32_t	   used;	/* live and deleted slots */
+	uint32_t	   cnt;		/* live slots */
+	_Atomic(struct ds_dest *) slot[];
+};
+
 struct ds_qp {
 	dlist_entry	  list;
 	struct rsocket	  *rs;
@@ -309,12 +492,16 @@ struct rsocket {
 			struct rdma_cm_id *cm_id;
 			uint64_t	  tcp_opts;
 			unsigned int	  keepalive_time;
+			unsigned int	  keepalive_seq;
+			uint32_t	  keepalive_due;
+			uint32_t	  rbuf_due;
 
 			unsigned int	  ctrl_seqno;
 			unsigned int	  ctrl_max_seqno;
 			uint16_t	  sseq_no;
 			uint16_t	  sseq_comp;
 			uint16_t	  rseq_no;
+			uint16_t	  rseq_landed;
 			uint16_t	  rseq_comp;
 
 			int		  remote_sge;
@@ -338,11 +525,64 @@ struct rsocket {
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+			uint32_t	  max_xfer;
+			uint32_t	  olen;
+
+			uint32_t	  zcopy_size;
+
+			int		  cq_share;
+			struct rs_cq	  *scq;
+			int		  cq_slot;
+			int		  wc_size;
+			int		  wc_head;
+			int		  wc_tail;
+			int		  wc_notify;
+			dlist_entry	  wc_notify_entry;
+			struct rs_wc	  *wc_backlog;
+
+			int		  srq_mode;
+			struct rs_srq	  *srq;
+			uint32_t	  rbuf_max;
+			int		  rbuf_adv_left;
+			int		  rbuf_stalled;
+			time_t		  rbuf_stall_time;
+			uint8_t		  *rbuf_old;
+			struct ibv_mr	  *rmr_old;
+			uint32_t	  rbuf_old_size;
+			int		  rbuf_old_offset;
+			int		  rbuf_old_left;
+
+			uint64_t	  rbuf_pos;
+			uint64_t	  rbuf_credit_pos;
+			struct rs_zc_seg  *zc_seg;
+			int		  zc_head;
+			int		  zc_tail;
+			uint32_t	  zc_bytes;
+
+			/* RIO_ASYNC writes, see riocomplete */
+			uint64_t	  iow_posted;
+			uint64_t	  iow_done;
+			uint64_t	  iow_completed;
+			uint64_t	  *iow_seq;
+			int		  iow_head;
+			int		  iow_tail;
+
+			/* RIO_NOTIFY, see riolanded */
+			int		  io_notify;
+			struct rs_sge	  remote_landed;
+			uint32_t	  landed_seq;
+			struct rs_iorange *landed_ring;
+			struct riorange	  *landed;
+			int		  landed_head;
+			int		  landed_tail;
+			uint32_t	  landed_held;
+			uint32_t	  landed_freed;
+			int		  landed_rsvd;
 		};
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			_Atomic(struct ds_dest_map *) dest_map;
 			struct ds_dest    *conn_dest;
 
 			int		  udp_sock;
@@ -363,6 +603,11 @@ struct rsocket {
 	int		  retries;
 	int		  err;
 
+	uint32_t	  poll_budget;
+	uint32_t	  poll_wait;
+	uint32_t	  poll_probe;
+	struct rsocket_stats stats;
+
 	int		  sqe_avail;
 	uint32_t	  sbuf_size;
 	uint16_t	  sq_size;
@@ -383,8 +628,34 @@ struct rsocket {
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
 	int		  unack_cqe;
+	struct rs_epoll_item *epoll_item;
+	int		  svc_index;
 };
 
+/*
+ * An rsocket declared single-threaded (RDMA_SINGLETHREAD) skips its locks,
+ * except while the keepalive service thread may also access it.  Both
+ * options are only changed by the thread using the rsocket, and never
+ * while one of its locks is held.
+ */
+static inline int rs_single_thread(struct rsocket *rs)
+{
+	return (rs->opts & (RS_OPT_SINGLE_THREAD | RS_OPT_SVC_ACTIVE)) ==
+	       RS_OPT_SINGLE_THREAD;
+}
+
+static inline void rs_lock(struct rsocket *rs, fastlock_t *lock)
+{
+	if (!rs_single_thread(rs))
+		fastlock_acquire(lock);
+}
+
+static inline void rs_unlock(struct rsocket *rs, fastlock_t *lock)
+{
+	if (!rs_single_thread(rs))
+		fastlock_release(lock);
+}
+
 #define DS_UDP_TAG 0x55555555
 
 struct ds_udp_header {
@@ -474,6 +745,11 @@ unlock:
 	return ret;
 }
 
+static struct rs_svc *udp_svc_get(struct rsocket *rs)
+{
+	return &udp_svc[rs->index % udp_svc_cnt];
+}
+
 static int ds_compare_addr(const void *dst1, const void *dst2)
 {
 	const struct sockaddr *sa1, *sa2;
@@ -487,6 +763,144 @@ static int ds_compare_addr(const void *dst1, const void *dst2)
 	return memcmp(dst1, dst2, len);
 }
 
+static uint32_t ds_hash_addr(const void *addr)
+{
+	const uint8_t *p = addr;
+	uint32_t hash = 2166136261U;
+	size_t i, len;
+
+	len = (((const struct sockaddr *) addr)->sa_family == AF_INET6) ?
+	      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619;
+	return hash;
+}
+
+static struct ds_dest *ds_find_dest(struct rsocket *rs, const void *addr)
+{
+	struct ds_dest_map *map;
+	struct ds_dest *dest;
+	uint32_t i;
+
+	map = atomic_load_explicit(&rs->dest_map, memory_order_acquire);
+	if (!map)
+		return NULL;
+
+	for (i = ds_hash_addr(addr) & map->mask; ; i = (i + 1) & map->mask) {
+		dest = atomic_load_explicit(&map->slot[i], memory_order_acquire);
+		if (!dest)
+			return NULL;
+		if (dest != DS_DEST_DELETED && !ds_compare_addr(addr, &dest->addr))
+			return dest;
+	}
+}
+
+/* Caller must hold map_lock */
+static int ds_grow_dest_map(struct rsocket *rs)
+{
+	struct ds_dest_map *map, *old;
+	struct ds_dest *dest;
+	uint32_t i, j, size;
+
+	old = atomic_load_explicit(&rs->dest_map, memory_order_relaxed);
+	for (size = DS_DEST_MAP_MIN; old && size < (old->cnt + 1) * 4; )
+		size <<= 1;
+
+	map = calloc(1, sizeof(*map) + size * sizeof(map->slot[0]));
+	if (!map)
+		return ERR(ENOMEM);
+
+	map->mask = size - 1;
+	map->prev = old;
+	for (i = 0; old && i <= old->mask; i++) {
+		dest = atomic_load_explicit(&old->slot[i], memory_order_relaxed);
+		if (!dest || dest == DS_DEST_DELETED)
+			continue;
+
+		for (j = ds_hash_addr(&dest->addr) & map->mask;
+		     atomic_load_explicit(&map->slot[j], memory_order_relaxed);
+		     j = (j + 1) & map->mask)
+			;
+		atomic_store_explicit(&map->slot[j], dest, memory_order_relaxed);
+		map->used++;
+		map->cnt++;
+	}
+
+	atomic_store_explicit(&rs->dest_map, map, memory_order_release);
+	return 0;
+}
+
+/* Caller must hold map_lock and have checked that addr is not present */
+static int ds_insert_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest_map *map;
+	struct ds_dest *cur;
+	uint32_t i;
+	int ret;
+
+	map = atomic_load_explicit(&rs->dest_map, memory_order_relaxed);
+	if (!map || (map->used + 1) * 4 > (map->mask + 1) * 3) {
+		ret = ds_grow_dest_map(rs);
+		if (ret)
+			return ret;
+		map = atomic_load_explicit(&rs->dest_map, memory_order_relaxed);
+	}
+
+	for (i = ds_hash_addr(&dest->addr) & map->mask; ; i = (i + 1) & map->mask) {
+		cur = atomic_load_explicit(&map->slot[i], memory_order_relaxed);
+		if (!cur)
+			map->used++;
+		if (!cur || cur == DS_DEST_DELETED)
+			break;
+	}
+
+	map->cnt++;
+	atomic_store_explicit(&map->slot[i], dest, memory_order_release);
+	return 0;
+}
+
+/* Caller must hold map_lock, or be freeing the rsocket */
+static void ds_remove_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest_map *map;
+	struct ds_dest *cur;
+	uint32_t i;
+
+	map = atomic_load_explicit(&rs->dest_map, memory_order_relaxed);
+	if (!map)
+		return;
+
+	for (i = ds_hash_addr(&dest->addr) & map->mask; ; i = (i + 1) & map->mask) {
+		cur = atomic_load_explicit(&map->slot[i], memory_order_relaxed);
+		if (!cur)
+			return;
+		if (cur == dest)
+			break;
+	}
+
+	map->cnt--;
+	atomic_store_explicit(&map->slot[i], DS_DEST_DELETED, memory_order_release);
+}
+
+static void ds_free_dest_map(struct rsocket *rs)
+{
+	struct ds_dest_map *map, *prev;
+	struct ds_dest *dest;
+	uint32_t i;
+
+	map = atomic_load_explicit(&rs->dest_map, memory_order_relaxed);
+	for (i = 0; map && i <= map->mask; i++) {
+		dest = atomic_load_explicit(&map->slot[i], memory_order_relaxed);
+		if (dest && dest != DS_DEST_DELETED)
+			free(dest);
+	}
+
+	for (; map; map = prev) {
+		prev = map->prev;
+		free(map);
+	}
+}
+
 static int rs_value_to_scale(int value, int bits)
 {
 	return value <= (1 << (bits - 1)) ?
@@ -508,10 +922,109 @@ static int rs_scale_to_value(int value, int bits)
 		(void) rc;                                                     \
 	}
 
+/****************************************************************************
+ * Statistics
+ ****************************************************************************/
+
+/*
+ * Counters are kept per rsocket, without atomics, by the threads using it.
+ * Process wide counters are the sum of the open rsockets plus the totals of
+ * those already closed.  If RS_STATS_FILE is set in the environment, the
+ * counters are appended to that file when the process exits.
+ */
+static const char *rs_stats_names[] = {
+	"bytes_sent", "bytes_recv", "rdma_writes", "inline_writes",
+	"copied_writes", "zcopy_writes", "credit_stalls", "credit_updates",
+	"rbuf_updates", "cq_arms", "cq_events", "block_time", "spin_hits",
+	"sleeps"
+};
+
+#define RS_STATS_CNT (sizeof(struct rsocket_stats) / sizeof(uint64_t))
+
+static void rs_add_stats(struct rsocket_stats *dst, struct rsocket_stats *src)
+{
+	uint64_t *d = (uint64_t *) dst, *s = (uint64_t *) src;
+	int i;
+
+	for (i = 0; i < RS_STATS_CNT; i++)
+		d[i] += s[i];
+}
+
+/* Caller must hold mut */
+static void __rs_get_proc_stats(struct rsocket_stats *stats)
+{
+	struct rsocket *rs;
+	int i, j;
+
+	*stats = rs_closed_stats;
+	for (i = 0; i < IDX_ARRAY_SIZE; i++) {
+		if (!idm.array[i])
+			continue;
+
+		for (j = 0; j < IDX_ENTRY_SIZE; j++) {
+			rs = idm.array[i][j];
+			if (rs)
+				rs_add_stats(stats, &rs->stats);
+		}
+	}
+}
+
+static void rs_get_proc_stats(struct rsocket_stats *stats)
+{
+	pthread_mutex_lock(&mut);
+	__rs_get_proc_stats(stats);
+	pthread_mutex_unlock(&mut);
+}
+
+static void rs_print_stats(FILE *f, const char *name, struct rsocket_stats *stats)
+{
+	uint64_t *val = (uint64_t *) stats;
+	int i;
+
+	fprintf(f, "%s", name);
+	for (i = 0; i < RS_STATS_CNT; i++)
+		fprintf(f, " %s=%" PRIu64, rs_stats_names[i], val[i]);
+	fprintf(f, "\n");
+}
+
+static void rs_dump_stats(void)
+{
+	struct rsocket_stats stats;
+	struct rsocket *rs;
+	char name[32];
+	FILE *f;
+	int i, j;
+
+	f = fopen(stats_file, "a");
+	if (!f)
+		return;
+
+	pthread_mutex_lock(&mut);
+	for (i = 0; i < IDX_ARRAY_SIZE; i++) {
+		if (!idm.array[i])
+			continue;
+
+		for (j = 0; j < IDX_ENTRY_SIZE; j++) {
+			rs = idm.array[i][j];
+			if (rs) {
+				snprintf(name, sizeof name, "rsocket %d", rs->index);
+				rs_print_stats(f, name, &rs->stats);
+			}
+		}
+	}
+	__rs_get_proc_stats(&stats);
+	pthread_mutex_unlock(&mut);
+
+	snprintf(name, sizeof name, "process %d", getpid());
+	rs_print_stats(f, name, &stats);
+	fclose(f);
+}
+
 static void rs_configure(void)
 {
 	FILE *f;
 	static int init;
+	int i;
 
 	if (init)
 		return;
@@ -520,10 +1033,22 @@ static void rs_configure(void)
 	if (init)
 		goto out;
 
+	udp_svc_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	if (udp_svc_cnt < 1)
+		udp_svc_cnt = 1;
+	else if (udp_svc_cnt > RS_UDP_SVC_MAX)
+		udp_svc_cnt = RS_UDP_SVC_MAX;
+	for (i = 0; i < RS_UDP_SVC_MAX; i++)
+		udp_svc[i].run = udp_svc_run;
+
 	if (ucma_init())
 		goto out;
 	ucma_ib_init();
 
+	stats_file = getenv("RS_STATS_FILE");
+	if (stats_file)
+		atexit(rs_dump_stats);
+
 	if ((f = fopen(RS_CONF_DIR "/polling_time", "r"))) {
 		failable_fscanf(f, "%u", &polling_time);
 		fclose(f);
@@ -559,6 +1084,20 @@ static void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/maxxfer_default", "r"))) {
+		failable_fscanf(f, "%u", &def_max_xfer);
+		fclose(f);
+		if (def_max_xfer && def_max_xfer < RS_OLAP_START_SIZE)
+			def_max_xfer = RS_OLAP_START_SIZE;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/srqsize_default", "r"))) {
+		failable_fscanf(f, "%u", &def_srqsize);
+		fclose(f);
+		if (def_srqsize < RS_QP_MIN_SIZE)
+			def_srqsize = RS_QP_MIN_SIZE;
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		failable_fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -584,6 +1123,7 @@ static void rs_remove(struct rsocket *rs)
 {
 	pthread_mutex_lock(&mut);
 	idm_clear(&idm, rs->index);
+	rs_add_stats(&rs_closed_stats, &rs->stats);
 	pthread_mutex_unlock(&mut);
 }
 
@@ -609,9 +1149,16 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = inherited_rs->sq_inline;
 		rs->sq_size = inherited_rs->sq_size;
 		rs->rq_size = inherited_rs->rq_size;
+		rs->poll_budget = inherited_rs->poll_budget;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->zcopy_size = inherited_rs->zcopy_size;
+			rs->max_xfer = inherited_rs->max_xfer;
+			rs->cq_share = inherited_rs->cq_share;
+			rs->srq_mode = inherited_rs->srq_mode;
+			rs->io_notify = inherited_rs->io_notify;
+			rs->opts = inherited_rs->opts & RS_OPT_SINGLE_THREAD;
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -619,11 +1166,15 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = def_inline;
 		rs->sq_size = def_sqsize;
 		rs->rq_size = def_rqsize;
+		rs->poll_budget = polling_time;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			rs->max_xfer = def_max_xfer;
 		}
 	}
+	if (type == SOCK_STREAM)
+		rs->olen = RS_OLAP_START_SIZE;
 	fastlock_init(&rs->slock);
 	fastlock_init(&rs->rlock);
 	fastlock_init(&rs->cq_lock);
@@ -702,6 +1253,7 @@ static void ds_set_qp_size(struct rsocket *rs)
 static int rs_init_bufs(struct rsocket *rs)
 {
 	uint32_t total_rbuf_size, total_sbuf_size;
+	struct timeval now;
 	size_t len;
 
 	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
@@ -721,6 +1273,12 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	len = sizeof(*rs->target_sgl) * RS_SGL_SIZE +
 	      sizeof(*rs->target_iomap) * rs->target_iomap_size;
+	if (rs->io_notify) {
+		rs->landed = calloc(rs->rq_size + 1, sizeof(*rs->landed));
+		if (!rs->landed)
+			return ERR(ENOMEM);
+		len += sizeof(*rs->landed_ring) * rs->rq_size;
+	}
 	rs->target_buffer_list = malloc(len);
 	if (!rs->target_buffer_list)
 		return ERR(ENOMEM);
@@ -733,6 +1291,21 @@ static int rs_init_bufs(struct rsocket *rs)
 	rs->target_sgl = rs->target_buffer_list;
 	if (rs->target_iomap_size)
 		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
+	if (rs->io_notify)
+		rs->landed_ring = (struct rs_iorange *) ((struct rs_iomap *)
+				  (rs->target_sgl + RS_SGL_SIZE) + rs->target_iomap_size);
+
+	/*
+	 * In shared receive mode, the receive buffer starts small and is sized
+	 * on demand, up to the configured size.  See rs_tune_rbuf.
+	 */
+	if (rs->srq_mode && !(rs->opts & RS_OPT_MSG_SEND) &&
+	    rs->rbuf_size >= (RS_RBUF_MIN_SIZE << 1)) {
+		rs->rbuf_max = rs->rbuf_size;
+		rs->rbuf_size = RS_RBUF_MIN_SIZE;
+		gettimeofday(&now, NULL);
+		rs->rbuf_stall_time = now.tv_sec;
+	}
 
 	total_rbuf_size = rs->rbuf_size;
 	if (rs->opts & RS_OPT_MSG_SEND)
@@ -751,8 +1324,13 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	rs->rbuf_free_offset = rs->rbuf_size >> 1;
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->rbuf_adv_left = rs->rbuf_size >> 1;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
+
+	/* Without the service, the buffer only shrinks as it is read */
+	if (rs->rbuf_max)
+		rs_notify_svc(&tcp_svc, rs, RS_SVC_ADD_RBUF);
 	return 0;
 }
 
@@ -774,103 +1352,591 @@ static int ds_init_bufs(struct ds_qp *qp)
 	return 0;
 }
 
+/****************************************************************************
+ * Shared CQs
+ ****************************************************************************/
+
+enum {
+	RS_CQ_PRIVATE,
+	RS_CQ_SHARE_DEVICE,
+	RS_CQ_SHARE_THREAD
+};
+
+static int rs_scq_pending(struct rsocket *rs)
+{
+	return rs->wc_head != rs->wc_tail;
+}
+
 /*
- * If a user is waiting on a datagram rsocket through poll or select, then
- * we need the first completion to generate an event on the related epoll fd
- * in order to signal the user.  We arm the CQ on creation for this purpose
+ * The shared CQ is rearmed as soon as an event is retrieved, so that any
+ * completion that arrives afterwards generates a new event.  Callers poll
+ * the CQ after retrieving an event.  Caller must hold scq->lock.
  */
-static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+static void rs_scq_get_event(struct rs_cq *scq)
 {
-	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
-	if (!cm_id->recv_cq_channel)
-		return -1;
+	struct ibv_cq *cq;
+	void *context;
 
-	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
-				       cm_id, cm_id->recv_cq_channel, 0);
-	if (!cm_id->recv_cq)
-		goto err1;
+	if (ibv_get_cq_event(scq->channel, &cq, &context))
+		return;
 
-	if (rs->fd_flags & O_NONBLOCK) {
-		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
-			goto err2;
+	ibv_req_notify_cq(scq->cq, 0);
+	if (++scq->unack_cqe >= scq->cq->cqe) {
+		ibv_ack_cq_events(scq->cq, scq->unack_cqe);
+		scq->unack_cqe = 0;
 	}
-
-	ibv_req_notify_cq(cm_id->recv_cq, 0);
-	cm_id->send_cq_channel = cm_id->recv_cq_channel;
-	cm_id->send_cq = cm_id->recv_cq;
-	return 0;
-
-err2:
-	ibv_destroy_cq(cm_id->recv_cq);
-	cm_id->recv_cq = NULL;
-err1:
-	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
-	cm_id->recv_cq_channel = NULL;
-	return -1;
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+/*
+ * Move completions from the shared CQ into the backlog of the rsocket that
+ * owns them.  If completions were handed to an rsocket other than the
+ * caller's, wake anyone who may be waiting on its behalf.  Caller must hold
+ * scq->lock.
+ */
+static void rs_scq_poll(struct rs_cq *scq, struct rsocket *rs)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge;
+	struct ibv_wc wcs[RS_POLL_BATCH], *wc;
+	struct rs_epoll_cq *ecq;
+	struct rsocket *owner;
+	struct rs_wc *bwc;
+	dlist_entry *entry;
+	uint64_t val = 1;
+	ssize_t rc;
+	int i, ret, notify = 0;
+
+	while ((ret = ibv_poll_cq(scq->cq, RS_POLL_BATCH, wcs)) > 0) {
+		for (i = 0, wc = wcs; i < ret; i++, wc++) {
+			owner = idx_at(&scq->slots, rs_wr_slot(wc->wr_id));
+			bwc = &owner->wc_backlog[owner->wc_tail];
+			bwc->wr_id = wc->wr_id;
+			bwc->imm_data = wc->imm_data;
+			bwc->status = (uint16_t) wc->status;
+			bwc->wc_flags = (uint16_t) wc->wc_flags;
+			if (++owner->wc_tail == owner->wc_size)
+				owner->wc_tail = 0;
+
+			if (!owner->wc_notify) {
+				owner->wc_notify = 1;
+				dlist_insert_tail(&owner->wc_notify_entry,
+						  &scq->wc_notify_list);
+			}
+			if (owner != rs)
+				notify = 1;
+		}
+	}
 
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	if (!notify)
+		return;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
+	pthread_cond_broadcast(&scq->cond);
+	for (entry = scq->notify_list.next; entry != &scq->notify_list;
+	     entry = entry->next) {
+		ecq = container_of(entry, struct rs_epoll_cq, entry);
+		if (!ecq->signaled) {
+			rc = write(ecq->evfd, &val, sizeof val);
+			(void) rc;
+			ecq->signaled = 1;
+		}
 	}
-
-	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
 }
 
-static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+static void rs_free_shared_cq(struct rs_cq *scq)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge[2];
+	int i;
 
-	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
-	sge[0].length = sizeof(struct ibv_grh);
-	sge[0].lkey = qp->rmr->lkey;
-	sge[1].addr = (uintptr_t) qp->rbuf + offset;
-	sge[1].length = RS_SNDLOWAT;
-	sge[1].lkey = qp->rmr->lkey;
+	if (scq->cq) {
+		if (scq->unack_cqe)
+			ibv_ack_cq_events(scq->cq, scq->unack_cqe);
+		ibv_destroy_cq(scq->cq);
+	}
+	if (scq->channel)
+		ibv_destroy_comp_channel(scq->channel);
 
-	wr.wr_id = rs_recv_wr_id(offset);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 2;
+	for (i = 0; i < IDX_ARRAY_SIZE; i++)
+		free(scq->slots.array[i]);
 
-	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
+	pthread_cond_destroy(&scq->cond);
+	pthread_mutex_destroy(&scq->lock);
+	free(scq);
 }
 
-static int rs_create_ep(struct rsocket *rs)
+static struct rs_cq *rs_alloc_shared_cq(struct rsocket *rs,
+					struct rdma_cm_id *cm_id, int cqe)
 {
-	struct ibv_qp_init_attr qp_attr;
-	int i, ret;
+	struct rs_cq *scq;
 
-	rs_set_qp_size(rs);
-	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
-		rs->opts |= RS_OPT_MSG_SEND;
-	ret = rs_create_cq(rs, rs->cm_id);
-	if (ret)
+	scq = calloc(1, sizeof(*scq));
+	if (!scq)
+		return NULL;
+
+	scq->verbs = cm_id->verbs;
+	scq->owner = pthread_self();
+	scq->per_thread = (rs->cq_share == RS_CQ_SHARE_THREAD);
+	pthread_mutex_init(&scq->lock, NULL);
+	pthread_cond_init(&scq->cond, NULL);
+	dlist_init(&scq->notify_list);
+	dlist_init(&scq->wc_notify_list);
+
+	scq->channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!scq->channel)
+		goto err;
+
+	/* Waiters poll the channel before retrieving events */
+	if (set_fd_nonblock(scq->channel->fd, true))
+		goto err;
+
+	scq->cq = ibv_create_cq(cm_id->verbs, cqe, scq, scq->channel, 0);
+	if (!scq->cq)
+		goto err;
+
+	ibv_req_notify_cq(scq->cq, 0);
+	return scq;
+
+err:
+	rs_free_shared_cq(scq);
+	return NULL;
+}
+
+/*
+ * Attach a connected rsocket to the shared CQ for its device, growing the
+ * CQ to hold completions for all of its send and receive work requests.
+ * If the CQ cannot be shared, the caller falls back to a private CQ.
+ */
+static int rs_get_shared_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+{
+	struct rs_cq *scq = NULL;
+	dlist_entry *entry;
+	int cqe, ret = -1;
+
+	cqe = rs->sq_size + rs->rq_size;
+	rs->wc_size = cqe + 1;
+	rs->wc_backlog = calloc(rs->wc_size, sizeof(*rs->wc_backlog));
+	if (!rs->wc_backlog)
+		return -1;
+
+	pthread_mutex_lock(&mut);
+	for (entry = rs_cq_list.next; entry != &rs_cq_list; entry = entry->next) {
+		scq = container_of(entry, struct rs_cq, entry);
+		if (scq->verbs == cm_id->verbs &&
+		    scq->per_thread == (rs->cq_share == RS_CQ_SHARE_THREAD) &&
+		    (!scq->per_thread || pthread_equal(scq->owner, pthread_self())))
+			break;
+		scq = NULL;
+	}
+
+	if (!scq) {
+		scq = rs_alloc_shared_cq(rs, cm_id, cqe);
+		if (!scq)
+			goto out;
+		dlist_insert_tail(&scq->entry, &rs_cq_list);
+	}
+
+	pthread_mutex_lock(&scq->lock);
+	if (scq->cqe_used + cqe > scq->cq->cqe &&
+	    ibv_resize_cq(scq->cq, max(scq->cqe_used + cqe, scq->cq->cqe << 1)) &&
+	    ibv_resize_cq(scq->cq, scq->cqe_used + cqe))
+		goto unlock;
+
+	rs->cq_slot = idx_insert(&scq->slots, rs);
+	if (rs->cq_slot <= 0) {
+		rs->cq_slot = 0;
+		goto unlock;
+	}
+
+	scq->cqe_used += cqe;
+	scq->refcnt++;
+	rs->scq = scq;
+	ret = 0;
+unlock:
+	pthread_mutex_unlock(&scq->lock);
+	if (!scq->refcnt) {
+		dlist_remove(&scq->entry);
+		rs_free_shared_cq(scq);
+	}
+out:
+	pthread_mutex_unlock(&mut);
+	if (ret) {
+		free(rs->wc_backlog);
+		rs->wc_backlog = NULL;
+	}
+	return ret;
+}
+
+/*
+ * The QP must be destroyed first.  Any of its completions still on the CQ
+ * are then flushed into our backlog, so that our slot is never referenced
+ * once it has been released.
+ */
+static void rs_put_shared_cq(struct rsocket *rs)
+{
+	struct rs_cq *scq = rs->scq;
+	int destroy;
+
+	pthread_mutex_lock(&scq->lock);
+	rs_scq_poll(scq, rs);
+	if (rs->wc_notify) {
+		dlist_remove(&rs->wc_notify_entry);
+		rs->wc_notify = 0;
+	}
+	idx_remove(&scq->slots, rs->cq_slot);
+	scq->cqe_used -= rs->wc_size - 1;
+	pthread_mutex_unlock(&scq->lock);
+
+	pthread_mutex_lock(&mut);
+	destroy = !--scq->refcnt;
+	if (destroy)
+		dlist_remove(&scq->entry);
+	pthread_mutex_unlock(&mut);
+
+	if (destroy)
+		rs_free_shared_cq(scq);
+	free(rs->wc_backlog);
+	rs->wc_backlog = NULL;
+	rs->scq = NULL;
+}
+
+/*
+ * Block until completions are available for this rsocket.  One waiter
+ * polls the channel; the rest sleep until it reports an event or another
+ * thread hands them completions.
+ */
+static int rs_scq_wait(struct rsocket *rs)
+{
+	struct rs_cq *scq = rs->scq;
+	struct pollfd fds;
+	int ret = 0;
+
+	pthread_mutex_lock(&scq->lock);
+	while (!ret) {
+		rs_scq_poll(scq, rs);
+		if (rs_scq_pending(rs))
+			break;
+
+		if (scq->leader) {
+			pthread_cond_wait(&scq->cond, &scq->lock);
+			continue;
+		}
+
+		scq->leader = 1;
+		pthread_mutex_unlock(&scq->lock);
+
+		fds.fd = scq->channel->fd;
+		fds.events = POLLIN;
+		fds.revents = 0;
+		ret = poll(&fds, 1, -1);
+
+		pthread_mutex_lock(&scq->lock);
+		scq->leader = 0;
+		if (ret > 0) {
+			rs_scq_get_event(scq);
+			ret = 0;
+		}
+		pthread_cond_broadcast(&scq->cond);
+	}
+	pthread_mutex_unlock(&scq->lock);
+
+	rs->cq_armed = 0;
+	if (ret && errno != EINTR)
+		rs->state = rs_error;
+	return ret;
+}
+
+static struct ibv_cq *rs_cq(struct rsocket *rs)
+{
+	return rs->scq ? rs->scq->cq : rs->cm_id->recv_cq;
+}
+
+static struct ibv_comp_channel *rs_cq_channel(struct rsocket *rs)
+{
+	return rs->scq ? rs->scq->channel : rs->cm_id->recv_cq_channel;
+}
+
+/* A shared CQ is always armed */
+static void rs_arm_cq(struct rsocket *rs)
+{
+	if (!rs->scq)
+		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+	rs->cq_armed = 1;
+	rs->stats.cq_arms++;
+}
+
+/*
+ * If a user is waiting on a datagram rsocket through poll or select, then
+ * we need the first completion to generate an event on the related epoll fd
+ * in order to signal the user.  We arm the CQ on creation for this purpose
+ */
+static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+{
+	if (rs->type == SOCK_STREAM && rs->cq_share &&
+	    !rs_get_shared_cq(rs, cm_id))
+		return 0;
+
+	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!cm_id->recv_cq_channel)
+		return -1;
+
+	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+				       cm_id, cm_id->recv_cq_channel, 0);
+	if (!cm_id->recv_cq)
+		goto err1;
+
+	if (rs->fd_flags & O_NONBLOCK) {
+		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
+			goto err2;
+	}
+
+	ibv_req_notify_cq(cm_id->recv_cq, 0);
+	cm_id->send_cq_channel = cm_id->recv_cq_channel;
+	cm_id->send_cq = cm_id->recv_cq;
+	return 0;
+
+err2:
+	ibv_destroy_cq(cm_id->recv_cq);
+	cm_id->recv_cq = NULL;
+err1:
+	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
+	cm_id->recv_cq_channel = NULL;
+	return -1;
+}
+
+/*
+ * Receives are posted as a single chained list of up to RS_POLL_BATCH
+ * work requests, so that reposting after a CQ poll rings one doorbell.
+ */
+static int rs_post_recvs(struct rsocket *rs, int cnt)
+{
+	struct ibv_recv_wr wr[RS_POLL_BATCH], *bad;
+	struct ibv_sge sge[RS_POLL_BATCH];
+	int i, n, ret = 0;
+
+	while (cnt && !ret) {
+		n = min(cnt, RS_POLL_BATCH);
+		for (i = 0; i < n; i++) {
+			wr[i].next = (i + 1 < n) ? &wr[i + 1] : NULL;
+			if (!(rs->opts & RS_OPT_MSG_SEND)) {
+				wr[i].wr_id = rs_recv_wr_id(0) | rs_wr_id_slot(rs);
+				wr[i].sg_list = NULL;
+				wr[i].num_sge = 0;
+			} else {
+				wr[i].wr_id = rs_recv_wr_id(rs->rbuf_msg_index) |
+					      rs_wr_id_slot(rs);
+				sge[i].addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+					      (rs->rbuf_msg_index * RS_MSG_SIZE);
+				sge[i].length = RS_MSG_SIZE;
+				sge[i].lkey = rs->rmr->lkey;
+
+				wr[i].sg_list = &sge[i];
+				wr[i].num_sge = 1;
+				if (++rs->rbuf_msg_index == rs->rq_size)
+					rs->rbuf_msg_index = 0;
+			}
+		}
+
+		ret = rdma_seterrno(ibv_post_recv(rs->cm_id->qp, wr, &bad));
+		cnt -= n;
+	}
+
+	return ret;
+}
+
+static inline void ds_init_recv_wr(struct rsocket *rs, struct ds_qp *qp,
+				   uint32_t offset, struct ibv_recv_wr *wr,
+				   struct ibv_sge *sge)
+{
+	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = qp->rmr->lkey;
+	sge[1].addr = (uintptr_t) qp->rbuf + offset;
+	sge[1].length = RS_SNDLOWAT;
+	sge[1].lkey = qp->rmr->lkey;
+
+	wr->wr_id = rs_recv_wr_id(offset);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 2;
+}
+
+static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge[2];
+
+	ds_init_recv_wr(rs, qp, offset, &wr, sge);
+	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
+}
+
+/****************************************************************************
+ * Shared receive queues
+ ****************************************************************************/
+
+/*
+ * A full SRQ fails the post with ENOMEM.  That is not an error here, since
+ * receives replaced on close may fill it before other rsockets repost.
+ */
+static int rs_post_srq_recvs(struct rs_srq *srq, int cnt)
+{
+	struct ibv_recv_wr wr[RS_POLL_BATCH], *bad;
+	int i, n, ret = 0;
+
+	while (cnt && !ret) {
+		n = min(cnt, RS_POLL_BATCH);
+		for (i = 0; i < n; i++) {
+			wr[i].next = (i + 1 < n) ? &wr[i + 1] : NULL;
+			wr[i].wr_id = rs_recv_wr_id(0);
+			wr[i].sg_list = NULL;
+			wr[i].num_sge = 0;
+		}
+
+		ret = ibv_post_srq_recv(srq->srq, wr, &bad);
+		if (ret == ENOMEM)
+			return 0;
+		ret = rdma_seterrno(ret);
+		cnt -= n;
+	}
+
+	return ret;
+}
+
+/* Replace every SRQ receive consumed by a batch of completions */
+static int rs_repost_srq(struct rsocket *rs, struct ibv_wc *wcs, int cnt)
+{
+	int i, rcnt = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (rs_wr_is_recv(wcs[i].wr_id))
+			rcnt++;
+	}
+
+	return rcnt ? rs_post_srq_recvs(rs->srq, rcnt) : 0;
+}
+
+static void rs_free_srq(struct rs_srq *srq)
+{
+	if (srq->srq)
+		ibv_destroy_srq(srq->srq);
+	free(srq);
+}
+
+static struct rs_srq *rs_alloc_srq(struct ibv_pd *pd)
+{
+	struct ibv_srq_init_attr attr;
+	struct ibv_device_attr dev_attr;
+	struct rs_srq *srq;
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq)
+		return NULL;
+
+	srq->pd = pd;
+	memset(&attr, 0, sizeof attr);
+	attr.attr.max_wr = def_srqsize;
+	attr.attr.max_sge = 1;
+	if (!ibv_query_device(pd->context, &dev_attr) && dev_attr.max_srq_wr)
+		attr.attr.max_wr = min_t(uint32_t, attr.attr.max_wr,
+					 dev_attr.max_srq_wr);
+
+	srq->srq = ibv_create_srq(pd, &attr);
+	if (!srq->srq)
+		goto err;
+
+	if (rs_post_srq_recvs(srq, attr.attr.max_wr))
+		goto err;
+
+	return srq;
+
+err:
+	rs_free_srq(srq);
+	return NULL;
+}
+
+/*
+ * Attach a connecting rsocket to the SRQ for its protection domain.  The
+ * SRQ is sized independently of the number of connections; peers that
+ * find it empty are throttled by RNR retries until receives are reposted.
+ * If the SRQ cannot be used, the caller falls back to a private RQ.
+ */
+static int rs_get_srq(struct rsocket *rs)
+{
+	struct rs_srq *srq = NULL;
+	dlist_entry *entry;
+	int ret = -1;
+
+	pthread_mutex_lock(&mut);
+	for (entry = rs_srq_list.next; entry != &rs_srq_list; entry = entry->next) {
+		srq = container_of(entry, struct rs_srq, entry);
+		if (srq->pd == rs->cm_id->pd)
+			break;
+		srq = NULL;
+	}
+
+	if (!srq) {
+		srq = rs_alloc_srq(rs->cm_id->pd);
+		if (!srq)
+			goto out;
+	}
+
+	if (!srq->refcnt++)
+		dlist_insert_tail(&srq->entry, &rs_srq_list);
+	rs->srq = srq;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&mut);
+	return ret;
+}
+
+/*
+ * Must be called before the QP is destroyed.  Receives that the QP took
+ * from the SRQ, but which we have not processed, are lost with it.  Flow
+ * control limits those to the data credits granted to the peer and its
+ * control messages in flight, so that many receives are replaced without
+ * waiting for them to be flushed.  The SRQ caps any excess at its size.
+ * A QP that never reached RTR never took any receives.
+ */
+static void rs_replace_srq_recvs(struct rsocket *rs)
+{
+	struct ibv_qp_init_attr init_attr;
+	struct ibv_qp_attr attr;
+
+	if (ibv_query_qp(rs->cm_id->qp, &attr, IBV_QP_STATE, &init_attr) ||
+	    attr.qp_state < IBV_QPS_RTR)
+		return;
+
+	rs_post_srq_recvs(rs->srq, rs->rq_size + RS_QP_CTRL_SIZE);
+}
+
+/* Must be called after the QP has been destroyed */
+static void rs_put_srq(struct rsocket *rs)
+{
+	struct rs_srq *srq = rs->srq;
+	int destroy;
+
+	pthread_mutex_lock(&mut);
+	destroy = !--srq->refcnt;
+	if (destroy)
+		dlist_remove(&srq->entry);
+	pthread_mutex_unlock(&mut);
+
+	if (destroy)
+		rs_free_srq(srq);
+	rs->srq = NULL;
+}
+
+static int rs_create_ep(struct rsocket *rs)
+{
+	struct ibv_qp_init_attr qp_attr;
+	int ret;
+
+	rs_set_qp_size(rs);
+	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
+		rs->opts |= RS_OPT_MSG_SEND;
+	ret = rs_create_cq(rs, rs->cm_id);
+	if (ret)
 		return ret;
 
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.qp_context = rs;
-	qp_attr.send_cq = rs->cm_id->send_cq;
-	qp_attr.recv_cq = rs->cm_id->recv_cq;
+	qp_attr.send_cq = rs_cq(rs);
+	qp_attr.recv_cq = rs_cq(rs);
 	qp_attr.qp_type = IBV_QPT_RC;
 	qp_attr.sq_sig_all = 1;
 	qp_attr.cap.max_send_wr = rs->sq_size;
@@ -879,6 +1945,14 @@ static int rs_create_ep(struct rsocket *rs)
 	qp_attr.cap.max_recv_sge = 1;
 	qp_attr.cap.max_inline_data = rs->sq_inline;
 
+	/* SRQ receives cannot carry the slot needed to demux a shared CQ */
+	if (rs->srq_mode && !rs->scq && !(rs->opts & RS_OPT_MSG_SEND) &&
+	    !rs_get_srq(rs)) {
+		qp_attr.srq = rs->srq->srq;
+		qp_attr.cap.max_recv_wr = 0;
+		qp_attr.cap.max_recv_sge = 0;
+	}
+
 	ret = rdma_create_qp(rs->cm_id, NULL, &qp_attr);
 	if (ret)
 		return ret;
@@ -891,12 +1965,22 @@ static int rs_create_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
-	for (i = 0; i < rs->rq_size; i++) {
-		ret = rs_post_recv(rs);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	return rs->srq ? 0 : rs_post_recvs(rs, rs->rq_size);
+}
+
+/*
+ * If the application enables the registration cache on the PD that we
+ * use, libibverbs may keep a deregistered MR and hand it out again for new
+ * memory at the same address.  Memory is dropped from the cache once we no
+ * longer use it, before it can be freed.
+ */
+static void rs_dereg_mr(struct ibv_mr *mr)
+{
+	void *addr = mr->addr;
+	size_t length = mr->length;
+
+	ibv_dereg_mr(mr);
+	ibv_mr_cache_invalidate(addr, length);
 }
 
 static void rs_release_iomap_mr(struct rs_iomap_mr *iomr)
@@ -905,43 +1989,49 @@ static void rs_release_iomap_mr(struct rs_iomap_mr *iomr)
 		return;
 
 	dlist_remove(&iomr->entry);
-	ibv_dereg_mr(iomr->mr);
+	rs_dereg_mr(iomr->mr);
 	if (iomr->index >= 0)
 		iomr->mr = NULL;
 	else
 		free(iomr);
 }
 
-static void rs_free_iomappings(struct rsocket *rs)
+static void rs_free_iomapping_list(dlist_entry *list)
 {
 	struct rs_iomap_mr *iomr;
 
-	while (!dlist_empty(&rs->iomap_list)) {
-		iomr = container_of(rs->iomap_list.next,
-				    struct rs_iomap_mr, entry);
-		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
-	}
-	while (!dlist_empty(&rs->iomap_queue)) {
-		iomr = container_of(rs->iomap_queue.next,
-				    struct rs_iomap_mr, entry);
-		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
+	while (!dlist_empty(list)) {
+		iomr = container_of(list->next, struct rs_iomap_mr, entry);
+		atomic_store(&iomr->refcnt, 1);
+		rs_release_iomap_mr(iomr);
 	}
 }
 
+/*
+ * The rsocket has already been removed from the index map, and no
+ * completions for outstanding iowrites will arrive, so release the
+ * mappings directly rather than through riounmap.
+ */
+static void rs_free_iomappings(struct rsocket *rs)
+{
+	rs_free_iomapping_list(&rs->iomap_list);
+	rs_free_iomapping_list(&rs->iomap_queue);
+}
+
 static void ds_free_qp(struct ds_qp *qp)
 {
 	if (qp->smr)
-		rdma_dereg_mr(qp->smr);
+		rs_dereg_mr(qp->smr);
 
 	if (qp->rbuf) {
 		if (qp->rmr)
-			rdma_dereg_mr(qp->rmr);
+			rs_dereg_mr(qp->rmr);
 		free(qp->rbuf);
 	}
 
 	if (qp->cm_id) {
 		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+			ds_remove_dest(qp->rs, &qp->dest);
 			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
 				  qp->cm_id->recv_cq_channel->fd, NULL);
 			rdma_destroy_qp(qp->cm_id);
@@ -952,10 +2042,14 @@ static void ds_free_qp(struct ds_qp *qp)
 	free(qp);
 }
 
+static void rs_epoll_remove(struct rsocket *rs);
+
 static void ds_free(struct rsocket *rs)
 {
 	struct ds_qp *qp;
 
+	rs_epoll_remove(rs);
+
 	if (rs->udp_sock >= 0)
 		close(rs->udp_sock);
 
@@ -976,7 +2070,7 @@ static void ds_free(struct rsocket *rs)
 	if (rs->sbuf)
 		free(rs->sbuf);
 
-	tdestroy(rs->dest_map, free);
+	ds_free_dest_map(rs);
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -992,24 +2086,43 @@ static void rs_free(struct rsocket *rs)
 		return;
 	}
 
+	rs_epoll_remove(rs);
+
+	if (rs->opts & RS_OPT_SVC_ACTIVE)
+		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_TCP);
+
 	if (rs->rmsg)
 		free(rs->rmsg);
 
+	if (rs->zc_seg)
+		free(rs->zc_seg);
+
+	if (rs->iow_seq)
+		free(rs->iow_seq);
+
+	if (rs->landed)
+		free(rs->landed);
+
 	if (rs->sbuf) {
 		if (rs->smr)
-			rdma_dereg_mr(rs->smr);
+			rs_dereg_mr(rs->smr);
 		free(rs->sbuf);
 	}
 
 	if (rs->rbuf) {
 		if (rs->rmr)
-			rdma_dereg_mr(rs->rmr);
+			rs_dereg_mr(rs->rmr);
 		free(rs->rbuf);
 	}
 
+	if (rs->rbuf_old) {
+		rs_dereg_mr(rs->rmr_old);
+		free(rs->rbuf_old);
+	}
+
 	if (rs->target_buffer_list) {
 		if (rs->target_mr)
-			rdma_dereg_mr(rs->target_mr);
+			rs_dereg_mr(rs->target_mr);
 		free(rs->target_buffer_list);
 	}
 
@@ -1019,9 +2132,16 @@ static void rs_free(struct rsocket *rs)
 	if (rs->cm_id) {
 		rs_free_iomappings(rs);
 		if (rs->cm_id->qp) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			if (rs->srq)
+				rs_replace_srq_recvs(rs);
+			if (!rs->scq)
+				ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rdma_destroy_qp(rs->cm_id);
 		}
+		if (rs->srq)
+			rs_put_srq(rs);
+		if (rs->scq)
+			rs_put_shared_cq(rs);
 		rdma_destroy_id(rs->cm_id);
 	}
 
@@ -1043,6 +2163,7 @@ static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 {
 	conn->version = 1;
 	conn->flags = RS_CONN_FLAG_IOMAP |
+		      (rs->io_notify ? RS_CONN_FLAG_IONOTIFY : 0) |
 		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
 	conn->credits = htobe16(rs->rq_size);
 	memset(conn->reserved, 0, sizeof conn->reserved);
@@ -1065,13 +2186,20 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	rs->remote_sge = 1;
 	if ((rs_host_is_net() && !(conn->flags & RS_CONN_FLAG_NET)) ||
 	    (!rs_host_is_net() && (conn->flags & RS_CONN_FLAG_NET)))
-		rs->opts = RS_OPT_SWAP_SGL;
+		rs->opts |= RS_OPT_SWAP_SGL;
 
 	if (conn->flags & RS_CONN_FLAG_IOMAP) {
 		rs->remote_iomap.addr = rs->remote_sgl.addr +
 					sizeof(rs->remote_sgl) * rs->remote_sgl.length;
 		rs->remote_iomap.length = rs_scale_to_value(conn->target_iomap_size, 8);
 		rs->remote_iomap.key = rs->remote_sgl.key;
+
+		if (conn->flags & RS_CONN_FLAG_IONOTIFY) {
+			rs->remote_landed.addr = rs->remote_iomap.addr +
+				sizeof(struct rs_iomap) * rs->remote_iomap.length;
+			rs->remote_landed.length = be16toh(conn->credits);
+			rs->remote_landed.key = rs->remote_sgl.key;
+		}
 	}
 
 	rs->target_sgl[0].addr = be64toh((__force __be64)conn->data_buf.addr);
@@ -1120,7 +2248,7 @@ static int ds_init_ep(struct rsocket *rs)
 	}
 	msg->next = NULL;
 
-	ret = rs_notify_svc(&udp_svc, rs, RS_SVC_ADD_DGRAM);
+	ret = rs_notify_svc(udp_svc_get(rs), rs, RS_SVC_ADD_DGRAM);
 	if (ret)
 		return ret;
 
@@ -1399,6 +2527,10 @@ connected:
 			rs->err = errno;
 		}
 	}
+
+	/* The CM channel will not report any further events */
+	if (!(rs->state & rs_opening))
+		rs_epoll_signal(rs);
 	return ret;
 }
 
@@ -1480,8 +2612,7 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
-	return 0;
+	return ds_insert_dest(qp->rs, &qp->dest);
 }
 
 static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
@@ -1578,13 +2709,17 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	union socket_addr src_addr;
 	socklen_t src_len;
 	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
+	struct ds_dest *new_dest;
 	int ret = 0;
 
+	*dest = ds_find_dest(rs, addr);
+	if (*dest)
+		return 0;
+
 	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (tdest)
-		goto found;
+	*dest = ds_find_dest(rs, addr);
+	if (*dest)
+		goto out;
 
 	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
 	if (ret)
@@ -1594,21 +2729,23 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	if (ret)
 		goto out;
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (!tdest) {
-		new_dest = calloc(1, sizeof(*new_dest));
-		if (!new_dest) {
-			ret = ERR(ENOMEM);
-			goto out;
-		}
+	*dest = ds_find_dest(rs, addr);
+	if (*dest)
+		goto out;
 
-		memcpy(&new_dest->addr, addr, addrlen);
-		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
+	new_dest = calloc(1, sizeof(*new_dest));
+	if (!new_dest) {
+		ret = ERR(ENOMEM);
+		goto out;
 	}
 
-found:
-	*dest = *tdest;
+	memcpy(&new_dest->addr, addr, addrlen);
+	new_dest->qp = qp;
+	ret = ds_insert_dest(rs, new_dest);
+	if (ret)
+		free(new_dest);
+	else
+		*dest = new_dest;
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -1652,7 +2789,7 @@ static int rs_post_msg(struct rsocket *rs, uint32_t msg)
 	struct ibv_send_wr wr, *bad;
 	struct ibv_sge sge;
 
-	wr.wr_id = rs_send_wr_id(msg);
+	wr.wr_id = rs_send_wr_id(msg) | rs_wr_id_slot(rs);
 	wr.next = NULL;
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
 		wr.sg_list = NULL;
@@ -1680,7 +2817,7 @@ static int rs_post_write(struct rsocket *rs,
 {
 	struct ibv_send_wr wr, *bad;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
+	wr.wr_id = rs_send_wr_id(wr_data) | rs_wr_id_slot(rs);
 	wr.next = NULL;
 	wr.sg_list = sgl;
 	wr.num_sge = nsge;
@@ -1703,7 +2840,7 @@ static int rs_post_write_msg(struct rsocket *rs,
 
 	wr.next = NULL;
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_send_wr_id(msg);
+		wr.wr_id = rs_send_wr_id(msg) | rs_wr_id_slot(rs);
 		wr.sg_list = sgl;
 		wr.num_sge = nsge;
 		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
@@ -1717,7 +2854,7 @@ static int rs_post_write_msg(struct rsocket *rs,
 		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
 		if (!ret) {
 			wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
-				   RS_WR_ID_FLAG_MSG_SEND;
+				   RS_WR_ID_FLAG_MSG_SEND | rs_wr_id_slot(rs);
 			sge.addr = (uintptr_t) &msg;
 			sge.lkey = 0;
 			sge.length = sizeof msg;
@@ -1732,24 +2869,71 @@ static int rs_post_write_msg(struct rsocket *rs,
 	}
 }
 
+static void ds_init_send_wr(struct rsocket *rs, struct ibv_send_wr *wr,
+			    struct ibv_sge *sge, uint32_t wr_data)
+{
+	wr->wr_id = rs_send_wr_id(wr_data);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_SEND;
+	wr->send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
+	wr->wr.ud.ah = rs->conn_dest->ah;
+	wr->wr.ud.remote_qpn = rs->conn_dest->qpn;
+	wr->wr.ud.remote_qkey = RDMA_UDP_QKEY;
+}
+
 static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 			uint32_t wr_data)
 {
 	struct ibv_send_wr wr, *bad;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 1;
-	wr.opcode = IBV_WR_SEND;
-	wr.send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
-	wr.wr.ud.ah = rs->conn_dest->ah;
-	wr.wr.ud.remote_qpn = rs->conn_dest->qpn;
-	wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
-
+	ds_init_send_wr(rs, &wr, sge, wr_data);
 	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
 }
 
+/*
+ * Post a chain of sends built by ds_sendmmsg.  Messages that could not be
+ * posted are returned to the free list.  Returns the number posted.
+ */
+static int ds_post_send_list(struct rsocket *rs, struct ds_qp *qp,
+			     struct ibv_send_wr *wr, int cnt)
+{
+	struct ibv_send_wr *bad = NULL;
+	struct ds_smsg *msg;
+	int i, ret, posted = cnt;
+
+	ret = ibv_post_send(qp->cm_id->qp, wr, &bad);
+	if (ret) {
+		errno = ret;
+		posted = bad ? bad - wr : 0;
+	}
+
+	for (i = 0; i < posted; i++)
+		rs->stats.bytes_sent += wr[i].sg_list->length - qp->hdr.length;
+
+	for (i = posted; i < cnt; i++) {
+		msg = (struct ds_smsg *) (uintptr_t) wr[i].sg_list->addr;
+		msg->next = rs->smsg_free;
+		rs->smsg_free = msg;
+		rs->sqe_avail++;
+	}
+	return posted;
+}
+
+static void rs_count_write(struct rsocket *rs, struct ibv_sge *sgl,
+			   uint32_t length, int flags)
+{
+	rs->stats.bytes_sent += length;
+	rs->stats.rdma_writes++;
+	if (flags & IBV_SEND_INLINE)
+		rs->stats.inline_writes++;
+	else if (sgl->lkey == rs->smr->lkey)
+		rs->stats.copied_writes++;
+	else
+		rs->stats.zcopy_writes++;
+}
+
 /*
  * Update target SGE before sending data.  Otherwise the remote side may
  * update the entry before we do.
@@ -1761,6 +2945,8 @@ static int rs_write_data(struct rsocket *rs,
 	uint64_t addr;
 	uint32_t rkey;
 
+	rs_count_write(rs, sgl, length, flags);
+
 	rs->sseq_no++;
 	rs->sqe_avail--;
 	if (rs->opts & RS_OPT_MSG_SEND)
@@ -1787,8 +2973,10 @@ static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t of
 {
 	uint64_t addr;
 
+	rs_count_write(rs, sgl, length, flags);
 	rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs->iow_posted++;
 
 	addr = iom->sge.addr + offset - iom->offset;
 	return rs_post_write(rs, sgl, nsge, rs_msg_set(RS_OP_WRITE, length),
@@ -1811,12 +2999,56 @@ static int rs_write_iomap(struct rsocket *rs, struct rs_iomap_mr *iomr,
 				 flags, addr, rs->remote_iomap.key);
 }
 
+static int rs_write_landed(struct rsocket *rs, uint32_t slot,
+			   struct ibv_sge *sgl, int nsge, int flags)
+{
+	uint64_t addr;
+
+	/* The send queue entries and sbuf space were reserved up front */
+	rs->landed_rsvd = 0;
+	rs->sseq_no++;
+	addr = rs->remote_landed.addr + slot * sizeof(struct rs_iorange);
+	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_IOMAP_LANDED, slot),
+				 flags, addr, rs->remote_landed.key);
+}
+
+/*
+ * The transfer size is learned per socket and carries over between calls.
+ * It starts small, so that the first transfer is posted quickly, and doubles
+ * up to max_xfer, but never beyond the size of the send buffer.  The
+ * caller limits the result to the space available locally and remotely.
+ */
+static uint32_t rs_olap_size(struct rsocket *rs, size_t left)
+{
+	uint32_t limit, xfer_size;
+
+	limit = rs->max_xfer ? min(rs->max_xfer, rs->sbuf_size) : rs->sbuf_size;
+	xfer_size = min(rs->olen, limit);
+	if (left <= xfer_size)
+		return left;
+
+	if (rs->olen < limit)
+		rs->olen <<= 1;
+	return xfer_size;
+}
+
 static uint32_t rs_sbuf_left(struct rsocket *rs)
 {
 	return (uint32_t) (((uint64_t) (uintptr_t) &rs->sbuf[rs->sbuf_size]) -
 			   rs->ssgl[0].addr);
 }
 
+/*
+ * Received messages are counted by the reader under rlock, including landed
+ * notifications once riolanded returns them.  Notifications that are not
+ * queued are consumed as they are polled under cq_lock.  Keeping separate
+ * counts gives each a single writer.
+ */
+static inline uint16_t rs_rseq(struct rsocket *rs)
+{
+	return rs->rseq_no + rs->rseq_landed;
+}
+
 static void rs_send_credits(struct rsocket *rs)
 {
 	struct ibv_sge ibsge;
@@ -1824,10 +3056,12 @@ static void rs_send_credits(struct rsocket *rs)
 	int flags;
 
 	rs->ctrl_seqno++;
-	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
+	rs->rseq_comp = rs_rseq(rs) + (rs->rq_size >> 1);
+	rs->stats.credit_updates++;
 	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
+		rs->stats.rbuf_updates++;
 
 		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
 			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
@@ -1853,10 +3087,11 @@ static void rs_send_credits(struct rsocket *rs)
 		ibsge.length = sizeof(sge);
 
 		rs_post_write_msg(rs, &ibsge, 1,
-			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size), flags,
+			rs_msg_set(RS_OP_SGL, rs_rseq(rs) + rs->rq_size), flags,
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
 
+		rs->rbuf_adv_left += rs->rbuf_size >> 1;
 		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
 		rs->rbuf_free_offset += rs->rbuf_size >> 1;
 		if (rs->rbuf_free_offset >= rs->rbuf_size)
@@ -1864,7 +3099,7 @@ static void rs_send_credits(struct rsocket *rs)
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
 	} else {
-		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
+		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs_rseq(rs) + rs->rq_size));
 	}
 }
 
@@ -1883,11 +3118,11 @@ static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
 		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+			((short) ((short) rs_rseq(rs) - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
 		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+			((short) ((short) rs_rseq(rs) - (short) rs->rseq_comp) >= 0)) &&
 		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
 	}
 }
@@ -1898,85 +3133,176 @@ static void rs_update_credits(struct rsocket *rs)
 		rs_send_credits(rs);
 }
 
+static int rs_poll_wcs(struct rsocket *rs, struct ibv_wc *wcs)
+{
+	struct rs_wc *bwc;
+	int cnt;
+
+	if (!rs->scq)
+		return ibv_poll_cq(rs->cm_id->recv_cq, RS_POLL_BATCH, wcs);
+
+	pthread_mutex_lock(&rs->scq->lock);
+	rs_scq_poll(rs->scq, rs);
+	for (cnt = 0; cnt < RS_POLL_BATCH && rs_scq_pending(rs); cnt++) {
+		bwc = &rs->wc_backlog[rs->wc_head];
+		wcs[cnt].wr_id = bwc->wr_id;
+		wcs[cnt].imm_data = bwc->imm_data;
+		wcs[cnt].status = (enum ibv_wc_status) bwc->status;
+		wcs[cnt].wc_flags = bwc->wc_flags;
+		if (++rs->wc_head == rs->wc_size)
+			rs->wc_head = 0;
+	}
+	pthread_mutex_unlock(&rs->scq->lock);
+	return cnt;
+}
+
+/*
+ * At most this many notifications hold their receive credit until riolanded
+ * retrieves them, so a reader that never calls riolanded cannot take the
+ * whole receive window away from the stream.
+ */
+static inline uint32_t rs_landed_hold_max(struct rsocket *rs)
+{
+	return rs->rq_size >> 2;
+}
+
+/*
+ * Queue a range announced by the peer.  The credit for the notification
+ * is only returned once riolanded retrieves the range, unless too many
+ * credits are held already.  Those notifications, and any that do not fit
+ * into the queue, are credited right away.  landed_held is only written
+ * here and landed_freed only by riolanded, their difference is the number
+ * of credits held.
+ */
+static void rs_save_landed(struct rsocket *rs, uint32_t slot)
+{
+	int tail;
+
+	tail = (rs->landed_tail + 1) % (rs->rq_size + 1);
+	if (!rs->landed || slot >= rs->rq_size || tail == rs->landed_head) {
+		rs->rseq_landed++;
+		return;
+	}
+
+	if (rs->landed_held - rs->landed_freed < rs_landed_hold_max(rs))
+		rs->landed_held++;
+	else
+		rs->rseq_landed++;
+
+	rs->landed[rs->landed_tail].offset = rs->landed_ring[slot].offset;
+	rs->landed[rs->landed_tail].len = rs->landed_ring[slot].length;
+	rs->landed_tail = tail;
+}
+
 static int rs_poll_cq(struct rsocket *rs)
 {
-	struct ibv_wc wc;
+	struct ibv_wc wcs[RS_POLL_BATCH], *wc;
 	uint32_t msg;
-	int ret, rcnt = 0;
+	int i, ret, rcnt = 0, closed = 0;
+
+	/*
+	 * A disconnect stops polling, but the rest of the batch was already
+	 * removed from the CQ and must still be accounted for.
+	 */
+	while (!closed && (ret = rs_poll_wcs(rs, wcs)) > 0) {
+		if (rs->srq && rs_repost_srq(rs, wcs, ret)) {
+			rs->state = rs_error;
+			rs->err = errno;
+		}
 
-	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
-		if (rs_wr_is_recv(wc.wr_id)) {
-			if (wc.status != IBV_WC_SUCCESS)
-				continue;
-			rcnt++;
+		for (i = 0, wc = wcs; i < ret; i++, wc++) {
+			if (rs_wr_is_recv(wc->wr_id)) {
+				if (wc->status != IBV_WC_SUCCESS)
+					continue;
+				rcnt++;
 
-			if (wc.wc_flags & IBV_WC_WITH_IMM) {
-				msg = be32toh(wc.imm_data);
-			} else {
-				msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
-					[rs_wr_data(wc.wr_id)];
+				if (wc->wc_flags & IBV_WC_WITH_IMM) {
+					msg = be32toh(wc->imm_data);
+				} else {
+					msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
+						[rs_wr_data(wc->wr_id)];
 
-			}
-			switch (rs_msg_op(msg)) {
-			case RS_OP_SGL:
-				rs->sseq_comp = (uint16_t) rs_msg_data(msg);
-				break;
-			case RS_OP_IOMAP_SGL:
-				/* The iomap was updated, that's nice to know. */
-				break;
-			case RS_OP_CTRL:
-				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
-					rs->state = rs_disconnected;
-					return 0;
-				} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
-					if (rs->state & rs_writable) {
-						rs->state &= ~rs_readable;
-					} else {
+				}
+				switch (rs_msg_op(msg)) {
+				case RS_OP_SGL:
+					rs->sseq_comp = (uint16_t) rs_msg_data(msg);
+					break;
+				case RS_OP_IOMAP_SGL:
+					/* The iomap was updated, that's nice to know. */
+					break;
+				case RS_OP_IOMAP_LANDED:
+					rs_save_landed(rs, rs_msg_data(msg));
+					break;
+				case RS_OP_CTRL:
+					if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
 						rs->state = rs_disconnected;
-						return 0;
+						closed = 1;
+					} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
+						if (rs->state & rs_writable) {
+							rs->state &= ~rs_readable;
+						} else {
+							rs->state = rs_disconnected;
+							closed = 1;
+						}
 					}
+					break;
+				case RS_OP_WRITE:
+					/* We really shouldn't be here. */
+					break;
+				case RS_OP_DATA:
+					rs->rbuf_adv_left -= rs_msg_data(msg);
+					if (!rs->rbuf_adv_left)
+						rs->rbuf_stalled = 1;
+					SWITCH_FALLTHROUGH;
+				default:
+					rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
+					rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
+					if (++rs->rmsg_tail == rs->rq_size + 1)
+						rs->rmsg_tail = 0;
+					break;
+				}
+			} else {
+				switch  (rs_msg_op(rs_wr_data(wc->wr_id))) {
+				case RS_OP_SGL:
+					rs->ctrl_max_seqno++;
+					break;
+				case RS_OP_CTRL:
+					rs->ctrl_max_seqno++;
+					if (rs_msg_data(rs_wr_data(wc->wr_id)) == RS_CTRL_DISCONNECT)
+						rs->state = rs_disconnected;
+					break;
+				case RS_OP_IOMAP_SGL:
+					rs->sqe_avail++;
+					if (!rs_wr_is_msg_send(wc->wr_id))
+						rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
+					break;
+				case RS_OP_IOMAP_LANDED:
+					rs->sqe_avail++;
+					if (!rs_wr_is_msg_send(wc->wr_id))
+						rs->sbuf_bytes_avail += sizeof(struct rs_iorange);
+					break;
+				case RS_OP_WRITE:
+					rs->iow_done++;
+					SWITCH_FALLTHROUGH;
+				default:
+					rs->sqe_avail++;
+					rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc->wr_id));
+					break;
+				}
+				if (wc->status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
+					rs->state = rs_error;
+					rs->err = EIO;
 				}
-				break;
-			case RS_OP_WRITE:
-				/* We really shouldn't be here. */
-				break;
-			default:
-				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
-				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
-				if (++rs->rmsg_tail == rs->rq_size + 1)
-					rs->rmsg_tail = 0;
-				break;
-			}
-		} else {
-			switch  (rs_msg_op(rs_wr_data(wc.wr_id))) {
-			case RS_OP_SGL:
-				rs->ctrl_max_seqno++;
-				break;
-			case RS_OP_CTRL:
-				rs->ctrl_max_seqno++;
-				if (rs_msg_data(rs_wr_data(wc.wr_id)) == RS_CTRL_DISCONNECT)
-					rs->state = rs_disconnected;
-				break;
-			case RS_OP_IOMAP_SGL:
-				rs->sqe_avail++;
-				if (!rs_wr_is_msg_send(wc.wr_id))
-					rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
-				break;
-			default:
-				rs->sqe_avail++;
-				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
-				break;
-			}
-			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
-				rs->state = rs_error;
-				rs->err = EIO;
 			}
 		}
 	}
 
+	if (closed)
+		return 0;
+
 	if (rs->state & rs_connected) {
-		while (!ret && rcnt--)
-			ret = rs_post_recv(rs);
+		if (!ret && rcnt && !rs->srq)
+			ret = rs_post_recvs(rs, rcnt);
 
 		if (ret) {
 			rs->state = rs_error;
@@ -1995,8 +3321,20 @@ static int rs_get_cq_event(struct rsocket *rs)
 	if (!rs->cq_armed)
 		return 0;
 
+	/* Leave the event for a blocked waiter, which will report it */
+	if (rs->scq) {
+		pthread_mutex_lock(&rs->scq->lock);
+		if (!rs->scq->leader)
+			rs_scq_get_event(rs->scq);
+		pthread_mutex_unlock(&rs->scq->lock);
+		rs->cq_armed = 0;
+		rs->stats.cq_events++;
+		return 0;
+	}
+
 	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
+		rs->stats.cq_events++;
 		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
 			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rs->unack_cqe = 0;
@@ -2027,7 +3365,7 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 {
 	int ret;
 
-	fastlock_acquire(&rs->cq_lock);
+	rs_lock(rs, &rs->cq_lock);
 	do {
 		rs_update_credits(rs);
 		ret = rs_poll_cq(rs);
@@ -2039,44 +3377,90 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 		} else if (nonblock) {
 			ret = ERR(EWOULDBLOCK);
 		} else if (!rs->cq_armed) {
-			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
-			rs->cq_armed = 1;
+			rs_arm_cq(rs);
 		} else {
 			rs_update_credits(rs);
-			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
+			rs_lock(rs, &rs->cq_wait_lock);
+			rs_unlock(rs, &rs->cq_lock);
 
-			ret = rs_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+			ret = rs->scq ? rs_scq_wait(rs) : rs_get_cq_event(rs);
+			rs_unlock(rs, &rs->cq_wait_lock);
+			rs_epoll_signal(rs);
+			rs_lock(rs, &rs->cq_lock);
 		}
 	} while (!ret);
 
 	rs_update_credits(rs);
-	fastlock_release(&rs->cq_lock);
+	rs_unlock(rs, &rs->cq_lock);
 	return ret;
 }
 
+/*
+ * Each rsocket busy polls for up to its budget (SO_BUSY_POLL, polling_time
+ * by default) before blocking.  Spinning is skipped while completions have
+ * been taking longer than the budget to arrive, so that rsockets with sparse
+ * traffic do not burn CPU.  Every RS_POLL_PROBE waits still spin, so that
+ * a drop in the average wait is noticed and spinning resumes.
+ */
+static uint32_t rs_spin_time(struct rsocket *rs)
+{
+	if (rs->poll_wait <= rs->poll_budget ||
+	    !(++rs->poll_probe % RS_POLL_PROBE))
+		return rs->poll_budget;
+	return 0;
+}
+
+static uint32_t rs_wait_time(struct timeval *s)
+{
+	struct timeval e;
+
+	gettimeofday(&e, NULL);
+	return (e.tv_sec - s->tv_sec) * 1000000 + (e.tv_usec - s->tv_usec) + 1;
+}
+
+/*
+ * Record a wait that was satisfied immediately (a wait of 0), by spinning,
+ * or by sleeping.  The average wait is weighted 1/8 toward each new sample.
+ * Samples are capped, so that an idle period is not remembered for long
+ * once traffic resumes.
+ */
+static void rs_poll_update(struct rsocket *rs, uint32_t wait, int slept)
+{
+	if (slept) {
+		rs->stats.sleeps++;
+		rs->stats.block_time += wait;
+	} else if (wait) {
+		rs->stats.spin_hits++;
+	}
+
+	wait = min(wait, rs->poll_budget << 2);
+	rs->poll_wait = rs->poll_wait - (rs->poll_wait >> 3) + (wait >> 3);
+}
+
 static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
-	struct timeval s, e;
-	uint32_t poll_time = 0;
+	struct timeval s;
+	uint32_t poll_time = 0, spin_time;
 	int ret;
 
+	spin_time = rs_spin_time(rs);
 	do {
 		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret && !nonblock)
+				rs_poll_update(rs, poll_time, 0);
 			return ret;
+		}
 
 		if (!poll_time)
 			gettimeofday(&s, NULL);
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+		poll_time = rs_wait_time(&s);
+	} while (poll_time <= spin_time);
 
 	ret = rs_process_cq(rs, 0, test);
+	if (!ret)
+		rs_poll_update(rs, rs_wait_time(&s), 1);
 	return ret;
 }
 
@@ -2181,6 +3565,7 @@ static int ds_get_cq_event(struct rsocket *rs)
 	qp = event.data.ptr;
 	ret = ibv_get_cq_event(qp->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
+		rs->stats.cq_events++;
 		ibv_ack_cq_events(qp->cm_id->recv_cq, 1);
 		qp->cq_armed = 0;
 		rs->cq_armed = 0;
@@ -2204,12 +3589,14 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 		} else if (!rs->cq_armed) {
 			ds_req_notify_cqs(rs);
 			rs->cq_armed = 1;
+			rs->stats.cq_arms++;
 		} else {
 			fastlock_acquire(&rs->cq_wait_lock);
 			fastlock_release(&rs->cq_lock);
 
 			ret = ds_get_cq_event(rs);
 			fastlock_release(&rs->cq_wait_lock);
+			rs_epoll_signal(rs);
 			fastlock_acquire(&rs->cq_lock);
 		}
 	} while (!ret);
@@ -2220,24 +3607,28 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
-	struct timeval s, e;
-	uint32_t poll_time = 0;
+	struct timeval s;
+	uint32_t poll_time = 0, spin_time;
 	int ret;
 
+	spin_time = rs_spin_time(rs);
 	do {
 		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret && !nonblock)
+				rs_poll_update(rs, poll_time, 0);
 			return ret;
+		}
 
 		if (!poll_time)
 			gettimeofday(&s, NULL);
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+		poll_time = rs_wait_time(&s);
+	} while (poll_time <= spin_time);
 
 	ret = ds_process_cqs(rs, 0, test);
+	if (!ret)
+		rs_poll_update(rs, rs_wait_time(&s), 1);
 	return ret;
 }
 
@@ -2311,7 +3702,7 @@ static int rs_conn_have_rdata(struct rsocket *rs)
 static int rs_conn_all_sends_done(struct rsocket *rs)
 {
 	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
-		rs->sqe_avail == rs->sq_size) ||
+		rs->sqe_avail + rs->landed_rsvd == rs->sq_size) ||
 	       !(rs->state & rs_connected);
 }
 
@@ -2371,19 +3762,166 @@ static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 		if (++rs->rmsg_head == rs->rq_size + 1)
 			rs->rmsg_head = 0;
 		rs->rqe_avail++;
+		rs->stats.bytes_recv += len;
 	}
 
 	return len;
 }
 
+static void rs_copy_rbuf(void *buf, uint8_t *rbuf, uint32_t rbuf_size,
+			 int *rbuf_offset, uint32_t len)
+{
+	uint32_t end_size;
+
+	end_size = rbuf_size - *rbuf_offset;
+	if (len > end_size) {
+		memcpy(buf, &rbuf[*rbuf_offset], end_size);
+		*rbuf_offset = 0;
+		buf += end_size;
+		len -= end_size;
+	}
+	memcpy(buf, &rbuf[*rbuf_offset], len);
+	*rbuf_offset += len;
+}
+
+/*
+ * Switch to a new receive buffer of the given size.  Space in the old
+ * buffer that the peer may still write into must be read before the new
+ * buffer is used, and the sender can only hold RS_SGL_SIZE target buffers.
+ * So one region of the new buffer is held back for each outstanding region
+ * of the old buffer, and released as that region is read.  Caller must
+ * hold rlock and cq_lock.
+ */
+static void rs_resize_rbuf(struct rsocket *rs, uint32_t size)
+{
+	struct ibv_mr *rmr;
+	uint8_t *rbuf;
+	uint32_t half;
+	int left;
+
+	rbuf = calloc(size, 1);
+	if (!rbuf)
+		return;
+
+	rmr = rdma_reg_write(rs->cm_id, rbuf, size);
+	if (!rmr) {
+		free(rbuf);
+		return;
+	}
+
+	half = rs->rbuf_size >> 1;
+	left = rs->rbuf_size - rs->rbuf_bytes_avail;
+	if (left) {
+		rs->rbuf_old = rs->rbuf;
+		rs->rmr_old = rs->rmr;
+		rs->rbuf_old_size = rs->rbuf_size;
+		rs->rbuf_old_offset = rs->rbuf_offset;
+		rs->rbuf_old_left = left;
+	} else {
+		rs_dereg_mr(rs->rmr);
+		free(rs->rbuf);
+	}
+
+	rs->rbuf = rbuf;
+	rs->rmr = rmr;
+	rs->rbuf_size = size;
+	rs->rbuf_offset = 0;
+	rs->rbuf_free_offset = 0;
+	rs->rbuf_bytes_avail = size - ((left + half - 1) / half) * (size >> 1);
+}
+
+/*
+ * Halve the receive buffer once the peer has not been limited by it for a
+ * while.  Caller must hold rlock and cq_lock.
+ */
+static int rs_shrink_idle_rbuf(struct rsocket *rs, time_t now)
+{
+	if (rs->rbuf_stalled || rs->rbuf_old ||
+	    rs->rbuf_size <= RS_RBUF_MIN_SIZE ||
+	    now - rs->rbuf_stall_time < RS_RBUF_IDLE_SEC)
+		return 0;
+
+	rs->rbuf_stall_time = now;
+	rs_resize_rbuf(rs, rs->rbuf_size >> 1);
+	return 1;
+}
+
+/*
+ * Called each time a region of the receive buffer has been read.  The
+ * buffer doubles if the peer used all of the space advertised to it, and
+ * halves once the peer has not been limited by it for a while.
+ */
+static void rs_tune_rbuf(struct rsocket *rs)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	rs_lock(rs, &rs->cq_lock);
+	if (rs->rbuf_stalled) {
+		rs->rbuf_stalled = 0;
+		rs->rbuf_stall_time = now.tv_sec;
+		if ((rs->rbuf_size << 1) <= rs->rbuf_max)
+			rs_resize_rbuf(rs, rs->rbuf_size << 1);
+	} else {
+		rs_shrink_idle_rbuf(rs, now.tv_sec);
+	}
+	rs_unlock(rs, &rs->cq_lock);
+}
+
+/*
+ * Space in the receive buffer is returned to the peer in order.  Data
+ * consumed behind data that is still held by rrecv_zc is credited once
+ * that data has been released.
+ */
+static void rs_consume_rbuf(struct rsocket *rs, uint32_t len)
+{
+	rs->stats.bytes_recv += len;
+	rs->rbuf_pos += len;
+	if (rs->zc_head == rs->zc_tail) {
+		rs->rbuf_bytes_avail += len;
+		rs->rbuf_credit_pos = rs->rbuf_pos;
+	}
+}
+
+/*
+ * Copy data out of the receive buffer.  Data left in a previous receive
+ * buffer is read first.  Messages never span regions, so a message lies
+ * entirely in one buffer.  Caller must hold rlock.
+ */
+static void rs_read_rbuf(struct rsocket *rs, void *buf, uint32_t len)
+{
+	if (rs->rbuf_old_left) {
+		rs_copy_rbuf(buf, rs->rbuf_old, rs->rbuf_old_size,
+			     &rs->rbuf_old_offset, len);
+		rs->stats.bytes_recv += len;
+		if (!(rs->rbuf_old_offset % (rs->rbuf_old_size >> 1)))
+			rs->rbuf_bytes_avail += rs->rbuf_size >> 1;
+
+		rs->rbuf_old_left -= len;
+		if (!rs->rbuf_old_left) {
+			rs_dereg_mr(rs->rmr_old);
+			free(rs->rbuf_old);
+			rs->rbuf_old = NULL;
+		}
+		return;
+	}
+
+	rs_copy_rbuf(buf, rs->rbuf, rs->rbuf_size, &rs->rbuf_offset, len);
+	rs_consume_rbuf(rs, len);
+	if (rs->rbuf_max && !(rs->rbuf_offset % (rs->rbuf_size >> 1)))
+		rs_tune_rbuf(rs);
+}
+
 static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 {
 	size_t left = len;
-	uint32_t end_size, rsize;
-	int rmsg_head, rbuf_offset;
+	uint32_t rsize;
+	int rmsg_head, rbuf_offset, old_offset, old_left;
 
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
+	old_offset = rs->rbuf_old_offset;
+	old_left = rs->rbuf_old_left;
 
 	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
@@ -2394,16 +3932,14 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 				rmsg_head = 0;
 		}
 
-		end_size = rs->rbuf_size - rbuf_offset;
-		if (rsize > end_size) {
-			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
-			rbuf_offset = 0;
-			buf += end_size;
-			rsize -= end_size;
-			left -= end_size;
+		if (old_left) {
+			rs_copy_rbuf(buf, rs->rbuf_old, rs->rbuf_old_size,
+				     &old_offset, rsize);
+			old_left -= rsize;
+		} else {
+			rs_copy_rbuf(buf, rs->rbuf, rs->rbuf_size,
+				     &rbuf_offset, rsize);
 		}
-		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
-		rbuf_offset += rsize;
 		buf += rsize;
 	}
 
@@ -2417,7 +3953,7 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
 	size_t left = len;
-	uint32_t end_size, rsize;
+	uint32_t rsize;
 	int ret = 0;
 
 	rs = idm_at(&idm, socket);
@@ -2438,7 +3974,7 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			return ret;
 		}
 	}
-	fastlock_acquire(&rs->rlock);
+	rs_lock(rs, &rs->rlock);
 	do {
 		if (!rs_have_rdata(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
@@ -2463,57 +3999,190 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 					rs->rmsg_head = 0;
 			}
 
-			end_size = rs->rbuf_size - rs->rbuf_offset;
-			if (rsize > end_size) {
-				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
-				rs->rbuf_offset = 0;
-				buf += end_size;
-				rsize -= end_size;
-				left -= end_size;
-				rs->rbuf_bytes_avail += end_size;
-			}
-			memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
-			rs->rbuf_offset += rsize;
+			rs_read_rbuf(rs, buf, rsize);
 			buf += rsize;
-			rs->rbuf_bytes_avail += rsize;
 		}
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
-	fastlock_release(&rs->rlock);
+	rs_unlock(rs, &rs->rlock);
 	return (ret && left == len) ? ret : len - left;
 }
 
-ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
-		  struct sockaddr *src_addr, socklen_t *addrlen)
+/*
+ * Return pointers to received data in the receive buffer, rather than
+ * copying it out.  The data is consumed from the stream, but its space is
+ * not returned to the peer until the user releases it.
+ */
+ssize_t rrecv_zc(int socket, struct iovec *iov, int *iovcnt, size_t len,
+		 int flags)
 {
 	struct rsocket *rs;
-	int ret;
+	size_t left = len;
+	uint32_t rsize;
+	uint8_t *buf;
+	int cnt = 0, tail, ret = 0;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
-		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
-		fastlock_release(&rs->rlock);
-		return ret;
+	if (rs->type != SOCK_STREAM || rs->rbuf_max || (flags & MSG_PEEK))
+		return ERR(ENOTSUP);
+	if (*iovcnt <= 0)
+		return ERR(EINVAL);
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+	rs_lock(rs, &rs->rlock);
+	if (!rs->zc_seg) {
+		rs->zc_seg = calloc(rs->rq_size + 1, sizeof(*rs->zc_seg));
+		if (!rs->zc_seg) {
+			ret = ERR(ENOMEM);
+			goto out;
+		}
 	}
 
-	ret = rrecv(socket, buf, len, flags);
-	if (ret > 0 && src_addr)
-		rgetpeername(socket, src_addr, addrlen);
+	if ((rs->zc_tail + 1) % (rs->rq_size + 1) == rs->zc_head) {
+		ret = ERR(ENOBUFS);
+		goto out;
+	}
 
-	return ret;
+	if (!rs_have_rdata(rs)) {
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_conn_have_rdata);
+		if (ret)
+			goto out;
+	}
+
+	for (; left && rs_have_rdata(rs); left -= rsize) {
+		if (rs->rbuf_offset == rs->rbuf_size)
+			rs->rbuf_offset = 0;
+
+		rsize = min_t(size_t, left, rs->rmsg[rs->rmsg_head].data);
+		rsize = min_t(uint32_t, rsize, rs->rbuf_size - rs->rbuf_offset);
+		buf = &rs->rbuf[rs->rbuf_offset];
+		if (cnt && iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == buf) {
+			iov[cnt - 1].iov_len += rsize;
+		} else if (cnt < *iovcnt) {
+			iov[cnt].iov_base = buf;
+			iov[cnt++].iov_len = rsize;
+		} else {
+			break;
+		}
+
+		rs->rmsg[rs->rmsg_head].data -= rsize;
+		if (!rs->rmsg[rs->rmsg_head].data) {
+			rs->rseq_no++;
+			if (++rs->rmsg_head == rs->rq_size + 1)
+				rs->rmsg_head = 0;
+		}
+		rs->rbuf_offset += rsize;
+	}
+
+	/* Merge with the last held segment if no data was copied in between */
+	if (left != len) {
+		tail = rs->zc_tail ? rs->zc_tail - 1 : rs->rq_size;
+		if (rs->zc_head != rs->zc_tail &&
+		    rs->zc_seg[tail].start + rs->zc_seg[tail].len == rs->rbuf_pos) {
+			rs->zc_seg[tail].len += len - left;
+		} else {
+			rs->zc_seg[rs->zc_tail].start = rs->rbuf_pos;
+			rs->zc_seg[rs->zc_tail].len = len - left;
+			if (++rs->zc_tail == rs->rq_size + 1)
+				rs->zc_tail = 0;
+		}
+		rs->rbuf_pos += len - left;
+		rs->zc_bytes += len - left;
+		rs->stats.bytes_recv += len - left;
+	}
+out:
+	rs_unlock(rs, &rs->rlock);
+	*iovcnt = cnt;
+	return ret ? ret : len - left;
 }
 
 /*
- * Simple, straightforward implementation for now that only tries to fill
- * in the first vector.
+ * Release the oldest len bytes returned by rrecv_zc, and return their space
+ * to the peer, along with the space of any data copied out behind them.
  */
-static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
+int rrecv_zc_release(int socket, size_t len)
 {
-	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
+	struct rsocket *rs;
+	struct rs_zc_seg *seg;
+	uint64_t pos;
+	uint32_t rsize;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(ENOTSUP);
+
+	rs_lock(rs, &rs->rlock);
+	if (len > rs->zc_bytes) {
+		rs_unlock(rs, &rs->rlock);
+		return ERR(EINVAL);
+	}
+
+	rs->zc_bytes -= len;
+	while (len) {
+		seg = &rs->zc_seg[rs->zc_head];
+		rsize = min_t(size_t, len, seg->len);
+		seg->start += rsize;
+		seg->len -= rsize;
+		len -= rsize;
+		if (!seg->len && ++rs->zc_head == rs->rq_size + 1)
+			rs->zc_head = 0;
+	}
+
+	pos = (rs->zc_head == rs->zc_tail) ?
+	      rs->rbuf_pos : rs->zc_seg[rs->zc_head].start;
+	rs->rbuf_bytes_avail += pos - rs->rbuf_credit_pos;
+	rs->rbuf_credit_pos = pos;
+	rs_unlock(rs, &rs->rlock);
+
+	rs_lock(rs, &rs->cq_lock);
+	rs_update_credits(rs);
+	rs_unlock(rs, &rs->cq_lock);
+	return 0;
+}
+
+ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
+		  struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	ret = rrecv(socket, buf, len, flags);
+	if (ret > 0 && src_addr)
+		rgetpeername(socket, src_addr, addrlen);
+
+	return ret;
+}
+
+/*
+ * Simple, straightforward implementation for now that only tries to fill
+ * in the first vector.
+ */
+static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
+{
+	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
 }
 
 ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
@@ -2521,7 +4190,190 @@ ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
 	if (msg->msg_control && msg->msg_controllen)
 		return ERR(ENOTSUP);
 
-	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
+	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
+}
+
+#define DS_MMSG_BATCH 16
+
+static int ds_post_recv_list(struct ds_qp *qp, struct ibv_recv_wr *wr)
+{
+	struct ibv_recv_wr *bad;
+
+	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, wr, &bad));
+}
+
+static uint32_t ds_copy_to_iov(const struct iovec *iov, size_t iovcnt,
+			       const void *data, uint32_t len)
+{
+	uint32_t size, left = len;
+	size_t i;
+
+	for (i = 0; i < iovcnt && left; i++) {
+		size = min_t(size_t, left, iov[i].iov_len);
+		memcpy(iov[i].iov_base, data, size);
+		data += size;
+		left -= size;
+	}
+	return len - left;
+}
+
+/*
+ * As for recvmmsg, the timeout is only checked after each message is
+ * received, so it does not bound the wait for the first one.
+ */
+static void rs_mmsg_deadline(struct timeval *end, struct timespec *timeout)
+{
+	gettimeofday(end, NULL);
+	end->tv_sec += timeout->tv_sec;
+	end->tv_usec += timeout->tv_nsec / 1000;
+	if (end->tv_usec >= 1000000) {
+		end->tv_sec++;
+		end->tv_usec -= 1000000;
+	}
+}
+
+static int rs_mmsg_expired(struct timeval *end)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return timercmp(&now, end, >=);
+}
+
+/*
+ * Receives are reposted to each QP as a single chain once the batch is
+ * reaped, rather than one post per datagram.  Any pending chain is
+ * posted before waiting for more data, so consumed buffers are never
+ * held back from the QP while blocked.  If a post fails, the messages
+ * already received are returned, as with recvmmsg.
+ */
+static int ds_recvmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags, struct timespec *timeout)
+{
+	struct ibv_recv_wr wr[DS_MMSG_BATCH];
+	struct ibv_sge sge[DS_MMSG_BATCH][2];
+	struct timeval end;
+	struct ds_qp *qp = NULL;
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	struct msghdr *mh;
+	unsigned int cnt = 0;
+	uint32_t len;
+	int n = 0, nonblock, ret = 0;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	if (timeout)
+		rs_mmsg_deadline(&end, timeout);
+
+	nonblock = rs_nonblocking(rs, flags);
+	while (cnt < vlen) {
+		if (!rs_have_rdata(rs)) {
+			if (n) {
+				ret = ds_post_recv_list(qp, wr);
+				n = 0;
+				if (ret)
+					break;
+			}
+			ret = ds_get_comp(rs, nonblock, rs_have_rdata);
+			if (ret)
+				break;
+		}
+
+		rmsg = &rs->dmsg[rs->rmsg_head];
+		if (n && (rmsg->qp != qp || n == DS_MMSG_BATCH)) {
+			ret = ds_post_recv_list(qp, wr);
+			n = 0;
+			if (ret)
+				break;
+		}
+
+		hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+		len = rmsg->length - hdr->length;
+
+		mh = &msgvec[cnt].msg_hdr;
+		msgvec[cnt].msg_len = ds_copy_to_iov(mh->msg_iov, mh->msg_iovlen,
+						     (void *) hdr + hdr->length,
+						     len);
+		mh->msg_flags = (msgvec[cnt].msg_len < len) ? MSG_TRUNC : 0;
+		mh->msg_controllen = 0;
+		if (mh->msg_name)
+			ds_set_src(mh->msg_name, &mh->msg_namelen, hdr);
+		cnt++;
+
+		if (flags & MSG_PEEK)
+			break;
+
+		qp = rmsg->qp;
+		ds_init_recv_wr(rs, qp, rmsg->offset, &wr[n], sge[n]);
+		if (n)
+			wr[n - 1].next = &wr[n];
+		n++;
+
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+		rs->rqe_avail++;
+		rs->stats.bytes_recv += msgvec[cnt - 1].msg_len;
+
+		if (flags & MSG_WAITFORONE)
+			nonblock = 1;
+
+		if (timeout && rs_mmsg_expired(&end))
+			break;
+	}
+
+	if (n)
+		ret = ds_post_recv_list(qp, wr);
+
+	return cnt ? cnt : ret;
+}
+
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct rsocket *rs;
+	struct timeval end;
+	struct msghdr *mh;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvmmsg(rs, msgvec, vlen, flags, timeout);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	if (timeout)
+		rs_mmsg_deadline(&end, timeout);
+
+	for (i = 0; i < vlen; ) {
+		mh = &msgvec[i].msg_hdr;
+		if (mh->msg_control && mh->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		ret = rrecvv(socket, mh->msg_iov, (int) mh->msg_iovlen,
+			     flags & ~MSG_WAITFORONE);
+		if (ret <= 0)
+			break;
+
+		msgvec[i++].msg_len = ret;
+		mh->msg_flags = 0;
+		mh->msg_controllen = 0;
+		if ((flags & MSG_PEEK) || (timeout && rs_mmsg_expired(&end)))
+			break;
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+
+	return i ? i : ret;
 }
 
 ssize_t rread(int socket, void *buf, size_t count)
@@ -2541,9 +4393,10 @@ static int rs_send_iomaps(struct rsocket *rs, int flags)
 	struct rs_iomap iom;
 	int ret;
 
-	fastlock_acquire(&rs->map_lock);
+	rs_lock(rs, &rs->map_lock);
 	while (!dlist_empty(&rs->iomap_queue)) {
 		if (!rs_can_send(rs)) {
+			rs->stats.credit_stalls++;
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2597,7 +4450,7 @@ static int rs_send_iomaps(struct rsocket *rs, int flags)
 	}
 
 	rs->iomap_pending = !dlist_empty(&rs->iomap_queue);
-	fastlock_release(&rs->map_lock);
+	rs_unlock(rs, &rs->map_lock);
 	return ret;
 }
 
@@ -2680,19 +4533,168 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 	offset = (uint8_t *) msg - rs->sbuf;
 
 	ret = ds_post_send(rs, &sge, offset);
-	return ret ? ret : len;
+	if (ret)
+		return ret;
+
+	rs->stats.bytes_sent += len;
+	return len;
+}
+
+static int rs_mr_contains(struct ibv_mr *mr, const void *buf, size_t len)
+{
+	uintptr_t addr = (uintptr_t) buf;
+
+	return addr >= (uintptr_t) mr->addr &&
+	       addr + len <= (uintptr_t) mr->addr + mr->length;
+}
+
+/*
+ * Find the pooled buffer containing buf.  If it is not yet registered with
+ * pd, *mr is left NULL and *pbuf is set if there is room for the
+ * registration.  Caller must hold pool_mut.
+ */
+static void rs_find_pool_mr(struct ibv_pd *pd, const void *buf, size_t len,
+			    struct rs_pool_buf **pbuf, struct ibv_mr **mr)
+{
+	struct rs_pool_buf *p;
+	dlist_entry *entry;
+	int i;
+
+	*pbuf = NULL;
+	*mr = NULL;
+	for (entry = rs_pool_list.next; entry != &rs_pool_list;
+	     entry = entry->next) {
+		p = container_of(entry, struct rs_pool_buf, entry);
+		if ((uintptr_t) buf < (uintptr_t) p->buf ||
+		    (uintptr_t) buf + len > (uintptr_t) p->buf + p->len)
+			continue;
+
+		for (i = 0; i < p->mr_cnt; i++) {
+			if (p->mr[i]->pd == pd) {
+				*mr = p->mr[i];
+				return;
+			}
+		}
+
+		if (p->mr_cnt < RS_POOL_MR_CNT)
+			*pbuf = p;
+		return;
+	}
+}
+
+/*
+ * The registration is made without holding pool_mut, so that sends from
+ * other buffers are not held up.  The buffer is looked up again before
+ * the new MR is added, since another thread may have registered it with
+ * the same PD, or removed it, in the meantime.
+ */
+static struct ibv_mr *rs_get_pool_mr(struct rsocket *rs, const void *buf,
+				     size_t len)
+{
+	struct ibv_pd *pd = rs->cm_id->pd;
+	struct rs_pool_buf *pbuf;
+	struct ibv_mr *mr, *new_mr;
+	void *pool_addr;
+	size_t pool_len;
+
+	if (dlist_empty(&rs_pool_list) || !pd)
+		return NULL;
+
+	pthread_mutex_lock(&pool_mut);
+	rs_find_pool_mr(pd, buf, len, &pbuf, &mr);
+	if (mr || !pbuf) {
+		pthread_mutex_unlock(&pool_mut);
+		return mr;
+	}
+	pool_addr = pbuf->buf;
+	pool_len = pbuf->len;
+	pthread_mutex_unlock(&pool_mut);
+
+	new_mr = ibv_reg_mr(pd, pool_addr, pool_len, IBV_ACCESS_LOCAL_WRITE);
+	if (!new_mr)
+		return NULL;
+
+	pthread_mutex_lock(&pool_mut);
+	rs_find_pool_mr(pd, buf, len, &pbuf, &mr);
+	if (!mr && pbuf && pbuf->buf == pool_addr && pbuf->len == pool_len) {
+		pbuf->mr[pbuf->mr_cnt++] = new_mr;
+		mr = new_mr;
+		new_mr = NULL;
+	}
+	pthread_mutex_unlock(&pool_mut);
+
+	if (new_mr)
+		ibv_dereg_mr(new_mr);
+	return mr;
+}
+
+/*
+ * Buffers that the application registered, either with the process
+ * through rregister, or with the rsocket through riomap.  Memory mapped
+ * with riomap is only sent from in place for transfers of at least the
+ * RDMA_ZEROCOPY size.  So is pooled memory, or, if RDMA_ZEROCOPY is not
+ * set, for transfers larger than the send buffer.  Smaller transfers are
+ * copied, so that blocking calls need not wait for the peer.
+ */
+static struct ibv_mr *rs_get_local_mr(struct rsocket *rs, const void *buf,
+				      size_t len)
+{
+	struct rs_iomap_mr *iomr;
+	struct ibv_mr *mr = NULL;
+	dlist_entry *entry;
+
+	if (rs->zcopy_size && len >= rs->zcopy_size &&
+	    !dlist_empty(&rs->iomap_list)) {
+		rs_lock(rs, &rs->map_lock);
+		for (entry = rs->iomap_list.next; entry != &rs->iomap_list;
+		     entry = entry->next) {
+			iomr = container_of(entry, struct rs_iomap_mr, entry);
+			if (rs_mr_contains(iomr->mr, buf, len)) {
+				mr = iomr->mr;
+				break;
+			}
+		}
+		rs_unlock(rs, &rs->map_lock);
+		if (mr)
+			return mr;
+	}
+
+	if (rs->zcopy_size ? len < rs->zcopy_size : len <= rs->sbuf_size)
+		return NULL;
+
+	return rs_get_pool_mr(rs, buf, len);
+}
+
+/*
+ * Blocking sends may bypass the send buffer, with the data written directly
+ * from the user's buffer, but only from buffers that the application
+ * registered.  Registering any other buffer per send costs more than the
+ * copy for all but the largest transfers, and a registration cannot be
+ * kept, since we cannot tell if the application frees the buffer and maps
+ * new memory at the same address afterwards.
+ */
+static struct ibv_mr *rs_get_zcopy_mr(struct rsocket *rs, const void *buf,
+				      size_t len, int flags)
+{
+	if (rs_nonblocking(rs, flags) || len <= rs->sq_inline)
+		return NULL;
+
+	return rs_get_local_mr(rs, buf, len);
 }
 
 /*
  * We overlap sending the data, by posting a small work request immediately,
- * then increasing the size of the send on each iteration.
+ * then increasing the size of the send on each iteration.  Zero-copy sends
+ * write as much as the remote target buffer allows, then wait for the
+ * writes to complete, so that the user may reuse the buffer on return.
  */
 ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
 	struct ibv_sge sge;
+	struct ibv_mr *mr;
 	size_t left = len;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	uint32_t xfer_size;
 	int ret = 0;
 
 	rs = idm_at(&idm, socket);
@@ -2714,14 +4716,16 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		}
 	}
 
-	fastlock_acquire(&rs->slock);
+	rs_lock(rs, &rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
 			goto out;
 	}
+	mr = rs_get_zcopy_mr(rs, buf, len, flags);
 	for (; left; left -= xfer_size, buf += xfer_size) {
 		if (!rs_can_send(rs)) {
+			rs->stats.credit_stalls++;
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2732,20 +4736,19 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			}
 		}
 
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
-		}
+		xfer_size = mr ? left : rs_olap_size(rs, left);
 
 		if (xfer_size > rs->sbuf_bytes_avail)
 			xfer_size = rs->sbuf_bytes_avail;
 		if (xfer_size > rs->target_sgl[rs->target_sge].length)
 			xfer_size = rs->target_sgl[rs->target_sge].length;
 
-		if (xfer_size <= rs->sq_inline) {
+		if (mr) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = mr->lkey;
+			ret = rs_write_data(rs, &sge, 1, xfer_size, 0);
+		} else if (xfer_size <= rs->sq_inline) {
 			sge.addr = (uintptr_t) buf;
 			sge.length = xfer_size;
 			sge.lkey = 0;
@@ -2770,8 +4773,10 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (ret)
 			break;
 	}
+	if (mr && left != len)
+		rs_get_comp(rs, 0, rs_conn_all_sends_done);
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(rs, &rs->slock);
 
 	return (ret && left == len) ? ret : len - left;
 }
@@ -2831,12 +4836,34 @@ static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, siz
 	}
 }
 
+/*
+ * Send each iovec separately, so that large entries are transferred
+ * directly from the user's buffer.
+ */
+static ssize_t rs_sendv_zcopy(int socket, const struct iovec *iov, int iovcnt,
+			      int flags)
+{
+	ssize_t ret, len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		ret = rsend(socket, iov[i].iov_base, iov[i].iov_len, flags);
+		if (ret < 0)
+			return len ? len : ret;
+
+		len += ret;
+		if ((size_t) ret < iov[i].iov_len)
+			break;
+	}
+	return len;
+}
+
 static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
 {
 	struct rsocket *rs;
 	const struct iovec *cur_iov;
 	size_t left, len, offset = 0;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	uint32_t xfer_size;
 	int i, ret = 0;
 
 	rs = idm_at(&idm, socket);
@@ -2851,13 +4878,21 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		}
 	}
 
+	if (!rs_nonblocking(rs, flags)) {
+		for (i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len > rs->sq_inline &&
+			    rs_get_local_mr(rs, iov[i].iov_base, iov[i].iov_len))
+				return rs_sendv_zcopy(socket, iov, iovcnt, flags);
+		}
+	}
+
 	cur_iov = iov;
 	len = iov[0].iov_len;
 	for (i = 1; i < iovcnt; i++)
 		len += iov[i].iov_len;
 	left = len;
 
-	fastlock_acquire(&rs->slock);
+	rs_lock(rs, &rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
@@ -2865,6 +4900,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 	}
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
+			rs->stats.credit_stalls++;
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2875,13 +4911,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 			}
 		}
 
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
-		}
+		xfer_size = rs_olap_size(rs, left);
 
 		if (xfer_size > rs->sbuf_bytes_avail)
 			xfer_size = rs->sbuf_bytes_avail;
@@ -2912,7 +4942,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 			break;
 	}
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(rs, &rs->slock);
 
 	return (ret && left == len) ? ret : len - left;
 }
@@ -2925,31 +4955,170 @@ ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
 
-ssize_t rwrite(int socket, const void *buf, size_t count)
+/*
+ * Consecutive messages to destinations on the same QP are posted as a
+ * single chain of work requests.  The chain is flushed before waiting for
+ * send buffers, or before sending to a destination without an address
+ * handle, which goes through the UDP socket.
+ */
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
 {
-	return rsend(socket, buf, count, 0);
-}
+	struct ibv_send_wr wr[DS_MMSG_BATCH];
+	struct ibv_sge sge[DS_MMSG_BATCH];
+	const struct iovec *iov;
+	struct ds_qp *qp = NULL;
+	struct ds_smsg *msg;
+	struct msghdr *mh;
+	unsigned int i, cnt = 0;
+	size_t len, offset;
+	ssize_t sent;
+	int n = 0, ret = 0;
+
+	for (i = 0; i < vlen; i++) {
+		mh = &msgvec[i].msg_hdr;
+		if (mh->msg_control && mh->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
 
-ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
-{
-	return rsendv(socket, iov, iovcnt, 0);
-}
+		if (mh->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(mh->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, mh->msg_name,
+						  mh->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
+		}
 
-static struct pollfd *rs_fds_alloc(nfds_t nfds)
-{
-	static __thread struct pollfd *rfds;
-	static __thread nfds_t rnfds;
+		for (len = 0, offset = 0; offset < mh->msg_iovlen; offset++)
+			len += mh->msg_iov[offset].iov_len;
 
-	if (nfds > rnfds) {
-		if (rfds)
-			free(rfds);
+		if (n && (rs->conn_dest->qp != qp || !rs->conn_dest->ah ||
+			  !ds_can_send(rs) || n == DS_MMSG_BATCH)) {
+			ret = ds_post_send_list(rs, qp, wr, n);
+			cnt += ret;
+			if (ret != n) {
+				ret = -1;
+				n = 0;
+				break;
+			}
+			n = 0;
+		}
 
-		rfds = malloc(sizeof(*rfds) * nfds);
-		rnfds = rfds ? nfds : 0;
-	}
+		if (!rs->conn_dest->ah) {
+			sent = ds_sendv_udp(rs, mh->msg_iov, mh->msg_iovlen,
+					    flags, RS_OP_DATA);
+			if (sent < 0) {
+				ret = sent;
+				break;
+			}
+			msgvec[i].msg_len = sent;
+			cnt++;
+			continue;
+		}
 
-	return rfds;
-}
+		if (len + rs->conn_dest->qp->hdr.length > RS_SNDLOWAT) {
+			ret = ERR(EMSGSIZE);
+			break;
+		}
+
+		if (!ds_can_send(rs)) {
+			ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+			if (ret)
+				break;
+		}
+
+		msg = rs->smsg_free;
+		rs->smsg_free = msg->next;
+		rs->sqe_avail--;
+
+		qp = rs->conn_dest->qp;
+		memcpy((void *) msg, &qp->hdr, qp->hdr.length);
+		iov = mh->msg_iov;
+		offset = 0;
+		rs_copy_iov((void *) msg + qp->hdr.length, &iov, &offset, len);
+
+		sge[n].addr = (uintptr_t) msg;
+		sge[n].length = qp->hdr.length + len;
+		sge[n].lkey = qp->smr->lkey;
+		ds_init_send_wr(rs, &wr[n], &sge[n], (uint8_t *) msg - rs->sbuf);
+		if (n)
+			wr[n - 1].next = &wr[n];
+		n++;
+		msgvec[i].msg_len = len;
+	}
+
+	if (n) {
+		i = ds_post_send_list(rs, qp, wr, n);
+		cnt += i;
+		if (i != n)
+			ret = -1;
+	}
+
+	return cnt ? cnt : ret;
+}
+
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_STREAM) {
+		for (i = 0; i < vlen; i++) {
+			ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+			if (ret < 0)
+				break;
+			msgvec[i].msg_len = ret;
+		}
+		return i ? i : ret;
+	}
+
+	if (rs->state == rs_init) {
+		ret = ds_init_ep(rs);
+		if (ret)
+			return ret;
+	}
+
+	fastlock_acquire(&rs->slock);
+	ret = ds_sendmmsg(rs, msgvec, vlen, flags);
+	fastlock_release(&rs->slock);
+	return ret;
+}
+
+ssize_t rwrite(int socket, const void *buf, size_t count)
+{
+	return rsend(socket, buf, count, 0);
+}
+
+ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
+{
+	return rsendv(socket, iov, iovcnt, 0);
+}
+
+static struct pollfd *rs_fds_alloc(nfds_t nfds)
+{
+	static __thread struct pollfd *rfds;
+	static __thread nfds_t rnfds;
+
+	if (nfds > rnfds) {
+		if (rfds)
+			free(rfds);
+
+		rfds = malloc(sizeof(*rfds) * nfds);
+		rnfds = rfds ? nfds : 0;
+	}
+
+	return rfds;
+}
 
 static int rs_poll_rs(struct rsocket *rs, int events,
 		      int nonblock, int (*test)(struct rsocket *rs))
@@ -3050,7 +5219,7 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 
 			if (rs->type == SOCK_STREAM) {
 				if (rs->state >= rs_connected)
-					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
+					rfds[i].fd = rs_cq_channel(rs)->fd;
 				else
 					rfds[i].fd = rs->cm_id->channel->fd;
 			} else {
@@ -3063,168 +5232,890 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 		}
 		rfds[i].revents = 0;
 	}
-	return 0;
+	return 0;
+}
+
+static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (!rfds[i].revents)
+			continue;
+
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			rs_lock(rs, &rs->cq_wait_lock);
+			if (rs->type == SOCK_STREAM)
+				rs_get_cq_event(rs);
+			else
+				ds_get_cq_event(rs);
+			rs_unlock(rs, &rs->cq_wait_lock);
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		} else {
+			fds[i].revents = rfds[i].revents;
+		}
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
+}
+
+/* Spin for the largest budget of the rsockets being polled */
+static uint32_t rs_poll_spin_time(struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	uint32_t spin_time = 0;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs)
+			spin_time = max(spin_time, rs_spin_time(rs));
+	}
+	return spin_time;
+}
+
+static void rs_poll_record(struct pollfd *fds, nfds_t nfds, uint32_t wait,
+			   int slept)
+{
+	struct rsocket *rs;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (!fds[i].revents)
+			continue;
+
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs)
+			rs_poll_update(rs, wait, slept);
+	}
+}
+
+/*
+ * We need to poll *all* fd's that the user specifies at least once.
+ * Note that we may receive events on an rsocket that may not be reported
+ * to the user (e.g. connection events or credit updates).  Process those
+ * events, then return to polling until we find ones of interest.
+ */
+int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct timeval s;
+	struct pollfd *rfds;
+	uint32_t poll_time = 0, spin_time;
+	int ret;
+
+	spin_time = rs_poll_spin_time(fds, nfds);
+	do {
+		ret = rs_poll_check(fds, nfds);
+		if (ret || !timeout) {
+			if (ret > 0 && timeout)
+				rs_poll_record(fds, nfds, poll_time, 0);
+			return ret;
+		}
+
+		if (!poll_time)
+			gettimeofday(&s, NULL);
+
+		poll_time = rs_wait_time(&s);
+	} while (poll_time <= spin_time);
+
+	rfds = rs_fds_alloc(nfds);
+	if (!rfds)
+		return ERR(ENOMEM);
+
+	do {
+		ret = rs_poll_arm(rfds, fds, nfds);
+		if (ret)
+			break;
+
+		ret = poll(rfds, nfds, timeout);
+		if (ret <= 0)
+			break;
+
+		ret = rs_poll_events(rfds, fds, nfds);
+	} while (!ret);
+
+	if (ret > 0)
+		rs_poll_record(fds, nfds, rs_wait_time(&s), 1);
+	return ret;
+}
+
+static struct pollfd *
+rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	struct pollfd *fds;
+	int fd, i = 0;
+
+	fds = calloc(*nfds, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (fd = 0; fd < *nfds; fd++) {
+		if (readfds && FD_ISSET(fd, readfds)) {
+			fds[i].fd = fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
+
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
+
+		if (fds[i].fd)
+			i++;
+	}
+
+	*nfds = i;
+	return fds;
+}
+
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
+
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
+
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+}
+
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
+{
+	struct pollfd *fds;
+	int ret;
+
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
+
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+
+	free(fds);
+	return ret;
+}
+
+/****************************************************************************
+ * repoll
+ ****************************************************************************/
+
+static struct epoll_event *rs_epoll_events_alloc(int maxevents)
+{
+	static __thread struct epoll_event *kevents;
+	static __thread int nkevents;
+
+	if (maxevents > nkevents) {
+		if (kevents)
+			free(kevents);
+
+		kevents = malloc(sizeof(*kevents) * maxevents);
+		nkevents = kevents ? maxevents : 0;
+	}
+
+	return kevents;
+}
+
+/* Caller must hold ep->lock */
+static void rs_epoll_queue(struct rs_epoll_item *item)
+{
+	uint64_t val = 1;
+	ssize_t rc;
+
+	if (item->queued)
+		return;
+
+	dlist_insert_tail(&item->ready, &item->ep->ready_list);
+	item->queued = 1;
+	if (item->ep->waiters) {
+		rc = write(item->ep->evfd, &val, sizeof val);
+		(void) rc;
+	}
+}
+
+/*
+ * Called when rsocket state changes outside of repoll_wait in a way that
+ * the kernel will not report through the rsocket's wait fd, for example
+ * when a blocking call consumes a CQ event.  Queue the rsocket to be
+ * rechecked, and rearmed if needed, by the next repoll_wait.
+ */
+static void rs_epoll_signal(struct rsocket *rs)
+{
+	struct rs_epoll_item *item;
+
+	if (!rs->epoll_item || rs_epoll_busy)
+		return;
+
+	pthread_mutex_lock(&epoll_mut);
+	item = rs->epoll_item;
+	if (item) {
+		pthread_mutex_lock(&item->ep->lock);
+		rs_epoll_queue(item);
+		pthread_mutex_unlock(&item->ep->lock);
+	}
+	pthread_mutex_unlock(&epoll_mut);
+}
+
+static int rs_epoll_wait_fd(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+
+	return (rs->state >= rs_connected) ?
+		rs->cm_id->recv_cq_channel->fd : rs->cm_id->channel->fd;
+}
+
+/*
+ * The fd that an rsocket waits on changes as a connection is established.
+ * Make sure the kernel epoll set is tracking the current one.
+ */
+static int rs_epoll_get_cq(struct rs_epoll_item *item)
+{
+	struct rs_epoll *ep = item->ep;
+	struct rs_cq *scq = item->rs->scq;
+	struct rs_epoll_cq *ecq;
+	struct epoll_event event;
+	dlist_entry *entry;
+
+	if (item->cq)
+		return 0;
+
+	if (item->wait_fd >= 0) {
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+		item->wait_fd = -1;
+	}
+
+	for (entry = ep->cq_list.next; entry != &ep->cq_list; entry = entry->next) {
+		ecq = container_of(entry, struct rs_epoll_cq, item.list);
+		if (ecq->scq == scq)
+			goto found;
+	}
+
+	ecq = calloc(1, sizeof(*ecq));
+	if (!ecq)
+		return ERR(ENOMEM);
+
+	ecq->item.ep = ep;
+	ecq->item.fd = -1;
+	ecq->item.wait_fd = scq->channel->fd;
+	ecq->item.cq = ecq;
+	ecq->scq = scq;
+	ecq->evfd = eventfd(0, EFD_NONBLOCK);
+	if (ecq->evfd < 0)
+		goto err1;
+
+	event.events = EPOLLIN;
+	event.data.ptr = &ecq->item;
+	if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ecq->evfd, &event))
+		goto err2;
+	if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, scq->channel->fd, &event))
+		goto err3;
+
+	pthread_mutex_lock(&scq->lock);
+	dlist_insert_tail(&ecq->entry, &scq->notify_list);
+	pthread_mutex_unlock(&scq->lock);
+	dlist_insert_tail(&ecq->item.list, &ep->cq_list);
+found:
+	ecq->refcnt++;
+	item->cq = ecq;
+	return 0;
+
+err3:
+	epoll_ctl(ep->epfd, EPOLL_CTL_DEL, ecq->evfd, NULL);
+err2:
+	close(ecq->evfd);
+err1:
+	free(ecq);
+	return -1;
+}
+
+/* Caller must hold ep->lock */
+static void rs_epoll_put_cq(struct rs_epoll_cq *ecq)
+{
+	struct rs_epoll *ep = ecq->item.ep;
+
+	if (--ecq->refcnt)
+		return;
+
+	pthread_mutex_lock(&ecq->scq->lock);
+	dlist_remove(&ecq->entry);
+	pthread_mutex_unlock(&ecq->scq->lock);
+
+	epoll_ctl(ep->epfd, EPOLL_CTL_DEL, ecq->item.wait_fd, NULL);
+	epoll_ctl(ep->epfd, EPOLL_CTL_DEL, ecq->evfd, NULL);
+	close(ecq->evfd);
+	ecq->item.cq = NULL;
+
+	dlist_remove(&ecq->item.list);
+	if (ep->waiters)
+		dlist_insert_tail(&ecq->item.list, &ep->free_list);
+	else
+		free(ecq);
+}
+
+/*
+ * Retrieve any event on the shared CQ and hand out its completions, then
+ * queue every rsocket in the set that received completions to be checked.
+ * Only the rsockets that received completions are visited.  Those that
+ * this set does not watch through the CQ are left for their own set to
+ * report.  Caller must hold ep->lock.
+ */
+static void rs_epoll_cq_event(struct rs_epoll *ep, struct rs_epoll_cq *ecq)
+{
+	struct rs_cq *scq = ecq->scq;
+	struct rs_epoll_item *item;
+	struct rsocket *rs;
+	dlist_entry *entry;
+	uint64_t val;
+	ssize_t rc;
+
+	pthread_mutex_lock(&scq->lock);
+	if (!scq->leader)
+		rs_scq_get_event(scq);
+	rs_scq_poll(scq, NULL);
+	if (ecq->signaled) {
+		rc = read(ecq->evfd, &val, sizeof val);
+		(void) rc;
+		ecq->signaled = 0;
+	}
+
+	entry = scq->wc_notify_list.next;
+	while (entry != &scq->wc_notify_list) {
+		rs = container_of(entry, struct rsocket, wc_notify_entry);
+		entry = entry->next;
+		item = rs->epoll_item;
+		if (item && (item->ep != ep || item->cq != ecq))
+			continue;
+
+		dlist_remove(&rs->wc_notify_entry);
+		rs->wc_notify = 0;
+		if (item)
+			rs_epoll_queue(item);
+	}
+	pthread_mutex_unlock(&scq->lock);
+}
+
+static int rs_epoll_update(struct rs_epoll_item *item)
+{
+	struct epoll_event event;
+	int fd, ret;
+
+	if (item->rs->type == SOCK_STREAM && item->rs->state >= rs_connected &&
+	    item->rs->scq)
+		return rs_epoll_get_cq(item);
+
+	fd = rs_epoll_wait_fd(item->rs);
+	if (fd == item->wait_fd)
+		return 0;
+
+	if (item->wait_fd >= 0)
+		epoll_ctl(item->ep->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+
+	event.events = EPOLLIN;
+	event.data.ptr = item;
+	ret = epoll_ctl(item->ep->epfd, EPOLL_CTL_ADD, fd, &event);
+	item->wait_fd = ret ? -1 : fd;
+	return ret;
+}
+
+/*
+ * Process any events reported on the rsocket's wait fd, then check the
+ * rsocket, arming its CQ(s) if no events are pending.  This is the same
+ * sequence rpoll performs, applied to a single rsocket.
+ */
+static uint32_t rs_epoll_check_rs(struct rs_epoll_item *item)
+{
+	struct rsocket *rs = item->rs;
+	uint32_t events;
+	int revents;
+
+	if (item->signaled) {
+		item->signaled = 0;
+		rs_lock(rs, &rs->cq_wait_lock);
+		if (rs->type == SOCK_STREAM)
+			rs_get_cq_event(rs);
+		else
+			ds_get_cq_event(rs);
+		rs_unlock(rs, &rs->cq_wait_lock);
+	}
+
+	events = item->event.events & (EPOLLIN | EPOLLOUT | EPOLLPRI);
+	revents = rs_poll_rs(rs, events, 0, rs_is_cq_armed);
+	if (!revents)
+		rs_epoll_update(item);
+
+	return (uint32_t) revents & (events | EPOLLERR | EPOLLHUP);
+}
+
+/* Caller must hold ep->lock */
+static int rs_epoll_process(struct rs_epoll *ep, struct epoll_event *kevents,
+			    int nkevents, struct epoll_event *events,
+			    int maxevents)
+{
+	struct rs_epoll_item *item;
+	dlist_entry requeue;
+	uint32_t revents;
+	uint64_t val;
+	ssize_t rc;
+	int i, cnt = 0;
+
+	for (i = 0; i < nkevents; i++) {
+		item = kevents[i].data.ptr;
+		if (!item) {
+			rc = read(ep->evfd, &val, sizeof val);
+			(void) rc;
+		} else if (item->cq && !item->rs) {
+			rs_epoll_cq_event(ep, item->cq);
+		} else if (item->fd < 0) {
+			continue;
+		} else if (!item->rs) {
+			events[cnt].events = kevents[i].events;
+			events[cnt++].data = item->event.data;
+		} else {
+			item->signaled = 1;
+			rs_epoll_queue(item);
+		}
+	}
+
+	dlist_init(&requeue);
+	while (cnt < maxevents && !dlist_empty(&ep->ready_list)) {
+		item = container_of(ep->ready_list.next,
+				    struct rs_epoll_item, ready);
+		dlist_remove(&item->ready);
+		item->queued = 0;
+		if (item->disabled)
+			continue;
+
+		revents = rs_epoll_check_rs(item);
+		if (!revents)
+			continue;
+
+		events[cnt].events = revents;
+		events[cnt++].data = item->event.data;
+		if (item->event.events & EPOLLONESHOT) {
+			item->disabled = 1;
+		} else if (!(item->event.events & EPOLLET)) {
+			dlist_insert_tail(&item->ready, &requeue);
+			item->queued = 1;
+		}
+	}
+
+	while (!dlist_empty(&requeue)) {
+		item = container_of(requeue.next, struct rs_epoll_item, ready);
+		dlist_remove(&item->ready);
+		dlist_insert_tail(&item->ready, &ep->ready_list);
+	}
+	return cnt;
+}
+
+static void rs_epoll_free_items(dlist_entry *list)
+{
+	struct rs_epoll_item *item;
+
+	while (!dlist_empty(list)) {
+		item = container_of(list->next, struct rs_epoll_item, list);
+		dlist_remove(&item->list);
+		free(item);
+	}
+}
+
+/* A repoll set spins for the largest budget of its rsockets */
+static void rs_epoll_set_poll_time(struct rs_epoll *ep)
+{
+	struct rs_epoll_item *item;
+	dlist_entry *entry;
+
+	ep->poll_time = 0;
+	for (entry = ep->item_list.next; entry != &ep->item_list;
+	     entry = entry->next) {
+		item = container_of(entry, struct rs_epoll_item, list);
+		if (item->rs)
+			ep->poll_time = max(ep->poll_time, item->rs->poll_budget);
+	}
+}
+
+/*
+ * Another thread may have retrieved a kernel event that references an
+ * item before the item was removed.  Items are only freed once no thread
+ * is processing kernel events.  Caller must hold ep->lock.
+ */
+static void rs_epoll_del(struct rs_epoll_item *item)
+{
+	struct rs_epoll *ep = item->ep;
+	int reset = 0;
+
+	idm_clear(&ep->items, item->fd);
+	if (item->rs) {
+		reset = (item->rs->poll_budget == ep->poll_time);
+		item->rs->epoll_item = NULL;
+		if (item->wait_fd >= 0)
+			epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+		if (item->cq) {
+			rs_epoll_put_cq(item->cq);
+			item->cq = NULL;
+		}
+		item->rs = NULL;
+	} else {
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+	}
+
+	if (item->queued) {
+		dlist_remove(&item->ready);
+		item->queued = 0;
+	}
+	item->fd = -1;
+
+	dlist_remove(&item->list);
+	if (ep->waiters)
+		dlist_insert_tail(&item->list, &ep->free_list);
+	else
+		free(item);
+
+	if (reset)
+		rs_epoll_set_poll_time(ep);
+}
+
+/*
+ * An rsocket has a single item, to which rs_epoll_signal and shared CQ
+ * completions are directed, so it can only belong to one set.
+ */
+static int rs_epoll_add(struct rs_epoll *ep, int fd, struct rsocket *rs,
+			struct epoll_event *event)
+{
+	struct rs_epoll_item *item;
+	struct epoll_event kevent;
+	int ret;
+
+	if (rs && rs->epoll_item)
+		return ERR(EBUSY);
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
+
+	item->ep = ep;
+	item->rs = rs;
+	item->fd = fd;
+	item->wait_fd = -1;
+	item->event = *event;
+	if (idm_set(&ep->items, fd, item) < 0) {
+		free(item);
+		return -1;
+	}
+
+	if (rs) {
+		ret = rs_epoll_update(item);
+	} else {
+		kevent.events = event->events;
+		kevent.data.ptr = item;
+		ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &kevent);
+	}
+	if (ret) {
+		idm_clear(&ep->items, fd);
+		free(item);
+		return ret;
+	}
+
+	dlist_insert_tail(&item->list, &ep->item_list);
+	if (rs) {
+		rs->epoll_item = item;
+		rs_epoll_queue(item);
+		ep->poll_time = max(ep->poll_time, rs->poll_budget);
+	}
+	return 0;
+}
+
+static int rs_epoll_mod(struct rs_epoll_item *item, struct epoll_event *event)
+{
+	struct epoll_event kevent;
+
+	item->event = *event;
+	item->disabled = 0;
+	if (item->rs) {
+		rs_epoll_queue(item);
+		return 0;
+	}
+
+	kevent.events = event->events;
+	kevent.data.ptr = item;
+	return epoll_ctl(item->ep->epfd, EPOLL_CTL_MOD, item->fd, &kevent);
 }
 
-static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+static void rs_epoll_remove(struct rsocket *rs)
 {
-	struct rsocket *rs;
-	int i, cnt = 0;
+	struct rs_epoll *ep;
 
-	for (i = 0; i < nfds; i++) {
-		if (!rfds[i].revents)
-			continue;
+	if (!rs->epoll_item)
+		return;
 
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			fastlock_acquire(&rs->cq_wait_lock);
-			if (rs->type == SOCK_STREAM)
-				rs_get_cq_event(rs);
-			else
-				ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		} else {
-			fds[i].revents = rfds[i].revents;
-		}
-		if (fds[i].revents)
-			cnt++;
+	pthread_mutex_lock(&epoll_mut);
+	if (rs->epoll_item) {
+		ep = rs->epoll_item->ep;
+		pthread_mutex_lock(&ep->lock);
+		rs_epoll_del(rs->epoll_item);
+		pthread_mutex_unlock(&ep->lock);
 	}
-	return cnt;
+	pthread_mutex_unlock(&epoll_mut);
 }
 
-/*
- * We need to poll *all* fd's that the user specifies at least once.
- * Note that we may receive events on an rsocket that may not be reported
- * to the user (e.g. connection events or credit updates).  Process those
- * events, then return to polling until we find ones of interest.
- */
-int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+static void rs_epoll_free(struct rs_epoll *ep)
 {
-	struct timeval s, e;
-	struct pollfd *rfds;
-	uint32_t poll_time = 0;
-	int ret;
-
-	do {
-		ret = rs_poll_check(fds, nfds);
-		if (ret || !timeout)
-			return ret;
+	int i;
 
-		if (!poll_time)
-			gettimeofday(&s, NULL);
+	if (ep->evfd >= 0)
+		close(ep->evfd);
+	if (ep->epfd >= 0)
+		close(ep->epfd);
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+	for (i = 0; i < IDX_ARRAY_SIZE; i++)
+		free(ep->items.array[i]);
 
-	rfds = rs_fds_alloc(nfds);
-	if (!rfds)
-		return ERR(ENOMEM);
+	pthread_mutex_destroy(&ep->lock);
+	free(ep);
+}
 
-	do {
-		ret = rs_poll_arm(rfds, fds, nfds);
-		if (ret)
-			break;
+static int rs_epoll_close(int epfd)
+{
+	struct rs_epoll *ep;
 
-		ret = poll(rfds, nfds, timeout);
-		if (ret <= 0)
-			break;
+	pthread_mutex_lock(&mut);
+	ep = idm_lookup(&epidm, epfd);
+	if (ep)
+		idm_clear(&epidm, epfd);
+	pthread_mutex_unlock(&mut);
+	if (!ep)
+		return EBADF;
 
-		ret = rs_poll_events(rfds, fds, nfds);
-	} while (!ret);
+	pthread_mutex_lock(&epoll_mut);
+	pthread_mutex_lock(&ep->lock);
+	while (!dlist_empty(&ep->item_list))
+		rs_epoll_del(container_of(ep->item_list.next,
+					  struct rs_epoll_item, list));
+	rs_epoll_free_items(&ep->free_list);
+	pthread_mutex_unlock(&ep->lock);
+	pthread_mutex_unlock(&epoll_mut);
 
-	return ret;
+	rs_epoll_free(ep);
+	return 0;
 }
 
-static struct pollfd *
-rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+int repoll_create(int size)
 {
-	struct pollfd *fds;
-	int fd, i = 0;
+	struct rs_epoll *ep;
+	struct epoll_event event;
+	int ret;
 
-	fds = calloc(*nfds, sizeof(*fds));
-	if (!fds)
-		return NULL;
+	if (size <= 0)
+		return ERR(EINVAL);
 
-	for (fd = 0; fd < *nfds; fd++) {
-		if (readfds && FD_ISSET(fd, readfds)) {
-			fds[i].fd = fd;
-			fds[i].events = POLLIN;
-		}
+	rs_configure();
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return ERR(ENOMEM);
 
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
-		}
+	pthread_mutex_init(&ep->lock, NULL);
+	dlist_init(&ep->item_list);
+	dlist_init(&ep->ready_list);
+	dlist_init(&ep->free_list);
+	dlist_init(&ep->cq_list);
+	ep->evfd = -1;
 
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
+	ep->epfd = epoll_create(size);
+	if (ep->epfd < 0)
+		goto err;
 
-		if (fds[i].fd)
-			i++;
+	ep->evfd = eventfd(0, EFD_NONBLOCK);
+	if (ep->evfd < 0)
+		goto err;
+
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->evfd, &event))
+		goto err;
+
+	pthread_mutex_lock(&mut);
+	ret = idm_set(&epidm, ep->epfd, ep);
+	pthread_mutex_unlock(&mut);
+	if (ret < 0)
+		goto err;
+
+	return ep->epfd;
+
+err:
+	ret = errno;
+	rs_epoll_free(ep);
+	return ERR(ret);
+}
+
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct rs_epoll *ep;
+	struct rs_epoll_item *item;
+	struct rsocket *rs;
+	int ret;
+
+	ep = idm_lookup(&epidm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+	if (fd == epfd)
+		return ERR(EINVAL);
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	rs = idm_lookup(&idm, fd);
+	pthread_mutex_lock(&epoll_mut);
+	pthread_mutex_lock(&ep->lock);
+	item = idm_lookup(&ep->items, fd);
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		ret = item ? ERR(EEXIST) : rs_epoll_add(ep, fd, rs, event);
+		break;
+	case EPOLL_CTL_MOD:
+		ret = item ? rs_epoll_mod(item, event) : ERR(ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		if (item)
+			rs_epoll_del(item);
+		ret = item ? 0 : ERR(ENOENT);
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
 	}
+	pthread_mutex_unlock(&ep->lock);
+	pthread_mutex_unlock(&epoll_mut);
+	return ret;
+}
 
-	*nfds = i;
-	return fds;
+/* Milliseconds left until end, rounded up */
+static int rs_epoll_time_left(struct timeval *end)
+{
+	struct timeval now, left;
+
+	gettimeofday(&now, NULL);
+	if (!timercmp(&now, end, <))
+		return 0;
+
+	timersub(end, &now, &left);
+	return left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
 }
 
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
+/*
+ * A wakeup may only carry events that are not reported to the user (e.g.
+ * credit updates), so we keep waiting until we find events of interest,
+ * the timeout expires, or the caller asked not to block.  Each wait is
+ * limited to the time left before the original timeout.
+ */
+static int rs_epoll_wait(struct rs_epoll *ep, struct epoll_event *events,
+			 int maxevents, int timeout)
 {
-	int i, cnt = 0;
+	struct epoll_event *kevents;
+	struct timeval end;
+	int ret, cnt, to, left = timeout;
 
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
-		}
+	kevents = rs_epoll_events_alloc(maxevents);
+	if (!kevents)
+		return ERR(ENOMEM);
 
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
-			cnt++;
+	if (timeout > 0) {
+		gettimeofday(&end, NULL);
+		end.tv_sec += timeout / 1000;
+		end.tv_usec += (timeout % 1000) * 1000;
+		if (end.tv_usec >= 1000000) {
+			end.tv_sec++;
+			end.tv_usec -= 1000000;
 		}
+	}
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
+	do {
+		if (timeout > 0)
+			left = rs_epoll_time_left(&end);
+
+		pthread_mutex_lock(&ep->lock);
+		to = dlist_empty(&ep->ready_list) ? left : 0;
+		ep->waiters++;
+		pthread_mutex_unlock(&ep->lock);
+
+		ret = epoll_wait(ep->epfd, kevents, maxevents, to);
+
+		pthread_mutex_lock(&ep->lock);
+		cnt = 0;
+		if (ret >= 0) {
+			rs_epoll_busy = 1;
+			cnt = rs_epoll_process(ep, kevents, ret, events, maxevents);
+			rs_epoll_busy = 0;
 		}
-	}
-	return cnt;
-}
+		if (!--ep->waiters)
+			rs_epoll_free_items(&ep->free_list);
+		pthread_mutex_unlock(&ep->lock);
 
-static int rs_convert_timeout(struct timeval *timeout)
-{
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+		if (ret < 0)
+			return ret;
+	} while (!cnt && left && (ret || !to));
+
+	return cnt;
 }
 
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-	struct pollfd *fds;
+	struct rs_epoll *ep;
+	struct timeval s;
+	uint32_t poll_time = 0;
 	int ret;
 
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
-		return ERR(ENOMEM);
+	ep = idm_lookup(&epidm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+	if (maxevents <= 0)
+		return ERR(EINVAL);
 
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+	do {
+		ret = rs_epoll_wait(ep, events, maxevents, 0);
+		if (ret || !timeout)
+			return ret;
 
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
+		if (!poll_time)
+			gettimeofday(&s, NULL);
 
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+		poll_time = rs_wait_time(&s);
+	} while (poll_time <= ep->poll_time);
 
-	free(fds);
-	return ret;
+	return rs_epoll_wait(ep, events, maxevents, timeout);
 }
 
 /*
@@ -3241,7 +6132,7 @@ int rshutdown(int socket, int how)
 	if (!rs)
 		return ERR(EBADF);
 	if (rs->opts & RS_OPT_SVC_ACTIVE)
-		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_TCP);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
@@ -3281,7 +6172,7 @@ out:
 
 	if (rs->state & rs_disconnected) {
 		/* Generate event by flushing receives to unblock rpoll */
-		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+		ibv_req_notify_cq(rs_cq(rs), 0);
 		ucma_shutdown(rs->cm_id);
 	}
 
@@ -3291,7 +6182,7 @@ out:
 static void ds_shutdown(struct rsocket *rs)
 {
 	if (rs->opts & RS_OPT_SVC_ACTIVE)
-		rs_notify_svc(&udp_svc, rs, RS_SVC_REM_DGRAM);
+		rs_notify_svc(udp_svc_get(rs), rs, RS_SVC_REM_DGRAM);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
@@ -3309,12 +6200,12 @@ int rclose(int socket)
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
-		return EBADF;
+		return rs_epoll_close(socket);
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
 		else if (rs->opts & RS_OPT_SVC_ACTIVE)
-			rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+			rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_TCP);
 	} else {
 		ds_shutdown(rs);
 	}
@@ -3372,8 +6263,8 @@ static int rs_set_keepalive(struct rsocket *rs, int on)
 	FILE *f;
 	int ret;
 
-	if ((on && (rs->opts & RS_OPT_SVC_ACTIVE)) ||
-	    (!on && !(rs->opts & RS_OPT_SVC_ACTIVE)))
+	if ((on && (rs->opts & RS_OPT_KEEPALIVE)) ||
+	    (!on && !(rs->opts & RS_OPT_KEEPALIVE)))
 		return 0;
 
 	if (on) {
@@ -3433,6 +6324,11 @@ int rsetsockopt(int socket, int level, int optname,
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
 			ret = 0;
 			break;
+		case SO_BUSY_POLL:
+			rs->poll_budget = *(uint32_t *) optval;
+			opts = NULL;
+			ret = 0;
+			break;
 		case SO_SNDBUF:
 			if (!rs->sbuf)
 				rs->sbuf_size = (*(uint32_t *) optval) << 1;
@@ -3447,7 +6343,7 @@ int rsetsockopt(int socket, int level, int optname,
 			break;
 		case SO_KEEPALIVE:
 			ret = rs_set_keepalive(rs, *(int *) optval);
-			opt_on = rs->opts & RS_OPT_SVC_ACTIVE;
+			opt_on = rs->opts & RS_OPT_KEEPALIVE;
 			break;
 		case SO_OOBINLINE:
 			opt_on = *(int *) optval;
@@ -3470,7 +6366,7 @@ int rsetsockopt(int socket, int level, int optname,
 				break;
 			}
 			rs->keepalive_time = *(int *) optval;
-			ret = (rs->opts & RS_OPT_SVC_ACTIVE) ?
+			ret = (rs->opts & RS_OPT_KEEPALIVE) ?
 			      rs_notify_svc(&tcp_svc, rs, RS_SVC_MOD_KEEPALIVE) : 0;
 			break;
 		case TCP_NODELAY:
@@ -3500,6 +6396,39 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
+		if (optname == RDMA_ZEROCOPY) {
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+				break;
+			}
+			rs_lock(rs, &rs->slock);
+			rs->zcopy_size = *(uint32_t *) optval;
+			rs_unlock(rs, &rs->slock);
+			ret = 0;
+			break;
+		} else if (optname == RDMA_SINGLETHREAD) {
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+				break;
+			}
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_SINGLE_THREAD;
+			else
+				rs->opts &= ~RS_OPT_SINGLE_THREAD;
+			ret = 0;
+			break;
+		} else if (optname == RDMA_MAXXFER) {
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+				break;
+			}
+			rs->max_xfer = *(uint32_t *) optval;
+			if (rs->max_xfer && rs->max_xfer < RS_OLAP_START_SIZE)
+				rs->max_xfer = RS_OLAP_START_SIZE;
+			ret = 0;
+			break;
+		}
+
 		if (rs->state >= rs_opening) {
 			ret = ERR(EINVAL);
 			break;
@@ -3526,6 +6455,32 @@ int rsetsockopt(int socket, int level, int optname,
 				(uint8_t) rs_value_to_scale(*(int *) optval, 8), 8);
 			ret = 0;
 			break;
+		case RDMA_SHAREDCQ:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+			} else if (*(uint32_t *) optval > RS_CQ_SHARE_THREAD) {
+				ret = ERR(EINVAL);
+			} else {
+				rs->cq_share = *(uint32_t *) optval;
+				ret = 0;
+			}
+			break;
+		case RDMA_SHAREDRQ:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+			} else {
+				rs->srq_mode = !!*(int *) optval;
+				ret = 0;
+			}
+			break;
+		case RDMA_IONOTIFY:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(ENOTSUP);
+			} else {
+				rs->io_notify = !!*(int *) optval;
+				ret = 0;
+			}
+			break;
 		case RDMA_ROUTE:
 			if ((rs->optval = malloc(optlen))) {
 				memcpy(rs->optval, optval, optlen);
@@ -3606,6 +6561,10 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->sbuf_size;
 			*optlen = sizeof(int);
 			break;
+		case SO_BUSY_POLL:
+			*((int *) optval) = rs->poll_budget;
+			*optlen = sizeof(int);
+			break;
 		case SO_LINGER:
 			/* Value is inverted so default so_opt = 0 is on */
 			((struct linger *) optval)->l_onoff =
@@ -3677,6 +6636,62 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->target_iomap_size;
 			*optlen = sizeof(int);
 			break;
+		case RDMA_ZEROCOPY:
+			*((int *) optval) = rs->type == SOCK_STREAM ?
+					    rs->zcopy_size : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_MAXXFER:
+			*((int *) optval) = rs->type == SOCK_STREAM ?
+					    rs->max_xfer : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_SHAREDCQ:
+			*((int *) optval) = rs->type == SOCK_STREAM ?
+					    rs->cq_share : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_SHAREDRQ:
+			*((int *) optval) = rs->type == SOCK_STREAM ?
+					    rs->srq_mode : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_SINGLETHREAD:
+			*((int *) optval) = !!(rs->opts & RS_OPT_SINGLE_THREAD);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_IONOTIFY:
+			*((int *) optval) = rs->type == SOCK_STREAM ?
+					    rs->io_notify : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_STATS:
+			if (*optlen < sizeof(struct rsocket_stats)) {
+				ret = EINVAL;
+			} else {
+				memcpy(optval, &rs->stats, sizeof(rs->stats));
+				*optlen = sizeof(struct rsocket_stats);
+			}
+			break;
+		case RDMA_PROCSTATS:
+			if (*optlen < sizeof(struct rsocket_stats)) {
+				ret = EINVAL;
+			} else {
+				rs_get_proc_stats(optval);
+				*optlen = sizeof(struct rsocket_stats);
+			}
+			break;
+		case RDMA_POLLSTATS:
+			if (*optlen < sizeof(struct rsocket_poll_stats)) {
+				ret = EINVAL;
+			} else {
+				((struct rsocket_poll_stats *) optval)->spin_hits =
+					rs->stats.spin_hits;
+				((struct rsocket_poll_stats *) optval)->sleeps =
+					rs->stats.sleeps;
+				*optlen = sizeof(struct rsocket_poll_stats);
+			}
+			break;
 		case RDMA_ROUTE:
 			if (rs->optval) {
 				if (*optlen < rs->optlen) {
@@ -3789,7 +6804,7 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 	if (!rs->cm_id->pd || (prot & ~(PROT_WRITE | PROT_NONE)))
 		return ERR(EINVAL);
 
-	fastlock_acquire(&rs->map_lock);
+	rs_lock(rs, &rs->map_lock);
 	if (prot & PROT_WRITE) {
 		iomr = rs_get_iomap_mr(rs);
 		access |= IBV_ACCESS_REMOTE_WRITE;
@@ -3822,7 +6837,7 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 		dlist_insert_tail(&iomr->entry, &rs->iomap_list);
 	}
 out:
-	fastlock_release(&rs->map_lock);
+	rs_unlock(rs, &rs->map_lock);
 	return offset;
 }
 
@@ -3836,7 +6851,7 @@ int riounmap(int socket, void *buf, size_t len)
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
-	fastlock_acquire(&rs->map_lock);
+	rs_lock(rs, &rs->map_lock);
 
 	for (entry = rs->iomap_list.next; entry != &rs->iomap_list;
 	     entry = entry->next) {
@@ -3857,10 +6872,53 @@ int riounmap(int socket, void *buf, size_t len)
 	}
 	ret = ERR(EINVAL);
 out:
-	fastlock_release(&rs->map_lock);
+	rs_unlock(rs, &rs->map_lock);
 	return ret;
 }
 
+int rregister(void *buf, size_t len)
+{
+	struct rs_pool_buf *pbuf;
+
+	if (!buf || !len)
+		return ERR(EINVAL);
+
+	pbuf = calloc(1, sizeof(*pbuf));
+	if (!pbuf)
+		return ERR(ENOMEM);
+
+	pbuf->buf = buf;
+	pbuf->len = len;
+	pthread_mutex_lock(&pool_mut);
+	dlist_insert_tail(&pbuf->entry, &rs_pool_list);
+	pthread_mutex_unlock(&pool_mut);
+	return 0;
+}
+
+int rderegister(void *buf, size_t len)
+{
+	struct rs_pool_buf *pbuf;
+	dlist_entry *entry;
+	int i;
+
+	pthread_mutex_lock(&pool_mut);
+	for (entry = rs_pool_list.next; entry != &rs_pool_list;
+	     entry = entry->next) {
+		pbuf = container_of(entry, struct rs_pool_buf, entry);
+		if (pbuf->buf == buf && pbuf->len == len) {
+			dlist_remove(&pbuf->entry);
+			pthread_mutex_unlock(&pool_mut);
+
+			for (i = 0; i < pbuf->mr_cnt; i++)
+				rs_dereg_mr(pbuf->mr[i]);
+			free(pbuf);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&pool_mut);
+	return ERR(EINVAL);
+}
+
 static struct rs_iomap *rs_find_iomap(struct rsocket *rs, off_t offset)
 {
 	int i;
@@ -3873,24 +6931,26 @@ static struct rs_iomap *rs_find_iomap(struct rsocket *rs, off_t offset)
 	return NULL;
 }
 
-size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags)
+/*
+ * Write count bytes to the remote iomap at offset.  Called with slock held.
+ * Data in registered memory is written directly from the user's buffer.
+ * Unless RIO_ASYNC is set, we wait for such writes to complete before
+ * returning, so that the buffer may be reused.
+ */
+static ssize_t rs_iowrite(struct rsocket *rs, const void *buf, size_t count,
+			  off_t offset, int flags)
 {
-	struct rsocket *rs;
 	struct rs_iomap *iom = NULL;
 	struct ibv_sge sge;
+	struct ibv_mr *mr = NULL;
 	size_t left = count;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	uint32_t xfer_size;
 	int ret = 0;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	fastlock_acquire(&rs->slock);
-	if (rs->iomap_pending) {
-		ret = rs_send_iomaps(rs, flags);
-		if (ret)
-			goto out;
-	}
+	if (count > rs->sq_inline &&
+	    ((flags & RIO_ASYNC) || !rs_nonblocking(rs, flags)))
+		mr = rs_get_local_mr(rs, buf, count);
+
 	for (; left; left -= xfer_size, buf += xfer_size, offset += xfer_size) {
 		if (!iom || offset > iom->offset + iom->sge.length) {
 			iom = rs_find_iomap(rs, offset);
@@ -3899,6 +6959,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		}
 
 		if (!rs_can_send(rs)) {
+			rs->stats.credit_stalls++;
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -3909,20 +6970,19 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 			}
 		}
 
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
-		}
+		xfer_size = mr ? left : rs_olap_size(rs, left);
 
 		if (xfer_size > rs->sbuf_bytes_avail)
 			xfer_size = rs->sbuf_bytes_avail;
 		if (xfer_size > iom->offset + iom->sge.length - offset)
 			xfer_size = iom->offset + iom->sge.length - offset;
 
-		if (xfer_size <= rs->sq_inline) {
+		if (mr) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = mr->lkey;
+			ret = rs_write_direct(rs, iom, offset, &sge, 1, xfer_size, 0);
+		} else if (xfer_size <= rs->sq_inline) {
 			sge.addr = (uintptr_t) buf;
 			sge.length = xfer_size;
 			sge.lkey = 0;
@@ -3948,12 +7008,283 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		if (ret)
 			break;
 	}
-out:
-	fastlock_release(&rs->slock);
+	if (mr && !(flags & RIO_ASYNC) && left != count)
+		rs_get_comp(rs, 0, rs_conn_all_sends_done);
 
 	return (ret && left == count) ? ret : count - left;
 }
 
+static inline int rs_landed_sqes(struct rsocket *rs)
+{
+	return (rs->opts & RS_OPT_MSG_SEND) ? 2 : 1;
+}
+
+/*
+ * Set aside what the notification of a RIO_NOTIFY write needs before any
+ * of its data is written, so that the notification can always follow the
+ * data.  Plain RDMA writes do not use receive credits, so the credit seen
+ * by rs_can_send here is still available once the data has been written.
+ */
+static int rs_reserve_landed(struct rsocket *rs, int flags)
+{
+	int ret;
+
+	if (!rs_can_send(rs)) {
+		rs->stats.credit_stalls++;
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_conn_can_send);
+		if (ret)
+			return ret;
+		if (!(rs->state & rs_writable))
+			return ERR(ECONNRESET);
+	}
+
+	rs->landed_rsvd = rs_landed_sqes(rs);
+	rs->sqe_avail -= rs->landed_rsvd;
+	rs->sbuf_bytes_avail -= sizeof(struct rs_iorange);
+	return 0;
+}
+
+static void rs_release_landed(struct rsocket *rs)
+{
+	rs->sqe_avail += rs->landed_rsvd;
+	rs->sbuf_bytes_avail += sizeof(struct rs_iorange);
+	rs->landed_rsvd = 0;
+}
+
+/*
+ * Tell the peer that [offset, offset + length) of its iomapped memory has
+ * been written.  The range is written into the next slot of the peer's
+ * landed ring.  A slot is not reused until the peer has granted credits
+ * for all of the messages sent after it, so it has been read by then.
+ * Called with the resources taken by rs_reserve_landed.
+ */
+static int rs_send_landed(struct rsocket *rs, uint64_t offset, uint64_t length)
+{
+	struct rs_iorange range;
+	struct ibv_sge sge;
+	uint32_t slot;
+	int ret;
+
+	if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+		range.offset = offset;
+		range.length = length;
+	} else {
+		range.offset = bswap_64(offset);
+		range.length = bswap_64(length);
+	}
+
+	slot = rs->landed_seq++ % rs->remote_landed.length;
+	if (rs->sq_inline >= sizeof range) {
+		sge.addr = (uintptr_t) &range;
+		sge.length = sizeof range;
+		sge.lkey = 0;
+		ret = rs_write_landed(rs, slot, &sge, 1, IBV_SEND_INLINE);
+	} else if (rs_sbuf_left(rs) >= sizeof range) {
+		memcpy((void *) (uintptr_t) rs->ssgl[0].addr, &range, sizeof range);
+		rs->ssgl[0].length = sizeof range;
+		ret = rs_write_landed(rs, slot, rs->ssgl, 1, 0);
+		if (rs_sbuf_left(rs) > sizeof range)
+			rs->ssgl[0].addr += sizeof range;
+		else
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+	} else {
+		rs->ssgl[0].length = rs_sbuf_left(rs);
+		memcpy((void *) (uintptr_t) rs->ssgl[0].addr, &range,
+			rs->ssgl[0].length);
+		rs->ssgl[1].length = sizeof range - rs->ssgl[0].length;
+		memcpy(rs->sbuf, ((void *) &range) + rs->ssgl[0].length,
+		       rs->ssgl[1].length);
+		ret = rs_write_landed(rs, slot, rs->ssgl, 2, 0);
+		rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+	}
+	return ret;
+}
+
+/* Move RIO_ASYNC writes whose last RDMA write has completed to the count */
+static void rs_iow_reap(struct rsocket *rs)
+{
+	while (rs->iow_head != rs->iow_tail &&
+	       rs->iow_seq[rs->iow_head] <= rs->iow_done) {
+		rs->iow_completed++;
+		if (++rs->iow_head == rs->sq_size + 1)
+			rs->iow_head = 0;
+	}
+}
+
+/*
+ * Each outstanding call has an RDMA write outstanding, so sq_size entries
+ * are enough.  Writes on the send queue complete in order.
+ */
+static void rs_iow_track(struct rsocket *rs)
+{
+	rs_iow_reap(rs);
+	rs->iow_seq[rs->iow_tail] = rs->iow_posted;
+	if (++rs->iow_tail == rs->sq_size + 1)
+		rs->iow_tail = 0;
+}
+
+static int rs_conn_iow_done(struct rsocket *rs)
+{
+	return rs->iow_head == rs->iow_tail ||
+	       rs->iow_seq[rs->iow_head] <= rs->iow_done ||
+	       !(rs->state & rs_connected);
+}
+
+static int rs_conn_have_landed(struct rsocket *rs)
+{
+	return rs->landed_head != rs->landed_tail || !(rs->state & rs_readable);
+}
+
+size_t riowritev(int socket, const struct iovec *iov, int iovcnt, off_t offset,
+		 int flags)
+{
+	struct rsocket *rs;
+	size_t len = 0;
+	ssize_t ret = 0;
+	int i;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if ((flags & RIO_NOTIFY) && !rs->remote_landed.length)
+		return ERR(ENOTSUP);
+
+	rs_lock(rs, &rs->slock);
+	if ((flags & RIO_ASYNC) && !rs->iow_seq) {
+		rs->iow_seq = calloc(rs->sq_size + 1, sizeof(*rs->iow_seq));
+		if (!rs->iow_seq) {
+			ret = ERR(ENOMEM);
+			goto out;
+		}
+	}
+
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, flags);
+		if (ret)
+			goto out;
+	}
+
+	if (flags & RIO_NOTIFY) {
+		ret = rs_reserve_landed(rs, flags);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		ret = rs_iowrite(rs, iov[i].iov_base, iov[i].iov_len,
+				 offset + len, flags);
+		if (ret < 0)
+			break;
+
+		len += ret;
+		if ((size_t) ret < iov[i].iov_len)
+			break;
+	}
+
+	if (len) {
+		if (flags & RIO_ASYNC)
+			rs_iow_track(rs);
+		if ((flags & RIO_NOTIFY) && rs_send_landed(rs, offset, len)) {
+			ret = -1;
+			len = 0;
+		}
+	} else if (flags & RIO_NOTIFY) {
+		rs_release_landed(rs);
+	}
+out:
+	rs_unlock(rs, &rs->slock);
+
+	return (ret < 0 && !len) ? ret : len;
+}
+
+size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = count;
+	return riowritev(socket, &iov, 1, offset, flags);
+}
+
+/*
+ * Report the number of RIO_ASYNC calls whose writes have completed.  Unless
+ * MSG_DONTWAIT is given, wait for the oldest outstanding call to complete.
+ */
+int riocomplete(int socket, uint64_t *count, int flags)
+{
+	struct rsocket *rs;
+	int ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(ENOTSUP);
+
+	rs_lock(rs, &rs->slock);
+	if (rs->iow_seq) {
+		if (!rs_conn_iow_done(rs) || rs_nonblocking(rs, flags)) {
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_iow_done);
+			if (ret && errno == EWOULDBLOCK)
+				ret = 0;
+		}
+		rs_iow_reap(rs);
+	}
+	*count = rs->iow_completed;
+	rs_unlock(rs, &rs->slock);
+	return ret;
+}
+
+/*
+ * Return ranges of the iomapped memory that the peer has written using
+ * RIO_NOTIFY.  Notification arrives after the data.  Returning a range
+ * frees its queue entry, so the credits still held for the queue are given
+ * back to the peer here.  Which entries hold them does not matter, only
+ * that no more are held than entries remain queued.
+ */
+int riolanded(int socket, struct riorange *ranges, int nranges, int flags)
+{
+	struct rsocket *rs;
+	uint32_t held;
+	int ret, cnt = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (!rs->landed || nranges <= 0)
+		return ERR(EINVAL);
+
+	rs_lock(rs, &rs->rlock);
+	if (rs->landed_head == rs->landed_tail) {
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_conn_have_landed);
+		if (ret) {
+			cnt = ret;
+			goto out;
+		}
+	}
+
+	while (cnt < nranges && rs->landed_head != rs->landed_tail) {
+		ranges[cnt++] = rs->landed[rs->landed_head];
+		if (++rs->landed_head == rs->rq_size + 1)
+			rs->landed_head = 0;
+	}
+	held = min(rs->landed_held - rs->landed_freed, (uint32_t) cnt);
+	rs->landed_freed += held;
+	rs->rseq_no += held;
+out:
+	rs_unlock(rs, &rs->rlock);
+
+	if (cnt > 0) {
+		rs_lock(rs, &rs->cq_lock);
+		rs_update_credits(rs);
+		rs_unlock(rs, &rs->cq_lock);
+	}
+	return cnt;
+}
+
 /****************************************************************************
  * Service Processing Threads
  ****************************************************************************/
@@ -3995,18 +7326,19 @@ static int rs_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
 	}
 
 	svc->rss[++svc->cnt] = rs;
+	rs->svc_index = svc->cnt;
 	return 0;
 }
 
+/*
+ * An rsocket is registered with at most one service, which tracks its
+ * slot in rs->svc_index.
+ */
 static int rs_svc_index(struct rs_svc *svc, struct rsocket *rs)
 {
-	int i;
+	int i = rs->svc_index;
 
-	for (i = 1; i <= svc->cnt; i++) {
-		if (svc->rss[i] == rs)
-			return i;
-	}
-	return -1;
+	return (i >= 1 && i <= svc->cnt && svc->rss[i] == rs) ? i : -1;
 }
 
 static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
@@ -4015,6 +7347,7 @@ static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
 
 	if ((i = rs_svc_index(svc, rs)) >= 0) {
 		svc->rss[i] = svc->rss[svc->cnt];
+		svc->rss[i]->svc_index = i;
 		memcpy(svc->contexts + i * svc->context_size,
 		       svc->contexts + svc->cnt * svc->context_size,
 		       svc->context_size);
@@ -4026,24 +7359,31 @@ static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
 
 static void udp_svc_process_sock(struct rs_svc *svc)
 {
+	struct epoll_event event;
 	struct rs_svc_msg msg;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
 	case RS_SVC_ADD_DGRAM:
 		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_SVC_ACTIVE;
-			udp_svc_fds = svc->contexts;
-			udp_svc_fds[svc->cnt].fd = msg.rs->udp_sock;
-			udp_svc_fds[svc->cnt].events = POLLIN;
-			udp_svc_fds[svc->cnt].revents = 0;
+		if (msg.status)
+			break;
+
+		event.events = EPOLLIN;
+		event.data.ptr = msg.rs;
+		if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, msg.rs->udp_sock, &event)) {
+			msg.status = errno;
+			rs_svc_rm_rs(svc, msg.rs);
+			break;
 		}
+		msg.rs->opts |= RS_OPT_SVC_ACTIVE;
 		break;
 	case RS_SVC_REM_DGRAM:
 		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
+		if (!msg.status) {
+			epoll_ctl(svc->epfd, EPOLL_CTL_DEL, msg.rs->udp_sock, NULL);
 			msg.rs->opts &= ~RS_OPT_SVC_ACTIVE;
+		}
 		break;
 	case RS_SVC_NOOP:
 		msg.status = 0;
@@ -4173,7 +7513,7 @@ static void udp_svc_forward(struct rsocket *rs, void *buf, size_t len,
 
 static void udp_svc_process_rs(struct rsocket *rs)
 {
-	static uint8_t buf[RS_SNDLOWAT];
+	uint8_t buf[RS_SNDLOWAT];
 	struct ds_dest *dest, *cur_dest;
 	struct ds_udp_header *udp_hdr;
 	union socket_addr addr;
@@ -4222,37 +7562,56 @@ static void udp_svc_process_rs(struct rsocket *rs)
 	}
 }
 
+/*
+ * Control messages are handled after the rsockets reported by the same
+ * wait, since a message may remove an rsocket that has a pending event.
+ */
 static void *udp_svc_run(void *arg)
 {
+	struct epoll_event events[16];
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
-	int i, ret;
+	int i, ret, cnt, ctrl;
 
 	ret = rs_svc_grow_sets(svc, 4);
-	if (ret) {
-		msg.status = ret;
-		write_all(svc->sock[1], &msg, sizeof msg);
-		return (void *) (uintptr_t) ret;
+	if (ret)
+		goto err1;
+
+	svc->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (svc->epfd < 0) {
+		ret = errno;
+		goto err1;
+	}
+
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = NULL;
+	if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, svc->sock[1], &events[0])) {
+		ret = errno;
+		goto err2;
 	}
 
-	udp_svc_fds = svc->contexts;
-	udp_svc_fds[0].fd = svc->sock[1];
-	udp_svc_fds[0].events = POLLIN;
 	do {
-		for (i = 0; i <= svc->cnt; i++)
-			udp_svc_fds[i].revents = 0;
+		cnt = epoll_wait(svc->epfd, events, 16, -1);
+		for (i = 0, ctrl = 0; i < cnt; i++) {
+			if (events[i].data.ptr)
+				udp_svc_process_rs(events[i].data.ptr);
+			else
+				ctrl = 1;
+		}
 
-		poll(udp_svc_fds, svc->cnt + 1, -1);
-		if (udp_svc_fds[0].revents)
+		if (ctrl)
 			udp_svc_process_sock(svc);
-
-		for (i = 1; i <= svc->cnt; i++) {
-			if (udp_svc_fds[i].revents)
-				udp_svc_process_rs(svc->rss[i]);
-		}
 	} while (svc->cnt >= 1);
 
+	close(svc->epfd);
 	return NULL;
+
+err2:
+	close(svc->epfd);
+err1:
+	msg.status = ret;
+	write_all(svc->sock[1], &msg, sizeof msg);
+	return (void *) (uintptr_t) ret;
 }
 
 static uint32_t rs_get_time(void)
@@ -4264,36 +7623,138 @@ static uint32_t rs_get_time(void)
 	return (uint32_t) now.tv_sec;
 }
 
+/*
+ * The keepalive service keeps its rsockets in a binary min-heap ordered by
+ * timeout.  Index 0 of the set is reserved, so the heap is rooted at 1.
+ * Besides sending keep-alives, it shrinks receive buffers that have grown
+ * and then gone idle.
+ */
+static void tcp_svc_swap(struct rs_svc *svc, int i, int j)
+{
+	struct rsocket *rs;
+	uint32_t timeout;
+
+	rs = svc->rss[i];
+	timeout = tcp_svc_timeouts[i];
+	svc->rss[i] = svc->rss[j];
+	tcp_svc_timeouts[i] = tcp_svc_timeouts[j];
+	svc->rss[j] = rs;
+	tcp_svc_timeouts[j] = timeout;
+
+	svc->rss[i]->svc_index = i;
+	svc->rss[j]->svc_index = j;
+}
+
+static void tcp_svc_heapify(struct rs_svc *svc, int i)
+{
+	int child;
+
+	while (i > 1 && tcp_svc_timeouts[i] < tcp_svc_timeouts[i >> 1]) {
+		tcp_svc_swap(svc, i, i >> 1);
+		i >>= 1;
+	}
+
+	while ((child = i << 1) <= svc->cnt) {
+		if (child < svc->cnt &&
+		    tcp_svc_timeouts[child + 1] < tcp_svc_timeouts[child])
+			child++;
+		if (tcp_svc_timeouts[i] <= tcp_svc_timeouts[child])
+			break;
+
+		tcp_svc_swap(svc, i, child);
+		i = child;
+	}
+}
+
+static uint32_t tcp_svc_timeout(struct rsocket *rs)
+{
+	if (!(rs->opts & RS_OPT_KEEPALIVE))
+		return rs->rbuf_due;
+	if (!rs->rbuf_max)
+		return rs->keepalive_due;
+	return min(rs->keepalive_due, rs->rbuf_due);
+}
+
+static int tcp_svc_add(struct rs_svc *svc, struct rsocket *rs)
+{
+	int ret;
+
+	if (rs->opts & RS_OPT_SVC_ACTIVE)
+		return 0;
+
+	ret = rs_svc_add_rs(svc, rs);
+	if (!ret) {
+		rs->opts |= RS_OPT_SVC_ACTIVE;
+		tcp_svc_timeouts = svc->contexts;
+	}
+	return ret;
+}
+
+static int tcp_svc_rem(struct rs_svc *svc, struct rsocket *rs)
+{
+	int i, ret;
+
+	i = rs_svc_index(svc, rs);
+	ret = rs_svc_rm_rs(svc, rs);
+	if (!ret) {
+		rs->opts &= ~(RS_OPT_SVC_ACTIVE | RS_OPT_KEEPALIVE);
+		if (i <= svc->cnt)
+			tcp_svc_heapify(svc, i);
+	}
+	return ret;
+}
+
+static void tcp_svc_update(struct rs_svc *svc, struct rsocket *rs)
+{
+	tcp_svc_timeouts[rs->svc_index] = tcp_svc_timeout(rs);
+	tcp_svc_heapify(svc, rs->svc_index);
+}
+
 static void tcp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
-	int i;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
 	case RS_SVC_ADD_KEEPALIVE:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
+		msg.status = tcp_svc_add(svc, msg.rs);
 		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_SVC_ACTIVE;
-			tcp_svc_timeouts = svc->contexts;
-			tcp_svc_timeouts[svc->cnt] = rs_get_time() +
-						     msg.rs->keepalive_time;
+			msg.rs->opts |= RS_OPT_KEEPALIVE;
+			msg.rs->keepalive_seq = msg.rs->ctrl_seqno + msg.rs->sseq_no;
+			msg.rs->keepalive_due = rs_get_time() + msg.rs->keepalive_time;
+			tcp_svc_update(svc, msg.rs);
 		}
 		break;
 	case RS_SVC_REM_KEEPALIVE:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_SVC_ACTIVE;
+		if (rs_svc_index(svc, msg.rs) < 0) {
+			msg.status = EBADF;
+		} else if (msg.rs->rbuf_max) {
+			msg.rs->opts &= ~RS_OPT_KEEPALIVE;
+			tcp_svc_update(svc, msg.rs);
+			msg.status = 0;
+		} else {
+			msg.status = tcp_svc_rem(svc, msg.rs);
+		}
 		break;
 	case RS_SVC_MOD_KEEPALIVE:
-		i = rs_svc_index(svc, msg.rs);
-		if (i >= 0) {
-			tcp_svc_timeouts[i] = rs_get_time() + msg.rs->keepalive_time;
+		if (rs_svc_index(svc, msg.rs) >= 0) {
+			msg.rs->keepalive_due = rs_get_time() + msg.rs->keepalive_time;
+			tcp_svc_update(svc, msg.rs);
 			msg.status = 0;
 		} else {
 			msg.status = EBADF;
 		}
 		break;
+	case RS_SVC_ADD_RBUF:
+		msg.status = tcp_svc_add(svc, msg.rs);
+		if (!msg.status) {
+			msg.rs->rbuf_due = rs_get_time() + RS_RBUF_IDLE_SEC;
+			tcp_svc_update(svc, msg.rs);
+		}
+		break;
+	case RS_SVC_REM_TCP:
+		msg.status = tcp_svc_rem(svc, msg.rs);
+		break;
 	case RS_SVC_NOOP:
 		msg.status = 0;
 		break;
@@ -4306,25 +7767,46 @@ static void tcp_svc_process_sock(struct rs_svc *svc)
 /*
  * Send a 0 byte RDMA write with immediate as keep-alive message.
  * This avoids the need for the receive side to do any acknowledgment.
+ * The keep-alive is skipped if the rsocket has sent anything since the
+ * last timeout, since that send will detect a failed peer just as well.
  */
 static void tcp_svc_send_keepalive(struct rsocket *rs)
 {
 	fastlock_acquire(&rs->cq_lock);
-	if (rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
+	if (rs->keepalive_seq == rs->ctrl_seqno + rs->sseq_no &&
+	    rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
 		rs->ctrl_seqno++;
 		rs_post_write(rs, NULL, 0, rs_msg_set(RS_OP_CTRL, RS_CTRL_KEEPALIVE),
 			      0, (uintptr_t) NULL, (uintptr_t) NULL);
 	}
+	rs->keepalive_seq = rs->ctrl_seqno + rs->sseq_no;
+	fastlock_release(&rs->cq_lock);
+}
+
+/*
+ * A thread blocked in rrecv holds rlock, so a buffer is skipped rather
+ * than waited on.  It is shrunk by the reader once data arrives instead.
+ */
+static void tcp_svc_check_rbuf(struct rsocket *rs, uint32_t now)
+{
+	if (!fastlock_tryacquire(&rs->rlock))
+		return;
+
+	fastlock_acquire(&rs->cq_lock);
+	if ((rs->state & rs_readable) && rs_shrink_idle_rbuf(rs, now))
+		rs_update_credits(rs);
 	fastlock_release(&rs->cq_lock);
-}	
+	fastlock_release(&rs->rlock);
+}
 
 static void *tcp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
+	struct rsocket *rs;
 	struct pollfd fds;
-	uint32_t now, next_timeout;
-	int i, ret, timeout;
+	uint32_t now;
+	int ret, timeout;
 
 	ret = rs_svc_grow_sets(svc, 16);
 	if (ret) {
@@ -4343,17 +7825,20 @@ static void *tcp_svc_run(void *arg)
 			tcp_svc_process_sock(svc);
 
 		now = rs_get_time();
-		next_timeout = ~0;
-		for (i = 1; i <= svc->cnt; i++) {
-			if (tcp_svc_timeouts[i] <= now) {
-				tcp_svc_send_keepalive(svc->rss[i]);
-				tcp_svc_timeouts[i] =
-					now + svc->rss[i]->keepalive_time;
+		while (svc->cnt >= 1 && tcp_svc_timeouts[1] <= now) {
+			rs = svc->rss[1];
+			if ((rs->opts & RS_OPT_KEEPALIVE) &&
+			    rs->keepalive_due <= now) {
+				tcp_svc_send_keepalive(rs);
+				rs->keepalive_due = now + rs->keepalive_time;
+			}
+			if (rs->rbuf_max && rs->rbuf_due <= now) {
+				tcp_svc_check_rbuf(rs, now);
+				rs->rbuf_due = now + RS_RBUF_IDLE_SEC;
 			}
-			if (tcp_svc_timeouts[i] < next_timeout)
-				next_timeout = tcp_svc_timeouts[i];
+			tcp_svc_update(svc, rs);
 		}
-		timeout = (int) (next_timeout - now);
+		timeout = svc->cnt >= 1 ? (int) (tcp_svc_timeouts[1] - now) : -1;
 	} while (svc->cnt >= 1);
 
 	return NULL;
@@ -40,11 +40,14 @@
 #include <poll.h>
 #include <sys/select.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct mmsghdr;
+
 int rsocket(int domain, int type, int protocol);
 int rbind(int socket, const struct sockaddr *addr, socklen_t addrlen);
 int rlisten(int socket, int backlog);
@@ -57,10 +60,16 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags);
 ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 		  struct sockaddr *src_addr, socklen_t *addrlen);
 ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags);
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
+ssize_t rrecv_zc(int socket, struct iovec *iov, int *iovcnt, size_t len,
+		 int flags);
+int rrecv_zc_release(int socket, size_t len);
 ssize_t rsend(int socket, const void *buf, size_t len, int flags);
 ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 		const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags);
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
 ssize_t rread(int socket, void *buf, size_t count);
 ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt);
 ssize_t rwrite(int socket, const void *buf, size_t count);
@@ -70,6 +79,10 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
 	    fd_set *exceptfds, struct timeval *timeout);
 
+int repoll_create(int size);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
 int rgetpeername(int socket, struct sockaddr *addr, socklen_t *addrlen);
 int rgetsockname(int socket, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -79,7 +92,39 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_ZEROCOPY,
+	RDMA_MAXXFER,
+	RDMA_SHAREDCQ,
+	RDMA_SHAREDRQ,
+	RDMA_SINGLETHREAD,
+	RDMA_POLLSTATS,
+	RDMA_STATS,
+	RDMA_PROCSTATS,
+	RDMA_IONOTIFY
+};
+
+struct rsocket_poll_stats {
+	uint64_t	spin_hits;
+	uint64_t	sleeps;
+};
+
+/* RDMA_STATS / RDMA_PROCSTATS, block_time is in microseconds */
+struct rsocket_stats {
+	uint64_t	bytes_sent;
+	uint64_t	bytes_recv;
+	uint64_t	rdma_writes;
+	uint64_t	inline_writes;
+	uint64_t	copied_writes;
+	uint64_t	zcopy_writes;
+	uint64_t	credit_stalls;
+	uint64_t	credit_updates;
+	uint64_t	rbuf_updates;
+	uint64_t	cq_arms;
+	uint64_t	cq_events;
+	uint64_t	block_time;
+	uint64_t	spin_hits;
+	uint64_t	sleeps;
 };
 
 int rsetsockopt(int socket, int level, int optname,
@@ -91,6 +136,23 @@ int rfcntl(int socket, int cmd, ... /* arg */ );
 off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offset);
 int riounmap(int socket, void *buf, size_t len);
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags);
+size_t riowritev(int socket, const struct iovec *iov, int iovcnt, off_t offset,
+		 int flags);
+
+/* riowrite and riowritev flags, in addition to MSG_DONTWAIT */
+#define RIO_ASYNC	0x10000000
+#define RIO_NOTIFY	0x20000000
+
+struct riorange {
+	uint64_t	offset;
+	uint64_t	len;
+};
+
+int riocomplete(int socket, uint64_t *count, int flags);
+int riolanded(int socket, struct riorange *ranges, int nranges, int flags);
+
+int rregister(void *buf, size_t len);
+int rderegister(void *buf, size_t len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1630 @@
+/*
+ * Copyright (c) 2026 The rdma-core contributors.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include <infiniband/driver.h>
+#include <infiniband/verbs.h>
+
+#include "loopback.h"
+
+/*
+ * The loopback provider implements verbs without any hardware or kernel
+ * support.  Operations are carried out by the process that posts them: data
+ * is copied with memcpy() within a process and with process_vm_writev() and
+ * process_vm_readv() between processes.  Sends that find no posted receive
+ * are retried by a progress thread, as an RC responder would after an RNR
+ * NAK.
+ */
+
+static const struct verbs_match_ent hca_table[] = {
+	VERBS_NAME_MATCH("loopback", NULL),
+	{},
+};
+
+static pthread_mutex_t fabric_mut = PTHREAD_MUTEX_INITIALIZER;
+static struct lo_fabric *fabric;
+static pid_t lo_pid;
+
+static pthread_mutex_t progress_mut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(progress_list);
+static bool progress_running;
+
+static void lo_mutex_init(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Fabric locks are robust, in case their owner died while holding them */
+static void lo_lock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(mutex);
+}
+
+static void lo_atfork_child(void)
+{
+	lo_pid = getpid();
+	progress_running = false;
+}
+
+static struct lo_fabric *lo_map_fabric(void)
+{
+	struct lo_fabric *fab;
+	struct stat st;
+	char name[32];
+	int fd, i, created = 0;
+
+	pthread_mutex_lock(&fabric_mut);
+	if (fabric)
+		goto out;
+
+	snprintf(name, sizeof name, "/rdma_loopback-%u", getuid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		created = 1;
+		if (ftruncate(fd, sizeof *fab))
+			goto err;
+	} else {
+		if (errno != EEXIST)
+			goto out;
+
+		fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+		if (fd < 0)
+			goto out;
+
+		/* Give the creator time to size the fabric */
+		for (i = 0; i < 1000; i++) {
+			if (fstat(fd, &st))
+				goto err;
+			if (st.st_size)
+				break;
+			usleep(1000);
+		}
+
+		if (st.st_size != sizeof *fab) {
+			fprintf(stderr, "loopback: /dev/shm%s does not match this library version\n",
+				name);
+			goto err;
+		}
+	}
+
+	fab = mmap(NULL, sizeof *fab, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (fab == MAP_FAILED)
+		goto out;
+
+	if (created) {
+		lo_mutex_init(&fab->lock);
+		lo_mutex_init(&fab->atomic_lock);
+		for (i = 0; i < LO_MAX_QP; i++)
+			lo_mutex_init(&fab->qp[i].rq.lock);
+		for (i = 0; i < LO_MAX_SRQ; i++)
+			lo_mutex_init(&fab->srq[i].rq.lock);
+		atomic_store(&fab->magic, LO_FABRIC_MAGIC);
+	} else {
+		for (i = 0; i < 1000; i++) {
+			if (atomic_load(&fab->magic) == LO_FABRIC_MAGIC)
+				break;
+			usleep(1000);
+		}
+
+		if (atomic_load(&fab->magic) != LO_FABRIC_MAGIC) {
+			munmap(fab, sizeof *fab);
+			goto out;
+		}
+	}
+
+	lo_pid = getpid();
+	pthread_atfork(NULL, NULL, lo_atfork_child);
+	fabric = fab;
+out:
+	pthread_mutex_unlock(&fabric_mut);
+	return fabric;
+err:
+	close(fd);
+	goto out;
+}
+
+/* A slot is free if unused, or if the process that owned it has exited */
+static bool lo_slot_free(struct lo_slot *slot)
+{
+	return !atomic_load(&slot->id) ||
+	       (slot->pid != lo_pid && kill(slot->pid, 0) && errno == ESRCH);
+}
+
+/*
+ * Claim a free slot of a fabric table.  Its id combines the slot index with
+ * a generation number, so stale keys and QP numbers are not mistaken for
+ * newer ones.
+ */
+static int lo_alloc_slot(struct lo_fabric *fab, struct lo_slot *table,
+			 size_t stride, int count, int index_bits,
+			 uint32_t gen_max)
+{
+	struct lo_slot *slot;
+	int i;
+
+	lo_lock(&fab->lock);
+	for (i = 0; i < count; i++) {
+		slot = (void *) table + i * stride;
+		if (lo_slot_free(slot)) {
+			slot->pid = lo_pid;
+			fab->gen++;
+			atomic_store(&slot->id,
+				     (fab->gen % gen_max + 1) << index_bits | i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fab->lock);
+
+	if (i == count) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return i;
+}
+
+static void lo_free_slot(struct lo_slot *slot)
+{
+	atomic_store(&slot->id, 0);
+}
+
+static struct lo_qp_slot *lo_qp_lookup(struct lo_fabric *fab, uint32_t qpn)
+{
+	struct lo_qp_slot *slot;
+
+	slot = &fab->qp[qpn & ((1 << LO_QPN_INDEX_BITS) - 1)];
+	return atomic_load(&slot->hdr.id) == qpn ? slot : NULL;
+}
+
+static struct lo_mr_slot *lo_mr_lookup(struct lo_fabric *fab, uint32_t key,
+				       pid_t pid, uint64_t addr, uint64_t len,
+				       uint32_t access)
+{
+	struct lo_mr_slot *slot;
+
+	slot = &fab->mr[key & ((1 << LO_KEY_INDEX_BITS) - 1)];
+	if (atomic_load(&slot->hdr.id) != key || slot->hdr.pid != pid ||
+	    (slot->access & access) != access ||
+	    addr < slot->addr || addr + len > slot->addr + slot->length)
+		return NULL;
+
+	return slot;
+}
+
+static struct lo_rq *lo_slot_rq(struct lo_fabric *fab, struct lo_qp_slot *slot)
+{
+	return slot->srq < 0 ? &slot->rq : &fab->srq[slot->srq].rq;
+}
+
+static void lo_rq_reset(struct lo_rq *rq, uint32_t max_wr, uint32_t max_sge)
+{
+	lo_lock(&rq->lock);
+	rq->max_wr = max_wr;
+	rq->max_sge = max_sge;
+	rq->limit = 0;
+	atomic_store(&rq->head, 0);
+	atomic_store(&rq->tail, 0);
+	atomic_store(&rq->done, 0);
+	pthread_mutex_unlock(&rq->lock);
+}
+
+/* Build an iovec for a scatter/gather list, validating its keys */
+static int lo_sge_iov(struct lo_fabric *fab, pid_t pid,
+		      const struct ibv_sge *sge, int num_sge, bool check,
+		      uint32_t access, struct iovec *iov, size_t *len)
+{
+	int i;
+
+	*len = 0;
+	for (i = 0; i < num_sge; i++) {
+		if (check && sge[i].length &&
+		    !lo_mr_lookup(fab, sge[i].lkey, pid, sge[i].addr,
+				  sge[i].length, access))
+			return -1;
+
+		iov[i].iov_base = (void *) (uintptr_t) sge[i].addr;
+		iov[i].iov_len = sge[i].length;
+		*len += sge[i].length;
+	}
+
+	return 0;
+}
+
+/* Drop the first len bytes of an iovec */
+static int lo_iov_skip(struct iovec *iov, int *cnt, size_t len)
+{
+	while (*cnt && len >= iov->iov_len) {
+		len -= iov->iov_len;
+		memmove(iov, iov + 1, --(*cnt) * sizeof *iov);
+	}
+
+	if (len && !*cnt)
+		return -1;
+
+	if (*cnt) {
+		iov->iov_base += len;
+		iov->iov_len -= len;
+	}
+	return 0;
+}
+
+static void lo_memcpy_iov(const struct iovec *dst, const struct iovec *src,
+			  size_t len)
+{
+	size_t doff = 0, soff = 0, n;
+
+	while (len) {
+		while (doff == dst->iov_len) {
+			dst++;
+			doff = 0;
+		}
+		while (soff == src->iov_len) {
+			src++;
+			soff = 0;
+		}
+
+		n = min(dst->iov_len - doff, src->iov_len - soff);
+		n = min(n, len);
+		memcpy(dst->iov_base + doff, src->iov_base + soff, n);
+		doff += n;
+		soff += n;
+		len -= n;
+	}
+}
+
+/*
+ * Copy len bytes between local buffers and the memory of process pid.  The
+ * remote iovec must be able to hold len bytes.
+ */
+static int lo_copy(pid_t pid, const struct iovec *local, int nlocal,
+		   const struct iovec *remote, int nremote, size_t len,
+		   bool write)
+{
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+
+	if (pid == lo_pid) {
+		if (write)
+			lo_memcpy_iov(remote, local, len);
+		else
+			lo_memcpy_iov(local, remote, len);
+		return 0;
+	}
+
+	if (write)
+		ret = process_vm_writev(pid, local, nlocal, remote, nremote, 0);
+	else
+		ret = process_vm_readv(pid, local, nlocal, remote, nremote, 0);
+
+	return ret == (ssize_t) len ? 0 : -1;
+}
+
+static void lo_notify(struct lo_context *ctx, uint32_t index, bool solicited)
+{
+	struct lo_cq_slot *slot = &ctx->fabric->cq[index];
+	struct ibv_comp_event ev;
+	uint32_t armed;
+
+	armed = atomic_load(&slot->armed);
+	if (armed == LO_ARM_NONE || (armed == LO_ARM_SOLICITED && !solicited))
+		return;
+
+	if (!atomic_compare_exchange_strong(&slot->armed, &armed, LO_ARM_NONE))
+		return;
+
+	ev.cq_handle = slot->handle;
+	sendto(ctx->sock, &ev, sizeof ev, MSG_DONTWAIT,
+	       (struct sockaddr *) &slot->addr, slot->addr_len);
+}
+
+static struct lo_recv_wqe *lo_get_recv(struct lo_rq *rq)
+{
+	struct lo_recv_wqe *wqe = NULL;
+	uint32_t head;
+
+	if (atomic_load(&rq->head) == atomic_load(&rq->tail))
+		return NULL;
+
+	lo_lock(&rq->lock);
+	head = atomic_load(&rq->head);
+	if (head != atomic_load(&rq->tail)) {
+		wqe = &rq->wqe[head % LO_MAX_WR];
+		atomic_store(&wqe->state, LO_WQE_BUSY);
+		atomic_store(&rq->head, head + 1);
+	}
+	pthread_mutex_unlock(&rq->lock);
+
+	return wqe;
+}
+
+static void lo_complete_recv(struct lo_context *ctx, struct lo_qp_slot *dst,
+			     struct lo_recv_wqe *wqe, enum ibv_wc_status status,
+			     enum ibv_wc_opcode opcode, uint32_t byte_len,
+			     struct ibv_send_wr *wr, uint32_t src_qp)
+{
+	wqe->status = status;
+	wqe->opcode = opcode;
+	wqe->byte_len = byte_len;
+	wqe->wc_flags = 0;
+	if (wr && (wr->opcode == IBV_WR_SEND_WITH_IMM ||
+		   wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)) {
+		wqe->imm_data = wr->imm_data;
+		wqe->wc_flags = IBV_WC_WITH_IMM;
+	}
+	wqe->qp_num = atomic_load(&dst->hdr.id);
+	wqe->src_qp = src_qp;
+	wqe->cqn = dst->cqn;
+	atomic_store(&wqe->state, LO_WQE_DONE);
+
+	lo_notify(ctx, dst->cqn, status != IBV_WC_SUCCESS ||
+		  (wr && (wr->send_flags & IBV_SEND_SOLICITED)));
+}
+
+/* Deliver the payload of a send into a receive buffer of dst */
+static enum ibv_wc_status lo_deliver(struct lo_context *ctx,
+				     struct lo_qp_slot *dst,
+				     struct lo_recv_wqe *wqe,
+				     struct iovec *liov, int nliov,
+				     size_t len, size_t skip,
+				     struct ibv_send_wr *wr, uint32_t src_qp)
+{
+	struct iovec riov[LO_MAX_SGE];
+	int nriov = wqe->num_sge;
+	size_t rlen;
+	enum ibv_wc_status status = IBV_WC_SUCCESS;
+
+	if (lo_sge_iov(ctx->fabric, dst->hdr.pid, wqe->sg_list, wqe->num_sge,
+		       true, IBV_ACCESS_LOCAL_WRITE, riov, &rlen))
+		status = IBV_WC_LOC_PROT_ERR;
+	else if (rlen < len + skip || lo_iov_skip(riov, &nriov, skip))
+		status = IBV_WC_LOC_LEN_ERR;
+	else if (lo_copy(dst->hdr.pid, liov, nliov, riov, nriov, len, true))
+		status = IBV_WC_LOC_PROT_ERR;
+
+	lo_complete_recv(ctx, dst, wqe, status, IBV_WC_RECV, len + skip, wr,
+			 src_qp);
+
+	return status == IBV_WC_LOC_LEN_ERR ? IBV_WC_REM_INV_REQ_ERR :
+	       status == IBV_WC_SUCCESS ? IBV_WC_SUCCESS : IBV_WC_REM_OP_ERR;
+}
+
+static int lo_execute_ud(struct lo_context *ctx, struct lo_qp *qp,
+			 struct ibv_send_wr *wr, struct iovec *liov,
+			 size_t len, struct ibv_wc *wc)
+{
+	struct lo_qp_slot *dst;
+	struct lo_recv_wqe *wqe;
+	uint32_t qkey;
+
+	if (wr->opcode != IBV_WR_SEND && wr->opcode != IBV_WR_SEND_WITH_IMM) {
+		wc->status = IBV_WC_LOC_QP_OP_ERR;
+		return 0;
+	}
+
+	if (len > 4096) {
+		wc->status = IBV_WC_LOC_LEN_ERR;
+		return 0;
+	}
+
+	/* Datagrams that cannot be delivered are silently dropped */
+	qkey = wr->wr.ud.remote_qkey & 0x80000000 ?
+	       qp->attr.qkey : wr->wr.ud.remote_qkey;
+	dst = lo_qp_lookup(ctx->fabric, wr->wr.ud.remote_qpn);
+	if (!dst || dst->qp_type != IBV_QPT_UD || dst->qkey != qkey ||
+	    atomic_load(&dst->state) < IBV_QPS_RTR ||
+	    atomic_load(&dst->state) == IBV_QPS_ERR)
+		return 0;
+
+	wqe = lo_get_recv(lo_slot_rq(ctx->fabric, dst));
+	if (wqe)
+		lo_deliver(ctx, dst, wqe, liov, wr->num_sge, len, LO_GRH_SIZE,
+			   wr, qp->ibv_qp.qp_num);
+	return 0;
+}
+
+static int lo_execute_atomic(struct lo_context *ctx, struct lo_qp_slot *dst,
+			     struct ibv_send_wr *wr, struct iovec *liov,
+			     size_t len, struct ibv_wc *wc)
+{
+	struct lo_fabric *fab = ctx->fabric;
+	uint64_t val, old;
+	struct iovec tiov = { .iov_base = &old, .iov_len = sizeof old };
+	struct iovec riov = {
+		.iov_base = (void *) (uintptr_t) wr->wr.atomic.remote_addr,
+		.iov_len = sizeof old
+	};
+
+	if (len != sizeof old || wr->wr.atomic.remote_addr % sizeof old) {
+		wc->status = IBV_WC_LOC_LEN_ERR;
+		return 0;
+	}
+
+	if (!lo_mr_lookup(fab, wr->wr.atomic.rkey, dst->hdr.pid,
+			  wr->wr.atomic.remote_addr, sizeof old,
+			  IBV_ACCESS_REMOTE_ATOMIC)) {
+		wc->status = IBV_WC_REM_ACCESS_ERR;
+		return 0;
+	}
+
+	/* Atomics are only atomic with respect to each other */
+	lo_lock(&fab->atomic_lock);
+	if (lo_copy(dst->hdr.pid, &tiov, 1, &riov, 1, sizeof old, false)) {
+		wc->status = IBV_WC_REM_ACCESS_ERR;
+		goto out;
+	}
+
+	if (wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+		val = old + wr->wr.atomic.compare_add;
+	else if (old == wr->wr.atomic.compare_add)
+		val = wr->wr.atomic.swap;
+	else
+		val = old;
+
+	tiov.iov_base = &val;
+	if (val != old &&
+	    lo_copy(dst->hdr.pid, &tiov, 1, &riov, 1, sizeof val, true)) {
+		wc->status = IBV_WC_REM_ACCESS_ERR;
+		goto out;
+	}
+out:
+	pthread_mutex_unlock(&fab->atomic_lock);
+
+	if (wc->status == IBV_WC_SUCCESS) {
+		tiov.iov_base = &old;
+		lo_memcpy_iov(liov, &tiov, sizeof old);
+		wc->byte_len = sizeof old;
+	}
+	return 0;
+}
+
+/*
+ * Carry out a send request.  Returns EAGAIN if the responder has no receive
+ * posted, otherwise fills in the send completion and returns 0.
+ */
+static int lo_execute(struct lo_context *ctx, struct lo_qp *qp,
+		      struct ibv_send_wr *wr, struct ibv_wc *wc)
+{
+	struct lo_fabric *fab = ctx->fabric;
+	struct iovec liov[LO_MAX_SGE], riov;
+	struct lo_qp_slot *dst;
+	struct lo_recv_wqe *wqe = NULL;
+	uint32_t access = 0;
+	size_t len;
+
+	memset(wc, 0, sizeof *wc);
+	wc->wr_id = wr->wr_id;
+	wc->qp_num = qp->ibv_qp.qp_num;
+	wc->status = IBV_WC_SUCCESS;
+
+	switch (wr->opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		wc->opcode = IBV_WC_SEND;
+		break;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		wc->opcode = IBV_WC_RDMA_WRITE;
+		break;
+	case IBV_WR_RDMA_READ:
+		wc->opcode = IBV_WC_RDMA_READ;
+		access = IBV_ACCESS_LOCAL_WRITE;
+		break;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+		wc->opcode = IBV_WC_COMP_SWAP;
+		access = IBV_ACCESS_LOCAL_WRITE;
+		break;
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		wc->opcode = IBV_WC_FETCH_ADD;
+		access = IBV_ACCESS_LOCAL_WRITE;
+		break;
+	default:
+		wc->status = IBV_WC_LOC_QP_OP_ERR;
+		return 0;
+	}
+
+	if (lo_sge_iov(fab, lo_pid, wr->sg_list, wr->num_sge,
+		       !(wr->send_flags & IBV_SEND_INLINE), access, liov, &len)) {
+		wc->status = IBV_WC_LOC_PROT_ERR;
+		return 0;
+	}
+
+	if (qp->ibv_qp.qp_type == IBV_QPT_UD)
+		return lo_execute_ud(ctx, qp, wr, liov, len, wc);
+
+	dst = lo_qp_lookup(fab, qp->attr.dest_qp_num);
+	if (!dst || atomic_load(&dst->state) < IBV_QPS_RTR ||
+	    atomic_load(&dst->state) == IBV_QPS_ERR) {
+		wc->status = IBV_WC_RETRY_EXC_ERR;
+		return 0;
+	}
+
+	switch (wr->opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		wqe = lo_get_recv(lo_slot_rq(fab, dst));
+		if (!wqe)
+			return EAGAIN;
+
+		wc->status = lo_deliver(ctx, dst, wqe, liov, wr->num_sge, len,
+					0, wr, qp->ibv_qp.qp_num);
+		break;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		/* A zero length write carries no R_Key to check */
+		if (len && !lo_mr_lookup(fab, wr->wr.rdma.rkey, dst->hdr.pid,
+					 wr->wr.rdma.remote_addr, len,
+					 IBV_ACCESS_REMOTE_WRITE)) {
+			wc->status = IBV_WC_REM_ACCESS_ERR;
+			break;
+		}
+
+		if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+			wqe = lo_get_recv(lo_slot_rq(fab, dst));
+			if (!wqe)
+				return EAGAIN;
+		}
+
+		riov.iov_base = (void *) (uintptr_t) wr->wr.rdma.remote_addr;
+		riov.iov_len = len;
+		if (lo_copy(dst->hdr.pid, liov, wr->num_sge, &riov, 1, len,
+			    true))
+			wc->status = IBV_WC_REM_ACCESS_ERR;
+
+		if (wqe)
+			lo_complete_recv(ctx, dst, wqe, wc->status,
+					 IBV_WC_RECV_RDMA_WITH_IMM, len, wr,
+					 qp->ibv_qp.qp_num);
+		break;
+	case IBV_WR_RDMA_READ:
+		riov.iov_base = (void *) (uintptr_t) wr->wr.rdma.remote_addr;
+		riov.iov_len = len;
+		if ((len && !lo_mr_lookup(fab, wr->wr.rdma.rkey, dst->hdr.pid,
+					  wr->wr.rdma.remote_addr, len,
+					  IBV_ACCESS_REMOTE_READ)) ||
+		    lo_copy(dst->hdr.pid, liov, wr->num_sge, &riov, 1, len,
+			    false))
+			wc->status = IBV_WC_REM_ACCESS_ERR;
+		else
+			wc->byte_len = len;
+		break;
+	default:
+		return lo_execute_atomic(ctx, dst, wr, liov, len, wc);
+	}
+
+	return 0;
+}
+
+static void lo_push_wc(struct lo_context *ctx, struct lo_cq *cq,
+		       struct ibv_wc *wc)
+{
+	pthread_spin_lock(&cq->lock);
+	if (cq->tail - cq->head < cq->size) {
+		cq->wc[cq->tail % cq->size] = *wc;
+		cq->tail++;
+	}
+	pthread_spin_unlock(&cq->lock);
+
+	lo_notify(ctx, cq->index, wc->status != IBV_WC_SUCCESS);
+}
+
+/* Complete every posted receive of a QP with a flush error */
+static void lo_flush_rq(struct lo_context *ctx, struct lo_qp *qp)
+{
+	struct lo_qp_slot *slot = &ctx->fabric->qp[qp->index];
+	struct lo_recv_wqe *wqe;
+	uint32_t head, tail;
+
+	if (qp->ibv_qp.srq)
+		return;
+
+	lo_lock(&slot->rq.lock);
+	head = atomic_load(&slot->rq.head);
+	tail = atomic_load(&slot->rq.tail);
+	for (; head != tail; head++) {
+		wqe = &slot->rq.wqe[head % LO_MAX_WR];
+		wqe->status = IBV_WC_WR_FLUSH_ERR;
+		wqe->opcode = IBV_WC_RECV;
+		wqe->byte_len = 0;
+		wqe->wc_flags = 0;
+		wqe->qp_num = qp->ibv_qp.qp_num;
+		wqe->cqn = slot->cqn;
+		atomic_store(&wqe->state, LO_WQE_DONE);
+	}
+	atomic_store(&slot->rq.head, tail);
+	pthread_mutex_unlock(&slot->rq.lock);
+
+	lo_notify(ctx, slot->cqn, true);
+}
+
+static void lo_set_state(struct lo_context *ctx, struct lo_qp *qp,
+			 enum ibv_qp_state state)
+{
+	qp->attr.qp_state = state;
+	qp->ibv_qp.state = state;
+	atomic_store(&ctx->fabric->qp[qp->index].state, state);
+
+	if (state == IBV_QPS_ERR)
+		lo_flush_rq(ctx, qp);
+}
+
+static void lo_complete_send(struct lo_context *ctx, struct lo_qp *qp,
+			     struct ibv_send_wr *wr, struct ibv_wc *wc)
+{
+	if (wc->status != IBV_WC_SUCCESS &&
+	    qp->attr.qp_state != IBV_QPS_ERR &&
+	    qp->ibv_qp.qp_type == IBV_QPT_RC)
+		lo_set_state(ctx, qp, IBV_QPS_ERR);
+
+	if (wc->status != IBV_WC_SUCCESS || qp->sq_sig_all ||
+	    (wr->send_flags & IBV_SEND_SIGNALED))
+		lo_push_wc(ctx, to_locq(qp->ibv_qp.send_cq), wc);
+}
+
+static void lo_flush_wc(struct lo_qp *qp, struct ibv_send_wr *wr,
+			struct ibv_wc *wc)
+{
+	memset(wc, 0, sizeof *wc);
+	wc->wr_id = wr->wr_id;
+	wc->qp_num = qp->ibv_qp.qp_num;
+	wc->status = IBV_WC_WR_FLUSH_ERR;
+}
+
+/* Retry deferred sends in order.  Called with the QP lock held. */
+static void lo_progress_qp(struct lo_context *ctx, struct lo_qp *qp)
+{
+	struct lo_pending *pending, *next;
+	struct ibv_wc wc;
+
+	list_for_each_safe(&qp->pending, pending, next, entry) {
+		if (qp->attr.qp_state == IBV_QPS_ERR)
+			lo_flush_wc(qp, &pending->wr, &wc);
+		else if (lo_execute(ctx, qp, &pending->wr, &wc) == EAGAIN)
+			break;
+
+		list_del(&pending->entry);
+		lo_complete_send(ctx, qp, &pending->wr, &wc);
+		free(pending);
+	}
+}
+
+static void *lo_progress_thread(void *arg)
+{
+	struct lo_qp *qp, *next;
+
+	pthread_mutex_lock(&progress_mut);
+	while (1) {
+		while (list_empty(&progress_list))
+			pthread_cond_wait(&progress_cond, &progress_mut);
+
+		/* Posting threads take the QP lock first, so only try it */
+		list_for_each_safe(&progress_list, qp, next, pending_entry) {
+			if (pthread_mutex_trylock(&qp->lock))
+				continue;
+
+			lo_progress_qp(to_loctx(qp->ibv_qp.context), qp);
+			if (list_empty(&qp->pending)) {
+				list_del(&qp->pending_entry);
+				qp->progress = 0;
+			}
+			pthread_mutex_unlock(&qp->lock);
+		}
+
+		pthread_mutex_unlock(&progress_mut);
+		usleep(10);
+		pthread_mutex_lock(&progress_mut);
+	}
+
+	return NULL;
+}
+
+/* Called with the QP lock held */
+static void lo_start_progress(struct lo_qp *qp)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_lock(&progress_mut);
+	if (!qp->progress) {
+		list_add_tail(&progress_list, &qp->pending_entry);
+		qp->progress = 1;
+	}
+
+	if (!progress_running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		progress_running = !pthread_create(&thread, &attr,
+						   lo_progress_thread, NULL);
+		pthread_attr_destroy(&attr);
+	}
+
+	pthread_cond_signal(&progress_cond);
+	pthread_mutex_unlock(&progress_mut);
+}
+
+static void lo_stop_progress(struct lo_qp *qp)
+{
+	struct lo_pending *pending, *next;
+
+	pthread_mutex_lock(&progress_mut);
+	if (qp->progress) {
+		list_del(&qp->pending_entry);
+		qp->progress = 0;
+	}
+	pthread_mutex_unlock(&progress_mut);
+
+	list_for_each_safe(&qp->pending, pending, next, entry) {
+		list_del(&pending->entry);
+		free(pending);
+	}
+}
+
+static int lo_defer(struct lo_qp *qp, struct ibv_send_wr *wr)
+{
+	struct lo_pending *pending;
+	size_t len = 0;
+	int i;
+
+	/* Inline data must be captured now, the buffers may be reused */
+	if (wr->send_flags & IBV_SEND_INLINE)
+		for (i = 0; i < wr->num_sge; i++)
+			len += wr->sg_list[i].length;
+
+	pending = malloc(sizeof *pending + len);
+	if (!pending)
+		return ENOMEM;
+
+	pending->wr = *wr;
+	pending->wr.next = NULL;
+	pending->wr.sg_list = pending->sg_list;
+	memcpy(pending->sg_list, wr->sg_list,
+	       wr->num_sge * sizeof *wr->sg_list);
+
+	if (wr->send_flags & IBV_SEND_INLINE) {
+		for (len = 0, i = 0; i < wr->num_sge; i++) {
+			memcpy(pending->data + len,
+			       (void *) (uintptr_t) wr->sg_list[i].addr,
+			       wr->sg_list[i].length);
+			len += wr->sg_list[i].length;
+		}
+		pending->wr.num_sge = 1;
+		pending->sg_list[0].addr = (uintptr_t) pending->data;
+		pending->sg_list[0].length = len;
+		pending->sg_list[0].lkey = 0;
+	}
+
+	list_add_tail(&qp->pending, &pending->entry);
+	return 0;
+}
+
+static int lo_check_send(struct lo_qp *qp, struct ibv_send_wr *wr)
+{
+	size_t len = 0;
+	int i;
+
+	if (qp->attr.qp_state != IBV_QPS_RTS &&
+	    qp->attr.qp_state != IBV_QPS_ERR)
+		return EINVAL;
+
+	if (wr->num_sge < 0 || wr->num_sge > qp->cap.max_send_sge)
+		return EINVAL;
+
+	if (wr->send_flags & IBV_SEND_INLINE) {
+		for (i = 0; i < wr->num_sge; i++)
+			len += wr->sg_list[i].length;
+		if (len > qp->cap.max_inline_data)
+			return EINVAL;
+	}
+
+	return 0;
+}
+
+static int lo_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			struct ibv_send_wr **bad_wr)
+{
+	struct lo_context *ctx = to_loctx(ibqp->context);
+	struct lo_qp *qp = to_loqp(ibqp);
+	struct ibv_wc wc;
+	int ret = 0;
+
+	pthread_mutex_lock(&qp->lock);
+	for (; wr; wr = wr->next) {
+		ret = lo_check_send(qp, wr);
+		if (ret)
+			break;
+
+		if (qp->attr.qp_state == IBV_QPS_ERR) {
+			lo_flush_wc(qp, wr, &wc);
+			lo_complete_send(ctx, qp, wr, &wc);
+			continue;
+		}
+
+		if (list_empty(&qp->pending) &&
+		    lo_execute(ctx, qp, wr, &wc) != EAGAIN) {
+			lo_complete_send(ctx, qp, wr, &wc);
+			continue;
+		}
+
+		ret = lo_defer(qp, wr);
+		if (ret)
+			break;
+	}
+
+	if (!list_empty(&qp->pending))
+		lo_start_progress(qp);
+	pthread_mutex_unlock(&qp->lock);
+
+	if (ret)
+		*bad_wr = wr;
+	return ret;
+}
+
+static int lo_post_rq(struct lo_rq *rq, struct ibv_recv_wr *wr,
+		      struct ibv_recv_wr **bad_wr)
+{
+	struct lo_recv_wqe *wqe;
+	uint32_t tail;
+	int ret = 0;
+
+	lo_lock(&rq->lock);
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge < 0 || wr->num_sge > rq->max_sge) {
+			ret = EINVAL;
+			break;
+		}
+
+		tail = atomic_load(&rq->tail);
+		if (tail - atomic_load(&rq->done) >= rq->max_wr) {
+			ret = ENOMEM;
+			break;
+		}
+
+		wqe = &rq->wqe[tail % LO_MAX_WR];
+		wqe->wr_id = wr->wr_id;
+		wqe->num_sge = wr->num_sge;
+		memcpy(wqe->sg_list, wr->sg_list,
+		       wr->num_sge * sizeof *wr->sg_list);
+		atomic_store(&wqe->state, LO_WQE_POSTED);
+		atomic_store(&rq->tail, tail + 1);
+	}
+	pthread_mutex_unlock(&rq->lock);
+
+	if (ret)
+		*bad_wr = wr;
+	return ret;
+}
+
+static int lo_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+			struct ibv_recv_wr **bad_wr)
+{
+	struct lo_qp *qp = to_loqp(ibqp);
+	int ret;
+
+	if (ibqp->srq || qp->attr.qp_state == IBV_QPS_RESET) {
+		*bad_wr = wr;
+		return EINVAL;
+	}
+
+	ret = lo_post_rq(qp->rq, wr, bad_wr);
+	if (qp->attr.qp_state == IBV_QPS_ERR)
+		lo_flush_rq(to_loctx(ibqp->context), qp);
+
+	return ret;
+}
+
+static int lo_post_srq_recv(struct ibv_srq *ibsrq, struct ibv_recv_wr *wr,
+			    struct ibv_recv_wr **bad_wr)
+{
+	struct lo_context *ctx = to_loctx(ibsrq->context);
+
+	return lo_post_rq(&ctx->fabric->srq[to_losrq(ibsrq)->index].rq, wr,
+			  bad_wr);
+}
+
+/* Poll the receive completions of a queue that belong to this CQ */
+static int lo_poll_rq(struct lo_cq *cq, struct lo_rq *rq, int ne,
+		      struct ibv_wc *wc)
+{
+	struct lo_recv_wqe *wqe;
+	uint32_t done;
+	int npolled = 0;
+
+	if (atomic_load(&rq->done) == atomic_load(&rq->head))
+		return 0;
+
+	lo_lock(&rq->lock);
+	for (; npolled < ne; npolled++, wc++) {
+		done = atomic_load(&rq->done);
+		if (done == atomic_load(&rq->head))
+			break;
+
+		wqe = &rq->wqe[done % LO_MAX_WR];
+		if (atomic_load(&wqe->state) != LO_WQE_DONE ||
+		    wqe->cqn != cq->index)
+			break;
+
+		memset(wc, 0, sizeof *wc);
+		wc->wr_id = wqe->wr_id;
+		wc->status = wqe->status;
+		wc->opcode = wqe->opcode;
+		wc->byte_len = wqe->byte_len;
+		wc->imm_data = wqe->imm_data;
+		wc->qp_num = wqe->qp_num;
+		wc->src_qp = wqe->src_qp;
+		wc->wc_flags = wqe->wc_flags;
+		wc->slid = LO_LID;
+
+		atomic_store(&wqe->state, LO_WQE_FREE);
+		atomic_store(&rq->done, done + 1);
+	}
+	pthread_mutex_unlock(&rq->lock);
+
+	return npolled;
+}
+
+static int lo_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	struct lo_cq *cq = to_locq(ibcq);
+	struct lo_rq_ref *ref;
+	int npolled = 0;
+
+	pthread_spin_lock(&cq->lock);
+	for (; npolled < ne && cq->head != cq->tail; npolled++)
+		wc[npolled] = cq->wc[cq->head++ % cq->size];
+
+	list_for_each(&cq->rqs, ref, entry) {
+		if (npolled == ne)
+			break;
+		npolled += lo_poll_rq(cq, ref->rq, ne - npolled, wc + npolled);
+	}
+	pthread_spin_unlock(&cq->lock);
+
+	return npolled;
+}
+
+static int lo_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	struct lo_context *ctx = to_loctx(ibcq->context);
+	struct lo_cq_slot *slot = &ctx->fabric->cq[to_locq(ibcq)->index];
+
+	if (slot->addr_len)
+		atomic_store(&slot->armed, solicited_only ?
+			     LO_ARM_SOLICITED : LO_ARM_NEXT);
+	return 0;
+}
+
+static int lo_cq_add_rq(struct lo_cq *cq, struct lo_rq *rq)
+{
+	struct lo_rq_ref *ref;
+	int ret = 0;
+
+	pthread_spin_lock(&cq->lock);
+	list_for_each(&cq->rqs, ref, entry) {
+		if (ref->rq == rq) {
+			ref->refcnt++;
+			goto out;
+		}
+	}
+
+	ref = malloc(sizeof *ref);
+	if (!ref) {
+		ret = ENOMEM;
+		goto out;
+	}
+
+	ref->rq = rq;
+	ref->refcnt = 1;
+	list_add_tail(&cq->rqs, &ref->entry);
+out:
+	pthread_spin_unlock(&cq->lock);
+	return ret;
+}
+
+static void lo_cq_del_rq(struct lo_cq *cq, struct lo_rq *rq)
+{
+	struct lo_rq_ref *ref;
+
+	pthread_spin_lock(&cq->lock);
+	list_for_each(&cq->rqs, ref, entry) {
+		if (ref->rq == rq) {
+			if (!--ref->refcnt) {
+				list_del(&ref->entry);
+				free(ref);
+			}
+			break;
+		}
+	}
+	pthread_spin_unlock(&cq->lock);
+}
+
+static struct ibv_cq *lo_create_cq(struct ibv_context *context, int cqe,
+				   struct ibv_comp_channel *channel,
+				   int comp_vector)
+{
+	struct lo_context *ctx = to_loctx(context);
+	struct lo_cq_slot *slot;
+	struct lo_cq *cq;
+	int index;
+
+	if (cqe < 1 || cqe > LO_MAX_CQE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cq = calloc(1, sizeof *cq);
+	if (!cq)
+		return NULL;
+
+	cq->wc = calloc(cqe, sizeof *cq->wc);
+	if (!cq->wc)
+		goto err;
+
+	index = lo_alloc_slot(ctx->fabric, &ctx->fabric->cq[0].hdr,
+			      sizeof ctx->fabric->cq[0], LO_MAX_CQ, 8, 0xffff);
+	if (index < 0)
+		goto err;
+
+	slot = &ctx->fabric->cq[index];
+	atomic_store(&slot->armed, LO_ARM_NONE);
+	slot->handle = (uintptr_t) &cq->ibv_cq;
+	slot->addr_len = 0;
+	if (channel) {
+		slot->addr_len = sizeof slot->addr;
+		if (getsockname(channel->fd, (struct sockaddr *) &slot->addr,
+				&slot->addr_len)) {
+			lo_free_slot(&slot->hdr);
+			goto err;
+		}
+	}
+
+	cq->index = index;
+	cq->size = cqe;
+	cq->ibv_cq.cqe = cqe;
+	list_head_init(&cq->rqs);
+	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+
+	return &cq->ibv_cq;
+
+err:
+	free(cq->wc);
+	free(cq);
+	return NULL;
+}
+
+static int lo_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct lo_context *ctx = to_loctx(ibcq->context);
+	struct lo_cq *cq = to_locq(ibcq);
+
+	if (!list_empty(&cq->rqs))
+		return EBUSY;
+
+	lo_free_slot(&ctx->fabric->cq[cq->index].hdr);
+	pthread_spin_destroy(&cq->lock);
+	free(cq->wc);
+	free(cq);
+	return 0;
+}
+
+static struct ibv_srq *lo_create_srq(struct ibv_pd *pd,
+				     struct ibv_srq_init_attr *attr)
+{
+	struct lo_context *ctx = to_loctx(pd->context);
+	struct lo_srq *srq;
+	int index;
+
+	if (attr->attr.max_wr > LO_MAX_WR || attr->attr.max_sge > LO_MAX_SGE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	srq = calloc(1, sizeof *srq);
+	if (!srq)
+		return NULL;
+
+	index = lo_alloc_slot(ctx->fabric, &ctx->fabric->srq[0].hdr,
+			      sizeof ctx->fabric->srq[0], LO_MAX_SRQ, 6, 0xffff);
+	if (index < 0) {
+		free(srq);
+		return NULL;
+	}
+
+	srq->index = index;
+	lo_rq_reset(&ctx->fabric->srq[index].rq, max(attr->attr.max_wr, 1U),
+		    attr->attr.max_sge);
+	ctx->fabric->srq[index].rq.limit = attr->attr.srq_limit;
+
+	return &srq->ibv_srq;
+}
+
+static int lo_modify_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr,
+			 int attr_mask)
+{
+	struct lo_context *ctx = to_loctx(ibsrq->context);
+
+	/* Resizing is not supported */
+	if (attr_mask & IBV_SRQ_MAX_WR)
+		return EINVAL;
+
+	if (attr_mask & IBV_SRQ_LIMIT)
+		ctx->fabric->srq[to_losrq(ibsrq)->index].rq.limit =
+			attr->srq_limit;
+
+	return 0;
+}
+
+static int lo_query_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr)
+{
+	struct lo_context *ctx = to_loctx(ibsrq->context);
+	struct lo_rq *rq = &ctx->fabric->srq[to_losrq(ibsrq)->index].rq;
+
+	attr->max_wr = rq->max_wr;
+	attr->max_sge = rq->max_sge;
+	attr->srq_limit = rq->limit;
+	return 0;
+}
+
+static int lo_destroy_srq(struct ibv_srq *ibsrq)
+{
+	struct lo_context *ctx = to_loctx(ibsrq->context);
+	struct lo_srq *srq = to_losrq(ibsrq);
+
+	lo_free_slot(&ctx->fabric->srq[srq->index].hdr);
+	free(srq);
+	return 0;
+}
+
+static struct ibv_qp *lo_create_qp(struct ibv_pd *pd,
+				   struct ibv_qp_init_attr *attr)
+{
+	struct lo_context *ctx = to_loctx(pd->context);
+	struct lo_fabric *fab = ctx->fabric;
+	struct lo_qp_slot *slot;
+	struct lo_qp *qp;
+	int index;
+
+	if ((attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UD) ||
+	    attr->cap.max_send_wr > LO_MAX_WR ||
+	    attr->cap.max_send_sge > LO_MAX_SGE ||
+	    attr->cap.max_inline_data > LO_MAX_INLINE ||
+	    (!attr->srq && (attr->cap.max_recv_wr > LO_MAX_WR ||
+			    attr->cap.max_recv_sge > LO_MAX_SGE))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof *qp);
+	if (!qp)
+		return NULL;
+
+	index = lo_alloc_slot(fab, &fab->qp[0].hdr, sizeof fab->qp[0],
+			      LO_MAX_QP, LO_QPN_INDEX_BITS, 0xffff);
+	if (index < 0)
+		goto err;
+
+	slot = &fab->qp[index];
+	slot->qp_type = attr->qp_type;
+	atomic_store(&slot->state, IBV_QPS_RESET);
+	slot->qkey = 0;
+	slot->dest_qpn = 0;
+	slot->srq = attr->srq ? (int32_t) to_losrq(attr->srq)->index : -1;
+	slot->cqn = to_locq(attr->recv_cq)->index;
+
+	qp->rq = lo_slot_rq(fab, slot);
+	if (!attr->srq)
+		lo_rq_reset(qp->rq, max(attr->cap.max_recv_wr, 1U),
+			    attr->cap.max_recv_sge);
+
+	if (lo_cq_add_rq(to_locq(attr->recv_cq), qp->rq)) {
+		lo_free_slot(&slot->hdr);
+		goto err;
+	}
+
+	qp->index = index;
+	qp->cap = attr->cap;
+	qp->sq_sig_all = attr->sq_sig_all;
+	qp->attr.qp_state = IBV_QPS_RESET;
+	qp->attr.cap = attr->cap;
+	qp->ibv_qp.qp_num = atomic_load(&slot->hdr.id);
+	pthread_mutex_init(&qp->lock, NULL);
+	list_head_init(&qp->pending);
+
+	return &qp->ibv_qp;
+
+err:
+	free(qp);
+	return NULL;
+}
+
+static int lo_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+		       int attr_mask, struct ibv_qp_init_attr *init_attr)
+{
+	struct lo_qp *qp = to_loqp(ibqp);
+
+	pthread_mutex_lock(&qp->lock);
+	*attr = qp->attr;
+	pthread_mutex_unlock(&qp->lock);
+
+	memset(init_attr, 0, sizeof *init_attr);
+	init_attr->qp_context = ibqp->qp_context;
+	init_attr->send_cq = ibqp->send_cq;
+	init_attr->recv_cq = ibqp->recv_cq;
+	init_attr->srq = ibqp->srq;
+	init_attr->cap = qp->cap;
+	init_attr->qp_type = ibqp->qp_type;
+	init_attr->sq_sig_all = qp->sq_sig_all;
+	return 0;
+}
+
+static int lo_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+			int attr_mask)
+{
+	struct lo_context *ctx = to_loctx(ibqp->context);
+	struct lo_qp *qp = to_loqp(ibqp);
+	struct lo_qp_slot *slot = &ctx->fabric->qp[qp->index];
+
+	pthread_mutex_lock(&qp->lock);
+	if (attr_mask & IBV_QP_CUR_STATE)
+		qp->attr.cur_qp_state = attr->cur_qp_state;
+	if (attr_mask & IBV_QP_ACCESS_FLAGS)
+		qp->attr.qp_access_flags = attr->qp_access_flags;
+	if (attr_mask & IBV_QP_PKEY_INDEX)
+		qp->attr.pkey_index = attr->pkey_index;
+	if (attr_mask & IBV_QP_PORT)
+		qp->attr.port_num = attr->port_num;
+	if (attr_mask & IBV_QP_QKEY) {
+		qp->attr.qkey = attr->qkey;
+		slot->qkey = attr->qkey;
+	}
+	if (attr_mask & IBV_QP_AV)
+		qp->attr.ah_attr = attr->ah_attr;
+	if (attr_mask & IBV_QP_PATH_MTU)
+		qp->attr.path_mtu = attr->path_mtu;
+	if (attr_mask & IBV_QP_TIMEOUT)
+		qp->attr.timeout = attr->timeout;
+	if (attr_mask & IBV_QP_RETRY_CNT)
+		qp->attr.retry_cnt = attr->retry_cnt;
+	if (attr_mask & IBV_QP_RNR_RETRY)
+		qp->attr.rnr_retry = attr->rnr_retry;
+	if (attr_mask & IBV_QP_RQ_PSN)
+		qp->attr.rq_psn = attr->rq_psn;
+	if (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC)
+		qp->attr.max_rd_atomic = attr->max_rd_atomic;
+	if (attr_mask & IBV_QP_MIN_RNR_TIMER)
+		qp->attr.min_rnr_timer = attr->min_rnr_timer;
+	if (attr_mask & IBV_QP_SQ_PSN)
+		qp->attr.sq_psn = attr->sq_psn;
+	if (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC)
+		qp->attr.max_dest_rd_atomic = attr->max_dest_rd_atomic;
+	if (attr_mask & IBV_QP_DEST_QPN) {
+		qp->attr.dest_qp_num = attr->dest_qp_num;
+		slot->dest_qpn = attr->dest_qp_num;
+	}
+
+	if (attr_mask & IBV_QP_STATE) {
+		if (attr->qp_state == IBV_QPS_RESET) {
+			lo_stop_progress(qp);
+			if (!ibqp->srq)
+				lo_rq_reset(qp->rq, qp->rq->max_wr,
+					    qp->rq->max_sge);
+		}
+		lo_set_state(ctx, qp, attr->qp_state);
+	}
+	pthread_mutex_unlock(&qp->lock);
+
+	return 0;
+}
+
+static int lo_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct lo_context *ctx = to_loctx(ibqp->context);
+	struct lo_qp *qp = to_loqp(ibqp);
+	struct lo_qp_slot *slot = &ctx->fabric->qp[qp->index];
+
+	pthread_mutex_lock(&qp->lock);
+	lo_stop_progress(qp);
+	atomic_store(&slot->state, IBV_QPS_RESET);
+	lo_free_slot(&slot->hdr);
+	pthread_mutex_unlock(&qp->lock);
+
+	lo_cq_del_rq(to_locq(ibqp->recv_cq), qp->rq);
+	pthread_mutex_destroy(&qp->lock);
+	free(qp);
+	return 0;
+}
+
+static struct ibv_mr *lo_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+				int access)
+{
+	struct lo_context *ctx = to_loctx(pd->context);
+	struct lo_fabric *fab = ctx->fabric;
+	struct lo_mr_slot *slot;
+	struct ibv_mr *mr;
+	int index;
+
+	mr = calloc(1, sizeof *mr);
+	if (!mr)
+		return NULL;
+
+	index = lo_alloc_slot(fab, &fab->mr[0].hdr, sizeof fab->mr[0],
+			      LO_MAX_MR, LO_KEY_INDEX_BITS, 0xfffff);
+	if (index < 0) {
+		free(mr);
+		return NULL;
+	}
+
+	slot = &fab->mr[index];
+	slot->access = access;
+	slot->addr = (uintptr_t) addr;
+	slot->length = length;
+
+	mr->handle = index;
+	mr->lkey = atomic_load(&slot->hdr.id);
+	mr->rkey = mr->lkey;
+	return mr;
+}
+
+static int lo_dereg_mr(struct ibv_mr *mr)
+{
+	struct lo_context *ctx = to_loctx(mr->context);
+
+	lo_free_slot(&ctx->fabric->mr[mr->handle].hdr);
+	free(mr);
+	return 0;
+}
+
+static struct ibv_pd *lo_alloc_pd(struct ibv_context *context)
+{
+	return calloc(1, sizeof(struct ibv_pd));
+}
+
+static int lo_dealloc_pd(struct ibv_pd *pd)
+{
+	free(pd);
+	return 0;
+}
+
+static struct ibv_ah *lo_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
+{
+	return calloc(1, sizeof(struct ibv_ah));
+}
+
+static int lo_destroy_ah(struct ibv_ah *ah)
+{
+	free(ah);
+	return 0;
+}
+
+static int lo_attach_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
+			   uint16_t lid)
+{
+	return ENOSYS;
+}
+
+static int lo_query_device(struct ibv_context *context,
+			   struct ibv_device_attr *attr)
+{
+	memset(attr, 0, sizeof *attr);
+	strcpy(attr->fw_ver, "1.0.0");
+	attr->max_mr_size = UINT64_MAX;
+	attr->page_size_cap = sysconf(_SC_PAGESIZE);
+	attr->max_qp = LO_MAX_QP;
+	attr->max_qp_wr = LO_MAX_WR;
+	attr->device_cap_flags = IBV_DEVICE_RC_RNR_NAK_GEN;
+	attr->max_sge = LO_MAX_SGE;
+	attr->max_sge_rd = LO_MAX_SGE;
+	attr->max_cq = LO_MAX_CQ;
+	attr->max_cqe = LO_MAX_CQE;
+	attr->max_mr = LO_MAX_MR;
+	attr->max_pd = INT32_MAX;
+	attr->max_qp_rd_atom = LO_MAX_RD_ATOM;
+	attr->max_qp_init_rd_atom = LO_MAX_RD_ATOM;
+	attr->max_res_rd_atom = LO_MAX_RD_ATOM * LO_MAX_QP;
+	attr->atomic_cap = IBV_ATOMIC_HCA;
+	attr->max_ah = INT32_MAX;
+	attr->max_srq = LO_MAX_SRQ;
+	attr->max_srq_wr = LO_MAX_WR;
+	attr->max_srq_sge = LO_MAX_SGE;
+	attr->max_pkeys = 1;
+	attr->phys_port_cnt = 1;
+	return 0;
+}
+
+static int lo_query_port(struct ibv_context *context, uint8_t port,
+			 struct ibv_port_attr *attr)
+{
+	if (port != 1)
+		return EINVAL;
+
+	memset(attr, 0, sizeof *attr);
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->gid_tbl_len = 1;
+	attr->max_msg_sz = 1U << 31;
+	attr->pkey_tbl_len = 1;
+	attr->lid = LO_LID;
+	attr->sm_lid = LO_LID;
+	attr->max_vl_num = 1;
+	attr->active_width = 1;
+	attr->active_speed = 1;
+	attr->phys_state = 5;
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+static struct ibv_context_ops lo_ctx_ops = {
+	.query_device = lo_query_device,
+	.query_port = lo_query_port,
+	.alloc_pd = lo_alloc_pd,
+	.dealloc_pd = lo_dealloc_pd,
+	.reg_mr = lo_reg_mr,
+	.dereg_mr = lo_dereg_mr,
+	.create_cq = lo_create_cq,
+	.poll_cq = lo_poll_cq,
+	.req_notify_cq = lo_req_notify_cq,
+	.cq_event = NULL,
+	.resize_cq = NULL,
+	.destroy_cq = lo_destroy_cq,
+	.create_srq = lo_create_srq,
+	.modify_srq = lo_modify_srq,
+	.query_srq = lo_query_srq,
+	.destroy_srq = lo_destroy_srq,
+	.post_srq_recv = lo_post_srq_recv,
+	.create_qp = lo_create_qp,
+	.query_qp = lo_query_qp,
+	.modify_qp = lo_modify_qp,
+	.destroy_qp = lo_destroy_qp,
+	.post_send = lo_post_send,
+	.post_recv = lo_post_recv,
+	.create_ah = lo_create_ah,
+	.destroy_ah = lo_destroy_ah,
+	.attach_mcast = lo_attach_mcast,
+	.detach_mcast = lo_attach_mcast
+};
+
+static struct ibv_context *lo_alloc_context(struct ibv_device *ibdev,
+					    int cmd_fd)
+{
+	struct lo_context *context;
+
+	context = calloc(1, sizeof *context);
+	if (!context)
+		return NULL;
+
+	context->fabric = lo_map_fabric();
+	if (!context->fabric)
+		goto err;
+
+	/* The command fd is the socket completion events are sent from */
+	context->sock = cmd_fd;
+
+	/* There are no asynchronous events, but readers may block on it */
+	context->ibv_ctx.async_fd = eventfd(0, EFD_CLOEXEC);
+	if (context->ibv_ctx.async_fd < 0)
+		goto err;
+
+	context->ibv_ctx.cmd_fd = cmd_fd;
+	context->ibv_ctx.ops = lo_ctx_ops;
+	return &context->ibv_ctx;
+
+err:
+	free(context);
+	return NULL;
+}
+
+static void lo_free_context(struct ibv_context *ibctx)
+{
+	free(to_loctx(ibctx));
+}
+
+static int lo_open_cmd_fd(struct verbs_device *verbs_device)
+{
+	return socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+}
+
+/*
+ * Completion events are delivered as datagrams, addressed to an autobound
+ * unix socket that lo_create_cq() records in the shared CQ slot.
+ */
+static int lo_create_comp_channel(struct ibv_context *context)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(sa_family_t))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static struct verbs_device *lo_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
+{
+	struct lo_device *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	return &dev->ibv_dev;
+}
+
+static void lo_uninit_device(struct verbs_device *verbs_device)
+{
+	free(container_of(verbs_device, struct lo_device, ibv_dev));
+}
+
+static const struct verbs_device_ops lo_dev_ops = {
+	.name = "loopback",
+	.match_min_abi_version = 0,
+	.match_max_abi_version = INT_MAX,
+	.match_table = hca_table,
+	.alloc_device = lo_device_alloc,
+	.uninit_device = lo_uninit_device,
+	.alloc_context = lo_alloc_context,
+	.free_context = lo_free_context,
+	.open_cmd_fd = lo_open_cmd_fd,
+	.create_comp_channel = lo_create_comp_channel,
+};
+PROVIDER_DRIVER(lo_dev_ops);
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2026 The rdma-core contributors.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <infiniband/driver.h>
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+/*
+ * All loopback objects of a user live in one shared memory fabric, so that
+ * the devices of different processes can reach each other.  Local objects
+ * such as PDs and send queues stay in the process; receive queues and the
+ * information needed to validate remote keys are kept in the fabric.
+ */
+#define LO_MAX_QP		256
+#define LO_MAX_SRQ		64
+#define LO_MAX_CQ		256
+#define LO_MAX_MR		4096
+#define LO_MAX_WR		4096
+#define LO_MAX_SGE		4
+#define LO_MAX_CQE		65536
+#define LO_MAX_INLINE		1024
+#define LO_MAX_RD_ATOM		16
+#define LO_GRH_SIZE		40
+#define LO_LID			1
+
+#define LO_QPN_INDEX_BITS	8
+#define LO_KEY_INDEX_BITS	12
+
+#define LO_FABRIC_MAGIC		0x6c6f6f70
+
+enum {
+	LO_ARM_NONE,
+	LO_ARM_NEXT,
+	LO_ARM_SOLICITED
+};
+
+enum {
+	LO_WQE_FREE,
+	LO_WQE_POSTED,
+	LO_WQE_BUSY,
+	LO_WQE_DONE
+};
+
+struct lo_recv_wqe {
+	uint64_t		wr_id;
+	_Atomic(uint32_t)	state;
+	uint32_t		num_sge;
+	struct ibv_sge		sg_list[LO_MAX_SGE];
+	/* Completion information, written by the sender */
+	uint32_t		status;
+	uint32_t		opcode;
+	uint32_t		byte_len;
+	uint32_t		imm_data;
+	uint32_t		wc_flags;
+	uint32_t		qp_num;
+	uint32_t		src_qp;
+	uint32_t		cqn;
+};
+
+/*
+ * Entries in [done, head) have been consumed by a sender, and entries in
+ * [head, tail) are posted.  The indices are free running.
+ */
+struct lo_rq {
+	pthread_mutex_t		lock;
+	uint32_t		max_wr;
+	uint32_t		max_sge;
+	uint32_t		limit;
+	_Atomic(uint32_t)	head;
+	_Atomic(uint32_t)	tail;
+	_Atomic(uint32_t)	done;
+	struct lo_recv_wqe	wqe[LO_MAX_WR];
+};
+
+/* Common header of fabric slots; the id is 0 while the slot is free */
+struct lo_slot {
+	_Atomic(uint32_t)	id;
+	pid_t			pid;
+};
+
+struct lo_qp_slot {
+	struct lo_slot		hdr;
+	uint32_t		qp_type;
+	_Atomic(uint32_t)	state;
+	uint32_t		qkey;
+	uint32_t		dest_qpn;
+	int32_t			srq;
+	uint32_t		cqn;
+	struct lo_rq		rq;
+};
+
+struct lo_srq_slot {
+	struct lo_slot		hdr;
+	struct lo_rq		rq;
+};
+
+struct lo_cq_slot {
+	struct lo_slot		hdr;
+	_Atomic(uint32_t)	armed;
+	uint64_t		handle;
+	socklen_t		addr_len;
+	struct sockaddr_un	addr;
+};
+
+struct lo_mr_slot {
+	struct lo_slot		hdr;
+	uint32_t		access;
+	uint64_t		addr;
+	uint64_t		length;
+};
+
+struct lo_fabric {
+	_Atomic(uint32_t)	magic;
+	uint32_t		gen;
+	pthread_mutex_t		lock;
+	pthread_mutex_t		atomic_lock;
+	struct lo_mr_slot	mr[LO_MAX_MR];
+	struct lo_cq_slot	cq[LO_MAX_CQ];
+	struct lo_qp_slot	qp[LO_MAX_QP];
+	struct lo_srq_slot	srq[LO_MAX_SRQ];
+};
+
+struct lo_device {
+	struct verbs_device	ibv_dev;
+};
+
+struct lo_context {
+	struct ibv_context	ibv_ctx;
+	struct lo_fabric	*fabric;
+	int			sock;
+};
+
+struct lo_rq_ref {
+	struct list_node	entry;
+	struct lo_rq		*rq;
+	int			refcnt;
+};
+
+struct lo_cq {
+	struct ibv_cq		ibv_cq;
+	pthread_spinlock_t	lock;
+	uint32_t		index;
+	uint32_t		size;
+	uint32_t		head;
+	uint32_t		tail;
+	struct ibv_wc		*wc;
+	struct list_head	rqs;
+};
+
+struct lo_srq {
+	struct ibv_srq		ibv_srq;
+	uint32_t		index;
+};
+
+struct lo_qp {
+	struct ibv_qp		ibv_qp;
+	pthread_mutex_t		lock;
+	uint32_t		index;
+	struct lo_rq		*rq;
+	struct ibv_qp_cap	cap;
+	int			sq_sig_all;
+	struct ibv_qp_attr	attr;
+	struct list_head	pending;
+	struct list_node	pending_entry;
+	int			progress;
+};
+
+/* A send request waiting for the responder to post a receive */
+struct lo_pending {
+	struct list_node	entry;
+	struct ibv_send_wr	wr;
+	struct ibv_sge		sg_list[LO_MAX_SGE];
+	uint8_t			data[];
+};
+
+#define to_loxxx(xxx, type)						\
+	((struct lo_##type *)						\
+	 ((void *) ib##xxx - offsetof(struct lo_##type, ibv_##xxx)))
+
+static inline struct lo_context *to_loctx(struct ibv_context *ibctx)
+{
+	return to_loxxx(ctx, context);
+}
+
+static inline struct lo_cq *to_locq(struct ibv_cq *ibcq)
+{
+	return to_loxxx(cq, cq);
+}
+
+static inline struct lo_qp *to_loqp(struct ibv_qp *ibqp)
+{
+	return to_loxxx(qp, qp);
+}
+
+static inline struct lo_srq *to_losrq(struct ibv_srq *ibsrq)
+{
+	return to_loxxx(srq, srq);
+}
+
+#endif /* LOOPBACK_H */
@@ -190,6 +190,7 @@ static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
 
 	cq->mmap_info = resp.mi;
 	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	atomic_init(&cq->armed, false);
 
 	return &cq->ibv_cq;
 }
@@ -246,6 +247,101 @@ static int rxe_destroy_cq(struct ibv_cq *ibcq)
 	return 0;
 }
 
+/* send a null post send as a doorbell */
+static int post_send_db(struct ibv_qp *ibqp)
+{
+	struct ibv_post_send cmd;
+	struct ibv_post_send_resp resp;
+
+	cmd.command	= IB_USER_VERBS_CMD_POST_SEND;
+	cmd.in_words	= sizeof(cmd)/4;
+	cmd.out_words	= sizeof(resp)/4;
+	cmd.response	= (uintptr_t)&resp;
+	cmd.qp_handle	= ibqp->handle;
+	cmd.wr_count	= 0;
+	cmd.sge_count	= 0;
+	cmd.wqe_size	= sizeof(struct ibv_send_wr);
+
+	if (write(ibqp->context->cmd_fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+		return errno;
+
+	return 0;
+}
+
+/*
+ * When RXE_DB_BATCH is set, rxe_post_send() only rings the doorbell once
+ * that many work requests have been posted since the last one.  QPs with a
+ * deferred doorbell are queued on the context, and rung as soon as the
+ * application drains or arms a CQ.  An application that waits in
+ * ibv_get_cq_event() never calls into the provider, and commonly re-arms
+ * the CQ before it posts more work, so once a CQ has been armed posts to
+ * QPs using it ring the doorbell right away.  Work is still held back
+ * while the application waits for completions by any other means, such
+ * as a message from the peer.
+ */
+static void rxe_queue_db(struct rxe_context *context, struct rxe_qp *qp)
+{
+	pthread_mutex_lock(&context->db_mutex);
+	if (!qp->db_queued) {
+		list_add_tail(&context->db_list, &qp->db_entry);
+		qp->db_queued = true;
+		atomic_fetch_add(&context->db_queued, 1);
+	}
+	pthread_mutex_unlock(&context->db_mutex);
+}
+
+/* must hold db_mutex */
+static void rxe_dequeue_db(struct rxe_context *context, struct rxe_qp *qp)
+{
+	if (qp->db_queued) {
+		list_del(&qp->db_entry);
+		qp->db_queued = false;
+		atomic_fetch_sub(&context->db_queued, 1);
+	}
+}
+
+/* ring the doorbell if work requests were posted since the last one */
+static int rxe_ring_db(struct rxe_qp *qp)
+{
+	unsigned int pending;
+
+	pthread_spin_lock(&qp->sq.lock);
+	pending = qp->db_pending;
+	qp->db_pending = 0;
+	pthread_spin_unlock(&qp->sq.lock);
+
+	return pending ? post_send_db(&qp->ibv_qp) : 0;
+}
+
+static void rxe_flush_db(struct rxe_context *context)
+{
+	struct rxe_qp *qp;
+
+	if (!atomic_load(&context->db_queued))
+		return;
+
+	pthread_mutex_lock(&context->db_mutex);
+	while ((qp = list_top(&context->db_list, struct rxe_qp, db_entry))) {
+		rxe_dequeue_db(context, qp);
+		rxe_ring_db(qp);
+	}
+	pthread_mutex_unlock(&context->db_mutex);
+}
+
+/* ring a QP's deferred doorbell before the kernel acts on the QP */
+static int rxe_flush_qp_db(struct rxe_qp *qp)
+{
+	struct rxe_context *context = to_rctx(qp->ibv_qp.context);
+	int ret;
+
+	pthread_mutex_lock(&context->db_mutex);
+	rxe_dequeue_db(context, qp);
+	ret = rxe_ring_db(qp);
+	pthread_mutex_unlock(&context->db_mutex);
+
+	return ret;
+}
+
 static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
@@ -267,9 +363,23 @@ static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 	}
 
 	pthread_spin_unlock(&cq->lock);
+
+	/* the CQ is drained, so release any work held back by batching */
+	if (npolled < ne)
+		rxe_flush_db(to_rctx(ibcq->context));
+
 	return npolled;
 }
 
+static int rxe_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	/* set before flushing, pairs with the check in rxe_post_send() */
+	atomic_store(&to_rcq(ibcq)->armed, true);
+	rxe_flush_db(to_rctx(ibcq->context));
+
+	return ibv_cmd_req_notify_cq(ibcq, solicited_only);
+}
+
 static struct ibv_srq *rxe_create_srq(struct ibv_pd *pd,
 				      struct ibv_srq_init_attr *attr)
 {
@@ -491,6 +601,8 @@ static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
 
 	qp->sq_mmap_info = resp.sq_mi;
 	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
+	qp->db_pending = 0;
+	qp->db_queued = false;
 
 	return &qp->ibv_qp;
 }
@@ -510,6 +622,11 @@ static int rxe_modify_qp(struct ibv_qp *ibvqp,
 			 int attr_mask)
 {
 	struct ibv_modify_qp cmd = {};
+	int ret;
+
+	ret = rxe_flush_qp_db(to_rqp(ibvqp));
+	if (ret)
+		return ret;
 
 	return ibv_cmd_modify_qp(ibvqp, attr, attr_mask, &cmd, sizeof cmd);
 }
@@ -519,6 +636,8 @@ static int rxe_destroy_qp(struct ibv_qp *ibv_qp)
 	int ret;
 	struct rxe_qp *qp = to_rqp(ibv_qp);
 
+	rxe_flush_qp_db(qp);
+
 	ret = ibv_cmd_destroy_qp(ibv_qp);
 	if (!ret) {
 		if (qp->rq_mmap_info.size)
@@ -666,27 +785,6 @@ static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
 	return 0;
 }
 
-/* send a null post send as a doorbell */
-static int post_send_db(struct ibv_qp *ibqp)
-{
-	struct ibv_post_send cmd;
-	struct ibv_post_send_resp resp;
-
-	cmd.command	= IB_USER_VERBS_CMD_POST_SEND;
-	cmd.in_words	= sizeof(cmd)/4;
-	cmd.out_words	= sizeof(resp)/4;
-	cmd.response	= (uintptr_t)&resp;
-	cmd.qp_handle	= ibqp->handle;
-	cmd.wr_count	= 0;
-	cmd.sge_count	= 0;
-	cmd.wqe_size	= sizeof(struct ibv_send_wr);
-
-	if (write(ibqp->context->cmd_fd, &cmd, sizeof(cmd)) != sizeof(cmd))
-		return errno;
-
-	return 0;
-}
-
 /* this API does not make a distinction between
    restartable and non-restartable errors */
 static int rxe_post_send(struct ibv_qp *ibqp,
@@ -694,9 +792,12 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 			 struct ibv_send_wr **bad_wr)
 {
 	int rc = 0;
-	int err;
+	int err = 0;
+	struct rxe_context *context = to_rctx(ibqp->context);
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *sq = &qp->sq;
+	unsigned int posted = 0;
+	bool ring;
 
 	if (!bad_wr)
 		return EINVAL;
@@ -715,12 +816,27 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 			break;
 		}
 
+		posted++;
 		wr_list = wr_list->next;
 	}
 
+	/* ring right away on an error, the send queue may be full */
+	qp->db_pending += posted;
+	ring = qp->db_pending && (qp->db_pending >= context->db_batch || rc);
+	if (ring)
+		qp->db_pending = 0;
+
 	pthread_spin_unlock(&sq->lock);
 
-	err =  post_send_db(ibqp);
+	if (ring) {
+		err = post_send_db(ibqp);
+	} else if (posted) {
+		rxe_queue_db(context, qp);
+		if (atomic_load(&to_rcq(ibqp->send_cq)->armed) ||
+		    atomic_load(&to_rcq(ibqp->recv_cq)->armed))
+			err = rxe_flush_qp_db(qp);
+	}
+
 	return err ? err : rc;
 }
 
@@ -837,7 +953,7 @@ static struct ibv_context_ops rxe_ctx_ops = {
 	.dereg_mr = rxe_dereg_mr,
 	.create_cq = rxe_create_cq,
 	.poll_cq = rxe_poll_cq,
-	.req_notify_cq = ibv_cmd_req_notify_cq,
+	.req_notify_cq = rxe_req_notify_cq,
 	.cq_event = NULL,
 	.resize_cq = rxe_resize_cq,
 	.destroy_cq = rxe_destroy_cq,
@@ -864,6 +980,7 @@ static struct ibv_context *rxe_alloc_context(struct ibv_device *ibdev,
 	struct rxe_context *context;
 	struct ibv_get_context cmd;
 	struct ibv_get_context_resp resp;
+	char *env;
 
 	context = malloc(sizeof *context);
 	if (!context)
@@ -878,6 +995,11 @@ static struct ibv_context *rxe_alloc_context(struct ibv_device *ibdev,
 
 	context->ibv_ctx.ops = rxe_ctx_ops;
 
+	env = getenv("RXE_DB_BATCH");
+	context->db_batch = env && atoi(env) > 0 ? atoi(env) : 1;
+	pthread_mutex_init(&context->db_mutex, NULL);
+	list_head_init(&context->db_list);
+
 	return &context->ibv_ctx;
 
 out:
@@ -889,6 +1011,7 @@ static void rxe_free_context(struct ibv_context *ibctx)
 {
 	struct rxe_context *context = to_rctx(ibctx);
 
+	pthread_mutex_destroy(&context->db_mutex);
 	free(context);
 }
 
@@ -36,6 +36,8 @@
 #ifndef RXE_H
 #define RXE_H
 
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <infiniband/driver.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -55,6 +57,10 @@ struct rxe_device {
 
 struct rxe_context {
 	struct ibv_context	ibv_ctx;
+	unsigned int		db_batch;
+	pthread_mutex_t		db_mutex;
+	struct list_head	db_list;
+	_Atomic(int)		db_queued;
 };
 
 struct rxe_cq {
@@ -62,6 +68,7 @@ struct rxe_cq {
 	struct mmap_info	mmap_info;
 	struct rxe_queue		*queue;
 	pthread_spinlock_t	lock;
+	atomic_bool		armed;
 };
 
 struct rxe_ah {
@@ -83,6 +90,9 @@ struct rxe_qp {
 	struct mmap_info	sq_mmap_info;
 	struct rxe_wq		sq;
 	unsigned int		ssn;
+	unsigned int		db_pending;
+	struct list_node	db_entry;
+	bool			db_queued;
 };
 
 #define qp_type(qp)		((qp)->ibv_qp.qp_type)